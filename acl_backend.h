@@ -0,0 +1,98 @@
+#ifndef __ACL_BACKEND_H__
+#define __ACL_BACKEND_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "db.h"
+#include "db_pool.h"
+
+/*
+ * Where the ACL rules come from, behind a table of operations so that the
+ * checks, caches and preloaded table do not depend on any one of them:
+ *
+ *   fetch   the patterns of a client for an access type, on a check the
+ *           caches cannot answer
+ *   load    every rule at once, as rows, to fill the preloaded table
+ *   poll    from the broker's tick, reports the clients whose rules
+ *           changed, or that they all did
+ *
+ * acl_backend_pg_new() queries PostgreSQL through the connection pool and
+ * follows its ACL change notifications. acl_backend_file_new() serves a
+ * local rules file with no database at all: a binary one, in the format of
+ * a preloaded table's snapshot (see acl_snapshot.h), is mapped and looked
+ * up in place; a text one, `client_id access topic' per line, is indexed
+ * in memory. The file is watched with inotify and read again whenever it
+ * is rewritten or replaced.
+ *
+ * Features needing more than these operations (refreshing ahead, prefetch,
+ * deltas, probes of a tripped circuit breaker) are PostgreSQL only.
+ */
+enum acl_fetch_status {
+	ACL_FETCH_OK,
+	ACL_FETCH_ERROR, // the backend answered with an error
+	ACL_FETCH_TIMEOUT, // no answer in time
+	ACL_FETCH_UNAVAILABLE, // the backend cannot be asked right now
+	ACL_FETCH_PENDING, // the same fetch timed out and is still running
+};
+
+// patterns of a fetch, handed back to the backend's release operation
+struct acl_rules {
+	int count;
+	const char **patterns;
+	void *owner; // what the patterns point into
+};
+
+struct acl_backend_events {
+	void (*changed)(const char *client_id, void *arg); // a NULL client id for all of them
+	void *arg;
+};
+
+struct acl_backend;
+
+struct acl_backend_ops {
+	const char *name;
+	enum acl_fetch_status (*fetch)(struct acl_backend *backend, const char *client_id, const char *username, int access,
+								   struct acl_rules *rules);
+	void (*release)(struct acl_backend *backend, struct acl_rules *rules);
+	long (*load)(struct acl_backend *backend, db_rule_cb cb, void *arg); // rows loaded, -1 on error
+	int (*poll)(struct acl_backend *backend, const struct acl_backend_events *events);
+	void (*destroy)(struct acl_backend *backend);
+};
+
+struct acl_backend {
+	const struct acl_backend_ops *ops;
+};
+
+struct acl_backend *acl_backend_pg_new(struct db_pool *pool, const struct db_acl_statement *stmt, const char *load_query,
+									   bool listening);
+struct acl_backend *acl_backend_file_new(const char *path);
+
+static inline enum acl_fetch_status acl_backend_fetch(struct acl_backend *backend, const char *client_id, const char *username,
+													  int access, struct acl_rules *rules)
+{
+	return backend->ops->fetch(backend, client_id, username, access, rules);
+}
+
+static inline void acl_backend_release(struct acl_backend *backend, struct acl_rules *rules)
+{
+	backend->ops->release(backend, rules);
+}
+
+static inline long acl_backend_load(struct acl_backend *backend, db_rule_cb cb, void *arg)
+{
+	return backend->ops->load(backend, cb, arg);
+}
+
+static inline int acl_backend_poll(struct acl_backend *backend, const struct acl_backend_events *events)
+{
+	return backend->ops->poll(backend, events);
+}
+
+static inline void acl_backend_destroy(struct acl_backend *backend)
+{
+	if (backend)
+		backend->ops->destroy(backend);
+}
+
+#endif//__ACL_BACKEND_H__
@@ -0,0 +1,463 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "acl_backend.h"
+#include "acl_snapshot.h"
+#include "acl_store.h"
+#include "utils.h"
+#include "mosquitto_broker.h"
+
+/*
+ * Rules of a local file, in either of two formats told apart by their
+ * first bytes:
+ *
+ *   binary    a snapshot of a preloaded ACL table (acl_snapshot.h), as a
+ *             broker with acl_preload_query and acl_snapshot_path writes
+ *             it; read into memory as it is and looked up in place, it is
+ *             never parsed. A copy rather than a mapping, which a rewrite
+ *             in place would turn into a fault
+ *   text      one rule per line, `client_id access topic', the access a
+ *             bitmask of MOSQ_ACL_* types and the topic the rest of the
+ *             line; blank lines and lines starting with `#' are skipped.
+ *             Read into memory to be parsed into an ACL store, for the same
+ *             reason
+ *
+ * The directory of the file is watched, and the file read again once it is
+ * closed after writing or renamed over: replacing it with rename(2) is what
+ * makes the swap atomic, a rewrite in place can be read half done. Rules
+ * that fail to read, a file that changed size while it was read among them,
+ * leave the previous ones in use.
+ */
+struct file_rules {
+	struct acl_snapshot snap; // of a binary file
+	struct acl_store *store; // of a text file, NULL for a binary one
+};
+
+struct file_backend {
+	struct acl_backend base;
+	char *path;
+	const char *name; // in `path', after its directory
+	int inotify_fd; // -1 if the file is not watched
+	struct file_rules rules;
+};
+
+static void rules_free(struct file_rules *rules)
+{
+	if (rules->store)
+	{
+		acl_store_cleanup(rules->store);
+		mosquitto_free(rules->store);
+	}
+	acl_snapshot_close(&rules->snap);
+	memset(rules, 0, sizeof(*rules));
+}
+
+static size_t rules_client_count(const struct file_rules *rules)
+{
+	return rules->store ? rules->store->client_count : (size_t)rules->snap.header->record_count;
+}
+
+static bool is_blank(char c)
+{
+	return c == ' ' || c == '\t';
+}
+
+/*
+ * Add one line of a text file to `store', NUL terminated and without its
+ * line break. Returns false if it is malformed.
+ */
+static bool parse_line(struct acl_store *store, char *line, int *rc)
+{
+	char *client_id, *access_str, *topic, *end;
+	long access;
+
+	while (is_blank(*line))
+		line++;
+	if (*line == '\0' || *line == '#')
+		return true;
+
+	client_id = line;
+	while (*line && !is_blank(*line))
+		line++;
+	if (*line == '\0')
+		return false;
+	*line++ = '\0';
+
+	while (is_blank(*line))
+		line++;
+	access_str = line;
+	while (*line && !is_blank(*line))
+		line++;
+	if (*line == '\0')
+		return false;
+	*line++ = '\0';
+
+	while (is_blank(*line))
+		line++;
+	topic = line;
+
+	errno = 0;
+	access = strtol(access_str, &end, 10);
+	if (errno || *end || end == access_str || access < 0 || access > 0x0f || *topic == '\0')
+		return false;
+
+	*rc = acl_store_add(store, client_id, (int)access, topic);
+	return true;
+}
+
+static int parse_text(struct acl_store *store, const char *path, const char *data, size_t size)
+{
+	const char *end = data + size;
+	char *line = NULL;
+	size_t line_cap = 0;
+	int line_no = 0;
+	int rc = MOSQ_ERR_SUCCESS;
+
+	while (data < end && rc == MOSQ_ERR_SUCCESS)
+	{
+		const char *eol = memchr(data, '\n', end - data);
+		size_t len = (eol ? eol : end) - data;
+		const char *next = eol ? eol + 1 : end;
+
+		line_no++;
+		if (len + 1 > line_cap)
+		{
+			mosquitto_free(line);
+			line_cap = (len + 1) * 2;
+			line = mosquitto_malloc(line_cap);
+			if (line == NULL)
+				return MOSQ_ERR_NOMEM;
+		}
+		memcpy(line, data, len);
+		if (len > 0 && line[len - 1] == '\r')
+			len--;
+		line[len] = '\0';
+		data = next;
+
+		if (strlen(line) != len || !parse_line(store, line, &rc))
+		{
+			mosquitto_log_printf(MOSQ_LOG_WARNING, "(mosquitto-auth-plugin) Invalid rule on line %d of ACL file %s, "
+								 "expected client id, access and topic.", line_no, path);
+			rc = MOSQ_ERR_INVAL;
+		}
+	}
+
+	mosquitto_free(line);
+	return rc;
+}
+
+/*
+ * Read the `size' bytes of a text file into a buffer, NULL if it cannot be
+ * read or no longer has that size; errno is 0 for the latter.
+ */
+static char *read_text(int fd, size_t size)
+{
+	char *data = mosquitto_malloc(size ? size : 1);
+	size_t done = 0;
+	ssize_t len;
+	char extra;
+
+	if (data == NULL)
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+	errno = 0;
+	while (done < size)
+	{
+		len = pread(fd, data + done, size - done, (off_t)done);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len <= 0)
+			goto fail;
+		done += (size_t)len;
+	}
+	// grown since fstat(), the last line would be cut
+	while ((len = pread(fd, &extra, 1, (off_t)size)) < 0 && errno == EINTR)
+		;
+	if (len != 0)
+		goto fail;
+	return data;
+
+fail:
+	if (len > 0)
+		errno = 0;
+	mosquitto_free(data);
+	return NULL;
+}
+
+static int rules_read(struct file_rules *rules, const char *path)
+{
+	char magic[8];
+	struct stat st;
+	char *data;
+	int fd, rc;
+
+	memset(rules, 0, sizeof(*rules));
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st) < 0)
+	{
+		mosquitto_log_printf(MOSQ_LOG_WARNING, "(mosquitto-auth-plugin) Opening ACL file %s failed: %s", path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return MOSQ_ERR_ERRNO;
+	}
+
+	// a snapshot reads and validates itself
+	if (st.st_size >= (off_t)sizeof(magic) && pread(fd, magic, sizeof(magic), 0) == sizeof(magic)
+		&& !memcmp(magic, ACL_SNAPSHOT_MAGIC, sizeof(magic)))
+	{
+		close(fd);
+		rc = acl_snapshot_read(&rules->snap, path);
+		if (rc == MOSQ_ERR_SUCCESS && !(rules->snap.header->flags & ACL_SNAPSHOT_STORE))
+		{
+			mosquitto_log_printf(MOSQ_LOG_WARNING, "(mosquitto-auth-plugin) ACL file %s is a snapshot of cached rules, "
+								 "only one of a preloaded table holds them all.", path);
+			acl_snapshot_close(&rules->snap);
+			rc = MOSQ_ERR_INVAL;
+		}
+		return rc;
+	}
+
+	data = read_text(fd, st.st_size);
+	close(fd);
+	if (data == NULL)
+	{
+		mosquitto_log_printf(MOSQ_LOG_WARNING, "(mosquitto-auth-plugin) Reading ACL file %s failed: %s", path,
+							 errno ? strerror(errno) : "file changed while read");
+		return errno ? MOSQ_ERR_ERRNO : MOSQ_ERR_INVAL;
+	}
+
+	rules->store = mosquitto_malloc(sizeof(struct acl_store));
+	if (rules->store == NULL || acl_store_init(rules->store) != MOSQ_ERR_SUCCESS)
+	{
+		mosquitto_free(rules->store);
+		rules->store = NULL;
+		rc = MOSQ_ERR_NOMEM;
+	}
+	else
+	{
+		rc = parse_text(rules->store, path, data, st.st_size);
+	}
+
+	mosquitto_free(data);
+	if (rc != MOSQ_ERR_SUCCESS)
+		rules_free(rules);
+	return rc;
+}
+
+static enum acl_fetch_status file_fetch(struct acl_backend *backend, const char *client_id, const char *username, int access,
+										struct acl_rules *rules)
+{
+	struct file_backend *fb = (struct file_backend *)backend;
+
+	memset(rules, 0, sizeof(*rules));
+
+	if (fb->rules.store)
+	{
+		const struct acl_store_client *client = acl_store_find(fb->rules.store, client_id);
+
+		if (client == NULL || client->rule_count == 0)
+			return ACL_FETCH_OK;
+		rules->patterns = mosquitto_malloc(sizeof(char *) * client->rule_count);
+		if (rules->patterns == NULL)
+			return ACL_FETCH_ERROR;
+		for (int i = 0; i < client->rule_count; i++)
+		{
+			if (client->rules[i].access & access)
+				rules->patterns[rules->count++] = acl_store_rule_topic(client, &client->rules[i]);
+		}
+	}
+	else
+	{
+		const struct acl_snapshot_record *record = acl_snapshot_find(&fb->rules.snap, client_id);
+		const struct acl_snapshot_rule *rule;
+
+		if (record == NULL || record->rule_count == 0)
+			return ACL_FETCH_OK;
+		rules->patterns = mosquitto_malloc(sizeof(char *) * record->rule_count);
+		if (rules->patterns == NULL)
+			return ACL_FETCH_ERROR;
+		rule = acl_snapshot_rules(record);
+		for (uint32_t i = 0; i < record->rule_count; i++, rule++)
+		{
+			if (rule->access & access)
+				rules->patterns[rules->count++] = acl_snapshot_rule_topic(record, rule);
+		}
+	}
+	return ACL_FETCH_OK;
+}
+
+static void file_release(struct acl_backend *backend, struct acl_rules *rules)
+{
+	mosquitto_free(rules->patterns);
+	memset(rules, 0, sizeof(*rules));
+}
+
+static long file_load(struct acl_backend *backend, db_rule_cb cb, void *arg)
+{
+	struct file_backend *fb = (struct file_backend *)backend;
+	long rows = 0;
+
+	if (fb->rules.store)
+	{
+		const struct acl_store *store = fb->rules.store;
+
+		for (size_t b = 0; store->buckets && b <= store->bucket_mask; b++)
+		{
+			for (const struct acl_store_client *client = store->buckets[b]; client; client = client->next)
+			{
+				const char *client_id = acl_store_client_id(client);
+
+				if (client->rule_count == 0 && cb(client_id, 0, NULL, NULL, arg) != MOSQ_ERR_SUCCESS)
+					return -1;
+				for (int i = 0; i < client->rule_count; i++, rows++)
+				{
+					if (cb(client_id, client->rules[i].access, acl_store_rule_topic(client, &client->rules[i]), NULL, arg)
+						!= MOSQ_ERR_SUCCESS)
+						return -1;
+				}
+			}
+		}
+	}
+	else
+	{
+		// a cursor of our own, the file's stays where it is
+		struct acl_snapshot snap = fb->rules.snap;
+		const struct acl_snapshot_record *record;
+
+		snap.cursor = snap.header->records_off;
+		while ((record = acl_snapshot_next(&snap)) != NULL)
+		{
+			const struct acl_snapshot_rule *rule = acl_snapshot_rules(record);
+			const char *client_id = acl_snapshot_client_id(record);
+
+			if (record->rule_count == 0 && cb(client_id, 0, NULL, NULL, arg) != MOSQ_ERR_SUCCESS)
+				return -1;
+			for (uint32_t i = 0; i < record->rule_count; i++, rule++, rows++)
+			{
+				if (cb(client_id, rule->access, acl_snapshot_rule_topic(record, rule), NULL, arg) != MOSQ_ERR_SUCCESS)
+					return -1;
+			}
+		}
+	}
+	return rows;
+}
+
+/*
+ * Whether the events read from the watch concern the file itself, or may
+ * have, when some were lost.
+ */
+static bool file_changed(struct file_backend *fb)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	bool changed = false;
+	ssize_t len;
+
+	while ((len = read(fb->inotify_fd, buf, sizeof(buf))) > 0)
+	{
+		for (char *p = buf; p < buf + len;)
+		{
+			const struct inotify_event *ev = (const struct inotify_event *)p;
+
+			if ((ev->mask & IN_Q_OVERFLOW) || (ev->len && !strcmp(ev->name, fb->name)))
+				changed = true;
+			p += sizeof(struct inotify_event) + ev->len;
+		}
+	}
+	return changed;
+}
+
+static int file_poll(struct acl_backend *backend, const struct acl_backend_events *events)
+{
+	struct file_backend *fb = (struct file_backend *)backend;
+	struct file_rules rules;
+	int64_t start;
+
+	if (fb->inotify_fd < 0 || !file_changed(fb))
+		return MOSQ_ERR_SUCCESS;
+
+	start = mono_time_ms();
+	if (rules_read(&rules, fb->path) != MOSQ_ERR_SUCCESS)
+	{
+		mosquitto_log_printf(MOSQ_LOG_WARNING, "(mosquitto-auth-plugin) Reloading ACL file %s failed, keeping the previous rules.",
+							 fb->path);
+		return MOSQ_ERR_INVAL;
+	}
+
+	// nothing fetched from the old rules is held past a check
+	rules_free(&fb->rules);
+	fb->rules = rules;
+	mosquitto_log_printf(MOSQ_LOG_INFO, "(mosquitto-auth-plugin) Reloaded ACL file %s, %zu clients in %lld ms.", fb->path,
+						 rules_client_count(&fb->rules), (long long)(mono_time_ms() - start));
+
+	events->changed(NULL, events->arg);
+	return MOSQ_ERR_SUCCESS;
+}
+
+static void file_destroy(struct acl_backend *backend)
+{
+	struct file_backend *fb = (struct file_backend *)backend;
+
+	if (fb->inotify_fd >= 0)
+		close(fb->inotify_fd);
+	rules_free(&fb->rules);
+	mosquitto_free(fb->path);
+	mosquitto_free(fb);
+}
+
+static const struct acl_backend_ops file_ops = {
+	.name = "file",
+	.fetch = file_fetch,
+	.release = file_release,
+	.load = file_load,
+	.poll = file_poll,
+	.destroy = file_destroy,
+};
+
+/*
+ * Rules of the file at `path', which must be readable now. Without inotify
+ * they are served as they are until the broker restarts.
+ */
+struct acl_backend *acl_backend_file_new(const char *path)
+{
+	struct file_backend *fb = mosquitto_calloc(1, sizeof(*fb));
+	const char *slash = strrchr(path, '/');
+	char *dir;
+
+	if (fb == NULL)
+		return NULL;
+	fb->base.ops = &file_ops;
+	fb->inotify_fd = -1;
+	fb->path = mosquitto_strdup(path);
+	if (fb->path == NULL || rules_read(&fb->rules, fb->path) != MOSQ_ERR_SUCCESS)
+	{
+		file_destroy(&fb->base);
+		return NULL;
+	}
+	fb->name = slash ? fb->path + (slash - path) + 1 : fb->path;
+	mosquitto_log_printf(MOSQ_LOG_INFO, "(mosquitto-auth-plugin) Serving ACL rules from %s file %s, %zu clients.",
+						 fb->rules.store ? "text" : "binary", path, rules_client_count(&fb->rules));
+
+	// renames only show up on the directory, not on the file they replace
+	dir = slash ? mosquitto_strdup(path) : NULL;
+	if (dir)
+		dir[slash == path ? 1 : slash - path] = '\0';
+	fb->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fb->inotify_fd >= 0 && inotify_add_watch(fb->inotify_fd, slash ? dir : ".", IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+	{
+		close(fb->inotify_fd);
+		fb->inotify_fd = -1;
+	}
+	if (fb->inotify_fd < 0)
+	{
+		mosquitto_log_printf(MOSQ_LOG_WARNING, "(mosquitto-auth-plugin) Watching ACL file %s failed: %s, changes need a restart.",
+							 path, strerror(errno));
+	}
+	mosquitto_free(dir);
+	return &fb->base;
+}
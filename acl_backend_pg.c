@@ -0,0 +1,161 @@
+#include <string.h>
+
+#include "acl_backend.h"
+#include "mosquitto_broker.h"
+
+struct pg_backend {
+	struct acl_backend base;
+	struct db_pool *pool;
+	const struct db_acl_statement *stmt;
+	const char *load_query; // listing the whole ACL table, NULL if none
+	bool listening; // the primary connection listens for ACL changes
+	const struct acl_backend_events *events; // of the poll in progress
+};
+
+static enum acl_fetch_status pg_fetch(struct acl_backend *backend, const char *client_id, const char *username, int access,
+									  struct acl_rules *rules)
+{
+	struct pg_backend *pg = (struct pg_backend *)backend;
+	PGresult *res;
+	bool timed_out;
+	int rows;
+
+	memset(rules, 0, sizeof(*rules));
+
+	// the same query timed out and is still running, its rows are cached when they come
+	if (db_pool_in_flight(pg->pool, client_id, username, access))
+		return ACL_FETCH_PENDING;
+
+	res = db_pool_exec_acl_query(pg->pool, pg->stmt, client_id, username, access, &timed_out);
+	if (res == NULL)
+		return timed_out ? ACL_FETCH_TIMEOUT : ACL_FETCH_UNAVAILABLE;
+
+	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+	{
+		mosquitto_log_printf(MOSQ_LOG_DEBUG, "(mosquitto-auth-plugin) Database error: %s.", PQresultErrorMessage(res));
+		PQclear(res);
+		return ACL_FETCH_ERROR;
+	}
+	if (PQnfields(res) != 1)
+	{
+		mosquitto_log_printf(MOSQ_LOG_DEBUG, "(mosquitto-auth-plugin) Database error: Expected 1 number of fields, got %d.", PQnfields(res));
+		PQclear(res);
+		return ACL_FETCH_ERROR;
+	}
+
+	rows = PQntuples(res);
+	if (rows > 0)
+	{
+		rules->patterns = mosquitto_malloc(sizeof(char *) * rows);
+		if (rules->patterns == NULL)
+		{
+			PQclear(res);
+			return ACL_FETCH_ERROR;
+		}
+	}
+	for (int row = 0; row < rows; row++)
+		rules->patterns[row] = PQgetvalue(res, row, 0);
+	rules->count = rows;
+	rules->owner = res;
+
+	return ACL_FETCH_OK;
+}
+
+static void pg_release(struct acl_backend *backend, struct acl_rules *rules)
+{
+	mosquitto_free(rules->patterns);
+	PQclear(rules->owner);
+	memset(rules, 0, sizeof(*rules));
+}
+
+static long pg_load(struct acl_backend *backend, db_rule_cb cb, void *arg)
+{
+	struct pg_backend *pg = (struct pg_backend *)backend;
+	PGconn *primary = db_pool_primary(pg->pool);
+
+	if (primary == NULL || pg->load_query == NULL)
+		return -1;
+	return db_stream_rules(primary, pg->load_query, NULL, cb, arg);
+}
+
+/*
+ * A notification names the clients whose permissions changed, one client
+ * id per line; an empty payload or "*" stands for all of them.
+ */
+static void on_notify(char *payload, void *arg)
+{
+	struct pg_backend *pg = arg;
+	char *line = payload;
+
+	// timed out queries in flight may have read the old rules
+	db_pool_forget_flights(pg->pool);
+
+	if (payload == NULL || *payload == '\0' || !strcmp(payload, "*"))
+	{
+		pg->events->changed(NULL, pg->events->arg);
+		return;
+	}
+
+	while (line)
+	{
+		char *next = strchr(line, '\n');
+
+		if (next)
+			*next++ = '\0';
+		if (*line)
+			pg->events->changed(line, pg->events->arg);
+		line = next;
+	}
+}
+
+static int pg_poll(struct acl_backend *backend, const struct acl_backend_events *events)
+{
+	struct pg_backend *pg = (struct pg_backend *)backend;
+	PGconn *primary = db_pool_primary(pg->pool);
+
+	if (!pg->listening || primary == NULL)
+		return MOSQ_ERR_SUCCESS;
+
+	pg->events = events;
+	if (db_drain_notifications(primary, on_notify, pg) < 0)
+	{
+		mosquitto_log_printf(MOSQ_LOG_WARNING, "(mosquitto-auth-plugin) Reading notifications failed: %s", PQerrorMessage(primary));
+		return MOSQ_ERR_UNKNOWN;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+static void pg_destroy(struct acl_backend *backend)
+{
+	mosquitto_free(backend);
+}
+
+static const struct acl_backend_ops pg_ops = {
+	.name = "postgres",
+	.fetch = pg_fetch,
+	.release = pg_release,
+	.load = pg_load,
+	.poll = pg_poll,
+	.destroy = pg_destroy,
+};
+
+/*
+ * Rules from the prepared ACL query, run on the connections of `pool' as
+ * `stmt' describes. `load_query' lists the whole table for load, and
+ * `listening' tells whether the primary connection receives the ACL change
+ * notifications poll reports. The pool and strings stay the caller's.
+ */
+struct acl_backend *acl_backend_pg_new(struct db_pool *pool, const struct db_acl_statement *stmt, const char *load_query,
+									   bool listening)
+{
+	struct pg_backend *pg = mosquitto_calloc(1, sizeof(*pg));
+
+	if (pg == NULL)
+		return NULL;
+	pg->base.ops = &pg_ops;
+	pg->pool = pool;
+	pg->stmt = stmt;
+	pg->load_query = load_query;
+	pg->listening = listening;
+	return &pg->base;
+}
@@ -0,0 +1,314 @@
+#include "acl_cache.h"
+#include "utils.h"
+#include "mosquitto_broker.h"
+
+/*
+ * Entries are bucketed on the client id alone, so every access type of a
+ * client lives in the same chain and can be dropped together.
+ */
+static struct acl_cache_entry **bucket_of(struct acl_cache *cache, uint32_t hash)
+{
+	return &cache->buckets[hash & cache->bucket_mask];
+}
+
+static bool username_eq(const char *a, const char *b)
+{
+	if (a == NULL || b == NULL)
+		return a == b;
+	return !strcmp(a, b);
+}
+
+static void lru_unlink(struct acl_cache *cache, struct acl_cache_entry *entry)
+{
+	if (entry->lru_prev)
+		entry->lru_prev->lru_next = entry->lru_next;
+	else
+		cache->lru_head = entry->lru_next;
+
+	if (entry->lru_next)
+		entry->lru_next->lru_prev = entry->lru_prev;
+	else
+		cache->lru_tail = entry->lru_prev;
+
+	entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void lru_push_front(struct acl_cache *cache, struct acl_cache_entry *entry)
+{
+	entry->lru_prev = NULL;
+	entry->lru_next = cache->lru_head;
+	if (cache->lru_head)
+		cache->lru_head->lru_prev = entry;
+	cache->lru_head = entry;
+	if (cache->lru_tail == NULL)
+		cache->lru_tail = entry;
+}
+
+static void entry_remove(struct acl_cache *cache, struct acl_cache_entry *entry)
+{
+	struct acl_cache_entry **link = bucket_of(cache, entry->hash);
+
+	while (*link && *link != entry)
+		link = &(*link)->hash_next;
+	if (*link)
+		*link = entry->hash_next;
+
+	lru_unlink(cache, entry);
+	cache->entry_count--;
+	acl_ruleset_release(&cache->rulesets, entry->set);
+	mosquitto_free(entry);
+}
+
+int acl_cache_init(struct acl_cache *cache, size_t max_entries, int64_t ttl_ms)
+{
+	size_t bucket_count = 16;
+
+	memset(cache, 0, sizeof(*cache));
+	cache->max_entries = max_entries;
+	cache->ttl_ms = ttl_ms;
+
+	if (!acl_cache_enabled(cache))
+		return MOSQ_ERR_SUCCESS;
+
+	// keep the load factor at or below one, the table never grows
+	while (bucket_count < max_entries)
+		bucket_count <<= 1;
+
+	cache->buckets = mosquitto_calloc(bucket_count, sizeof(struct acl_cache_entry *));
+	if (cache->buckets == NULL)
+		return MOSQ_ERR_NOMEM;
+	cache->bucket_mask = bucket_count - 1;
+
+	return acl_ruleset_table_init(&cache->rulesets);
+}
+
+void acl_cache_cleanup(struct acl_cache *cache)
+{
+	acl_cache_clear(cache);
+	acl_ruleset_table_cleanup(&cache->rulesets);
+	mosquitto_free(cache->buckets);
+	cache->buckets = NULL;
+}
+
+bool acl_cache_enabled(const struct acl_cache *cache)
+{
+	return cache->max_entries > 0 && cache->ttl_ms > 0;
+}
+
+static struct acl_cache_entry *entry_find(struct acl_cache *cache, const char *client_id, int access)
+{
+	uint32_t hash = hash_str(client_id, 0);
+	struct acl_cache_entry *entry;
+
+	for (entry = *bucket_of(cache, hash); entry; entry = entry->hash_next)
+	{
+		if (entry->hash == hash && entry->access == access && !strcmp(entry->client_id, client_id))
+			break;
+	}
+	return entry;
+}
+
+const struct acl_cache_entry *acl_cache_get(struct acl_cache *cache, const char *client_id, const char *username, int access)
+{
+	struct acl_cache_entry *entry;
+
+	if (cache->buckets == NULL)
+		return NULL;
+
+	entry = entry_find(cache, client_id, access);
+	if (entry == NULL)
+	{
+		cache->misses++;
+		return NULL;
+	}
+
+	// rules were expanded for another username
+	if (!username_eq(entry->username, username))
+	{
+		entry_remove(cache, entry);
+		cache->misses++;
+		return NULL;
+	}
+
+	// stale rules are kept as the last known ones until replaced or evicted
+	if (entry->expires <= mono_time_ms())
+	{
+		cache->misses++;
+		return NULL;
+	}
+
+	lru_unlink(cache, entry);
+	lru_push_front(cache, entry);
+	cache->hits++;
+	return entry;
+}
+
+/*
+ * As acl_cache_get(), but returns the entry even once it has expired, for
+ * when the database cannot be asked for fresh rules.
+ */
+const struct acl_cache_entry *acl_cache_get_stale(struct acl_cache *cache, const char *client_id, const char *username, int access)
+{
+	struct acl_cache_entry *entry;
+
+	if (cache->buckets == NULL)
+		return NULL;
+
+	entry = entry_find(cache, client_id, access);
+	if (entry == NULL || !username_eq(entry->username, username))
+		return NULL;
+
+	lru_unlink(cache, entry);
+	lru_push_front(cache, entry);
+	return entry;
+}
+
+/*
+ * Cache the raw patterns `rules' of `client_id' for `access', or, with
+ * `expanded', patterns already expanded for `username'.
+ */
+int acl_cache_put(struct acl_cache *cache, const char *client_id, const char *username, int access, const char *const *rules, int rule_count,
+				  bool expanded)
+{
+	return acl_cache_put_until(cache, client_id, username, access, rules, rule_count, expanded, mono_time_ms() + cache->ttl_ms);
+}
+
+/*
+ * As acl_cache_put(), for rules that expire at `expires' rather than after
+ * the cache's TTL, e.g. ones another instance fetched earlier.
+ */
+int acl_cache_put_until(struct acl_cache *cache, const char *client_id, const char *username, int access, const char *const *rules,
+						int rule_count, bool expanded, int64_t expires)
+{
+	struct acl_cache_entry *entry, *old, **bucket;
+	size_t client_id_len, username_len = 0;
+	char *str;
+
+	if (cache->buckets == NULL)
+		return MOSQ_ERR_SUCCESS;
+
+	// a single block for the header and the key
+	client_id_len = strlen(client_id) + 1;
+	if (username)
+		username_len = strlen(username) + 1;
+
+	entry = mosquitto_malloc(sizeof(*entry) + client_id_len + username_len);
+	if (entry == NULL)
+		return MOSQ_ERR_NOMEM;
+
+	entry->set = acl_ruleset_intern(&cache->rulesets, rules, rule_count, expanded);
+	if (entry->set == NULL)
+	{
+		mosquitto_free(entry);
+		return MOSQ_ERR_NOMEM;
+	}
+
+	entry->hash = hash_str(client_id, 0);
+	entry->access = access;
+	entry->expires = expires;
+	entry->refreshing = false;
+
+	str = (char *)(entry + 1);
+	memcpy(str, client_id, client_id_len);
+	entry->client_id = str;
+	str += client_id_len;
+
+	entry->username = NULL;
+	if (username)
+	{
+		memcpy(str, username, username_len);
+		entry->username = str;
+	}
+
+	// replace the entry already present for this key, if any, only now as
+	// `rules' may point into its set
+	for (old = *bucket_of(cache, entry->hash); old; old = old->hash_next)
+	{
+		if (old->access == access && !strcmp(old->client_id, client_id))
+		{
+			entry_remove(cache, old);
+			break;
+		}
+	}
+
+	while (cache->entry_count >= cache->max_entries && cache->lru_tail)
+		entry_remove(cache, cache->lru_tail);
+
+	bucket = bucket_of(cache, entry->hash);
+	entry->hash_next = *bucket;
+	*bucket = entry;
+	entry->lru_prev = entry->lru_next = NULL;
+	lru_push_front(cache, entry);
+	cache->entry_count++;
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+/*
+ * Whether the rules of `entry' grant `topic' to the entry's client.
+ */
+bool acl_cache_match(const struct acl_cache_entry *entry, const char *topic)
+{
+	return acl_ruleset_match(entry->set, topic, entry->client_id, entry->username);
+}
+
+/*
+ * Drop every access type cached for `client_id', e.g. after its permissions
+ * have changed.
+ */
+void acl_cache_remove_client(struct acl_cache *cache, const char *client_id)
+{
+	struct acl_cache_entry *entry, *next;
+
+	if (cache->buckets == NULL)
+		return;
+
+	for (entry = *bucket_of(cache, hash_str(client_id, 0)); entry; entry = next)
+	{
+		next = entry->hash_next;
+		if (!strcmp(entry->client_id, client_id))
+			entry_remove(cache, entry);
+	}
+}
+
+void acl_cache_clear(struct acl_cache *cache)
+{
+	while (cache->lru_tail)
+		entry_remove(cache, cache->lru_tail);
+}
+
+/*
+ * Bring every entry's expiry within `window_ms', spread evenly over it from
+ * the most to the least recently used, so that rules made stale all at once
+ * are fetched again a few at a time, the busiest clients' first. Entries
+ * expiring sooner are left alone.
+ */
+void acl_cache_expire_spread(struct acl_cache *cache, int64_t window_ms)
+{
+	int64_t now = mono_time_ms();
+	size_t rank = 0;
+
+	for (struct acl_cache_entry *entry = cache->lru_head; entry; entry = entry->lru_next)
+	{
+		int64_t expires = now + window_ms * (int64_t)++rank / (int64_t)(cache->entry_count + 1);
+
+		if (expires < entry->expires)
+			entry->expires = expires;
+	}
+}
+
+/*
+ * Whether `entry' is due for a refresh ahead of its expiry, i.e. expires
+ * within `ahead_ms' and has not been claimed yet. A claimed entry stays
+ * marked until it is replaced.
+ */
+bool acl_cache_claim_refresh(const struct acl_cache_entry *entry, int64_t ahead_ms)
+{
+	struct acl_cache_entry *claimed = (struct acl_cache_entry *)entry;
+
+	if (entry->refreshing || entry->expires - mono_time_ms() > ahead_ms)
+		return false;
+
+	claimed->refreshing = true;
+	return true;
+}
@@ -0,0 +1,68 @@
+#ifndef __ACL_CACHE_H__
+#define __ACL_CACHE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "acl_ruleset.h"
+
+/*
+ * In-memory cache of the ACL rows returned for a (client id, access type)
+ * pair, so a hit needs neither a database round trip nor any heap
+ * allocation. Rules are kept unexpanded in interned rule sets (see
+ * acl_ruleset.h), compiled into a topic trie once per distinct set and
+ * shared by every entry holding the same patterns; a hit is matched in a
+ * single walk, %c/%u resolved for the entry's client on the way. The
+ * username is still part of the key, as it changes what the templates
+ * grant.
+ *
+ * Each entry is a single allocation holding the key and a reference to its
+ * rule set. Entries are chained in a fixed size bucket array and
+ * linked in an LRU list; once `max_entries' is reached the least recently
+ * used entry is evicted. Expired entries are no longer hits, but are kept
+ * as the client's last known rules until replaced or evicted.
+ */
+struct acl_cache_entry {
+	struct acl_cache_entry *hash_next; // next entry in the same bucket
+	struct acl_cache_entry *lru_prev; // more recently used entry
+	struct acl_cache_entry *lru_next; // less recently used entry
+	uint32_t hash; // hash of client_id
+	int access; // MOSQ_ACL_* access type
+	int64_t expires; // monotonic expiry time, in ms
+	const char *client_id;
+	const char *username; // username the rules were fetched for, may be NULL
+	struct acl_ruleset *set; // the rules, shared with the entries holding the same
+	bool refreshing; // a refresh ahead of expiry has been asked for
+};
+
+struct acl_cache {
+	struct acl_cache_entry **buckets;
+	size_t bucket_mask; // bucket count - 1, bucket count is a power of two
+	size_t entry_count;
+	size_t max_entries; // 0 disables the cache
+	int64_t ttl_ms;
+	struct acl_cache_entry *lru_head; // most recently used
+	struct acl_cache_entry *lru_tail; // least recently used
+	struct acl_ruleset_table rulesets; // the distinct rule sets of the entries
+	uint64_t hits;
+	uint64_t misses;
+};
+
+int acl_cache_init(struct acl_cache *cache, size_t max_entries, int64_t ttl_ms);
+void acl_cache_cleanup(struct acl_cache *cache);
+bool acl_cache_enabled(const struct acl_cache *cache);
+
+const struct acl_cache_entry *acl_cache_get(struct acl_cache *cache, const char *client_id, const char *username, int access);
+const struct acl_cache_entry *acl_cache_get_stale(struct acl_cache *cache, const char *client_id, const char *username, int access);
+int acl_cache_put(struct acl_cache *cache, const char *client_id, const char *username, int access, const char *const *rules, int rule_count,
+				  bool expanded);
+int acl_cache_put_until(struct acl_cache *cache, const char *client_id, const char *username, int access, const char *const *rules,
+						int rule_count, bool expanded, int64_t expires);
+bool acl_cache_match(const struct acl_cache_entry *entry, const char *topic);
+void acl_cache_remove_client(struct acl_cache *cache, const char *client_id);
+void acl_cache_clear(struct acl_cache *cache);
+void acl_cache_expire_spread(struct acl_cache *cache, int64_t window_ms);
+bool acl_cache_claim_refresh(const struct acl_cache_entry *entry, int64_t ahead_ms);
+
+#endif//__ACL_CACHE_H__
@@ -0,0 +1,262 @@
+#include "acl_ruleset.h"
+#include "utils.h"
+#include "mosquitto_broker.h"
+
+#define RULESET_SORT_STACK 64 // patterns normalized without a heap allocation
+
+static int compare_rules(const void *a, const void *b)
+{
+	return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+static struct acl_ruleset **bucket_of(struct acl_ruleset_table *table, uint32_t hash)
+{
+	return &table->buckets[hash & table->bucket_mask];
+}
+
+static bool same_set(const struct acl_ruleset *set, uint32_t hash, const char *const *rules, int rule_count, bool expanded)
+{
+	if (set->hash != hash || set->rule_count != rule_count || set->expanded != expanded)
+		return false;
+	for (int i = 0; i < rule_count; i++)
+	{
+		if (strcmp(set->rules[i], rules[i]))
+			return false;
+	}
+	return true;
+}
+
+static void grow(struct acl_ruleset_table *table)
+{
+	size_t bucket_count = (table->bucket_mask + 1) * 2;
+	struct acl_ruleset **buckets = mosquitto_calloc(bucket_count, sizeof(struct acl_ruleset *));
+
+	// a longer chain is all a failure costs
+	if (buckets == NULL)
+		return;
+
+	for (size_t b = 0; b <= table->bucket_mask; b++)
+	{
+		struct acl_ruleset *set, *next;
+
+		for (set = table->buckets[b]; set; set = next)
+		{
+			next = set->next;
+			set->next = buckets[set->hash & (bucket_count - 1)];
+			buckets[set->hash & (bucket_count - 1)] = set;
+		}
+	}
+	mosquitto_free(table->buckets);
+	table->buckets = buckets;
+	table->bucket_mask = bucket_count - 1;
+}
+
+static struct acl_ruleset *new_set(uint32_t hash, const char *const *rules, int rule_count, bool expanded)
+{
+	struct acl_ruleset *set;
+	size_t size = sizeof(*set) + sizeof(char *) * rule_count;
+	char *str;
+
+	for (int i = 0; i < rule_count; i++)
+		size += strlen(rules[i]) + 1;
+
+	set = mosquitto_malloc(size);
+	if (set == NULL)
+		return NULL;
+
+	set->trie = topic_trie_new();
+	if (set->trie == NULL)
+	{
+		mosquitto_free(set);
+		return NULL;
+	}
+
+	set->hash = hash;
+	set->refs = 1;
+	set->expanded = expanded;
+	set->has_templates = false;
+	set->rule_count = rule_count;
+	set->rules = (const char **)(set + 1);
+
+	str = (char *)(set->rules + rule_count);
+	for (int i = 0; i < rule_count; i++)
+	{
+		size_t len = strlen(rules[i]) + 1;
+
+		memcpy(str, rules[i], len);
+		set->rules[i] = str;
+		str += len;
+
+		if (t_is_template(rules[i]))
+		{
+			// the trie would take a literal %c/%u for a template, sub_acl_check() matches it
+			if (expanded)
+				continue;
+			set->has_templates = true;
+		}
+
+		if (topic_trie_add(set->trie, rules[i]) != MOSQ_ERR_SUCCESS)
+		{
+			topic_trie_free(set->trie);
+			mosquitto_free(set);
+			return NULL;
+		}
+	}
+	set->size = size + topic_trie_memory(set->trie);
+	return set;
+}
+
+int acl_ruleset_table_init(struct acl_ruleset_table *table)
+{
+	memset(table, 0, sizeof(*table));
+	table->buckets = mosquitto_calloc(64, sizeof(struct acl_ruleset *));
+	if (table->buckets == NULL)
+		return MOSQ_ERR_NOMEM;
+	table->bucket_mask = 63;
+	return MOSQ_ERR_SUCCESS;
+}
+
+void acl_ruleset_table_cleanup(struct acl_ruleset_table *table)
+{
+	for (size_t b = 0; table->buckets && b <= table->bucket_mask; b++)
+	{
+		struct acl_ruleset *set, *next;
+
+		for (set = table->buckets[b]; set; set = next)
+		{
+			next = set->next;
+			topic_trie_free(set->trie);
+			mosquitto_free(set);
+		}
+	}
+	mosquitto_free(table->buckets);
+	memset(table, 0, sizeof(*table));
+}
+
+/*
+ * A reference to the set of `rules', shared with every other holder of the
+ * same patterns, released with acl_ruleset_release(). `expanded' tells the
+ * rules were expanded for one client and hold no templates. Returns NULL if
+ * out of memory.
+ */
+struct acl_ruleset *acl_ruleset_intern(struct acl_ruleset_table *table, const char *const *rules, int rule_count, bool expanded)
+{
+	const char *stack[RULESET_SORT_STACK];
+	const char **sorted = stack;
+	struct acl_ruleset *set, **bucket;
+	uint32_t hash = expanded ? 1 : 2;
+	int count = 0;
+
+	if (rule_count > RULESET_SORT_STACK)
+	{
+		sorted = mosquitto_malloc(sizeof(char *) * rule_count);
+		if (sorted == NULL)
+			return NULL;
+	}
+
+	// the same patterns in another order, or repeated, grant the same
+	for (int i = 0; i < rule_count; i++)
+	{
+		if (*rules[i])
+			sorted[count++] = rules[i];
+	}
+	qsort(sorted, count, sizeof(char *), compare_rules);
+	rule_count = count;
+	count = 0;
+	for (int i = 0; i < rule_count; i++)
+	{
+		if (count == 0 || strcmp(sorted[count - 1], sorted[i]))
+		{
+			sorted[count++] = sorted[i];
+			// the NUL separates the patterns in the hash too
+			hash = hash_bytes(sorted[i], strlen(sorted[i]) + 1, hash);
+		}
+	}
+
+	for (set = *bucket_of(table, hash); set; set = set->next)
+	{
+		if (same_set(set, hash, sorted, count, expanded))
+		{
+			set->refs++;
+			goto done;
+		}
+	}
+
+	set = new_set(hash, sorted, count, expanded);
+	if (set == NULL)
+		goto done;
+
+	if (table->count >= table->bucket_mask + 1)
+		grow(table);
+	bucket = bucket_of(table, hash);
+	set->next = *bucket;
+	*bucket = set;
+	table->count++;
+	table->memory += set->size;
+
+done:
+	if (sorted != stack)
+		mosquitto_free(sorted);
+	return set;
+}
+
+void acl_ruleset_release(struct acl_ruleset_table *table, struct acl_ruleset *set)
+{
+	struct acl_ruleset **link;
+
+	if (set == NULL || --set->refs > 0)
+		return;
+
+	for (link = bucket_of(table, set->hash); *link && *link != set; link = &(*link)->next)
+		;
+	if (*link)
+		*link = set->next;
+
+	table->count--;
+	table->memory -= set->size;
+	topic_trie_free(set->trie);
+	mosquitto_free(set);
+}
+
+/*
+ * Whether a pattern of `set', its templates standing for `client_id' and
+ * `username', matches `topic'.
+ */
+bool acl_ruleset_match(const struct acl_ruleset *set, const char *topic, const char *client_id, const char *username)
+{
+	if (set->expanded)
+	{
+		if (topic_trie_match(set->trie, topic))
+			return true;
+		for (int i = 0; i < set->rule_count; i++)
+		{
+			if (t_is_template(set->rules[i]) && sub_acl_check(set->rules[i], topic))
+				return true;
+		}
+		return false;
+	}
+
+	if (!set->has_templates)
+		return topic_trie_match(set->trie, topic);
+
+	if (t_match_in_place(client_id, username))
+		return topic_trie_match_template(set->trie, topic, client_id, username);
+
+	// values that would change the structure of the patterns, expand them
+	if (topic_trie_match(set->trie, topic))
+		return true;
+	for (int i = 0; i < set->rule_count; i++)
+	{
+		char *expanded;
+		bool match;
+
+		if (!t_is_template(set->rules[i]))
+			continue;
+		t_expand(client_id, username, set->rules[i], &expanded);
+		match = expanded && *expanded && sub_acl_check(expanded, topic);
+		mosquitto_free(expanded);
+		if (match)
+			return true;
+	}
+	return false;
+}
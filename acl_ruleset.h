@@ -0,0 +1,53 @@
+#ifndef __ACL_RULESET_H__
+#define __ACL_RULESET_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "topic_trie.h"
+
+/*
+ * Interned ACL rule sets. Most clients of a fleet get the same patterns
+ * from the ACL query, differing only in the %c/%u values their templates
+ * stand for, so the patterns are kept unexpanded: normalized (sorted, empty
+ * and duplicate ones dropped) and hashed, an identical set already held is
+ * shared instead of stored again. Memory then grows with the number of
+ * distinct policies rather than with the number of clients.
+ *
+ * A set is immutable once interned, and reference counted: it is freed
+ * when the last holder releases it. Its patterns are compiled into one
+ * topic trie whose template levels are resolved at match time against the
+ * client id and username of the check.
+ *
+ * Sets made of rules already expanded for one client, as an older snapshot
+ * or another instance may hand them over, are interned apart: a %c or %u
+ * in them is literal.
+ */
+struct acl_ruleset {
+	struct acl_ruleset *next; // next set in the same bucket
+	uint32_t hash; // of the normalized patterns and `expanded'
+	uint32_t refs;
+	bool expanded; // the patterns hold no templates, whatever they read
+	bool has_templates;
+	int rule_count;
+	const char **rules; // normalized patterns
+	struct topic_trie *trie; // `rules' compiled for matching
+	size_t size; // bytes of the set's block and trie
+};
+
+struct acl_ruleset_table {
+	struct acl_ruleset **buckets;
+	size_t bucket_mask; // bucket count - 1, bucket count is a power of two
+	size_t count; // distinct sets held
+	size_t memory; // bytes of the sets and their tries
+};
+
+int acl_ruleset_table_init(struct acl_ruleset_table *table);
+void acl_ruleset_table_cleanup(struct acl_ruleset_table *table);
+
+struct acl_ruleset *acl_ruleset_intern(struct acl_ruleset_table *table, const char *const *rules, int rule_count, bool expanded);
+void acl_ruleset_release(struct acl_ruleset_table *table, struct acl_ruleset *set);
+bool acl_ruleset_match(const struct acl_ruleset *set, const char *topic, const char *client_id, const char *username);
+
+#endif//__ACL_RULESET_H__
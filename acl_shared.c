@@ -0,0 +1,443 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "acl_shared.h"
+#include "utils.h"
+#include "mosquitto_broker.h"
+#include "mosquitto_plugin.h"
+
+#define ALIGN8(x) (((x) + 7) & ~(size_t)7)
+#define SLOTS_SHARE 8 // the slots take up to 1/SLOTS_SHARE of the segment, the ring the rest
+
+static uint32_t key_hash(const char *client_id, int access)
+{
+	return hash_str(client_id, (uint32_t)access);
+}
+
+/*
+ * Lay out a segment that was just created, zero filled.
+ */
+static void layout(struct acl_shared *shared)
+{
+	struct acl_shared_header *h = shared->header;
+	uint64_t slot_count = 1;
+
+	while (slot_count * 2 * sizeof(struct acl_shared_slot) <= shared->size / SLOTS_SHARE)
+		slot_count *= 2;
+
+	h->format = ACL_SHARED_FORMAT;
+	h->size = shared->size;
+	h->slot_count = slot_count;
+	h->slots_off = ALIGN8(sizeof(*h));
+	h->data_off = h->slots_off + slot_count * sizeof(struct acl_shared_slot);
+	h->data_size = (h->size - h->data_off) & ~(uint64_t)7;
+	atomic_init(&h->data_head, 0);
+	atomic_init(&h->epoch, 1);
+	memcpy(h->magic, ACL_SHARED_MAGIC, sizeof(h->magic));
+}
+
+static bool header_valid(const struct acl_shared *shared)
+{
+	const struct acl_shared_header *h = shared->header;
+
+	return !memcmp(h->magic, ACL_SHARED_MAGIC, sizeof(h->magic)) && h->format == ACL_SHARED_FORMAT && h->size == shared->size
+		   && h->slot_count && !(h->slot_count & (h->slot_count - 1)) && h->slots_off == ALIGN8(sizeof(*h))
+		   && h->data_off == h->slots_off + h->slot_count * sizeof(struct acl_shared_slot) && h->data_off < h->size
+		   && h->data_size >= 8 && !(h->data_size % 8) && h->data_off + h->data_size <= h->size;
+}
+
+static bool atomics_lock_free(void)
+{
+	_Atomic uint64_t wide;
+	_Atomic uint32_t narrow;
+
+	return atomic_is_lock_free(&wide) && atomic_is_lock_free(&narrow);
+}
+
+/*
+ * Map the segment `name', creating it with `size' bytes if no instance did
+ * yet.
+ */
+int acl_shared_open(struct acl_shared *shared, const char *name, size_t size)
+{
+	struct stat st;
+	void *base = MAP_FAILED;
+	bool created = false;
+	int fd;
+
+	memset(shared, 0, sizeof(*shared));
+
+	if (!atomics_lock_free())
+	{
+		mosquitto_log_printf(MOSQ_LOG_WARNING, "(mosquitto-auth-plugin) Not sharing ACL segment %s, 64 bit atomics are not lock-free here.", name);
+		return MOSQ_ERR_NOT_SUPPORTED;
+	}
+
+	fd = shm_open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0)
+	{
+		mosquitto_log_printf(MOSQ_LOG_WARNING, "(mosquitto-auth-plugin) Opening shared ACL segment %s failed: %s", name, strerror(errno));
+		return MOSQ_ERR_ERRNO;
+	}
+
+	// instances starting together are serialized, only the first one sizes and lays out the segment
+	if (flock(fd, LOCK_EX) == 0 && fstat(fd, &st) == 0)
+	{
+		created = st.st_size == 0;
+		if (created && ftruncate(fd, (off_t)size) == 0)
+			st.st_size = (off_t)size;
+		if ((size_t)st.st_size >= sizeof(struct acl_shared_header))
+			base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+	if (base == MAP_FAILED)
+	{
+		mosquitto_log_printf(MOSQ_LOG_WARNING, "(mosquitto-auth-plugin) Mapping shared ACL segment %s failed: %s", name, strerror(errno));
+		close(fd);
+		return MOSQ_ERR_ERRNO;
+	}
+
+	shared->base = base;
+	shared->size = st.st_size;
+	shared->header = base;
+	if (created)
+		layout(shared);
+	flock(fd, LOCK_UN);
+	close(fd);
+
+	if (!header_valid(shared))
+	{
+		mosquitto_log_printf(MOSQ_LOG_WARNING, "(mosquitto-auth-plugin) Ignoring invalid or outdated shared ACL segment %s, "
+							 "remove it to have it created again.", name);
+		acl_shared_close(shared);
+		return MOSQ_ERR_INVAL;
+	}
+
+	shared->slots = (struct acl_shared_slot *)(shared->base + shared->header->slots_off);
+	shared->data = shared->base + shared->header->data_off;
+	return MOSQ_ERR_SUCCESS;
+}
+
+void acl_shared_close(struct acl_shared *shared)
+{
+	if (shared->base)
+		munmap(shared->base, shared->size);
+	memset(shared, 0, sizeof(*shared));
+}
+
+bool acl_shared_is_open(const struct acl_shared *shared)
+{
+	return shared->base != NULL;
+}
+
+static struct acl_shared_slot *slot_at(struct acl_shared *shared, uint32_t hash, int i)
+{
+	return &shared->slots[(hash + i) & (shared->header->slot_count - 1)];
+}
+
+/*
+ * Take the slot for writing, unless another writer holds it.
+ */
+static bool slot_lock(struct acl_shared_slot *slot, uint32_t *seq)
+{
+	*seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+	if ((*seq & 1) || !atomic_compare_exchange_strong_explicit(&slot->seq, seq, *seq + 1, memory_order_relaxed, memory_order_relaxed))
+		return false;
+
+	// readers seeing any of the writes below see the odd sequence number too
+	atomic_thread_fence(memory_order_release);
+	return true;
+}
+
+static void slot_unlock(struct acl_shared_slot *slot, uint32_t seq)
+{
+	atomic_store_explicit(&slot->seq, seq + 2, memory_order_release);
+}
+
+/*
+ * Copy the record at `pos' out of the ring, as long as it is the one of
+ * `client_id' and `username' and the ring did not come back over it while
+ * it was read.
+ */
+static struct acl_shared_rules *copy_record(struct acl_shared *shared, uint64_t pos, uint32_t size, const char *client_id,
+											const char *username)
+{
+	const struct acl_shared_header *h = shared->header;
+	struct acl_shared_record record;
+	struct acl_shared_rules *rules;
+	size_t off = pos % h->data_size, len;
+	char *copy, *str, *end;
+
+	if (size < sizeof(record) || size > ACL_SHARED_RECORD_MAX || off + size > h->data_size)
+		return NULL;
+
+	memcpy(&record, shared->data + off, sizeof(record));
+	if (record.rule_count > size)
+		return NULL;
+
+	rules = mosquitto_malloc(sizeof(*rules) + sizeof(char *) * record.rule_count + size);
+	if (rules == NULL)
+		return NULL;
+	rules->rules = (const char **)(rules + 1);
+	copy = (char *)(rules->rules + record.rule_count);
+	memcpy(copy, shared->data + off, size);
+
+	atomic_thread_fence(memory_order_acquire);
+	if (atomic_load_explicit(&h->data_head, memory_order_relaxed) - pos > h->data_size || memcmp(&record, copy, sizeof(record))
+		|| record.pos != pos || record.size != size)
+		goto miss;
+
+	str = copy + sizeof(record);
+	end = copy + size;
+
+	len = strnlen(str, end - str);
+	if (str + len == end || strcmp(str, client_id))
+		goto miss;
+	str += len + 1;
+
+	if (record.username_len == 0 ? username != NULL : username == NULL)
+		goto miss;
+	if (username)
+	{
+		len = strnlen(str, end - str);
+		if (str + len == end || len + 1 != record.username_len || strcmp(str, username))
+			goto miss;
+		str += len + 1;
+	}
+
+	for (uint32_t i = 0; i < record.rule_count; i++)
+	{
+		len = strnlen(str, end - str);
+		if (str + len == end)
+			goto miss;
+		rules->rules[i] = str;
+		str += len + 1;
+	}
+	rules->rule_count = (int)record.rule_count;
+	return rules;
+
+miss:
+	mosquitto_free(rules);
+	return NULL;
+}
+
+/*
+ * The rules of `client_id' for `access', fetched for `username', if an
+ * instance shared them and they have not expired. The copy is freed with
+ * mosquitto_free().
+ */
+struct acl_shared_rules *acl_shared_get(struct acl_shared *shared, const char *client_id, const char *username, int access)
+{
+	uint32_t hash = key_hash(client_id, access);
+	struct acl_shared_rules *rules;
+	uint64_t epoch;
+	int64_t now;
+
+	if (shared->base == NULL)
+		return NULL;
+
+	epoch = atomic_load_explicit(&shared->header->epoch, memory_order_acquire);
+	now = mono_time_ms();
+	for (int i = 0; i < ACL_SHARED_PROBE; i++)
+	{
+		struct acl_shared_slot *slot = slot_at(shared, hash, i);
+		uint32_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+
+		if ((seq & 1) || atomic_load_explicit(&slot->hash, memory_order_relaxed) != hash
+			|| atomic_load_explicit(&slot->access, memory_order_relaxed) != (uint32_t)access
+			|| atomic_load_explicit(&slot->epoch, memory_order_relaxed) != epoch)
+			continue;
+
+		int64_t expires = atomic_load_explicit(&slot->expires, memory_order_relaxed);
+		uint64_t pos = atomic_load_explicit(&slot->pos, memory_order_relaxed);
+		uint32_t size = atomic_load_explicit(&slot->size, memory_order_relaxed);
+
+		atomic_thread_fence(memory_order_acquire);
+		if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq || expires <= now)
+			continue;
+
+		rules = copy_record(shared, pos, size, client_id, username);
+		if (rules)
+		{
+			rules->expires = expires;
+			return rules;
+		}
+	}
+	return NULL;
+}
+
+static bool stamp_current(struct acl_shared *shared, const struct acl_shared_stamp *stamp, uint32_t hash)
+{
+	return atomic_load_explicit(&shared->header->epoch, memory_order_acquire) == stamp->epoch
+		   && atomic_load_explicit(&slot_at(shared, hash, 0)->invalidations, memory_order_acquire) == stamp->invalidations;
+}
+
+/*
+ * Stamp the segment before fetching the rules of `client_id' for `access',
+ * for acl_shared_put() to tell whether they were dropped meanwhile.
+ */
+struct acl_shared_stamp acl_shared_stamp(struct acl_shared *shared, const char *client_id, int access)
+{
+	struct acl_shared_stamp stamp = {0, 0};
+
+	if (shared->base)
+	{
+		stamp.epoch = atomic_load_explicit(&shared->header->epoch, memory_order_acquire);
+		stamp.invalidations = atomic_load_explicit(&slot_at(shared, key_hash(client_id, access), 0)->invalidations, memory_order_acquire);
+	}
+	return stamp;
+}
+
+/*
+ * Share the rules of `client_id' for `access', fetched for `username'
+ * after `stamp' was taken, until `expires'. Rules the client was removed or
+ * the table cleared since are not shared, nor are records too large for
+ * the ring, and a slot being written by another instance keeps that
+ * instance's rules.
+ */
+int acl_shared_put(struct acl_shared *shared, const struct acl_shared_stamp *stamp, const char *client_id, const char *username,
+				   int access, const char *const *rules, int rule_count, int64_t expires)
+{
+	struct acl_shared_header *h = shared->header;
+	size_t client_id_len = strlen(client_id) + 1, username_len = username ? strlen(username) + 1 : 0;
+	size_t size = sizeof(struct acl_shared_record) + client_id_len + username_len;
+	struct acl_shared_slot *target = NULL;
+	struct acl_shared_record record;
+	uint32_t hash, seq;
+	uint64_t pos;
+	int64_t now;
+	uint8_t *str;
+
+	if (shared->base == NULL)
+		return MOSQ_ERR_SUCCESS;
+
+	hash = key_hash(client_id, access);
+	if (!stamp_current(shared, stamp, hash))
+		return MOSQ_ERR_SUCCESS;
+
+	for (int i = 0; i < rule_count; i++)
+		size += strlen(rules[i]) + 1;
+	size = ALIGN8(size);
+	if (size > ACL_SHARED_RECORD_MAX || size > h->data_size / 4)
+		return MOSQ_ERR_INVAL;
+
+	// reserve the record's bytes, skipping what is left at the end of the ring if it does not fit there
+	do
+	{
+		pos = atomic_fetch_add_explicit(&h->data_head, size, memory_order_relaxed);
+	} while (pos % h->data_size + size > h->data_size);
+	atomic_thread_fence(memory_order_release);
+
+	record.pos = pos;
+	record.size = (uint32_t)size;
+	record.rule_count = (uint32_t)rule_count;
+	record.username_len = (uint32_t)username_len;
+	record.padding = 0;
+
+	str = shared->data + pos % h->data_size;
+	memcpy(str, &record, sizeof(record));
+	str += sizeof(record);
+	memcpy(str, client_id, client_id_len);
+	str += client_id_len;
+	if (username)
+	{
+		memcpy(str, username, username_len);
+		str += username_len;
+	}
+	for (int i = 0; i < rule_count; i++)
+	{
+		size_t len = strlen(rules[i]) + 1;
+
+		memcpy(str, rules[i], len);
+		str += len;
+	}
+
+	// the key's slot if it has one, else the first one free, else the one it hashes to
+	now = mono_time_ms();
+	for (int i = 0; i < ACL_SHARED_PROBE; i++)
+	{
+		struct acl_shared_slot *slot = slot_at(shared, hash, i);
+
+		if (atomic_load_explicit(&slot->hash, memory_order_relaxed) == hash
+			&& atomic_load_explicit(&slot->access, memory_order_relaxed) == (uint32_t)access)
+		{
+			target = slot;
+			break;
+		}
+		if (target == NULL
+			&& (atomic_load_explicit(&slot->epoch, memory_order_relaxed) != stamp->epoch
+				|| atomic_load_explicit(&slot->expires, memory_order_relaxed) <= now))
+			target = slot;
+	}
+	if (target == NULL)
+		target = slot_at(shared, hash, 0);
+
+	if (!slot_lock(target, &seq))
+		return MOSQ_ERR_SUCCESS;
+	atomic_store_explicit(&target->hash, hash, memory_order_relaxed);
+	atomic_store_explicit(&target->access, (uint32_t)access, memory_order_relaxed);
+	atomic_store_explicit(&target->size, (uint32_t)size, memory_order_relaxed);
+	// a clear since the stamp left the slot in an older epoch, where it is empty
+	atomic_store_explicit(&target->epoch, stamp->epoch, memory_order_relaxed);
+	atomic_store_explicit(&target->expires, expires, memory_order_relaxed);
+	atomic_store_explicit(&target->pos, pos, memory_order_relaxed);
+	slot_unlock(target, seq);
+
+	// a removal that bumped the counter after it was checked above may have found the slot locked and skipped it
+	atomic_thread_fence(memory_order_seq_cst);
+	if (!stamp_current(shared, stamp, hash) && slot_lock(target, &seq))
+	{
+		if (atomic_load_explicit(&target->pos, memory_order_relaxed) == pos)
+			atomic_store_explicit(&target->expires, 0, memory_order_relaxed);
+		slot_unlock(target, seq);
+	}
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+/*
+ * Drop the shared rules of `client_id', for every instance. Clients hashing
+ * the same for an access type lose theirs too, they are fetched again.
+ */
+void acl_shared_remove_client(struct acl_shared *shared, const char *client_id)
+{
+	if (shared->base == NULL)
+		return;
+
+	for (int access = MOSQ_ACL_READ; access <= MOSQ_ACL_UNSUBSCRIBE; access <<= 1)
+	{
+		uint32_t hash = key_hash(client_id, access), seq;
+
+		// rules being fetched meanwhile are not shared, see acl_shared_put()
+		atomic_fetch_add_explicit(&slot_at(shared, hash, 0)->invalidations, 1, memory_order_release);
+		atomic_thread_fence(memory_order_seq_cst);
+
+		for (int i = 0; i < ACL_SHARED_PROBE; i++)
+		{
+			struct acl_shared_slot *slot = slot_at(shared, hash, i);
+
+			if (atomic_load_explicit(&slot->hash, memory_order_relaxed) != hash
+				|| atomic_load_explicit(&slot->access, memory_order_relaxed) != (uint32_t)access)
+				continue;
+
+			// a slot being written is left alone, its writer sees the counter moved once done
+			if (slot_lock(slot, &seq))
+			{
+				atomic_store_explicit(&slot->expires, 0, memory_order_relaxed);
+				slot_unlock(slot, seq);
+			}
+		}
+	}
+}
+
+/*
+ * Drop every shared rule, for every instance.
+ */
+void acl_shared_clear(struct acl_shared *shared)
+{
+	if (shared->base)
+		atomic_fetch_add_explicit(&shared->header->epoch, 1, memory_order_release);
+}
@@ -0,0 +1,119 @@
+#ifndef __ACL_SHARED_H__
+#define __ACL_SHARED_H__
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Cached rules shared by the brokers of a host through a POSIX shared
+ * memory segment, so that whichever instance fetches a client's rules first
+ * fills them in for all of them, and a client reconnecting to another
+ * instance is still a warm hit.
+ *
+ * The segment is created by the first instance and never removed; later
+ * ones map it as it is, whatever size they were configured with. It only
+ * holds offsets from its start, never pointers, as every process maps it at
+ * its own address. Layout, all integers in host byte order:
+ *
+ *   header    struct acl_shared_header
+ *   slots     struct acl_shared_slot[slot_count]
+ *   data      ring of struct acl_shared_record, each followed by the
+ *             client id, username and rules, NUL terminated and padded to
+ *             8 bytes; the rules are the raw patterns, templates unexpanded
+ *
+ * No lock is ever taken across processes. Records are appended to the ring
+ * at a position reserved with one atomic add, and are overwritten once the
+ * ring wraps around: a record is only read while the ring has not come
+ * back to it. Slots form an open addressed table keyed by hash of client id
+ * and access type, where a key may sit in any of the ACL_SHARED_PROBE slots
+ * from the one it hashes to. A slot is written under a sequence number odd
+ * while the write is in progress, and readers retry nothing: a slot or
+ * record changing under them is a miss. A writer dying mid-write leaves its
+ * slot unused. Clearing the whole table is a bump of the header's epoch,
+ * which invalidates every slot written before.
+ *
+ * Rules fetched before their client's removal must not be shared after it:
+ * a fetch takes a stamp of the epoch and of the invalidation counter of the
+ * slot its key hashes to, which removing the client bumps, and the rules
+ * are only shared, under the stamped epoch, if the counter has not moved
+ * by the time they are written.
+ *
+ * Expiry times are from the monotonic clock, which all the processes of a
+ * host share. The atomics have to be lock-free, a lock emulating them would
+ * be private to each process: acl_shared_open() refuses to share on a
+ * target where they are not.
+ */
+#define ACL_SHARED_MAGIC "MQACLSHM"
+#define ACL_SHARED_FORMAT 2 // 1 held rules expanded for the username
+#define ACL_SHARED_PROBE 8 // slots a key can be stored in, from the one it hashes to
+#define ACL_SHARED_RECORD_MAX 65536 // bytes of a record, clients with more rules are not shared
+
+struct acl_shared_header {
+	char magic[8];
+	uint32_t format;
+	uint32_t padding;
+	uint64_t size; // of the segment
+	uint64_t slot_count; // a power of two
+	uint64_t slots_off;
+	uint64_t data_off;
+	uint64_t data_size; // of the ring, a multiple of 8
+	_Atomic uint64_t data_head; // bytes ever reserved in the ring, the next record's position
+	_Atomic uint64_t epoch; // slots of an older epoch are empty
+};
+
+struct acl_shared_slot {
+	_Atomic uint32_t seq; // odd while being written
+	_Atomic uint32_t hash; // of the client id, seeded with the access type
+	_Atomic uint32_t access; // MOSQ_ACL_* access type
+	_Atomic uint32_t size; // of the record
+	_Atomic uint64_t epoch; // of the table when written
+	_Atomic int64_t expires; // monotonic time the rules expire at, in ms
+	_Atomic uint64_t pos; // of the record in the ring, counted from its start, never wrapped
+	_Atomic uint32_t invalidations; // removals of the clients hashing to this slot, whichever slot they are in
+	uint32_t padding;
+};
+
+struct acl_shared_record {
+	uint64_t pos; // where it was written, as in its slot
+	uint32_t size;
+	uint32_t rule_count;
+	uint32_t username_len; // 0 if none, else with the NUL byte
+	uint32_t padding;
+	// client id, username if any, then the rules, all NUL terminated
+};
+
+struct acl_shared {
+	uint8_t *base; // the mapping, NULL when closed
+	size_t size;
+	struct acl_shared_header *header;
+	struct acl_shared_slot *slots;
+	uint8_t *data;
+};
+
+// state of the segment when a client's rules started being fetched, see acl_shared_stamp()
+struct acl_shared_stamp {
+	uint64_t epoch;
+	uint32_t invalidations;
+};
+
+// rules of a client copied out of the segment, one block
+struct acl_shared_rules {
+	int64_t expires;
+	int rule_count;
+	const char **rules;
+};
+
+int acl_shared_open(struct acl_shared *shared, const char *name, size_t size);
+void acl_shared_close(struct acl_shared *shared);
+bool acl_shared_is_open(const struct acl_shared *shared);
+
+struct acl_shared_rules *acl_shared_get(struct acl_shared *shared, const char *client_id, const char *username, int access);
+struct acl_shared_stamp acl_shared_stamp(struct acl_shared *shared, const char *client_id, int access);
+int acl_shared_put(struct acl_shared *shared, const struct acl_shared_stamp *stamp, const char *client_id, const char *username,
+				   int access, const char *const *rules, int rule_count, int64_t expires);
+void acl_shared_remove_client(struct acl_shared *shared, const char *client_id);
+void acl_shared_clear(struct acl_shared *shared);
+
+#endif//__ACL_SHARED_H__
@@ -0,0 +1,678 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "acl_snapshot.h"
+#include "utils.h"
+#include "mosquitto_broker.h"
+
+#define ALIGN8(x) (((x) + 7) & ~(size_t)7)
+
+static size_t strings_start(const struct acl_snapshot_record *record)
+{
+	return sizeof(struct acl_snapshot_record) + sizeof(struct acl_snapshot_rule) * record->rule_count;
+}
+
+static const struct acl_snapshot_record *record_at(const struct acl_snapshot *snap, uint64_t off)
+{
+	const struct acl_snapshot_record *record;
+
+	if (off < snap->header->records_off || off % 8 || off + sizeof(*record) > snap->size)
+		return NULL;
+
+	record = (const struct acl_snapshot_record *)(snap->base + off);
+	if (record->size < sizeof(*record) || off + record->size > snap->size)
+		return NULL;
+	return record;
+}
+
+// whether `off' is one of the `count' record starts, in ascending order
+static bool is_record_start(const uint64_t *starts, uint64_t count, uint64_t off)
+{
+	uint64_t lo = 0, hi = count;
+
+	while (lo < hi)
+	{
+		uint64_t mid = lo + (hi - lo) / 2;
+
+		if (starts[mid] == off)
+			return true;
+		if (starts[mid] < off)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return false;
+}
+
+/*
+ * Every chain only links record starts, in increasing order, of records
+ * hashing to its bucket: a record belongs to one chain, walked once.
+ */
+static bool validate_chains(const struct acl_snapshot *snap, const uint64_t *starts)
+{
+	const struct acl_snapshot_header *h = snap->header;
+	const uint64_t *buckets = (const uint64_t *)(snap->base + h->buckets_off);
+
+	for (uint64_t b = 0; b < h->bucket_count; b++)
+	{
+		for (uint64_t off = buckets[b]; off;)
+		{
+			const struct acl_snapshot_record *record;
+
+			if (!is_record_start(starts, h->record_count, off))
+				return false;
+			record = (const struct acl_snapshot_record *)(snap->base + off);
+			if ((record->hash & (h->bucket_count - 1)) != b || (record->next_off && record->next_off <= off))
+				return false;
+			off = record->next_off;
+		}
+	}
+	return true;
+}
+
+/*
+ * Check every record and chain once at open, so lookups can trust the
+ * strings and rules they read, and chains cannot loop or lead anywhere but
+ * to the start of a record of their bucket.
+ */
+static bool validate_records(const struct acl_snapshot *snap)
+{
+	uint64_t off = snap->header->records_off;
+	uint64_t *starts;
+	bool valid = false;
+
+	if (snap->header->record_count > (snap->size - off) / sizeof(struct acl_snapshot_record))
+		return false;
+	starts = mosquitto_malloc(sizeof(*starts) * (snap->header->record_count ? snap->header->record_count : 1));
+	if (starts == NULL)
+		return false;
+
+	for (uint64_t i = 0; i < snap->header->record_count; i++)
+	{
+		const struct acl_snapshot_record *record = record_at(snap, off);
+		const struct acl_snapshot_rule *rules;
+		size_t start, len;
+
+		if (record == NULL)
+			goto out;
+
+		start = strings_start(record);
+		if (record->rule_count > record->size || start >= record->size)
+			goto out;
+		len = record->size - start;
+
+		// strings end in a NUL byte, offsets stay inside the record
+		if (snap->base[off + record->size - 1] != '\0')
+			goto out;
+		if (record->username_off != ACL_SNAPSHOT_NO_USERNAME && record->username_off >= len)
+			goto out;
+		rules = acl_snapshot_rules(record);
+		for (uint32_t r = 0; r < record->rule_count; r++)
+		{
+			if (rules[r].topic_off >= len)
+				goto out;
+		}
+
+		starts[i] = off;
+		off += record->size;
+	}
+	valid = off == snap->size && validate_chains(snap, starts);
+
+out:
+	mosquitto_free(starts);
+	return valid;
+}
+
+// read the `size' bytes of `fd' into a new block, NULL if they could not all be read
+static uint8_t *read_file(int fd, size_t size)
+{
+	uint8_t *data = mosquitto_malloc(size);
+	size_t done = 0;
+
+	while (data && done < size)
+	{
+		ssize_t len = pread(fd, data + done, size - done, (off_t)done);
+
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len <= 0)
+		{
+			mosquitto_free(data);
+			return NULL;
+		}
+		done += (size_t)len;
+	}
+	return data;
+}
+
+static int open_snapshot(struct acl_snapshot *snap, const char *path, bool copy)
+{
+	struct stat st;
+	void *base;
+	int fd;
+
+	memset(snap, 0, sizeof(*snap));
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		if (errno != ENOENT)
+			mosquitto_log_printf(MOSQ_LOG_WARNING, "(mosquitto-auth-plugin) Opening ACL snapshot %s failed: %s", path, strerror(errno));
+		return MOSQ_ERR_NOT_FOUND;
+	}
+
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct acl_snapshot_header))
+	{
+		close(fd);
+		return MOSQ_ERR_INVAL;
+	}
+
+	if (copy)
+	{
+		errno = 0;
+		base = read_file(fd, st.st_size);
+		if (base == NULL)
+			base = MAP_FAILED;
+	}
+	else
+	{
+		base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+	close(fd);
+	if (base == MAP_FAILED)
+	{
+		mosquitto_log_printf(MOSQ_LOG_WARNING, "(mosquitto-auth-plugin) %s ACL snapshot %s failed: %s", copy ? "Reading" : "Mapping", path,
+							 errno ? strerror(errno) : "file truncated");
+		return MOSQ_ERR_ERRNO;
+	}
+
+	snap->base = base;
+	snap->size = st.st_size;
+	snap->copied = copy;
+	snap->header = base;
+
+	const struct acl_snapshot_header *h = snap->header;
+	if (memcmp(h->magic, ACL_SNAPSHOT_MAGIC, sizeof(h->magic)) || h->format != ACL_SNAPSHOT_FORMAT
+		|| h->file_size != snap->size || h->bucket_count == 0 || (h->bucket_count & (h->bucket_count - 1))
+		|| h->bucket_count > snap->size / sizeof(uint64_t)
+		|| h->buckets_off != sizeof(*h) || h->records_off != h->buckets_off + h->bucket_count * sizeof(uint64_t)
+		|| h->records_off > snap->size || !validate_records(snap))
+	{
+		mosquitto_log_printf(MOSQ_LOG_WARNING, "(mosquitto-auth-plugin) Ignoring invalid or outdated ACL snapshot %s.", path);
+		acl_snapshot_close(snap);
+		return MOSQ_ERR_INVAL;
+	}
+
+	snap->cursor = h->records_off;
+	return MOSQ_ERR_SUCCESS;
+}
+
+/*
+ * Map the snapshot at `path' and check it. The file must only ever be
+ * replaced with rename(2): a mapped file truncated in place faults its
+ * readers.
+ */
+int acl_snapshot_open(struct acl_snapshot *snap, const char *path)
+{
+	return open_snapshot(snap, path, false);
+}
+
+/*
+ * As acl_snapshot_open(), reading the file into memory instead, for a file
+ * other programs write, which may then be rewritten in place.
+ */
+int acl_snapshot_read(struct acl_snapshot *snap, const char *path)
+{
+	return open_snapshot(snap, path, true);
+}
+
+void acl_snapshot_close(struct acl_snapshot *snap)
+{
+	if (snap->copied)
+		mosquitto_free((void *)snap->base);
+	else if (snap->base)
+		munmap((void *)snap->base, snap->size);
+	memset(snap, 0, sizeof(*snap));
+}
+
+bool acl_snapshot_is_open(const struct acl_snapshot *snap)
+{
+	return snap->base != NULL;
+}
+
+const struct acl_snapshot_record *acl_snapshot_find(const struct acl_snapshot *snap, const char *client_id)
+{
+	const uint64_t *buckets;
+	const struct acl_snapshot_record *record;
+	uint32_t hash;
+	uint64_t off;
+
+	if (snap->base == NULL)
+		return NULL;
+
+	hash = hash_str(client_id, 0);
+	buckets = (const uint64_t *)(snap->base + snap->header->buckets_off);
+	for (off = buckets[hash & (snap->header->bucket_count - 1)]; off; off = record->next_off)
+	{
+		record = record_at(snap, off);
+		if (record == NULL)
+			return NULL;
+		if (record->hash == hash && !strcmp(acl_snapshot_client_id(record), client_id))
+			return record;
+	}
+	return NULL;
+}
+
+/*
+ * Walk the records in file order, one per call, starting over after
+ * acl_snapshot_open(). Returns NULL after the last one.
+ */
+const struct acl_snapshot_record *acl_snapshot_next(struct acl_snapshot *snap)
+{
+	const struct acl_snapshot_record *record;
+
+	if (snap->base == NULL || snap->cursor >= snap->size)
+		return NULL;
+
+	record = record_at(snap, snap->cursor);
+	if (record)
+		snap->cursor += record->size;
+	return record;
+}
+
+const char *acl_snapshot_client_id(const struct acl_snapshot_record *record)
+{
+	return (const char *)record + strings_start(record);
+}
+
+const char *acl_snapshot_username(const struct acl_snapshot_record *record)
+{
+	if (record->username_off == ACL_SNAPSHOT_NO_USERNAME)
+		return NULL;
+	return (const char *)record + strings_start(record) + record->username_off;
+}
+
+const struct acl_snapshot_rule *acl_snapshot_rules(const struct acl_snapshot_record *record)
+{
+	return (const struct acl_snapshot_rule *)(record + 1);
+}
+
+const char *acl_snapshot_rule_topic(const struct acl_snapshot_record *record, const struct acl_snapshot_rule *rule)
+{
+	return (const char *)record + strings_start(record) + rule->topic_off;
+}
+
+/*
+ * Fill `store' from a snapshot of a preloaded ACL table.
+ */
+int acl_snapshot_load_store(const struct acl_snapshot *snap, struct acl_store *store)
+{
+	uint64_t off = snap->header->records_off;
+
+	for (uint64_t i = 0; i < snap->header->record_count; i++)
+	{
+		const struct acl_snapshot_record *record = (const struct acl_snapshot_record *)(snap->base + off);
+		const struct acl_snapshot_rule *rules = acl_snapshot_rules(record);
+		const char *client_id = acl_snapshot_client_id(record);
+		int rc = acl_store_add(store, client_id, 0, NULL);
+
+		for (uint32_t r = 0; r < record->rule_count && rc == MOSQ_ERR_SUCCESS; r++)
+			rc = acl_store_add(store, client_id, rules[r].access, acl_snapshot_rule_topic(record, &rules[r]));
+		if (rc != MOSQ_ERR_SUCCESS)
+			return rc;
+
+		off += record->size;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+void acl_snapshot_writer_init(struct acl_snapshot_writer *writer)
+{
+	memset(writer, 0, sizeof(*writer));
+}
+
+void acl_snapshot_writer_cleanup(struct acl_snapshot_writer *writer)
+{
+	mosquitto_free(writer->records);
+	memset(writer, 0, sizeof(*writer));
+}
+
+int acl_snapshot_writer_add(struct acl_snapshot_writer *writer, const char *client_id, const char *username, uint8_t flags,
+							uint8_t access_known, const char *const *topics, const uint8_t *access, uint32_t rule_count)
+{
+	struct acl_snapshot_record *record;
+	struct acl_snapshot_rule *rules;
+	size_t size, strings_len;
+	char *str;
+
+	strings_len = strlen(client_id) + 1 + (username ? strlen(username) + 1 : 0);
+	for (uint32_t i = 0; i < rule_count; i++)
+		strings_len += strlen(topics[i]) + 1;
+
+	size = ALIGN8(sizeof(*record) + sizeof(*rules) * rule_count + strings_len);
+	if (size > UINT32_MAX)
+		return MOSQ_ERR_INVAL;
+
+	if (writer->records_len + size > writer->records_cap)
+	{
+		size_t cap = writer->records_cap ? writer->records_cap * 2 : 65536;
+		uint8_t *records;
+
+		while (cap < writer->records_len + size)
+			cap *= 2;
+		records = mosquitto_realloc(writer->records, cap);
+		if (records == NULL)
+			return MOSQ_ERR_NOMEM;
+		writer->records = records;
+		writer->records_cap = cap;
+	}
+
+	record = (struct acl_snapshot_record *)(writer->records + writer->records_len);
+	memset(record, 0, size);
+	record->hash = hash_str(client_id, 0);
+	record->size = (uint32_t)size;
+	record->rule_count = rule_count;
+	record->flags = flags;
+	record->access_known = access_known;
+
+	rules = (struct acl_snapshot_rule *)(record + 1);
+	str = (char *)(rules + rule_count);
+	strcpy(str, client_id);
+	str += strlen(client_id) + 1;
+
+	record->username_off = ACL_SNAPSHOT_NO_USERNAME;
+	if (username)
+	{
+		record->username_off = (uint32_t)(str - (char *)(rules + rule_count));
+		strcpy(str, username);
+		str += strlen(username) + 1;
+	}
+
+	for (uint32_t i = 0; i < rule_count; i++)
+	{
+		rules[i].topic_off = (uint32_t)(str - (char *)(rules + rule_count));
+		rules[i].access = access[i];
+		strcpy(str, topics[i]);
+		str += strlen(topics[i]) + 1;
+	}
+
+	writer->records_len += size;
+	writer->record_count++;
+	return MOSQ_ERR_SUCCESS;
+}
+
+static bool same_username(const char *a, const char *b)
+{
+	if (a == NULL || b == NULL)
+		return a == b;
+	return !strcmp(a, b);
+}
+
+/*
+ * Add one record per cached client, merging the entries of all its access
+ * types. Entries of a client share a bucket, which keeps the grouping local.
+ * Records hold the rules expanded for the client's username, as their
+ * revalidation needs it; the cache's shared sets are expanded on the way.
+ */
+int acl_snapshot_writer_add_cache(struct acl_snapshot_writer *writer, const struct acl_cache *cache)
+{
+	const char **topics = NULL;
+	char **expansions = NULL; // expanded templates among `topics', to free
+	uint8_t *access = NULL;
+	uint32_t cap = 0;
+	int rc = MOSQ_ERR_SUCCESS;
+
+	if (cache->buckets == NULL)
+		return MOSQ_ERR_SUCCESS;
+
+	for (size_t b = 0; b <= cache->bucket_mask && rc == MOSQ_ERR_SUCCESS; b++)
+	{
+		for (const struct acl_cache_entry *entry = cache->buckets[b]; entry && rc == MOSQ_ERR_SUCCESS; entry = entry->hash_next)
+		{
+			const struct acl_cache_entry *other;
+			uint32_t count = 0, expansion_count = 0;
+			uint8_t known = 0;
+			bool seen = false;
+
+			// the client was written with the first of its entries
+			for (other = cache->buckets[b]; other != entry; other = other->hash_next)
+			{
+				if (!strcmp(other->client_id, entry->client_id))
+				{
+					seen = true;
+					break;
+				}
+			}
+			if (seen)
+				continue;
+
+			for (other = entry; other; other = other->hash_next)
+			{
+				if (strcmp(other->client_id, entry->client_id) || !same_username(other->username, entry->username))
+					continue;
+
+				const struct acl_ruleset *set = other->set;
+
+				if (count + set->rule_count > cap)
+				{
+					uint32_t new_cap = (count + set->rule_count) * 2;
+					const char **new_topics = mosquitto_realloc(topics, sizeof(char *) * new_cap);
+					char **new_expansions;
+					uint8_t *new_access;
+
+					if (new_topics == NULL)
+					{
+						rc = MOSQ_ERR_NOMEM;
+						break;
+					}
+					topics = new_topics;
+					new_expansions = mosquitto_realloc(expansions, sizeof(char *) * new_cap);
+					if (new_expansions == NULL)
+					{
+						rc = MOSQ_ERR_NOMEM;
+						break;
+					}
+					expansions = new_expansions;
+					new_access = mosquitto_realloc(access, new_cap);
+					if (new_access == NULL)
+					{
+						rc = MOSQ_ERR_NOMEM;
+						break;
+					}
+					access = new_access;
+					cap = new_cap;
+				}
+
+				for (int i = 0; i < set->rule_count; i++)
+				{
+					const char *topic = set->rules[i];
+
+					if (!set->expanded && t_is_template(topic))
+					{
+						char *expanded;
+
+						t_expand(entry->client_id, entry->username, topic, &expanded);
+						if (expanded == NULL)
+						{
+							rc = MOSQ_ERR_NOMEM;
+							break;
+						}
+						topic = expansions[expansion_count++] = expanded;
+					}
+					topics[count] = topic;
+					access[count++] = (uint8_t)other->access;
+				}
+				if (rc != MOSQ_ERR_SUCCESS)
+					break;
+				known |= (uint8_t)other->access;
+			}
+
+			if (rc == MOSQ_ERR_SUCCESS)
+				rc = acl_snapshot_writer_add(writer, entry->client_id, entry->username, ACL_SNAPSHOT_EXPANDED, known, topics, access, count);
+			while (expansion_count > 0)
+				mosquitto_free(expansions[--expansion_count]);
+		}
+	}
+
+	mosquitto_free(topics);
+	mosquitto_free(expansions);
+	mosquitto_free(access);
+	return rc;
+}
+
+/*
+ * Add one record per client of the preloaded ACL table, with its patterns
+ * unexpanded and the rules of every access type.
+ */
+int acl_snapshot_writer_add_store(struct acl_snapshot_writer *writer, const struct acl_store *store)
+{
+	const char **topics = NULL;
+	uint8_t *access = NULL;
+	int cap = 0;
+	int rc = MOSQ_ERR_SUCCESS;
+
+	if (store->buckets == NULL)
+		return MOSQ_ERR_SUCCESS;
+
+	for (size_t b = 0; b <= store->bucket_mask && rc == MOSQ_ERR_SUCCESS; b++)
+	{
+		for (const struct acl_store_client *client = store->buckets[b]; client && rc == MOSQ_ERR_SUCCESS; client = client->next)
+		{
+			if (client->rule_count > cap)
+			{
+				mosquitto_free(topics);
+				mosquitto_free(access);
+				cap = client->rule_count * 2;
+				topics = mosquitto_malloc(sizeof(char *) * cap);
+				access = mosquitto_malloc(cap);
+				if (topics == NULL || access == NULL)
+				{
+					rc = MOSQ_ERR_NOMEM;
+					break;
+				}
+			}
+
+			for (int i = 0; i < client->rule_count; i++)
+			{
+				topics[i] = acl_store_rule_topic(client, &client->rules[i]);
+				access[i] = client->rules[i].access;
+			}
+			rc = acl_snapshot_writer_add(writer, acl_store_client_id(client), NULL, 0, 0x0f, topics, access, client->rule_count);
+		}
+	}
+
+	mosquitto_free(topics);
+	mosquitto_free(access);
+	return rc;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	while (len > 0)
+	{
+		ssize_t n = write(fd, p, len);
+
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return MOSQ_ERR_ERRNO;
+		}
+		p += n;
+		len -= n;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+/*
+ * Link the records into buckets and atomically replace the file at `path'
+ * with the result (written to `path'.tmp first, then renamed).
+ */
+int acl_snapshot_writer_commit(struct acl_snapshot_writer *writer, const char *path, uint32_t flags, int64_t acl_version)
+{
+	struct acl_snapshot_header header;
+	uint64_t bucket_count = 16, *buckets, *offsets;
+	char *tmp_path;
+	int fd, rc;
+
+	while (bucket_count < writer->record_count)
+		bucket_count <<= 1;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, ACL_SNAPSHOT_MAGIC, sizeof(header.magic));
+	header.format = ACL_SNAPSHOT_FORMAT;
+	header.flags = flags;
+	header.acl_version = acl_version;
+	header.created = (int64_t)time(NULL);
+	header.record_count = writer->record_count;
+	header.bucket_count = bucket_count;
+	header.buckets_off = sizeof(header);
+	header.records_off = header.buckets_off + bucket_count * sizeof(uint64_t);
+	header.file_size = header.records_off + writer->records_len;
+
+	buckets = mosquitto_calloc(bucket_count, sizeof(uint64_t));
+	offsets = mosquitto_malloc(sizeof(uint64_t) * (writer->record_count + 1));
+	tmp_path = mosquitto_malloc(strlen(path) + 5);
+	if (buckets == NULL || offsets == NULL || tmp_path == NULL)
+	{
+		mosquitto_free(buckets);
+		mosquitto_free(offsets);
+		mosquitto_free(tmp_path);
+		return MOSQ_ERR_NOMEM;
+	}
+
+	for (uint64_t i = 0, off = 0; i < writer->record_count; i++)
+	{
+		offsets[i] = off;
+		off += ((struct acl_snapshot_record *)(writer->records + off))->size;
+	}
+
+	// link from the last record back, so every chain runs towards higher offsets
+	for (uint64_t i = writer->record_count; i-- > 0;)
+	{
+		struct acl_snapshot_record *record = (struct acl_snapshot_record *)(writer->records + offsets[i]);
+		uint64_t *bucket = &buckets[record->hash & (bucket_count - 1)];
+
+		record->next_off = *bucket;
+		*bucket = header.records_off + offsets[i];
+	}
+	mosquitto_free(offsets);
+
+	sprintf(tmp_path, "%s.tmp", path);
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0)
+	{
+		mosquitto_log_printf(MOSQ_LOG_WARNING, "(mosquitto-auth-plugin) Writing ACL snapshot %s failed: %s", tmp_path, strerror(errno));
+		mosquitto_free(buckets);
+		mosquitto_free(tmp_path);
+		return MOSQ_ERR_ERRNO;
+	}
+
+	rc = write_all(fd, &header, sizeof(header));
+	if (rc == MOSQ_ERR_SUCCESS)
+		rc = write_all(fd, buckets, bucket_count * sizeof(uint64_t));
+	if (rc == MOSQ_ERR_SUCCESS)
+		rc = write_all(fd, writer->records, writer->records_len);
+	if (rc == MOSQ_ERR_SUCCESS && fsync(fd) < 0)
+		rc = MOSQ_ERR_ERRNO;
+	if (close(fd) < 0 && rc == MOSQ_ERR_SUCCESS)
+		rc = MOSQ_ERR_ERRNO;
+	if (rc == MOSQ_ERR_SUCCESS && rename(tmp_path, path) < 0)
+		rc = MOSQ_ERR_ERRNO;
+
+	if (rc != MOSQ_ERR_SUCCESS)
+	{
+		mosquitto_log_printf(MOSQ_LOG_WARNING, "(mosquitto-auth-plugin) Writing ACL snapshot %s failed: %s", path, strerror(errno));
+		unlink(tmp_path);
+	}
+
+	mosquitto_free(buckets);
+	mosquitto_free(tmp_path);
+	return rc;
+}
@@ -0,0 +1,103 @@
+#ifndef __ACL_SNAPSHOT_H__
+#define __ACL_SNAPSHOT_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "acl_cache.h"
+#include "acl_store.h"
+
+/*
+ * On-disk copy of the plugin's ACL data, written at shutdown and on a timer
+ * and memory-mapped at startup, so a restarted broker has warm rules before
+ * (or without) reaching the database. Snapshots are always replaced with
+ * rename(2), never rewritten in place.
+ *
+ * The file only uses offsets from its start, never pointers, so it is used
+ * in place once mapped. Layout, all integers in host byte order:
+ *
+ *   header    struct acl_snapshot_header
+ *   buckets   uint64_t[bucket_count], offset of the first record per bucket
+ *   records   struct acl_snapshot_record, each followed by its rules and
+ *             strings (client id, username, patterns), padded to 8 bytes
+ *
+ * Records are bucketed on hash_str(client_id) and chained through next_off.
+ */
+#define ACL_SNAPSHOT_MAGIC "MQACLSNP"
+#define ACL_SNAPSHOT_FORMAT 1
+
+#define ACL_SNAPSHOT_STORE 0x01 // header: records are the preloaded ACL table
+
+#define ACL_SNAPSHOT_EXPANDED 0x01 // record: patterns are expanded for `username'
+#define ACL_SNAPSHOT_NO_USERNAME UINT32_MAX
+
+struct acl_snapshot_header {
+	char magic[8];
+	uint32_t format;
+	uint32_t flags; // ACL_SNAPSHOT_STORE
+	int64_t acl_version; // highest rule version of a preloaded table
+	int64_t created; // wall clock time of writing, in s
+	uint64_t file_size;
+	uint64_t record_count;
+	uint64_t bucket_count; // a power of two
+	uint64_t buckets_off;
+	uint64_t records_off;
+};
+
+struct acl_snapshot_rule {
+	uint32_t topic_off; // from the start of the record's strings
+	uint8_t access; // MOSQ_ACL_* bits granted by the pattern
+	uint8_t padding[3];
+};
+
+struct acl_snapshot_record {
+	uint64_t next_off; // next record in the bucket, 0 ends the chain
+	uint32_t hash;
+	uint32_t size; // of the record, its rules and strings, padded
+	uint32_t rule_count;
+	uint32_t username_off; // ACL_SNAPSHOT_NO_USERNAME if none
+	uint8_t flags; // ACL_SNAPSHOT_EXPANDED
+	uint8_t access_known; // access types the record has the full rules for
+	uint8_t padding[6];
+	// struct acl_snapshot_rule rules[rule_count], then the strings
+};
+
+struct acl_snapshot {
+	const uint8_t *base; // the mapping or copy, NULL when closed
+	size_t size;
+	bool copied; // `base' is a copy of the file, see acl_snapshot_read()
+	const struct acl_snapshot_header *header;
+	uint64_t cursor; // offset of the next record to revalidate
+};
+
+// growable buffer the next snapshot is built in
+struct acl_snapshot_writer {
+	uint8_t *records;
+	size_t records_len;
+	size_t records_cap;
+	uint64_t record_count;
+};
+
+int acl_snapshot_open(struct acl_snapshot *snap, const char *path);
+int acl_snapshot_read(struct acl_snapshot *snap, const char *path);
+void acl_snapshot_close(struct acl_snapshot *snap);
+bool acl_snapshot_is_open(const struct acl_snapshot *snap);
+const struct acl_snapshot_record *acl_snapshot_find(const struct acl_snapshot *snap, const char *client_id);
+const struct acl_snapshot_record *acl_snapshot_next(struct acl_snapshot *snap);
+
+const char *acl_snapshot_client_id(const struct acl_snapshot_record *record);
+const char *acl_snapshot_username(const struct acl_snapshot_record *record);
+const struct acl_snapshot_rule *acl_snapshot_rules(const struct acl_snapshot_record *record);
+const char *acl_snapshot_rule_topic(const struct acl_snapshot_record *record, const struct acl_snapshot_rule *rule);
+int acl_snapshot_load_store(const struct acl_snapshot *snap, struct acl_store *store);
+
+void acl_snapshot_writer_init(struct acl_snapshot_writer *writer);
+void acl_snapshot_writer_cleanup(struct acl_snapshot_writer *writer);
+int acl_snapshot_writer_add(struct acl_snapshot_writer *writer, const char *client_id, const char *username, uint8_t flags,
+							uint8_t access_known, const char *const *topics, const uint8_t *access, uint32_t rule_count);
+int acl_snapshot_writer_add_cache(struct acl_snapshot_writer *writer, const struct acl_cache *cache);
+int acl_snapshot_writer_add_store(struct acl_snapshot_writer *writer, const struct acl_store *store);
+int acl_snapshot_writer_commit(struct acl_snapshot_writer *writer, const char *path, uint32_t flags, int64_t acl_version);
+
+#endif//__ACL_SNAPSHOT_H__
@@ -0,0 +1,256 @@
+#include "acl_store.h"
+#include "utils.h"
+#include "mosquitto_broker.h"
+
+static struct acl_store_client *find_client(const struct acl_store *store, const char *client_id, uint32_t hash)
+{
+	struct acl_store_client *client;
+
+	for (client = store->buckets[hash & store->bucket_mask]; client; client = client->next)
+	{
+		if (client->hash == hash && !strcmp(client->strings, client_id))
+			return client;
+	}
+	return NULL;
+}
+
+static void link_client(struct acl_store *store, struct acl_store_client *client)
+{
+	struct acl_store_client **bucket = &store->buckets[client->hash & store->bucket_mask];
+
+	client->next = *bucket;
+	*bucket = client;
+}
+
+static int grow_buckets(struct acl_store *store)
+{
+	struct acl_store_client **old = store->buckets;
+	size_t old_count = store->bucket_mask + 1;
+
+	store->buckets = mosquitto_calloc(old_count * 2, sizeof(struct acl_store_client *));
+	if (store->buckets == NULL)
+	{
+		store->buckets = old;
+		return MOSQ_ERR_NOMEM;
+	}
+	store->bucket_mask = old_count * 2 - 1;
+	store->memory += old_count * sizeof(struct acl_store_client *);
+
+	for (size_t i = 0; i < old_count; i++)
+	{
+		struct acl_store_client *client = old[i], *next;
+
+		for (; client; client = next)
+		{
+			next = client->next;
+			link_client(store, client);
+		}
+	}
+	mosquitto_free(old);
+	return MOSQ_ERR_SUCCESS;
+}
+
+static int append_string(struct acl_store *store, struct acl_store_client *client, const char *s, uint32_t *offset)
+{
+	size_t len = strlen(s) + 1;
+
+	if (client->strings_len + len > UINT32_MAX)
+		return MOSQ_ERR_INVAL;
+
+	if (client->strings_len + len > client->strings_cap)
+	{
+		size_t cap = client->strings_cap ? client->strings_cap * 2 : 64;
+		char *strings;
+
+		while (cap < client->strings_len + len)
+			cap *= 2;
+		strings = mosquitto_realloc(client->strings, cap);
+		if (strings == NULL)
+			return MOSQ_ERR_NOMEM;
+		store->memory += cap - client->strings_cap;
+		client->strings = strings;
+		client->strings_cap = cap;
+	}
+
+	memcpy(client->strings + client->strings_len, s, len);
+	*offset = (uint32_t)client->strings_len;
+	client->strings_len += len;
+	return MOSQ_ERR_SUCCESS;
+}
+
+static struct acl_store_client *new_client(struct acl_store *store, const char *client_id, uint32_t hash)
+{
+	struct acl_store_client *client;
+	uint32_t offset;
+
+	if (store->client_count >= store->bucket_mask + 1 && grow_buckets(store) != MOSQ_ERR_SUCCESS)
+		return NULL;
+
+	client = mosquitto_calloc(1, sizeof(struct acl_store_client));
+	if (client == NULL)
+		return NULL;
+	client->hash = hash;
+
+	if (append_string(store, client, client_id, &offset) != MOSQ_ERR_SUCCESS)
+	{
+		mosquitto_free(client);
+		return NULL;
+	}
+
+	store->memory += sizeof(struct acl_store_client);
+	store->client_count++;
+	link_client(store, client);
+	return client;
+}
+
+// forget every rule of `client', keeping only its id
+static void clear_client(struct acl_store *store, struct acl_store_client *client)
+{
+	store->rule_count -= client->rule_count;
+	client->rule_count = 0;
+	client->strings_len = strlen(client->strings) + 1;
+}
+
+static void free_client(struct acl_store *store, struct acl_store_client *client)
+{
+	store->memory -= sizeof(struct acl_store_client) + client->strings_cap + sizeof(struct acl_store_rule) * client->rule_cap;
+	store->rule_count -= client->rule_count;
+	store->client_count--;
+	mosquitto_free(client->strings);
+	mosquitto_free(client->rules);
+	mosquitto_free(client);
+}
+
+static int add_rule(struct acl_store *store, struct acl_store_client *client, int access, const char *topic)
+{
+	struct acl_store_rule *rule;
+
+	if (client->rule_count == client->rule_cap)
+	{
+		int cap = client->rule_cap ? client->rule_cap * 2 : 4;
+		struct acl_store_rule *rules = mosquitto_realloc(client->rules, sizeof(*rules) * cap);
+
+		if (rules == NULL)
+			return MOSQ_ERR_NOMEM;
+		store->memory += sizeof(*rules) * (cap - client->rule_cap);
+		client->rules = rules;
+		client->rule_cap = cap;
+	}
+
+	rule = &client->rules[client->rule_count];
+	if (append_string(store, client, topic, &rule->topic_off) != MOSQ_ERR_SUCCESS)
+		return MOSQ_ERR_NOMEM;
+	rule->access = (uint8_t)access;
+	rule->flags = t_is_template(acl_store_rule_topic(client, rule)) ? ACL_STORE_TEMPLATE : 0;
+	client->rule_count++;
+	store->rule_count++;
+	return MOSQ_ERR_SUCCESS;
+}
+
+int acl_store_init(struct acl_store *store)
+{
+	memset(store, 0, sizeof(*store));
+
+	store->buckets = mosquitto_calloc(1024, sizeof(struct acl_store_client *));
+	if (store->buckets == NULL)
+		return MOSQ_ERR_NOMEM;
+	store->bucket_mask = 1023;
+	store->memory = 1024 * sizeof(struct acl_store_client *);
+	return MOSQ_ERR_SUCCESS;
+}
+
+void acl_store_cleanup(struct acl_store *store)
+{
+	if (store->buckets == NULL)
+		return;
+
+	for (size_t i = 0; i <= store->bucket_mask; i++)
+	{
+		struct acl_store_client *client = store->buckets[i], *next;
+
+		for (; client; client = next)
+		{
+			next = client->next;
+			free_client(store, client);
+		}
+	}
+	mosquitto_free(store->buckets);
+	memset(store, 0, sizeof(*store));
+}
+
+const struct acl_store_client *acl_store_find(const struct acl_store *store, const char *client_id)
+{
+	if (store->buckets == NULL)
+		return NULL;
+	return find_client(store, client_id, hash_str(client_id, 0));
+}
+
+/*
+ * Add one row of the full ACL table. A NULL topic only records the client.
+ */
+int acl_store_add(struct acl_store *store, const char *client_id, int access, const char *topic)
+{
+	uint32_t hash = hash_str(client_id, 0);
+	struct acl_store_client *client = find_client(store, client_id, hash);
+
+	if (client == NULL)
+	{
+		client = new_client(store, client_id, hash);
+		if (client == NULL)
+			return MOSQ_ERR_NOMEM;
+	}
+
+	if (topic == NULL || access == 0)
+		return MOSQ_ERR_SUCCESS;
+	return add_rule(store, client, access, topic);
+}
+
+/*
+ * Start applying a delta. Within it, the first row seen for a client replaces
+ * all of its previous rules; see acl_store_sync().
+ */
+uint32_t acl_store_begin_sync(struct acl_store *store)
+{
+	return ++store->sync_gen;
+}
+
+/*
+ * Apply one row of a delta. A delta carries every current row of each client
+ * it names, a NULL topic standing for a client left without rules, which is
+ * then dropped from the store.
+ */
+int acl_store_sync(struct acl_store *store, const char *client_id, int access, const char *topic)
+{
+	uint32_t hash = hash_str(client_id, 0);
+	struct acl_store_client *client = find_client(store, client_id, hash);
+
+	if (client && client->sync_gen != store->sync_gen)
+	{
+		clear_client(store, client);
+	}
+
+	if (client == NULL)
+	{
+		if (topic == NULL)
+			return MOSQ_ERR_SUCCESS;
+		client = new_client(store, client_id, hash);
+		if (client == NULL)
+			return MOSQ_ERR_NOMEM;
+	}
+	client->sync_gen = store->sync_gen;
+
+	if (topic == NULL || access == 0)
+	{
+		if (client->rule_count == 0)
+		{
+			struct acl_store_client **link = &store->buckets[hash & store->bucket_mask];
+
+			while (*link != client)
+				link = &(*link)->next;
+			*link = client->next;
+			free_client(store, client);
+		}
+		return MOSQ_ERR_SUCCESS;
+	}
+	return add_rule(store, client, access, topic);
+}
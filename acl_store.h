@@ -0,0 +1,67 @@
+#ifndef __ACL_STORE_H__
+#define __ACL_STORE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * In-process copy of the whole ACL table, used when the rules are preloaded
+ * at startup. Patterns are kept unexpanded, each with the bitmask of access
+ * types (MOSQ_ACL_*) it grants and whether it is a %c/%u template, found out
+ * once when it is added.
+ *
+ * Every client owns one string block holding its id and the text of all its
+ * patterns, referenced by offset so it can grow while rows are streamed in,
+ * and one rule array. Replacing or dropping a client frees exactly those two
+ * allocations, so memory stays proportional to the live rules however many
+ * deltas are applied.
+ */
+#define ACL_STORE_TEMPLATE 0x01 // the pattern holds %c/%u tokens
+
+struct acl_store_rule {
+	uint32_t topic_off; // offset of the pattern in the client's string block
+	uint8_t access; // MOSQ_ACL_* bits granted by the pattern
+	uint8_t flags; // ACL_STORE_TEMPLATE
+};
+
+struct acl_store_client {
+	struct acl_store_client *next; // next client in the same bucket
+	uint32_t hash;
+	uint32_t sync_gen; // delta that last replaced this client's rules
+	char *strings; // client id followed by every pattern, NUL separated
+	size_t strings_len;
+	size_t strings_cap;
+	struct acl_store_rule *rules;
+	int rule_count;
+	int rule_cap;
+};
+
+struct acl_store {
+	struct acl_store_client **buckets;
+	size_t bucket_mask; // bucket count - 1, a power of two
+	size_t client_count;
+	size_t rule_count;
+	size_t memory; // bytes allocated for clients, rules and strings
+	uint32_t sync_gen;
+};
+
+int acl_store_init(struct acl_store *store);
+void acl_store_cleanup(struct acl_store *store);
+
+const struct acl_store_client *acl_store_find(const struct acl_store *store, const char *client_id);
+int acl_store_add(struct acl_store *store, const char *client_id, int access, const char *topic);
+uint32_t acl_store_begin_sync(struct acl_store *store);
+int acl_store_sync(struct acl_store *store, const char *client_id, int access, const char *topic);
+
+static inline const char *acl_store_client_id(const struct acl_store_client *client)
+{
+	return client->strings;
+}
+
+static inline const char *acl_store_rule_topic(const struct acl_store_client *client, const struct acl_store_rule *rule)
+{
+	return client->strings + rule->topic_off;
+}
+
+#endif//__ACL_STORE_H__
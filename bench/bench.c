@@ -0,0 +1,934 @@
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/x509.h>
+
+#ifndef BENCH_MOCK_PQ
+#include <libpq-fe.h>
+#endif
+
+#include "bench.h"
+#include "db.h"
+#include "utils.h"
+
+/*
+ * Benchmarks of the plugin's hot paths: topic matching, pattern expansion,
+ * in place template matching and whole ACL checks made through the callback the broker would call,
+ * over a range of rule counts and caching modes, authentication of TLS
+ * clients by their certificate, and ACL queries sent one round trip at a
+ * time against the same queries pipelined in batches.
+ *
+ * Each case reports the mean time per operation over a tight loop, the
+ * allocations the plugin made per operation through the broker API, and
+ * percentiles of individually timed operations (which include the cost of
+ * reading the clock, printed at startup).
+ *
+ * auth_plugin_bench answers the plugin's queries from an in-memory mock of
+ * libpq; auth_plugin_bench_pg loads the same rules into a table of a local
+ * PostgreSQL database, reached over its Unix socket.
+ */
+
+#define SAMPLE_LIMIT (1 << 20) // individually timed operations per case, at most
+#define OP_COUNT 4096 // distinct checks cycled through by the ACL cases
+#define BATCH_SIZE 32 // ACL queries per operation of the db/ cases
+#define RELOAD_EVERY 4096 // checks between configuration reloads of the acl/reload cases
+#define TRACE_TICK_EVERY 256 // checks between ticks of the acl/trace cases, which drain the trace
+
+#ifdef BENCH_MOCK_PQ
+#define BENCH_OPTIONS "n:s:c:d:p:r:vh"
+#else
+#define BENCH_OPTIONS "n:s:c:d:p:vh"
+#endif
+
+struct bench_config {
+	long iterations;
+	unsigned long seed;
+	int clients;
+	const char *filter;
+	const char *db_name;
+	const char *db_port;
+};
+
+struct bench_op {
+	struct mosquitto *client;
+	char *topic;
+	int access;
+};
+
+struct workload {
+	int clients;
+	int rules_per_client;
+	struct mosquitto *client;
+	char **ids;
+	char **usernames;
+	struct bench_op ops[OP_COUNT];
+};
+
+typedef bool (*bench_fn)(void *ctx, long i);
+
+static struct bench_config config = {
+	.iterations = 1000000,
+	.seed = 1,
+	.clients = 256,
+	.db_name = "mosquitto_bench",
+	.db_port = "5432",
+};
+
+static volatile long sink;
+static uint64_t rng_state;
+
+static uint64_t rng_next(void)
+{
+	// xorshift64*, deterministic for a given seed
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 2685821657736338717ULL;
+}
+
+static int rng_below(int n)
+{
+	return (int)(rng_next() % (uint64_t)n);
+}
+
+static inline int64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int compare_i64(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static bool selected(const char *name)
+{
+	return config.filter == NULL || strstr(name, config.filter) != NULL;
+}
+
+/*
+ * Time `iterations' calls of `fn', then a sample of them one by one, and
+ * print the results as one row.
+ */
+static void run(const char *name, bench_fn fn, void *ctx, long iterations)
+{
+	long samples = iterations < SAMPLE_LIMIT ? iterations : SAMPLE_LIMIT;
+	int64_t *latency = malloc(sizeof(int64_t) * samples);
+	unsigned long long allocs;
+	long matches = 0;
+	int64_t start, elapsed;
+
+	// warm caches, branch predictors and the plugin's own cache
+	for (long i = 0; i < iterations / 10 + 1; i++)
+		matches += fn(ctx, i);
+
+	allocs = bench_alloc_count;
+	start = now_ns();
+	for (long i = 0; i < iterations; i++)
+		matches += fn(ctx, i);
+	elapsed = now_ns() - start;
+	allocs = bench_alloc_count - allocs;
+
+	for (long i = 0; i < samples; i++)
+	{
+		start = now_ns();
+		matches += fn(ctx, i);
+		latency[i] = now_ns() - start;
+	}
+	qsort(latency, samples, sizeof(int64_t), compare_i64);
+	sink = matches;
+
+	printf("%-40s %10.1f %10.2f %9lld %9lld %9lld\n", name, (double)elapsed / iterations, (double)allocs / iterations,
+		   (long long)latency[samples / 2], (long long)latency[samples * 99 / 100], (long long)latency[samples * 999 / 1000]);
+	fflush(stdout);
+	free(latency);
+}
+
+static void print_header(void)
+{
+	int64_t start = now_ns();
+
+	for (int i = 0; i < 1000; i++)
+		sink = now_ns();
+
+	printf("clock overhead %.1f ns, %ld iterations, seed %lu\n\n", (double)(now_ns() - start) / 1000, config.iterations, config.seed);
+	printf("%-40s %10s %10s %9s %9s %9s\n", "case", "ns/op", "allocs/op", "p50 ns", "p99 ns", "p999 ns");
+}
+
+/*
+ * sub_acl_check
+ */
+
+struct match_case {
+	const char *name;
+	const char *acl;
+	const char *topic;
+};
+
+static const struct match_case match_cases[] = {
+	{ "match/exact", "sensors/kitchen/temp", "sensors/kitchen/temp" },
+	{ "match/exact-miss", "sensors/kitchen/temp", "sensors/kitchen/humidity" },
+	{ "match/deep", "site/12/building/4/floor/2/room/17/sensor/9/temp/celsius",
+	  "site/12/building/4/floor/2/room/17/sensor/9/temp/celsius" },
+	{ "match/deep-miss-late", "site/12/building/4/floor/2/room/17/sensor/9/temp/celsius",
+	  "site/12/building/4/floor/2/room/17/sensor/9/temp/kelvin" },
+	{ "match/plus-levels", "+/+/+/+/+/+/+/+/+/+", "a/b/c/d/e/f/g/h/i/j" },
+	{ "match/plus-mixed", "site/+/building/+/floor/+/room/+/temp", "site/12/building/4/floor/2/room/17/temp" },
+	{ "match/hash", "site/12/#", "site/12/building/4/floor/2/room/17/sensor/9/temp" },
+	{ "match/hash-miss-early", "fleet/#", "site/12/building/4/floor/2/room/17/sensor/9/temp" },
+	{ "match/sub-hash", "site/+/building/#", "site/12/building/#" },
+};
+
+static bool bench_match(void *ctx, long i)
+{
+	const struct match_case *c = ctx;
+
+	return sub_acl_check(c->acl, c->topic);
+}
+
+/*
+ * t_expand
+ */
+
+struct expand_case {
+	const char *name;
+	const char *pattern;
+};
+
+static const struct expand_case expand_cases[] = {
+	{ "expand/none", "site/+/building/+/temp" },
+	{ "expand/client", "clients/%c/cmd/#" },
+	{ "expand/user", "users/%u/devices/+/state" },
+	{ "expand/client-user", "tenants/%u/clients/%c/+/%c/state" },
+};
+
+static bool bench_expand(void *ctx, long i)
+{
+	const struct expand_case *c = ctx;
+	char *expanded;
+
+	t_expand("client-00042-9f3c", "user-00042", c->pattern, &expanded);
+	bool ok = expanded != NULL;
+	mosquitto_free(expanded);
+	return ok;
+}
+
+/*
+ * sub_acl_check_template
+ */
+
+static const struct match_case template_cases[] = {
+	{ "template/client", "clients/%c/cmd/#", "clients/client-00042-9f3c/cmd/reboot/now" },
+	{ "template/user", "users/%u/devices/+/state", "users/user-00042/devices/thermostat/state" },
+	{ "template/client-user", "tenants/%u/clients/%c/+/%c/state", "tenants/user-00042/clients/client-00042-9f3c/x/client-00042-9f3c/state" },
+	{ "template/miss", "clients/%c/cmd/#", "clients/client-00043-0000/cmd/reboot" },
+};
+
+static bool bench_template(void *ctx, long i)
+{
+	const struct match_case *c = ctx;
+
+	return sub_acl_check_template(c->acl, c->topic, "client-00042-9f3c", "user-00042");
+}
+
+/*
+ * Whole ACL checks
+ */
+
+/*
+ * Rule `n' of a client, cycling through the shapes seen in practice: deep
+ * patterns with several single level wildcards, per-client and per-user
+ * templates, and long exact topics.
+ */
+static void make_rule(char *buf, size_t len, int n, int *access)
+{
+	switch (n % 4)
+	{
+	case 0:
+		snprintf(buf, len, "site/%d/building/+/floor/+/room/+/temp", n);
+		break;
+	case 1:
+		snprintf(buf, len, "clients/%%c/cmd/%d/#", n);
+		break;
+	case 2:
+		snprintf(buf, len, "users/%%u/devices/%d/+/state", n);
+		break;
+	default:
+		snprintf(buf, len, "fleet/%d/vehicle/%d/telemetry/gps/position", n, n * 7);
+		break;
+	}
+
+	switch (n % 3)
+	{
+	case 0:
+		*access = MOSQ_ACL_READ | MOSQ_ACL_WRITE | MOSQ_ACL_SUBSCRIBE | MOSQ_ACL_UNSUBSCRIBE;
+		break;
+	case 1:
+		*access = MOSQ_ACL_READ | MOSQ_ACL_SUBSCRIBE;
+		break;
+	default:
+		*access = MOSQ_ACL_WRITE;
+		break;
+	}
+}
+
+/*
+ * A topic granted by rule `n' of `client', wildcards filled in.
+ */
+static char *make_topic(int n, const struct mosquitto *client)
+{
+	char rule[256], topic[512], *wp = topic;
+	int access;
+
+	make_rule(rule, sizeof(rule), n, &access);
+	for (const char *s = rule; *s && wp < topic + sizeof(topic) - 64; s++)
+	{
+		if (*s == '+')
+			wp += sprintf(wp, "x%d", rng_below(100));
+		else if (*s == '#')
+			wp += sprintf(wp, "a/b/c");
+		else if (s[0] == '%' && s[1] == 'c')
+			wp += sprintf(wp, "%s", client->id), s++;
+		else if (s[0] == '%' && s[1] == 'u')
+			wp += sprintf(wp, "%s", client->username), s++;
+		else
+			*wp++ = *s;
+	}
+	*wp = '\0';
+	return strdup(topic);
+}
+
+static int pick_access(int mask)
+{
+	int bits[4], count = 0;
+
+	for (int access = MOSQ_ACL_READ; access <= MOSQ_ACL_UNSUBSCRIBE; access <<= 1)
+	{
+		if (mask & access)
+			bits[count++] = access;
+	}
+	return bits[rng_below(count)];
+}
+
+static void workload_init(struct workload *w, int clients, int rules_per_client)
+{
+	char buf[64];
+
+	w->clients = clients;
+	w->rules_per_client = rules_per_client;
+	w->client = calloc(clients, sizeof(struct mosquitto));
+	w->ids = calloc(clients, sizeof(char *));
+	w->usernames = calloc(clients, sizeof(char *));
+
+	for (int c = 0; c < clients; c++)
+	{
+		snprintf(buf, sizeof(buf), "client-%05d-%04x", c, (unsigned)(rng_next() & 0xffff));
+		w->ids[c] = strdup(buf);
+		snprintf(buf, sizeof(buf), "user-%05d", c);
+		w->usernames[c] = strdup(buf);
+		w->client[c].id = w->ids[c];
+		w->client[c].username = w->usernames[c];
+		w->client[c].address = "127.0.0.1";
+	}
+
+	// four in five checks are granted by one of the client's rules
+	for (int i = 0; i < OP_COUNT; i++)
+	{
+		struct bench_op *op = &w->ops[i];
+		char rule[256];
+		int access;
+
+		op->client = &w->client[rng_below(clients)];
+		if (rng_below(5) < 4)
+		{
+			int n = rng_below(rules_per_client);
+
+			make_rule(rule, sizeof(rule), n, &access);
+			op->topic = make_topic(n, op->client);
+			op->access = pick_access(access);
+		}
+		else
+		{
+			snprintf(rule, sizeof(rule), "site/%d/unknown/%d/temp", rng_below(1000), rng_below(1000));
+			op->topic = strdup(rule);
+			op->access = 1 << rng_below(4);
+		}
+	}
+}
+
+static void workload_cleanup(struct workload *w)
+{
+	for (int c = 0; c < w->clients; c++)
+	{
+		free(w->ids[c]);
+		free(w->usernames[c]);
+	}
+	for (int i = 0; i < OP_COUNT; i++)
+		free(w->ops[i].topic);
+	free(w->client);
+	free(w->ids);
+	free(w->usernames);
+}
+
+#ifdef BENCH_MOCK_PQ
+static bool load_rules(const struct workload *w)
+{
+	char rule[256];
+	int access;
+
+	mock_pq_reset();
+	for (int c = 0; c < w->clients; c++)
+	{
+		for (int n = 0; n < w->rules_per_client; n++)
+		{
+			make_rule(rule, sizeof(rule), n, &access);
+			mock_pq_add_rule(w->ids[c], access, rule);
+		}
+	}
+	return true;
+}
+#else
+static bool exec_ok(PGconn *conn, const char *query)
+{
+	PGresult *res = PQexec(conn, query);
+	bool ok = PQresultStatus(res) == PGRES_COMMAND_OK;
+
+	if (!ok)
+		fprintf(stderr, "%s: %s", query, PQresultErrorMessage(res));
+	PQclear(res);
+	return ok;
+}
+
+static bool load_rules(const struct workload *w)
+{
+	char conninfo[256], line[512];
+	PGresult *res;
+	bool ok;
+	int access;
+
+	snprintf(conninfo, sizeof(conninfo), "dbname='%s' port=%s", config.db_name, config.db_port);
+	PGconn *conn = PQconnectdb(conninfo);
+	if (PQstatus(conn) != CONNECTION_OK)
+	{
+		fprintf(stderr, "Connecting to %s failed: %s", conninfo, PQerrorMessage(conn));
+		PQfinish(conn);
+		return false;
+	}
+
+	ok = exec_ok(conn, "DROP TABLE IF EXISTS mosq_auth_bench")
+		 && exec_ok(conn, "CREATE TABLE mosq_auth_bench (client_id text NOT NULL, access int NOT NULL, topic text NOT NULL)");
+
+	res = PQexec(conn, "COPY mosq_auth_bench FROM STDIN");
+	ok = ok && PQresultStatus(res) == PGRES_COPY_IN;
+	PQclear(res);
+	for (int c = 0; ok && c < w->clients; c++)
+	{
+		for (int n = 0; ok && n < w->rules_per_client; n++)
+		{
+			char rule[256];
+
+			make_rule(rule, sizeof(rule), n, &access);
+			int len = snprintf(line, sizeof(line), "%s\t%d\t%s\n", w->ids[c], access, rule);
+			ok = PQputCopyData(conn, line, len) == 1;
+		}
+	}
+	ok = PQputCopyEnd(conn, ok ? NULL : "aborted") == 1 && ok;
+	while ((res = PQgetResult(conn)) != NULL)
+	{
+		ok = ok && PQresultStatus(res) == PGRES_COMMAND_OK;
+		PQclear(res);
+	}
+
+	ok = ok && exec_ok(conn, "CREATE INDEX ON mosq_auth_bench (client_id)") && exec_ok(conn, "ANALYZE mosq_auth_bench");
+	if (!ok)
+		fprintf(stderr, "Loading the benchmark rules failed: %s", PQerrorMessage(conn));
+	PQfinish(conn);
+	return ok;
+}
+#endif
+
+struct acl_bench {
+	const struct workload *workload;
+	MOSQ_FUNC_generic_callback check;
+	void *userdata;
+	MOSQ_FUNC_generic_callback tick, reload;
+	void *tick_userdata, *reload_userdata;
+	struct mosquitto_opt *options[2]; // reloaded in turn
+	int option_count;
+};
+
+static bool bench_acl_check(void *ctx, long i)
+{
+	struct acl_bench *b = ctx;
+	const struct bench_op *op = &b->workload->ops[i % OP_COUNT];
+	struct mosquitto_evt_acl_check ed;
+
+	memset(&ed, 0, sizeof(ed));
+	ed.client = op->client;
+	ed.topic = op->topic;
+	ed.access = op->access;
+	return b->check(MOSQ_EVT_ACL_CHECK, &ed, b->userdata) == MOSQ_ERR_SUCCESS;
+}
+
+/*
+ * A cached check, the broker's tick in between, and every RELOAD_EVERY
+ * checks a configuration reload switching to the other spelling of the ACL
+ * query: its connections come up and are swapped in from the ticks while
+ * the checks go on.
+ */
+static bool bench_acl_reload(void *ctx, long i)
+{
+	struct acl_bench *b = ctx;
+
+	if (i % RELOAD_EVERY == RELOAD_EVERY - 1)
+	{
+		struct mosquitto_evt_reload ed;
+
+		memset(&ed, 0, sizeof(ed));
+		ed.options = b->options[(i / RELOAD_EVERY) % 2];
+		ed.option_count = b->option_count;
+		b->reload(MOSQ_EVT_RELOAD, &ed, b->reload_userdata);
+	}
+	b->tick(MOSQ_EVT_TICK, NULL, b->tick_userdata);
+	return bench_acl_check(ctx, i);
+}
+
+/*
+ * A cached check captured to a trace, the broker ticking every
+ * TRACE_TICK_EVERY checks so the writer keeps up.
+ */
+static bool bench_acl_trace(void *ctx, long i)
+{
+	struct acl_bench *b = ctx;
+
+	if (i % TRACE_TICK_EVERY == 0)
+		b->tick(MOSQ_EVT_TICK, NULL, b->tick_userdata);
+	return bench_acl_check(ctx, i);
+}
+
+enum acl_mode {
+	MODE_DB,
+	MODE_CACHE,
+	MODE_RELOAD,
+	MODE_TRACE,
+	MODE_PRELOAD,
+	MODE_FILE,
+};
+
+static const char *mode_names[] = { "db", "cache", "reload", "trace", "preload", "file" };
+
+/*
+ * Write the workload's rules to a new text rules file, its name replacing
+ * the XXXXXX of `path'.
+ */
+static bool write_rules_file(const struct workload *w, char *path)
+{
+	char rule[256];
+	int access;
+	int fd = mkstemp(path);
+	FILE *f = fd >= 0 ? fdopen(fd, "w") : NULL;
+
+	if (f == NULL)
+	{
+		if (fd >= 0)
+			close(fd);
+		return false;
+	}
+	for (int c = 0; c < w->clients; c++)
+	{
+		for (int n = 0; n < w->rules_per_client; n++)
+		{
+			make_rule(rule, sizeof(rule), n, &access);
+			fprintf(f, "%s %d %s\n", w->ids[c], access, rule);
+		}
+	}
+	return fclose(f) == 0;
+}
+
+static void bench_acl(const struct workload *w, enum acl_mode mode)
+{
+	static mosquitto_plugin_id_t *identifier;
+	struct mosquitto_opt options[8], reloaded[8];
+	int option_count = 0;
+	char name[64];
+	void *data = NULL;
+	struct acl_bench b;
+	long iterations = config.iterations;
+	char path[] = "/tmp/mosq_auth_bench_XXXXXX";
+
+	snprintf(name, sizeof(name), "acl/%s/%d-rules", mode_names[mode], w->rules_per_client);
+	if (!selected(name))
+		return;
+
+#define OPTION(k, v) options[option_count++] = (struct mosquitto_opt){ .key = (k), .value = (v) }
+	if (mode == MODE_FILE)
+	{
+		// the matching engine on its own, no database round trip at all
+		if (!write_rules_file(w, path))
+		{
+			fprintf(stderr, "%s: writing the rules file failed\n", name);
+			unlink(path);
+			return;
+		}
+		OPTION("acl_backend", "file");
+		OPTION("acl_file_path", path);
+	}
+	else
+	{
+		OPTION("db_name", (char *)config.db_name);
+		OPTION("db_port", (char *)config.db_port);
+		OPTION("db_aclquery", "SELECT topic FROM mosq_auth_bench WHERE client_id = '%s' AND access & %d <> 0");
+	}
+	OPTION("unixsocket_path", "/run/mosquitto/bench.sock");
+	if (mode == MODE_CACHE || mode == MODE_RELOAD || mode == MODE_TRACE)
+	{
+		OPTION("acl_cache_ttl", "3600");
+	}
+	else if (mode == MODE_PRELOAD)
+	{
+		OPTION("acl_preload_query", "SELECT client_id, access, topic FROM mosq_auth_bench");
+	}
+	if (mode == MODE_TRACE)
+	{
+		// every check captured, what the writer does with them is off the broker's thread
+		OPTION("trace_path", "/dev/null");
+	}
+#undef OPTION
+
+	if (mosquitto_plugin_init(identifier, &data, options, option_count) != MOSQ_ERR_SUCCESS)
+	{
+		fprintf(stderr, "%s: initializing the plugin failed\n", name);
+		if (mode == MODE_FILE)
+			unlink(path);
+		return;
+	}
+
+	b.workload = w;
+	b.check = bench_callback(MOSQ_EVT_ACL_CHECK, &b.userdata);
+	b.tick = bench_callback(MOSQ_EVT_TICK, &b.tick_userdata);
+	b.reload = bench_callback(MOSQ_EVT_RELOAD, &b.reload_userdata);
+	// the same query, spelled otherwise
+	memcpy(reloaded, options, sizeof(options));
+	reloaded[2].value = "SELECT topic FROM mosq_auth_bench WHERE client_id = '%s' AND (access & %d) <> 0";
+	b.options[0] = reloaded;
+	b.options[1] = options;
+	b.option_count = option_count;
+	// keep the slow cases, a round trip per check without a cache, to seconds
+	iterations /= w->rules_per_client * (mode == MODE_DB ? 10 : 1);
+	if (iterations < 10000)
+		iterations = 10000 < config.iterations ? 10000 : config.iterations;
+	run(name, mode == MODE_RELOAD ? bench_acl_reload : mode == MODE_TRACE ? bench_acl_trace : bench_acl_check, &b, iterations);
+
+	mosquitto_plugin_cleanup(data, options, option_count);
+	if (mode == MODE_FILE)
+		unlink(path);
+}
+
+struct batch_bench {
+	const struct workload *workload;
+	PGconn *conn;
+	struct db_acl_statement stmt;
+};
+
+static bool bench_batch_sequential(void *ctx, long i)
+{
+	struct batch_bench *b = ctx;
+	long rows = 0;
+	bool timed_out;
+
+	for (int k = 0; k < BATCH_SIZE; k++)
+	{
+		const struct bench_op *op = &b->workload->ops[(i * BATCH_SIZE + k) % OP_COUNT];
+		PGresult *res = db_exec_acl_query(b->conn, &b->stmt, op->client->id, op->access, 0, &timed_out);
+
+		rows += PQntuples(res);
+		PQclear(res);
+	}
+	return rows > 0;
+}
+
+static bool bench_batch_pipeline(void *ctx, long i)
+{
+	struct batch_bench *b = ctx;
+	const char *client_ids[BATCH_SIZE];
+	int access[BATCH_SIZE];
+	PGresult *results[BATCH_SIZE];
+	long rows = 0;
+
+	for (int k = 0; k < BATCH_SIZE; k++)
+	{
+		const struct bench_op *op = &b->workload->ops[(i * BATCH_SIZE + k) % OP_COUNT];
+
+		client_ids[k] = op->client->id;
+		access[k] = op->access;
+	}
+	if (db_exec_acl_batch(b->conn, &b->stmt, BATCH_SIZE, client_ids, access, results) < 0)
+		return false;
+
+	for (int k = 0; k < BATCH_SIZE; k++)
+	{
+		rows += PQntuples(results[k]);
+		PQclear(results[k]);
+	}
+	return rows > 0;
+}
+
+/*
+ * The ACL queries of BATCH_SIZE checks, one round trip each and then all in
+ * a single pipeline, as the refresher sends them. What they compare is the
+ * number of round trips, so against the mock they need -r to mean anything.
+ */
+static void bench_batch(const struct workload *w)
+{
+	char sequential[64], pipeline[64], conninfo[256];
+	struct batch_bench b;
+	long iterations = config.iterations / (BATCH_SIZE * 10);
+
+	snprintf(sequential, sizeof(sequential), "db/sequential/%d-rules", w->rules_per_client);
+	snprintf(pipeline, sizeof(pipeline), "db/pipeline/%d-rules", w->rules_per_client);
+	if (!selected(sequential) && !selected(pipeline))
+		return;
+#ifdef BENCH_MOCK_PQ
+	if (mock_pq_round_trip <= 0)
+		return;
+#endif
+
+	snprintf(conninfo, sizeof(conninfo), "dbname='%s' port=%s", config.db_name, config.db_port);
+	b.workload = w;
+	b.conn = PQconnectdb(conninfo);
+	char *query = db_format_acl_query("SELECT topic FROM mosq_auth_bench WHERE client_id = '%s' AND access & %d <> 0", &b.stmt.access_first);
+	if (PQstatus(b.conn) != CONNECTION_OK || query == NULL || db_prepare_acl_query(b.conn, query, &b.stmt) != MOSQ_ERR_SUCCESS)
+	{
+		fprintf(stderr, "%s: preparing the ACL query failed\n", pipeline);
+		mosquitto_free(query);
+		PQfinish(b.conn);
+		return;
+	}
+	mosquitto_free(query);
+	PQsetnonblocking(b.conn, 1);
+
+	if (iterations < 1000)
+		iterations = 1000 < config.iterations ? 1000 : config.iterations;
+	if (selected(sequential))
+		run(sequential, bench_batch_sequential, &b, iterations);
+	if (selected(pipeline))
+		run(pipeline, bench_batch_pipeline, &b, iterations);
+
+	PQfinish(b.conn);
+}
+
+/*
+ * Authentication of TLS clients, each presenting a certificate of its own
+ * whose common name holds its client id
+ */
+
+struct cert_bench {
+	MOSQ_FUNC_generic_callback auth;
+	void *userdata;
+	struct mosquitto *clients;
+	int count;
+};
+
+static bool bench_cert_auth(void *ctx, long i)
+{
+	struct cert_bench *b = ctx;
+	struct mosquitto_evt_basic_auth ed;
+
+	memset(&ed, 0, sizeof(ed));
+	ed.client = &b->clients[i % b->count];
+	return b->auth(MOSQ_EVT_BASIC_AUTH, &ed, b->userdata) == MOSQ_ERR_SUCCESS;
+}
+
+static void bench_cert(bool cached)
+{
+	static mosquitto_plugin_id_t *identifier;
+	const char *name = cached ? "auth/cert/cached" : "auth/cert/parse";
+	char size[16];
+	struct mosquitto_opt options[] = {
+		{ .key = "db_name", .value = (char *)config.db_name },
+		{ .key = "db_port", .value = (char *)config.db_port },
+		{ .key = "db_aclquery", .value = "SELECT topic FROM mosq_auth_bench WHERE client_id = '%s' AND access & %d <> 0" },
+		{ .key = "unixsocket_path", .value = "/run/mosquitto/bench.sock" },
+		// every connect prefetches the device's rules, unless its certificate says they are still cached
+		{ .key = "acl_cache_ttl", .value = "3600" },
+		{ .key = "acl_prefetch_query", .value = "SELECT client_id, access, topic FROM mosq_auth_bench WHERE client_id = $1" },
+		{ .key = "cert_cache_size", .value = size },
+	};
+	struct cert_bench b;
+	bool made = true;
+	void *data = NULL;
+
+	if (!selected(name))
+		return;
+
+	b.count = config.clients;
+	b.clients = calloc(b.count, sizeof(struct mosquitto));
+	for (int c = 0; c < b.count; c++)
+	{
+		char buf[64];
+
+		snprintf(buf, sizeof(buf), "device-%05d", c);
+		b.clients[c].id = strdup(buf);
+		b.clients[c].address = "192.0.2.1";
+		snprintf(buf, sizeof(buf), "device-%05d.fleet.example.org", c);
+		b.clients[c].certificate = bench_certificate(buf, c + 1);
+		made = made && b.clients[c].certificate;
+	}
+
+	// slack for buckets the certificates fill unevenly, a full one would miss on every round
+	snprintf(size, sizeof(size), "%d", cached ? b.count * 8 : 0);
+	if (!made)
+	{
+		fprintf(stderr, "%s: generating the certificates failed\n", name);
+	}
+	else if (mosquitto_plugin_init(identifier, &data, options, sizeof(options) / sizeof(options[0])) != MOSQ_ERR_SUCCESS)
+	{
+		fprintf(stderr, "%s: initializing the plugin failed\n", name);
+	}
+	else
+	{
+		b.auth = bench_callback(MOSQ_EVT_BASIC_AUTH, &b.userdata);
+		run(name, bench_cert_auth, &b, config.iterations / 10 > 10000 ? config.iterations / 10 : config.iterations);
+		mosquitto_plugin_cleanup(data, options, sizeof(options) / sizeof(options[0]));
+	}
+
+	for (int c = 0; c < b.count; c++)
+	{
+		free((char *)b.clients[c].id);
+		X509_free(b.clients[c].certificate);
+	}
+	free(b.clients);
+}
+
+static void usage(const char *prog)
+{
+#ifdef BENCH_MOCK_PQ
+	fprintf(stderr, "Usage: %s [-n iterations] [-s seed] [-c clients] [-d db_name] [-p db_port] [-r round_trip_us] [-v] [filter]\n"
+					"\n"
+					"Runs the cases whose name contains `filter', all of them by default. The db/ cases\n"
+					"only run with -r, the time a round trip to the mock database takes.\n",
+			prog);
+#else
+	fprintf(stderr, "Usage: %s [-n iterations] [-s seed] [-c clients] [-d db_name] [-p db_port] [-v] [filter]\n"
+					"\n"
+					"Runs the cases whose name contains `filter', all of them by default.\n",
+			prog);
+#endif
+}
+
+int main(int argc, char *argv[])
+{
+	static const int rule_counts[] = { 1, 10, 100, 1000 };
+	int opt;
+
+	while ((opt = getopt(argc, argv, BENCH_OPTIONS)) != -1)
+	{
+		switch (opt)
+		{
+		case 'n':
+			config.iterations = atol(optarg);
+			break;
+		case 's':
+			config.seed = strtoul(optarg, NULL, 10);
+			break;
+		case 'c':
+			config.clients = atoi(optarg);
+			break;
+		case 'd':
+			config.db_name = optarg;
+			break;
+		case 'p':
+			config.db_port = optarg;
+			break;
+		case 'v':
+			bench_verbose = true;
+			break;
+#ifdef BENCH_MOCK_PQ
+		case 'r':
+			mock_pq_round_trip = atol(optarg);
+			break;
+#endif
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (optind < argc)
+		config.filter = argv[optind];
+	if (config.iterations < 1 || config.clients < 1)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+	rng_state = config.seed * 0x9e3779b97f4a7c15ULL + 1;
+
+	print_header();
+
+	for (size_t i = 0; i < sizeof(match_cases) / sizeof(match_cases[0]); i++)
+	{
+		if (selected(match_cases[i].name))
+			run(match_cases[i].name, bench_match, (void *)&match_cases[i], config.iterations);
+	}
+
+	for (size_t i = 0; i < sizeof(expand_cases) / sizeof(expand_cases[0]); i++)
+	{
+		if (selected(expand_cases[i].name))
+			run(expand_cases[i].name, bench_expand, (void *)&expand_cases[i], config.iterations);
+	}
+
+	for (size_t i = 0; i < sizeof(template_cases) / sizeof(template_cases[0]); i++)
+	{
+		if (selected(template_cases[i].name))
+			run(template_cases[i].name, bench_template, (void *)&template_cases[i], config.iterations);
+	}
+
+	bench_cert(false);
+	bench_cert(true);
+
+	for (size_t r = 0; r < sizeof(rule_counts) / sizeof(rule_counts[0]); r++)
+	{
+		struct workload w;
+		bool wanted = false;
+		char name[64];
+
+		// only load rules some selected case needs, the file case writes its own
+		for (int mode = MODE_DB; mode <= MODE_PRELOAD; mode++)
+		{
+			snprintf(name, sizeof(name), "acl/%s/%d-rules", mode_names[mode], rule_counts[r]);
+			wanted = wanted || selected(name);
+		}
+		snprintf(name, sizeof(name), "db/pipeline/%d-rules", rule_counts[r]);
+		wanted = wanted || selected(name);
+		snprintf(name, sizeof(name), "db/sequential/%d-rules", rule_counts[r]);
+		wanted = wanted || selected(name);
+		snprintf(name, sizeof(name), "acl/%s/%d-rules", mode_names[MODE_FILE], rule_counts[r]);
+		if (!wanted && !selected(name))
+			continue;
+
+		workload_init(&w, config.clients, rule_counts[r]);
+		if (wanted && !load_rules(&w))
+		{
+			workload_cleanup(&w);
+			return 1;
+		}
+		bench_acl(&w, MODE_DB);
+		bench_acl(&w, MODE_CACHE);
+		bench_acl(&w, MODE_RELOAD);
+		bench_acl(&w, MODE_TRACE);
+		bench_acl(&w, MODE_PRELOAD);
+		bench_acl(&w, MODE_FILE);
+		bench_batch(&w);
+		workload_cleanup(&w);
+	}
+
+	return 0;
+}
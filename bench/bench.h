@@ -0,0 +1,35 @@
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mosquitto_broker.h"
+#include "mosquitto_plugin.h"
+#include "mosquitto.h"
+
+/*
+ * The broker's client object is opaque to plugins, so the stub broker API is
+ * free to define it with just what the plugin asks about.
+ */
+struct mosquitto {
+	const char *id;
+	const char *username;
+	const char *address;
+	void *certificate; // X509 presented over TLS, NULL if none
+};
+
+// broker_stub.c
+extern unsigned long long bench_alloc_count; // calls to mosquitto_malloc/calloc/realloc/strdup
+extern bool bench_verbose; // print every plugin log line, not only errors
+
+MOSQ_FUNC_generic_callback bench_callback(int event, void **userdata);
+void *bench_certificate(const char *common_name, long serial);
+
+// mock_pq.c, only linked into the mock variant
+extern long mock_pq_round_trip; // us the mock waits per round trip, 0 (default) for none
+void mock_pq_add_rule(const char *client_id, int access, const char *topic);
+void mock_pq_reset(void);
+
+#endif//__BENCH_H__
@@ -0,0 +1,174 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+
+#include "bench.h"
+
+/*
+ * Just enough of the broker's plugin API to load the plugin in a benchmark:
+ * memory functions that count allocations, a log that stays quiet, a
+ * callback table the benchmark calls the plugin through, and certificates
+ * for the clients to present.
+ */
+
+unsigned long long bench_alloc_count;
+bool bench_verbose;
+
+static struct {
+	MOSQ_FUNC_generic_callback cb;
+	void *userdata;
+} callbacks[MOSQ_EVT_DISCONNECT + 1];
+
+MOSQ_FUNC_generic_callback bench_callback(int event, void **userdata)
+{
+	if (event < 0 || event > MOSQ_EVT_DISCONNECT)
+		return NULL;
+	*userdata = callbacks[event].userdata;
+	return callbacks[event].cb;
+}
+
+/*
+ * A self-signed X509 with `common_name' as its subject's CN (none if NULL),
+ * or NULL on failure. One key, made on first use, signs every certificate:
+ * only their subjects and signatures matter to the plugin.
+ */
+void *bench_certificate(const char *common_name, long serial)
+{
+	static EVP_PKEY *key;
+	X509 *cert;
+	X509_NAME *name;
+
+	if (key == NULL)
+	{
+		EVP_PKEY_CTX *kctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+
+		if (kctx == NULL || EVP_PKEY_keygen_init(kctx) <= 0 || EVP_PKEY_CTX_set_ec_paramgen_curve_nid(kctx, NID_X9_62_prime256v1) <= 0
+			|| EVP_PKEY_keygen(kctx, &key) <= 0)
+		{
+			EVP_PKEY_CTX_free(kctx);
+			return NULL;
+		}
+		EVP_PKEY_CTX_free(kctx);
+	}
+
+	cert = X509_new();
+	if (cert == NULL)
+		return NULL;
+	X509_set_version(cert, 2);
+	ASN1_INTEGER_set(X509_get_serialNumber(cert), serial);
+	X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+	X509_gmtime_adj(X509_getm_notAfter(cert), 86400);
+	X509_set_pubkey(cert, key);
+	name = X509_get_subject_name(cert);
+	X509_NAME_add_entry_by_txt(name, "O", MBSTRING_ASC, (const unsigned char *)"Mosquitto Bench", -1, -1, 0);
+	if (common_name)
+		X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char *)common_name, -1, -1, 0);
+	X509_set_issuer_name(cert, name);
+	if (!X509_sign(cert, key, EVP_sha256()))
+	{
+		X509_free(cert);
+		return NULL;
+	}
+	return cert;
+}
+
+int mosquitto_callback_register(mosquitto_plugin_id_t *identifier, int event, MOSQ_FUNC_generic_callback cb_func, const void *event_data, void *userdata)
+{
+	if (event < 0 || event > MOSQ_EVT_DISCONNECT)
+		return MOSQ_ERR_NOT_SUPPORTED;
+	if (callbacks[event].cb)
+		return MOSQ_ERR_ALREADY_EXISTS;
+	callbacks[event].cb = cb_func;
+	callbacks[event].userdata = userdata;
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_callback_unregister(mosquitto_plugin_id_t *identifier, int event, MOSQ_FUNC_generic_callback cb_func, const void *event_data)
+{
+	if (event < 0 || event > MOSQ_EVT_DISCONNECT || callbacks[event].cb != cb_func)
+		return MOSQ_ERR_NOT_FOUND;
+	callbacks[event].cb = NULL;
+	callbacks[event].userdata = NULL;
+	return MOSQ_ERR_SUCCESS;
+}
+
+void *mosquitto_calloc(size_t nmemb, size_t size)
+{
+	bench_alloc_count++;
+	return calloc(nmemb, size);
+}
+
+void mosquitto_free(void *mem)
+{
+	free(mem);
+}
+
+void *mosquitto_malloc(size_t size)
+{
+	bench_alloc_count++;
+	return malloc(size);
+}
+
+void *mosquitto_realloc(void *ptr, size_t size)
+{
+	bench_alloc_count++;
+	return realloc(ptr, size);
+}
+
+char *mosquitto_strdup(const char *s)
+{
+	bench_alloc_count++;
+	return strdup(s);
+}
+
+void mosquitto_log_printf(int level, const char *fmt, ...)
+{
+	va_list va;
+
+	if (!bench_verbose && level != MOSQ_LOG_ERR)
+		return;
+
+	va_start(va, fmt);
+	vfprintf(stderr, fmt, va);
+	va_end(va);
+	fputc('\n', stderr);
+}
+
+const char *mosquitto_client_address(const struct mosquitto *client)
+{
+	return client->address;
+}
+
+const char *mosquitto_client_id(const struct mosquitto *client)
+{
+	return client->id;
+}
+
+const char *mosquitto_client_username(const struct mosquitto *client)
+{
+	return client->username;
+}
+
+void *mosquitto_client_certificate(const struct mosquitto *client)
+{
+	// a reference of its own, as the broker gives out
+	if (client->certificate)
+		X509_up_ref(client->certificate);
+	return client->certificate;
+}
+
+int mosquitto_set_username(struct mosquitto *client, const char *username)
+{
+	return MOSQ_ERR_NOT_SUPPORTED;
+}
+
+int mosquitto_broker_publish_copy(const char *clientid, const char *topic, int payloadlen, const void *payload, int qos, bool retain, mosquitto_property *properties)
+{
+	if (bench_verbose)
+		fprintf(stderr, "%s %.*s\n", topic, payloadlen, (const char *)payload);
+	return MOSQ_ERR_SUCCESS;
+}
@@ -0,0 +1,525 @@
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <libpq-fe.h>
+
+#include "bench.h"
+
+/*
+ * In-memory stand-in for libpq, answering the plugin's queries from a rule
+ * table filled by the benchmark, so the ACL paths can be measured without a
+ * database. Only what the plugin calls is implemented. Whatever the SQL, the
+ * prepared ACL statement returns the topics of client $1 granting access $2,
+ * and any other query streams the whole table as client, access, topic rows.
+ * Connections started without blocking are polled on /dev/null, always
+ * ready, and connected by the first PQconnectPoll().
+ *
+ * Answers are immediate unless mock_pq_round_trip is set: each blocking call,
+ * each query result read and each pipeline sync then sleeps that long first,
+ * as the client would wait on the network and server, so that sending fewer
+ * round trips shows. Queries in a pipeline share the round trip of their sync.
+ */
+
+long mock_pq_round_trip;
+
+struct mock_rule {
+	char *client_id;
+	char *topic;
+	int access;
+	uint32_t hash;
+	struct mock_rule *next; // next rule of the same bucket
+};
+
+#define MOCK_BUCKETS 4096
+
+static struct mock_rule *buckets[MOCK_BUCKETS];
+static struct mock_rule **rule_list; // every rule, in insertion order
+static size_t rule_count, rule_cap;
+
+#define MOCK_PIPELINE 256 // queries and syncs in a pipeline, at most
+
+struct pg_conn {
+	ConnStatusType status;
+	bool connecting; // started by PQconnectStart(), not polled yet
+	size_t stream_pos; // next row of a streamed query, SIZE_MAX when none is pending
+	PGresult *pending; // result of a sent ACL query, not read yet
+	bool pipeline;
+	bool separator; // the NULL ending a query's results in a pipeline is due
+	int queued, next; // results of the pipeline, and the next to be read
+	bool arrived; // the pipeline's results up to the next sync paid their round trip
+	PGresult *queue[MOCK_PIPELINE];
+};
+
+struct pg_result {
+	ExecStatusType status;
+	int ntuples;
+	int nfields;
+	char **values; // ntuples * nfields, owned by the result
+};
+
+static uint32_t mock_hash(const char *s)
+{
+	uint32_t h = 2166136261u;
+
+	while (*s)
+		h = (h ^ (uint8_t)*s++) * 16777619u;
+	return h;
+}
+
+void mock_pq_add_rule(const char *client_id, int access, const char *topic)
+{
+	struct mock_rule *rule = calloc(1, sizeof(*rule));
+
+	rule->client_id = strdup(client_id);
+	rule->topic = strdup(topic);
+	rule->access = access;
+	rule->hash = mock_hash(client_id);
+	rule->next = buckets[rule->hash % MOCK_BUCKETS];
+	buckets[rule->hash % MOCK_BUCKETS] = rule;
+
+	if (rule_count == rule_cap)
+	{
+		rule_cap = rule_cap ? rule_cap * 2 : 1024;
+		rule_list = realloc(rule_list, sizeof(*rule_list) * rule_cap);
+	}
+	rule_list[rule_count++] = rule;
+}
+
+void mock_pq_reset(void)
+{
+	for (size_t i = 0; i < rule_count; i++)
+	{
+		free(rule_list[i]->client_id);
+		free(rule_list[i]->topic);
+		free(rule_list[i]);
+	}
+	free(rule_list);
+	rule_list = NULL;
+	rule_count = rule_cap = 0;
+	memset(buckets, 0, sizeof(buckets));
+}
+
+static void round_trip(void)
+{
+	struct timespec delay = { mock_pq_round_trip / 1000000, mock_pq_round_trip % 1000000 * 1000 };
+
+	if (mock_pq_round_trip > 0)
+		nanosleep(&delay, NULL);
+}
+
+static PGresult *new_result(ExecStatusType status, int nfields, int ntuples)
+{
+	PGresult *res = calloc(1, sizeof(*res));
+
+	res->status = status;
+	res->nfields = nfields;
+	res->ntuples = ntuples;
+	if (ntuples)
+		res->values = calloc((size_t)ntuples * nfields, sizeof(char *));
+	return res;
+}
+
+PGconn *PQconnectdb(const char *conninfo)
+{
+	PGconn *conn = calloc(1, sizeof(*conn));
+
+	conn->status = CONNECTION_OK;
+	conn->stream_pos = SIZE_MAX;
+	return conn;
+}
+
+PGconn *PQconnectStart(const char *conninfo)
+{
+	PGconn *conn = PQconnectdb(conninfo);
+
+	conn->connecting = true;
+	return conn;
+}
+
+void PQreset(PGconn *conn)
+{
+	conn->status = CONNECTION_OK;
+}
+
+int PQresetStart(PGconn *conn)
+{
+	conn->status = CONNECTION_OK;
+	conn->connecting = true;
+	return 1;
+}
+
+PostgresPollingStatusType PQconnectPoll(PGconn *conn)
+{
+	conn->connecting = false;
+	return PGRES_POLLING_OK;
+}
+
+void PQfinish(PGconn *conn)
+{
+	if (conn)
+	{
+		PQclear(conn->pending);
+		while (conn->next < conn->queued)
+			PQclear(conn->queue[conn->next++]);
+	}
+	free(conn);
+}
+
+ConnStatusType PQstatus(const PGconn *conn)
+{
+	return conn ? conn->status : CONNECTION_BAD;
+}
+
+char *PQerrorMessage(const PGconn *conn)
+{
+	return "";
+}
+
+int PQsocket(const PGconn *conn)
+{
+	static int ready = -1;
+
+	if (!conn->connecting)
+		return -1;
+	if (ready < 0)
+		ready = open("/dev/null", O_RDWR);
+	return ready;
+}
+
+char *PQescapeIdentifier(PGconn *conn, const char *str, size_t len)
+{
+	char *res = malloc(len + 3);
+
+	res[0] = '"';
+	memcpy(res + 1, str, len);
+	res[len + 1] = '"';
+	res[len + 2] = '\0';
+	return res;
+}
+
+void PQfreemem(void *ptr)
+{
+	free(ptr);
+}
+
+PGresult *PQexec(PGconn *conn, const char *query)
+{
+	round_trip();
+	return new_result(PGRES_COMMAND_OK, 0, 0);
+}
+
+PGresult *PQprepare(PGconn *conn, const char *stmtName, const char *query, int nParams, const Oid *paramTypes)
+{
+	round_trip();
+	return new_result(PGRES_COMMAND_OK, 0, 0);
+}
+
+PGresult *PQdescribePrepared(PGconn *conn, const char *stmt)
+{
+	round_trip();
+	// text client id and int4 access in, one text topic column out
+	return new_result(PGRES_COMMAND_OK, 1, 0);
+}
+
+int PQsendPrepare(PGconn *conn, const char *stmtName, const char *query, int nParams, const Oid *paramTypes)
+{
+	conn->pending = new_result(PGRES_COMMAND_OK, 0, 0);
+	return 1;
+}
+
+int PQsendDescribePrepared(PGconn *conn, const char *stmt)
+{
+	conn->pending = new_result(PGRES_COMMAND_OK, 1, 0);
+	return 1;
+}
+
+int PQnparams(const PGresult *res)
+{
+	return 2;
+}
+
+Oid PQparamtype(const PGresult *res, int param_num)
+{
+	return param_num == 0 ? 25 : 23;
+}
+
+Oid PQftype(const PGresult *res, int field_num)
+{
+	return 25;
+}
+
+int PQsetnonblocking(PGconn *conn, int arg)
+{
+	return 0;
+}
+
+int PQflush(PGconn *conn)
+{
+	return 0;
+}
+
+int PQisBusy(PGconn *conn)
+{
+	return 0;
+}
+
+static PGresult *acl_query(const int *paramLengths, const char *const *paramValues, const int *paramFormats)
+{
+	char client_id[256];
+	size_t len = (size_t)paramLengths[0] < sizeof(client_id) - 1 ? (size_t)paramLengths[0] : sizeof(client_id) - 1;
+	int access, count = 0;
+	struct mock_rule *rule;
+	PGresult *res;
+
+	memcpy(client_id, paramValues[0], len);
+	client_id[len] = '\0';
+	if (paramFormats[1])
+	{
+		uint32_t v;
+
+		memcpy(&v, paramValues[1], sizeof(v));
+		access = (int)ntohl(v);
+	}
+	else
+	{
+		access = atoi(paramValues[1]);
+	}
+
+	uint32_t hash = mock_hash(client_id);
+	for (rule = buckets[hash % MOCK_BUCKETS]; rule; rule = rule->next)
+	{
+		if (rule->hash == hash && (rule->access & access) && !strcmp(rule->client_id, client_id))
+			count++;
+	}
+
+	res = new_result(PGRES_TUPLES_OK, 1, count);
+	count = 0;
+	for (rule = buckets[hash % MOCK_BUCKETS]; rule; rule = rule->next)
+	{
+		if (rule->hash == hash && (rule->access & access) && !strcmp(rule->client_id, client_id))
+			res->values[count++] = strdup(rule->topic);
+	}
+	return res;
+}
+
+PGresult *PQexecPrepared(PGconn *conn, const char *stmtName, int nParams, const char *const *paramValues,
+						 const int *paramLengths, const int *paramFormats, int resultFormat)
+{
+	round_trip();
+	return acl_query(paramLengths, paramValues, paramFormats);
+}
+
+int PQsendQueryPrepared(PGconn *conn, const char *stmtName, int nParams, const char *const *paramValues,
+						const int *paramLengths, const int *paramFormats, int resultFormat)
+{
+	PGresult *res = acl_query(paramLengths, paramValues, paramFormats);
+
+	// answered at once, the mock never keeps a query busy
+	if (conn->pipeline)
+	{
+		if (conn->queued == MOCK_PIPELINE)
+		{
+			PQclear(res);
+			return 0;
+		}
+		conn->queue[conn->queued++] = res;
+	}
+	else
+	{
+		conn->pending = res;
+	}
+	return 1;
+}
+
+int PQsendQuery(PGconn *conn, const char *query)
+{
+	if (!strncmp(query, "LISTEN ", 7))
+	{
+		conn->pending = new_result(PGRES_COMMAND_OK, 0, 0);
+		return 1;
+	}
+
+	// else probes, which always get through
+	conn->pending = new_result(PGRES_TUPLES_OK, 1, 1);
+	conn->pending->values[0] = strdup("1");
+	return 1;
+}
+
+int PQsendQueryParams(PGconn *conn, const char *command, int nParams, const Oid *paramTypes, const char *const *paramValues,
+					  const int *paramLengths, const int *paramFormats, int resultFormat)
+{
+	const char *client_id = nParams ? paramValues[0] : NULL;
+	uint32_t hash;
+	struct mock_rule *rule;
+	char access[16];
+	int count = 0;
+
+	if (client_id == NULL)
+	{
+		conn->stream_pos = 0;
+		return 1;
+	}
+
+	// the rules of client $1; deltas find no client named after a version,
+	// the table never changes
+	hash = mock_hash(client_id);
+	for (rule = buckets[hash % MOCK_BUCKETS]; rule; rule = rule->next)
+	{
+		if (rule->hash == hash && !strcmp(rule->client_id, client_id))
+			count++;
+	}
+
+	conn->pending = new_result(PGRES_TUPLES_OK, 3, count);
+	count = 0;
+	for (rule = buckets[hash % MOCK_BUCKETS]; rule; rule = rule->next)
+	{
+		if (rule->hash == hash && !strcmp(rule->client_id, client_id))
+		{
+			snprintf(access, sizeof(access), "%d", rule->access);
+			conn->pending->values[count * 3] = strdup(rule->client_id);
+			conn->pending->values[count * 3 + 1] = strdup(access);
+			conn->pending->values[count * 3 + 2] = strdup(rule->topic);
+			count++;
+		}
+	}
+	conn->stream_pos = SIZE_MAX;
+	return 1;
+}
+
+int PQsetSingleRowMode(PGconn *conn)
+{
+	return 1;
+}
+
+#ifdef LIBPQ_HAS_PIPELINING
+int PQenterPipelineMode(PGconn *conn)
+{
+	conn->pipeline = true;
+	return 1;
+}
+
+int PQexitPipelineMode(PGconn *conn)
+{
+	if (conn->next < conn->queued)
+		return 0;
+	conn->pipeline = false;
+	conn->separator = false;
+	conn->arrived = false;
+	conn->queued = conn->next = 0;
+	return 1;
+}
+
+int PQpipelineSync(PGconn *conn)
+{
+	if (conn->queued == MOCK_PIPELINE)
+		return 0;
+	conn->queue[conn->queued++] = new_result(PGRES_PIPELINE_SYNC, 0, 0);
+	return 1;
+}
+#endif
+
+PGresult *PQgetResult(PGconn *conn)
+{
+	PGresult *res;
+	char access[16];
+
+#ifdef LIBPQ_HAS_PIPELINING
+	if (conn->pipeline)
+	{
+		if (conn->separator || conn->next == conn->queued)
+		{
+			conn->separator = false;
+			return NULL;
+		}
+		if (!conn->arrived)
+			round_trip();
+		res = conn->queue[conn->next++];
+		conn->separator = res->status != PGRES_PIPELINE_SYNC;
+		conn->arrived = conn->separator;
+		return res;
+	}
+#endif
+
+	if (conn->pending)
+	{
+		round_trip();
+		res = conn->pending;
+		conn->pending = NULL;
+		return res;
+	}
+
+	if (conn->stream_pos == SIZE_MAX)
+		return NULL;
+	if (conn->stream_pos == 0)
+		round_trip();
+
+	if (conn->stream_pos == rule_count)
+	{
+		conn->stream_pos = SIZE_MAX;
+		return new_result(PGRES_TUPLES_OK, 3, 0);
+	}
+
+	struct mock_rule *rule = rule_list[conn->stream_pos++];
+	res = new_result(PGRES_SINGLE_TUPLE, 3, 1);
+	snprintf(access, sizeof(access), "%d", rule->access);
+	res->values[0] = strdup(rule->client_id);
+	res->values[1] = strdup(access);
+	res->values[2] = strdup(rule->topic);
+	return res;
+}
+
+int PQconsumeInput(PGconn *conn)
+{
+	return 1;
+}
+
+PGnotify *PQnotifies(PGconn *conn)
+{
+	return NULL;
+}
+
+ExecStatusType PQresultStatus(const PGresult *res)
+{
+	return res ? res->status : PGRES_FATAL_ERROR;
+}
+
+char *PQresultErrorMessage(const PGresult *res)
+{
+	return "";
+}
+
+int PQntuples(const PGresult *res)
+{
+	return res->ntuples;
+}
+
+int PQnfields(const PGresult *res)
+{
+	return res->nfields;
+}
+
+char *PQgetvalue(const PGresult *res, int tup_num, int field_num)
+{
+	char *value = res->values[tup_num * res->nfields + field_num];
+
+	return value ? value : "";
+}
+
+int PQgetisnull(const PGresult *res, int tup_num, int field_num)
+{
+	return res->values[tup_num * res->nfields + field_num] == NULL;
+}
+
+void PQclear(PGresult *res)
+{
+	if (res == NULL)
+		return;
+	for (int i = 0; i < res->ntuples * res->nfields; i++)
+		free(res->values[i]);
+	free(res->values);
+	free(res);
+}
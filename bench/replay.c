@@ -0,0 +1,494 @@
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <openssl/x509.h>
+
+#include "bench.h"
+#include "trace.h"
+#include "utils.h"
+
+/*
+ * Replay of a trace captured by the plugin (trace_path) through the
+ * callbacks the broker would call, against the stub broker API and the
+ * rules of a local file (acl_backend file), as fast as possible or at the
+ * pace of the capture.
+ *
+ * Clients are presented the way they came in: through the Unix socket
+ * listener, or over TLS with a certificate whose common name is the
+ * username their authentication ended with, the same certificate for the
+ * same name. The broker is ticked every REPLAY_TICK_INTERVAL of trace time.
+ *
+ * Prints the throughput, then per callback the latency percentiles of the
+ * replay next to those of the capture, and the number of results that
+ * differ from the captured ones, so two builds or configurations can be
+ * compared on the same production workload. Expiries go by the clock: at
+ * full speed, the trace's hours fit in the TTLs of its seconds.
+ */
+
+#define REPLAY_OPTION_MAX 64
+#define REPLAY_TICK_INTERVAL 100000000 // ns of trace time between ticks
+#define REPLAY_ADDRESS "192.0.2.1" // of the clients not on the Unix socket
+#define REPLAY_UNIX_SOCKET "/run/mosquitto/replay.sock"
+
+enum replay_kind {
+	REPLAY_AUTH,
+	REPLAY_READ, // the ACL checks, in the order of the MOSQ_ACL_* bits
+	REPLAY_WRITE,
+	REPLAY_SUBSCRIBE,
+	REPLAY_UNSUBSCRIBE,
+	REPLAY_DISCONNECT,
+	REPLAY_KINDS
+};
+
+static const char *const kind_names[REPLAY_KINDS] = { "basic_auth", "acl/read", "acl/write", "acl/subscribe", "acl/unsubscribe", "disconnect" };
+
+struct replay_op {
+	const struct trace_record *record;
+	struct mosquitto *client;
+	const char *username; // in the trace, NULL if none
+	const char *topic;
+	void *certificate; // presented by an authenticating client, NULL if none
+	int kind;
+};
+
+struct replay_stats {
+	long count;
+	long mismatches; // results other than the captured one
+	int64_t *latency; // of the replay, in ns
+	int64_t *captured; // latency of the same callbacks in the trace
+};
+
+// open addressing, keys are strings of the trace
+struct string_map {
+	const char **keys;
+	void **values;
+	size_t mask;
+};
+
+struct replay {
+	unsigned char *data; // the whole trace file
+	const struct trace_file_header *header;
+	struct replay_op *ops;
+	long op_count;
+	long client_count;
+	struct string_map clients; // client id to struct mosquitto
+	struct string_map certificates; // common name to X509
+	void *anonymous; // certificate without a common name, made if needed
+	struct replay_stats stats[REPLAY_KINDS];
+};
+
+static bool paced;
+
+static inline int64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int compare_i64(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static bool map_init(struct string_map *m, long count)
+{
+	size_t slots = 64;
+
+	while (slots < (size_t)count * 2)
+		slots <<= 1;
+	m->keys = calloc(slots, sizeof(char *));
+	m->values = calloc(slots, sizeof(void *));
+	m->mask = slots - 1;
+	return m->keys && m->values;
+}
+
+static void **map_slot(struct string_map *m, const char *key)
+{
+	size_t i = hash_str(key, 0) & m->mask;
+
+	while (m->keys[i] && strcmp(m->keys[i], key))
+		i = (i + 1) & m->mask;
+	m->keys[i] = key;
+	return &m->values[i];
+}
+
+static void map_cleanup(struct string_map *m, void (*free_value)(void *))
+{
+	for (size_t i = 0; m->values && i <= m->mask; i++)
+	{
+		if (m->values[i])
+			free_value(m->values[i]);
+	}
+	free(m->keys);
+	free(m->values);
+}
+
+static void free_certificate(void *cert)
+{
+	X509_free(cert);
+}
+
+static int kind_of(const struct trace_record *record)
+{
+	switch (record->event)
+	{
+	case TRACE_BASIC_AUTH:
+		return REPLAY_AUTH;
+	case TRACE_DISCONNECT:
+		return REPLAY_DISCONNECT;
+	case TRACE_ACL_CHECK:
+		if (record->access && record->access <= MOSQ_ACL_UNSUBSCRIBE && !(record->access & (record->access - 1)))
+			return REPLAY_READ + __builtin_ctz(record->access);
+		return -1;
+	default:
+		return -1;
+	}
+}
+
+static bool read_file(const char *path, unsigned char **data, size_t *size)
+{
+	FILE *f = fopen(path, "rb");
+	long len;
+
+	if (f == NULL || fseek(f, 0, SEEK_END) || (len = ftell(f)) < 0 || fseek(f, 0, SEEK_SET))
+	{
+		if (f)
+			fclose(f);
+		return false;
+	}
+	*data = malloc(len ? len : 1);
+	*size = (size_t)len;
+	if (*data == NULL || fread(*data, 1, *size, f) != *size)
+	{
+		free(*data);
+		fclose(f);
+		return false;
+	}
+	fclose(f);
+	return true;
+}
+
+/*
+ * Read the trace and turn its records into operations on the clients they
+ * name, making their certificates up front.
+ */
+static bool replay_load(struct replay *r, const char *path)
+{
+	size_t size, off;
+	long records = 0, skipped = 0;
+
+	memset(r, 0, sizeof(*r));
+	if (!read_file(path, &r->data, &size))
+	{
+		fprintf(stderr, "%s: reading the trace failed\n", path);
+		return false;
+	}
+	r->header = (const struct trace_file_header *)r->data;
+	if (size < sizeof(*r->header) || memcmp(r->header->magic, TRACE_MAGIC, sizeof(r->header->magic)) || r->header->format != TRACE_FORMAT)
+	{
+		fprintf(stderr, "%s: not a trace of format %d\n", path, TRACE_FORMAT);
+		return false;
+	}
+
+	// records are at least their header, which bounds the count
+	r->ops = calloc((size - sizeof(*r->header)) / sizeof(struct trace_record) + 1, sizeof(struct replay_op));
+	if (r->ops == NULL || !map_init(&r->clients, (long)(size / sizeof(struct trace_record)))
+		|| !map_init(&r->certificates, (long)(size / sizeof(struct trace_record))))
+	{
+		fprintf(stderr, "%s: out of memory\n", path);
+		return false;
+	}
+
+	for (off = sizeof(*r->header); off + sizeof(struct trace_record) <= size; off += ((const struct trace_record *)(r->data + off))->size)
+	{
+		const struct trace_record *record = (const struct trace_record *)(r->data + off);
+		bool has_username = record->username_len != TRACE_NO_USERNAME;
+		size_t strings = (size_t)record->client_id_len + (has_username ? record->username_len : 0) + record->topic_len + 3;
+		struct replay_op *op = &r->ops[r->op_count];
+		const char *str = (const char *)(record + 1);
+		void **slot;
+
+		if (record->size % 8 || record->size < sizeof(*record) + strings || record->size > size - off)
+			break;
+		records++;
+		op->kind = kind_of(record);
+		if (op->kind < 0)
+		{
+			skipped++;
+			continue;
+		}
+
+		op->record = record;
+		op->username = has_username ? str + record->client_id_len + 1 : NULL;
+		op->topic = str + record->client_id_len + (has_username ? record->username_len : 0) + 2;
+
+		slot = map_slot(&r->clients, str);
+		if (*slot == NULL)
+		{
+			struct mosquitto *client = calloc(1, sizeof(struct mosquitto));
+
+			if (client == NULL)
+				return false;
+			client->id = str;
+			client->address = REPLAY_ADDRESS;
+			*slot = client;
+			r->client_count++;
+		}
+		op->client = *slot;
+
+		if (op->kind == REPLAY_AUTH && (record->flags & TRACE_CERTIFICATE) && !(record->flags & TRACE_UNIX_SOCKET))
+		{
+			void **cert = op->username ? map_slot(&r->certificates, op->username) : &r->anonymous;
+
+			if (*cert == NULL)
+				*cert = bench_certificate(op->username, r->op_count + 1);
+			if (*cert == NULL)
+			{
+				fprintf(stderr, "%s: generating a certificate failed\n", path);
+				return false;
+			}
+			op->certificate = *cert;
+		}
+		r->stats[op->kind].count++;
+		r->op_count++;
+	}
+
+	// a capture still being written ends mid-record
+	if (off < size)
+		fprintf(stderr, "%s: truncated at byte %zu\n", path, off);
+
+	for (int k = 0; k < REPLAY_KINDS; k++)
+	{
+		r->stats[k].latency = malloc(sizeof(int64_t) * (r->stats[k].count + 1));
+		r->stats[k].captured = malloc(sizeof(int64_t) * (r->stats[k].count + 1));
+		if (r->stats[k].latency == NULL || r->stats[k].captured == NULL)
+			return false;
+		r->stats[k].count = 0;
+	}
+
+	printf("%s: %ld records of %ld clients over %.1f s, one client in %u traced", path, records, r->client_count,
+		   r->op_count ? (double)(r->ops[r->op_count - 1].record->time - r->ops[0].record->time) / 1e9 : 0.0, r->header->sample);
+	if (skipped)
+		printf(", %ld of unknown events skipped", skipped);
+	printf("\n");
+	return true;
+}
+
+static void replay_cleanup(struct replay *r)
+{
+	map_cleanup(&r->clients, free);
+	map_cleanup(&r->certificates, free_certificate);
+	X509_free(r->anonymous);
+	for (int k = 0; k < REPLAY_KINDS; k++)
+	{
+		free(r->stats[k].latency);
+		free(r->stats[k].captured);
+	}
+	free(r->ops);
+	free(r->data);
+}
+
+static void tick(void)
+{
+	struct mosquitto_evt_tick ed;
+	void *userdata;
+	MOSQ_FUNC_generic_callback cb = bench_callback(MOSQ_EVT_TICK, &userdata);
+
+	memset(&ed, 0, sizeof(ed));
+	if (cb)
+		cb(MOSQ_EVT_TICK, &ed, userdata);
+}
+
+static void wait_until(int64_t deadline)
+{
+	struct timespec ts = { .tv_sec = deadline / 1000000000, .tv_nsec = deadline % 1000000000 };
+
+	while (now_ns() < deadline && clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL))
+		;
+}
+
+static int call(const struct replay_op *op, const char *unix_socket)
+{
+	struct mosquitto *client = op->client;
+	void *userdata;
+
+	client->username = op->username;
+	switch (op->kind)
+	{
+	case REPLAY_AUTH:
+	{
+		struct mosquitto_evt_basic_auth ed;
+		MOSQ_FUNC_generic_callback cb = bench_callback(MOSQ_EVT_BASIC_AUTH, &userdata);
+
+		client->address = (op->record->flags & TRACE_UNIX_SOCKET) ? unix_socket : REPLAY_ADDRESS;
+		client->certificate = op->certificate;
+		memset(&ed, 0, sizeof(ed));
+		ed.client = client;
+		return cb(MOSQ_EVT_BASIC_AUTH, &ed, userdata);
+	}
+	case REPLAY_DISCONNECT:
+	{
+		struct mosquitto_evt_disconnect ed;
+		MOSQ_FUNC_generic_callback cb = bench_callback(MOSQ_EVT_DISCONNECT, &userdata);
+
+		memset(&ed, 0, sizeof(ed));
+		ed.client = client;
+		return cb(MOSQ_EVT_DISCONNECT, &ed, userdata);
+	}
+	default:
+	{
+		struct mosquitto_evt_acl_check ed;
+		MOSQ_FUNC_generic_callback cb = bench_callback(MOSQ_EVT_ACL_CHECK, &userdata);
+
+		memset(&ed, 0, sizeof(ed));
+		ed.client = client;
+		ed.topic = op->topic;
+		ed.access = op->record->access;
+		return cb(MOSQ_EVT_ACL_CHECK, &ed, userdata);
+	}
+	}
+}
+
+static void replay_run(struct replay *r, const char *unix_socket)
+{
+	int64_t origin, elapsed, next_tick = 0;
+	// the capture starts with the plugin, the first sampled event comes later
+	int64_t first = r->op_count ? r->ops[0].record->time : 0;
+
+	origin = now_ns();
+	for (long i = 0; i < r->op_count; i++)
+	{
+		const struct replay_op *op = &r->ops[i];
+		struct replay_stats *stats = &r->stats[op->kind];
+		int64_t start;
+		int rc;
+
+		if (paced)
+			wait_until(origin + op->record->time - first);
+		if (op->record->time >= next_tick)
+		{
+			next_tick = op->record->time + REPLAY_TICK_INTERVAL;
+			tick();
+		}
+
+		start = now_ns();
+		rc = call(op, unix_socket);
+		stats->latency[stats->count] = now_ns() - start;
+		stats->captured[stats->count] = op->record->latency;
+		stats->count++;
+		stats->mismatches += rc != op->record->result;
+	}
+	elapsed = now_ns() - origin;
+	tick();
+
+	printf("replayed %ld events in %.3f s, %.0f events/s%s\n\n", r->op_count, (double)elapsed / 1e9,
+		   elapsed ? (double)r->op_count * 1e9 / (double)elapsed : 0.0, paced ? " at the pace of the capture" : "");
+}
+
+static void print_stats(struct replay *r)
+{
+	printf("%-16s %10s %10s %9s %9s %9s %9s %11s %11s %11s\n", "event", "count", "mismatches", "p50 ns", "p99 ns", "p999 ns", "max ns",
+		   "trace p50", "trace p99", "trace p999");
+	for (int k = 0; k < REPLAY_KINDS; k++)
+	{
+		struct replay_stats *s = &r->stats[k];
+
+		if (s->count == 0)
+			continue;
+		qsort(s->latency, s->count, sizeof(int64_t), compare_i64);
+		qsort(s->captured, s->count, sizeof(int64_t), compare_i64);
+		printf("%-16s %10ld %10ld %9lld %9lld %9lld %9lld %11lld %11lld %11lld\n", kind_names[k], s->count, s->mismatches,
+			   (long long)s->latency[s->count / 2], (long long)s->latency[s->count * 99 / 100], (long long)s->latency[s->count * 999 / 1000],
+			   (long long)s->latency[s->count - 1], (long long)s->captured[s->count / 2], (long long)s->captured[s->count * 99 / 100],
+			   (long long)s->captured[s->count * 999 / 1000]);
+	}
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-t] [-v] [-o key=value]... trace_file rules_file\n"
+					"\n"
+					"Replays `trace_file' through the plugin, its rules read from `rules_file' by the file\n"
+					"backend. -t keeps the pace of the capture, -o adds or overrides a plugin option.\n",
+			prog);
+}
+
+int main(int argc, char *argv[])
+{
+	static mosquitto_plugin_id_t *identifier;
+	struct mosquitto_opt options[REPLAY_OPTION_MAX];
+	const char *unix_socket = REPLAY_UNIX_SOCKET;
+	int option_count = 0, opt, rc = 0;
+	struct replay r;
+	void *data = NULL;
+
+	options[option_count++] = (struct mosquitto_opt){ .key = "acl_backend", .value = "file" };
+	options[option_count++] = (struct mosquitto_opt){ .key = "acl_file_path", .value = NULL };
+	options[option_count++] = (struct mosquitto_opt){ .key = "unixsocket_path", .value = REPLAY_UNIX_SOCKET };
+	options[option_count++] = (struct mosquitto_opt){ .key = "metrics_interval", .value = "0" };
+
+	while ((opt = getopt(argc, argv, "to:vh")) != -1)
+	{
+		char *eq;
+
+		switch (opt)
+		{
+		case 't':
+			paced = true;
+			break;
+		case 'o':
+			eq = strchr(optarg, '=');
+			if (eq == NULL || option_count == REPLAY_OPTION_MAX)
+			{
+				usage(argv[0]);
+				return 1;
+			}
+			*eq = '\0';
+			// the later of the same option wins
+			options[option_count++] = (struct mosquitto_opt){ .key = optarg, .value = eq + 1 };
+			if (!strcmp(optarg, "unixsocket_path"))
+				unix_socket = eq + 1;
+			break;
+		case 'v':
+			bench_verbose = true;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (argc - optind != 2)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+	options[1].value = argv[optind + 1];
+
+	if (!replay_load(&r, argv[optind]))
+	{
+		replay_cleanup(&r);
+		return 1;
+	}
+
+	if (mosquitto_plugin_init(identifier, &data, options, option_count) != MOSQ_ERR_SUCCESS)
+	{
+		fprintf(stderr, "initializing the plugin failed\n");
+		rc = 1;
+	}
+	else
+	{
+		replay_run(&r, unix_socket);
+		mosquitto_plugin_cleanup(data, options, option_count);
+		print_stats(&r);
+	}
+
+	replay_cleanup(&r);
+	return rc;
+}
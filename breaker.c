@@ -0,0 +1,52 @@
+#include "breaker.h"
+#include "utils.h"
+
+void breaker_init(struct breaker *b, int threshold, int64_t slow_ms, int64_t cooldown_ms)
+{
+	memset(b, 0, sizeof(*b));
+	b->threshold = threshold;
+	b->slow_ns = slow_ms * 1000000;
+	b->cooldown_ms = cooldown_ms;
+}
+
+/*
+ * Record the outcome of a query. Returns true when it opened the breaker.
+ */
+bool breaker_record(struct breaker *b, bool failed, int64_t latency_ns)
+{
+	if (b->threshold == 0 || b->open)
+		return false;
+
+	failed |= b->slow_ns > 0 && latency_ns > b->slow_ns;
+	b->failures = (b->failures << 1) | failed;
+	if (b->samples < BREAKER_WINDOW)
+		b->samples++;
+
+	if (b->samples < BREAKER_MIN_SAMPLES || __builtin_popcount(b->failures) * 100 < b->threshold * b->samples)
+		return false;
+
+	b->open = true;
+	b->next_probe = mono_time_ms() + b->cooldown_ms;
+	return true;
+}
+
+/*
+ * Whether an open breaker is due for its next probe, which is then
+ * scheduled one cooldown later.
+ */
+bool breaker_probe_due(struct breaker *b)
+{
+	int64_t now = mono_time_ms();
+
+	if (!b->open || now < b->next_probe)
+		return false;
+	b->next_probe = now + b->cooldown_ms;
+	return true;
+}
+
+void breaker_close(struct breaker *b)
+{
+	b->open = false;
+	b->failures = 0;
+	b->samples = 0;
+}
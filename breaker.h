@@ -0,0 +1,34 @@
+#ifndef __BREAKER_H__
+#define __BREAKER_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define BREAKER_WINDOW 32 // last ACL queries the failure rate is taken over
+#define BREAKER_MIN_SAMPLES 10 // queries in the window before it can trip
+
+/*
+ * Circuit breaker around the ACL queries. Each query is recorded as failed
+ * when it errors, times out, finds no connection or takes longer than
+ * `slow_ns'. Once at least `threshold' percent of the last BREAKER_WINDOW
+ * queries failed, the breaker opens: checks stop querying the database and
+ * are answered from the last known rules or the fallback decision, while a
+ * probe is sent every `cooldown_ms' from the tick. The first probe that
+ * succeeds closes it again.
+ */
+struct breaker {
+	int threshold; // percent of failed queries that opens the breaker, 0 disables it
+	int64_t slow_ns; // queries slower than this count as failed, 0 if only errors do
+	int64_t cooldown_ms; // ms between probes while open
+	uint32_t failures; // one bit per query in the window, set if it failed, newest in bit 0
+	int samples; // queries in the window
+	bool open;
+	int64_t next_probe; // monotonic ms of the next probe while open
+};
+
+void breaker_init(struct breaker *b, int threshold, int64_t slow_ms, int64_t cooldown_ms);
+bool breaker_record(struct breaker *b, bool failed, int64_t latency_ns);
+bool breaker_probe_due(struct breaker *b);
+void breaker_close(struct breaker *b);
+
+#endif//__BREAKER_H__
@@ -0,0 +1,164 @@
+#include <string.h>
+
+#include "cert_cache.h"
+#include "mosquitto_broker.h"
+
+static struct cert_identity *bucket_of(struct cert_cache *cache, const struct cert_key *key)
+{
+	size_t n = key->len < sizeof(uint64_t) ? key->len : sizeof(uint64_t);
+	uint64_t h = 0;
+
+	// a signature ends in random looking bytes, its DER header does not
+	memcpy(&h, key->data + key->len - n, n);
+	return &cache->slots[(h & cache->bucket_mask) * CERT_CACHE_WAYS];
+}
+
+static bool same_key(const struct cert_identity *identity, const struct cert_key *key)
+{
+	return identity->signature && identity->signature_len == key->len && !memcmp(identity->signature, key->data, key->len);
+}
+
+static void identity_clear(struct cert_identity *identity)
+{
+	mosquitto_free(identity->signature);
+	mosquitto_free(identity->client_id);
+	memset(identity, 0, sizeof(*identity));
+}
+
+int cert_cache_init(struct cert_cache *cache, size_t max_entries)
+{
+	size_t bucket_count = 1;
+
+	memset(cache, 0, sizeof(*cache));
+	if (max_entries == 0)
+		return MOSQ_ERR_SUCCESS;
+
+	while (bucket_count * CERT_CACHE_WAYS < max_entries)
+		bucket_count <<= 1;
+
+	cache->slots = mosquitto_calloc(bucket_count * CERT_CACHE_WAYS, sizeof(struct cert_identity));
+	if (cache->slots == NULL)
+		return MOSQ_ERR_NOMEM;
+	cache->bucket_mask = bucket_count - 1;
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+void cert_cache_cleanup(struct cert_cache *cache)
+{
+	if (cache->slots)
+	{
+		for (size_t i = 0; i < (cache->bucket_mask + 1) * CERT_CACHE_WAYS; i++)
+			identity_clear(&cache->slots[i]);
+		mosquitto_free(cache->slots);
+	}
+	memset(cache, 0, sizeof(*cache));
+}
+
+bool cert_cache_enabled(const struct cert_cache *cache)
+{
+	return cache->slots != NULL;
+}
+
+/*
+ * Point `key' at the signature of `cert', valid as long as the certificate.
+ */
+bool cert_cache_key(X509 *cert, struct cert_key *key)
+{
+	const ASN1_BIT_STRING *signature;
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	signature = cert->signature;
+#else
+	X509_get0_signature(&signature, NULL, cert);
+#endif
+	if (signature == NULL || ASN1_STRING_length(signature) <= 0)
+		return false;
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	key->data = ASN1_STRING_data((ASN1_STRING *)signature);
+#else
+	key->data = ASN1_STRING_get0_data(signature);
+#endif
+	key->len = ASN1_STRING_length(signature);
+	return true;
+}
+
+struct cert_identity *cert_cache_get(struct cert_cache *cache, const struct cert_key *key)
+{
+	struct cert_identity *slot;
+
+	if (cache->slots == NULL)
+		return NULL;
+
+	slot = bucket_of(cache, key);
+	for (int way = 0; way < CERT_CACHE_WAYS; way++, slot++)
+	{
+		if (same_key(slot, key))
+		{
+			slot->used = ++cache->tick;
+			cache->hits++;
+			return slot;
+		}
+	}
+	cache->misses++;
+	return NULL;
+}
+
+/*
+ * Remember the common name of the certificate with `key', in place of the
+ * least recently used identity of its bucket. Returns the new identity, or
+ * NULL if the cache is disabled or out of memory.
+ */
+struct cert_identity *cert_cache_put(struct cert_cache *cache, const struct cert_key *key, const char *common_name)
+{
+	struct cert_identity *slot, *victim;
+	size_t name_len = strlen(common_name) + 1;
+	unsigned char *block;
+
+	if (cache->slots == NULL)
+		return NULL;
+
+	block = mosquitto_malloc(key->len + name_len);
+	if (block == NULL)
+		return NULL;
+	memcpy(block, key->data, key->len);
+	memcpy(block + key->len, common_name, name_len);
+
+	slot = victim = bucket_of(cache, key);
+	for (int way = 0; way < CERT_CACHE_WAYS; way++, slot++)
+	{
+		if (slot->signature == NULL || same_key(slot, key))
+		{
+			victim = slot;
+			break;
+		}
+		if (slot->used < victim->used)
+			victim = slot;
+	}
+
+	if (victim->signature == NULL)
+		cache->entry_count++;
+	identity_clear(victim);
+	victim->signature = block;
+	victim->signature_len = key->len;
+	victim->common_name = (char *)block + key->len;
+	victim->used = ++cache->tick;
+	return victim;
+}
+
+/*
+ * Whether `client_id' is part of the identity's common name, found out
+ * once per client id. A new client id also forgets the rules prefetched
+ * for the previous one.
+ */
+bool cert_identity_match(struct cert_identity *identity, const char *client_id)
+{
+	if (identity->client_id && !strcmp(identity->client_id, client_id))
+		return identity->client_id_match;
+
+	mosquitto_free(identity->client_id);
+	identity->client_id = mosquitto_strdup(client_id);
+	identity->client_id_match = strstr(identity->common_name, client_id) != NULL;
+	identity->prefetch_expires = 0;
+	return identity->client_id_match;
+}
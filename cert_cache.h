@@ -0,0 +1,67 @@
+#ifndef __CERT_CACHE_H__
+#define __CERT_CACHE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <openssl/x509.h>
+
+/*
+ * Bounded cache of the identities read from client certificates, so that a
+ * device reconnecting with the certificate it used before skips parsing its
+ * subject.
+ *
+ * Identities are keyed by the certificate's signature: the broker's TLS
+ * layer verified it before authentication, so two certificates getting this
+ * far with the same signature were signed over the same contents, and the
+ * common name of a key cannot change; entries need no expiry. The signature
+ * is compared in full rather than through a fingerprint: it is at hand,
+ * where a SHA-256 of it or of the DER certificate costs more than reading
+ * the subject the cache saves. Signatures are as uniform as a digest, so
+ * their last bytes pick the bucket, one of a fixed table of
+ * CERT_CACHE_WAYS-way buckets, a full bucket replacing its least recently
+ * used identity.
+ *
+ * An identity also remembers the client id last checked against its common
+ * name and the result, and when the client's rules were last prefetched,
+ * so a reconnect inside the ACL cache TTL does not prefetch them again.
+ */
+#define CERT_CACHE_WAYS 4
+
+// signature of a certificate, pointing into it
+struct cert_key {
+	const unsigned char *data;
+	size_t len;
+};
+
+struct cert_identity {
+	unsigned char *signature; // the key, NULL when the slot is free
+	size_t signature_len;
+	uint64_t used; // cache tick of the last lookup
+	char *common_name; // stored after the signature, in the same block
+	char *client_id; // last client id checked against the common name, NULL if none
+	bool client_id_match; // `client_id' is part of the common name
+	uint64_t prefetch_generation; // ACL generation the client's rules were prefetched in
+	int64_t prefetch_expires; // monotonic time the prefetched rules expire at in ms, 0 if none
+};
+
+struct cert_cache {
+	struct cert_identity *slots; // bucket_mask + 1 buckets of CERT_CACHE_WAYS slots, NULL if disabled
+	size_t bucket_mask; // bucket count - 1, bucket count is a power of two
+	size_t entry_count;
+	uint64_t tick; // counts lookups, orders the identities of a bucket by recency
+	uint64_t hits;
+	uint64_t misses;
+};
+
+int cert_cache_init(struct cert_cache *cache, size_t max_entries);
+void cert_cache_cleanup(struct cert_cache *cache);
+bool cert_cache_enabled(const struct cert_cache *cache);
+
+bool cert_cache_key(X509 *cert, struct cert_key *key);
+struct cert_identity *cert_cache_get(struct cert_cache *cache, const struct cert_key *key);
+struct cert_identity *cert_cache_put(struct cert_cache *cache, const struct cert_key *key, const char *common_name);
+bool cert_identity_match(struct cert_identity *identity, const char *client_id);
+
+#endif//__CERT_CACHE_H__
@@ -0,0 +1,540 @@
+#include "client_state.h"
+#include "utils.h"
+#include "mosquitto_broker.h"
+
+#define CLIENT_ALIGN sizeof(void *)
+
+static struct client_block *block_get(struct client_table *table, size_t size)
+{
+	struct client_block *block;
+
+	if (size <= CLIENT_BLOCK_SIZE && table->idle)
+	{
+		block = table->idle;
+		table->idle = block->next;
+		table->idle_count--;
+	}
+	else
+	{
+		size = size > CLIENT_BLOCK_SIZE ? size : CLIENT_BLOCK_SIZE;
+		block = mosquitto_malloc(sizeof(*block) + size);
+		if (block == NULL)
+			return NULL;
+		block->size = size;
+	}
+
+	block->next = NULL;
+	block->used = 0;
+	table->block_count++;
+	return block;
+}
+
+static void blocks_release(struct client_table *table, struct client_block *block)
+{
+	struct client_block *next;
+
+	for (; block; block = next)
+	{
+		next = block->next;
+		table->block_count--;
+		if (block->size == CLIENT_BLOCK_SIZE && table->idle_count < CLIENT_IDLE_MAX)
+		{
+			block->next = table->idle;
+			table->idle = block;
+			table->idle_count++;
+		}
+		else
+		{
+			mosquitto_free(block);
+		}
+	}
+}
+
+/*
+ * Bump allocate `size' bytes from the arena, adding a block in front of it
+ * when the current one is full.
+ */
+static void *arena_alloc(struct client_table *table, struct client_block **arena, size_t size)
+{
+	struct client_block *block = *arena;
+	size_t offset = block ? (block->used + CLIENT_ALIGN - 1) & ~(CLIENT_ALIGN - 1) : 0;
+
+	if (block == NULL || offset + size > block->size)
+	{
+		block = block_get(table, size);
+		if (block == NULL)
+			return NULL;
+		block->next = *arena;
+		*arena = block;
+		offset = 0;
+	}
+
+	block->used = offset + size;
+	return block->data + offset;
+}
+
+static char *arena_strdup(struct client_table *table, struct client_block **arena, const char *s)
+{
+	size_t len = strlen(s) + 1;
+	char *copy = arena_alloc(table, arena, len);
+
+	if (copy)
+		memcpy(copy, s, len);
+	return copy;
+}
+
+int client_table_init(struct client_table *table, int64_t grant_ttl_ms, bool memo)
+{
+	memset(table, 0, sizeof(*table));
+	table->grant_ttl_ms = grant_ttl_ms > 0 ? grant_ttl_ms : 0;
+	table->memo = memo;
+
+	table->buckets = mosquitto_calloc(64, sizeof(struct client_state *));
+	if (table->buckets == NULL)
+		return MOSQ_ERR_NOMEM;
+	table->bucket_mask = 63;
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+static void state_free(struct client_table *table, struct client_state *state)
+{
+	// the state heads its own block, see client_table_add()
+	struct client_block *head = (struct client_block *)((char *)state - offsetof(struct client_block, data));
+
+	topic_trie_free(state->grant_trie);
+	blocks_release(table, state->memo);
+	blocks_release(table, state->arena);
+	blocks_release(table, head);
+}
+
+void client_table_cleanup(struct client_table *table)
+{
+	struct client_state *state, *next;
+	struct client_block *block;
+
+	if (table->buckets)
+	{
+		for (size_t i = 0; i <= table->bucket_mask; i++)
+		{
+			for (state = table->buckets[i]; state; state = next)
+			{
+				next = state->hash_next;
+				state_free(table, state);
+			}
+		}
+		mosquitto_free(table->buckets);
+		table->buckets = NULL;
+	}
+
+	while ((block = table->idle) != NULL)
+	{
+		table->idle = block->next;
+		mosquitto_free(block);
+	}
+	table->idle_count = 0;
+	table->count = 0;
+}
+
+static void grow(struct client_table *table)
+{
+	size_t bucket_count = (table->bucket_mask + 1) * 2;
+	struct client_state **buckets = mosquitto_calloc(bucket_count, sizeof(struct client_state *));
+	struct client_state *state, *next;
+
+	// a failed resize only makes the chains longer
+	if (buckets == NULL)
+		return;
+
+	for (size_t i = 0; i <= table->bucket_mask; i++)
+	{
+		for (state = table->buckets[i]; state; state = next)
+		{
+			next = state->hash_next;
+			state->hash_next = buckets[state->hash & (bucket_count - 1)];
+			buckets[state->hash & (bucket_count - 1)] = state;
+		}
+	}
+	mosquitto_free(table->buckets);
+	table->buckets = buckets;
+	table->bucket_mask = bucket_count - 1;
+}
+
+static struct client_state **find_link(struct client_table *table, const char *client_id, uint32_t hash)
+{
+	struct client_state **link = &table->buckets[hash & table->bucket_mask];
+
+	while (*link && ((*link)->hash != hash || strcmp((*link)->client_id, client_id)))
+		link = &(*link)->hash_next;
+	return link;
+}
+
+/*
+ * Create the state of a client that has just authenticated on the
+ * connection `client', replacing the one of a connection it takes over.
+ */
+struct client_state *client_table_add(struct client_table *table, const void *client, const char *client_id, const char *username)
+{
+	uint32_t hash = hash_str(client_id, 0);
+	struct client_state **link = find_link(table, client_id, hash);
+	size_t id_len = strlen(client_id) + 1, username_len = username ? strlen(username) + 1 : 0;
+	struct client_state *state;
+	struct client_block *head;
+
+	if (*link)
+	{
+		state = *link;
+		*link = state->hash_next;
+		state_free(table, state);
+		table->count--;
+	}
+
+	// the state and its keys head a block of their own, never moved nor freed before the state
+	head = block_get(table, sizeof(*state) + id_len + username_len);
+	if (head == NULL)
+		return NULL;
+	state = (struct client_state *)head->data;
+	memset(state, 0, sizeof(*state));
+	head->used = sizeof(*state) + id_len + username_len;
+
+	state->hash = hash;
+	state->client = client;
+	state->client_id = memcpy(head->data + sizeof(*state), client_id, id_len);
+	state->username = username ? memcpy(head->data + sizeof(*state) + id_len, username, username_len) : NULL;
+
+	if (table->count >= table->bucket_mask + 1)
+	{
+		grow(table);
+	}
+	link = &table->buckets[hash & table->bucket_mask];
+	state->hash_next = *link;
+	*link = state;
+	table->count++;
+
+	return state;
+}
+
+/*
+ * The state of `client_id' when it is the one of the connection `client'.
+ */
+struct client_state *client_table_find(struct client_table *table, const void *client, const char *client_id)
+{
+	struct client_state *state;
+
+	if (client_id == NULL)
+		return NULL;
+
+	state = *find_link(table, client_id, hash_str(client_id, 0));
+	return state && state->client == client ? state : NULL;
+}
+
+void client_table_remove(struct client_table *table, const void *client, const char *client_id)
+{
+	struct client_state **link, *state;
+
+	if (client_id == NULL)
+		return;
+
+	link = find_link(table, client_id, hash_str(client_id, 0));
+	state = *link;
+	if (state && state->client == client)
+	{
+		*link = state->hash_next;
+		state_free(table, state);
+		table->count--;
+	}
+}
+
+/*
+ * Whether clients get a state at all, for their grants or decision memo.
+ */
+bool client_table_enabled(const struct client_table *table)
+{
+	return client_grants_enabled(table) || client_memo_enabled(table);
+}
+
+bool client_grants_enabled(const struct client_table *table)
+{
+	return table->grant_ttl_ms > 0;
+}
+
+/*
+ * Move the grants left to a fresh arena, dropping the bytes of the ones
+ * removed since the last time, and compile them again.
+ */
+static bool rebuild_grants(struct client_table *table, struct client_state *state)
+{
+	struct client_block *arena = NULL;
+	struct topic_trie *trie = NULL;
+	const char **grants = NULL;
+	int cap = state->grant_count;
+
+	if (cap > 0)
+	{
+		grants = arena_alloc(table, &arena, sizeof(char *) * cap);
+		trie = topic_trie_new();
+		if (grants == NULL || trie == NULL)
+			goto fail;
+	}
+
+	for (int i = 0; i < state->grant_count; i++)
+	{
+		grants[i] = arena_strdup(table, &arena, state->grants[i]);
+		if (grants[i] == NULL || topic_trie_add(trie, grants[i]) != MOSQ_ERR_SUCCESS)
+			goto fail;
+	}
+
+	topic_trie_free(state->grant_trie);
+	blocks_release(table, state->arena);
+	state->arena = arena;
+	state->grants = grants;
+	state->grant_cap = cap;
+	state->grant_trie = trie;
+	state->wasted = 0;
+	return true;
+
+fail:
+	topic_trie_free(trie);
+	blocks_release(table, arena);
+	return false;
+}
+
+static void drop_grants(struct client_table *table, struct client_state *state)
+{
+	for (int i = 0; i < state->grant_count; i++)
+		state->wasted += strlen(state->grants[i]) + 1;
+	state->grant_count = 0;
+	topic_trie_free(state->grant_trie);
+	state->grant_trie = NULL;
+}
+
+/*
+ * Whether a subscription granted to the client in full matches `topic'.
+ * Grants older than the table's TTL are dropped instead.
+ */
+bool client_grants_match(struct client_table *table, struct client_state *state, const char *topic)
+{
+	if (state->grant_trie == NULL)
+		return false;
+
+	if (state->grants_expire <= mono_time_ms())
+	{
+		drop_grants(table, state);
+		return false;
+	}
+	return topic_trie_match(state->grant_trie, topic);
+}
+
+/*
+ * Grant the subscription `filter' in full, which restarts the grants' TTL.
+ * Returns false when it could not be added, the client having too many.
+ */
+bool client_grant_add(struct client_table *table, struct client_state *state, const char *filter)
+{
+	if (!client_grants_enabled(table) || state->grant_count >= CLIENT_GRANTS_MAX)
+		return false;
+
+	for (int i = 0; i < state->grant_count; i++)
+	{
+		if (!strcmp(state->grants[i], filter))
+			return true;
+	}
+
+	if (state->wasted >= CLIENT_BLOCK_SIZE && !rebuild_grants(table, state))
+		return false;
+
+	if (state->grant_count == state->grant_cap)
+	{
+		int cap = state->grant_cap ? state->grant_cap * 2 : 4;
+		const char **grants = arena_alloc(table, &state->arena, sizeof(char *) * cap);
+
+		if (grants == NULL)
+			return false;
+		if (state->grant_count > 0)
+			memcpy(grants, state->grants, sizeof(char *) * state->grant_count);
+		state->wasted += sizeof(char *) * state->grant_cap;
+		state->grants = grants;
+		state->grant_cap = cap;
+	}
+
+	const char *copy = arena_strdup(table, &state->arena, filter);
+	if (copy == NULL)
+		return false;
+	if (state->grant_trie == NULL)
+	{
+		state->grant_trie = topic_trie_new();
+		if (state->grant_trie == NULL)
+			return false;
+	}
+	if (topic_trie_add(state->grant_trie, copy) != MOSQ_ERR_SUCCESS)
+	{
+		// the trie may hold part of it, start again from the grants
+		rebuild_grants(table, state);
+		return false;
+	}
+
+	state->grants[state->grant_count++] = copy;
+	state->grants_expire = mono_time_ms() + table->grant_ttl_ms;
+	return true;
+}
+
+void client_grant_remove(struct client_table *table, struct client_state *state, const char *filter)
+{
+	for (int i = 0; i < state->grant_count; i++)
+	{
+		if (strcmp(state->grants[i], filter))
+			continue;
+
+		state->wasted += strlen(filter) + 1;
+		memmove(&state->grants[i], &state->grants[i + 1], sizeof(char *) * (state->grant_count - i - 1));
+		state->grant_count--;
+
+		// the trie cannot forget a pattern, it is compiled again
+		if (!rebuild_grants(table, state))
+			drop_grants(table, state);
+		return;
+	}
+}
+
+/*
+ * Drop the grants of `client_id', or of every client when NULL, e.g. after
+ * their permissions have changed.
+ */
+void client_table_drop_grants(struct client_table *table, const char *client_id)
+{
+	struct client_state *state;
+
+	if (client_id)
+	{
+		state = *find_link(table, client_id, hash_str(client_id, 0));
+		if (state)
+			drop_grants(table, state);
+		return;
+	}
+
+	for (size_t i = 0; i <= table->bucket_mask; i++)
+	{
+		for (state = table->buckets[i]; state; state = state->hash_next)
+			drop_grants(table, state);
+	}
+}
+
+bool client_memo_enabled(const struct client_table *table)
+{
+	return table->memo;
+}
+
+/*
+ * The slot holding the decision on `topic' for `access', or else the one it
+ * would go to: an empty slot, an expired one or the one the key hashes to.
+ */
+static struct client_memo_slot *memo_slot(struct client_block *memo, int access, const char *topic, size_t len,
+										  uint32_t hash, int64_t now, bool *found)
+{
+	struct client_memo_slot *slots = (struct client_memo_slot *)memo->data, *free_slot = NULL;
+
+	*found = false;
+	for (size_t i = 0; i < CLIENT_MEMO_SLOTS; i++)
+	{
+		struct client_memo_slot *slot = &slots[(hash + i) & (CLIENT_MEMO_SLOTS - 1)];
+
+		// slots are only ever emptied all at once, an empty one ends the probe
+		if (slot->access == 0)
+			return free_slot ? free_slot : slot;
+		if (slot->hash == hash && slot->access == access && slot->len == len && !memcmp(slot->topic, topic, len))
+		{
+			*found = true;
+			return slot;
+		}
+		if (free_slot == NULL && slot->expires <= now)
+			free_slot = slot;
+	}
+	return free_slot ? free_slot : &slots[hash & (CLIENT_MEMO_SLOTS - 1)];
+}
+
+/*
+ * Whether a decision on `topic' for `access' is memoized and still holds,
+ * in which case it is stored in `allow'.
+ */
+bool client_memo_get(struct client_state *state, int access, const char *topic, bool *allow)
+{
+	size_t len = strlen(topic);
+	struct client_memo_slot *slot;
+	int64_t now;
+	bool found;
+
+	if (state->memo == NULL || len > CLIENT_MEMO_TOPIC_MAX)
+		return false;
+
+	now = mono_time_ms();
+	slot = memo_slot(state->memo, access, topic, len, hash_bytes(topic, len, (uint32_t)access), now, &found);
+	if (!found || slot->expires <= now)
+		return false;
+
+	*allow = slot->allow;
+	return true;
+}
+
+/*
+ * Memoize the decision on `topic' for `access', made from rules holding
+ * until `expires'.
+ */
+void client_memo_put(struct client_table *table, struct client_state *state, int access, const char *topic, bool allow, int64_t expires)
+{
+	size_t len = strlen(topic);
+	uint32_t hash = hash_bytes(topic, len, (uint32_t)access);
+	struct client_memo_slot *slot;
+	bool found;
+
+	if (!table->memo || len > CLIENT_MEMO_TOPIC_MAX || expires <= mono_time_ms())
+		return;
+
+	if (state->memo == NULL)
+	{
+		state->memo = block_get(table, CLIENT_BLOCK_SIZE);
+		if (state->memo == NULL)
+			return;
+		memset(state->memo->data, 0, CLIENT_BLOCK_SIZE);
+		state->memo->used = CLIENT_BLOCK_SIZE;
+	}
+
+	slot = memo_slot(state->memo, access, topic, len, hash, mono_time_ms(), &found);
+	slot->expires = expires;
+	slot->hash = hash;
+	slot->access = (uint8_t)access;
+	slot->allow = allow;
+	slot->len = (uint16_t)len;
+	memcpy(slot->topic, topic, len);
+}
+
+static void drop_memo(struct client_table *table, struct client_state *state)
+{
+	blocks_release(table, state->memo);
+	state->memo = NULL;
+}
+
+/*
+ * Forget the decisions made for `client_id', or for every client when NULL,
+ * once the rules they were made from have changed.
+ */
+void client_table_drop_memo(struct client_table *table, const char *client_id)
+{
+	struct client_state *state;
+
+	if (!table->memo)
+		return;
+
+	if (client_id)
+	{
+		state = *find_link(table, client_id, hash_str(client_id, 0));
+		if (state)
+			drop_memo(table, state);
+		return;
+	}
+
+	for (size_t i = 0; i <= table->bucket_mask; i++)
+	{
+		for (state = table->buckets[i]; state; state = state->hash_next)
+			drop_memo(table, state);
+	}
+}
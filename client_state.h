@@ -0,0 +1,105 @@
+#ifndef __CLIENT_STATE_H__
+#define __CLIENT_STATE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "topic_trie.h"
+
+#define CLIENT_BLOCK_SIZE 512 // bytes of a client's arena block, the unit memory is pooled in
+#define CLIENT_IDLE_MAX 4096 // free blocks kept for the next clients, the rest go back to the heap
+#define CLIENT_GRANTS_MAX 256 // subscriptions granted per client, later ones are checked in full
+#define CLIENT_MEMO_TOPIC_MAX 48 // bytes of a topic whose decision is memoized, longer ones are checked in full
+
+/*
+ * State of the connected clients, from their authentication to their
+ * disconnection: the subscriptions whose messages they may read in full,
+ * and the decisions last made on the concrete topics they use.
+ *
+ * Whatever a state holds is bump allocated from its own arena, a chain of
+ * CLIENT_BLOCK_SIZE blocks released as a whole when the client goes, so
+ * nothing is freed piecemeal and nothing outlives the connection. Blocks
+ * are all the same size and released ones are kept for the next clients,
+ * up to CLIENT_IDLE_MAX of them: connection churn neither fragments the
+ * heap nor goes through the allocator. Only data larger than a block gets
+ * a block of its own from the heap. Dropping grants leaves their bytes in
+ * the arena until it is rebuilt, which happens once they would fill a
+ * block.
+ *
+ * States are found by client id, and also carry the broker's context of
+ * the connection: a client taking over the session of another replaces its
+ * state, and the events of the old connection then find no state of theirs.
+ *
+ * The decision memo is a block of its own, an open addressed table of
+ * CLIENT_MEMO_SLOTS slots keyed by topic hash and access type, taken on the
+ * first decision and released whenever the client's rules change: a check
+ * repeated on the same topic is then one hash and one compare. A decision
+ * holds until the rules it came from expire; a full table replaces the
+ * entry its key hashes to.
+ */
+struct client_block {
+	struct client_block *next;
+	size_t size; // bytes of `data'
+	size_t used;
+	char data[];
+};
+
+struct client_memo_slot {
+	int64_t expires; // monotonic time the decision no longer holds at, in ms
+	uint32_t hash; // of the topic, seeded with the access type
+	uint8_t access; // MOSQ_ACL_* access type, 0 for an empty slot
+	bool allow;
+	uint16_t len;
+	char topic[CLIENT_MEMO_TOPIC_MAX]; // not NUL terminated
+};
+
+#define CLIENT_MEMO_SLOTS (CLIENT_BLOCK_SIZE / sizeof(struct client_memo_slot)) // a power of two
+
+struct client_state {
+	struct client_state *hash_next; // next state in the same bucket
+	uint32_t hash; // hash of client_id
+	const void *client; // broker's context of the connection
+	const char *client_id; // in the arena, as everything below
+	const char *username; // may be NULL
+	struct client_block *arena; // block allocated from first
+	size_t wasted; // arena bytes of dropped grants
+	int grant_count;
+	int grant_cap;
+	const char **grants; // subscriptions granted in full
+	struct topic_trie *grant_trie; // `grants' compiled for matching, NULL if none
+	int64_t grants_expire; // monotonic time the grants are dropped at, in ms
+	struct client_block *memo; // CLIENT_MEMO_SLOTS decisions, NULL until the first one
+};
+
+struct client_table {
+	struct client_state **buckets;
+	size_t bucket_mask; // bucket count - 1, bucket count is a power of two
+	size_t count;
+	int64_t grant_ttl_ms; // 0 disables grants
+	bool memo; // decisions are memoized
+	struct client_block *idle; // released blocks of CLIENT_BLOCK_SIZE
+	size_t idle_count;
+	size_t block_count; // blocks held by clients
+};
+
+int client_table_init(struct client_table *table, int64_t grant_ttl_ms, bool memo);
+void client_table_cleanup(struct client_table *table);
+
+struct client_state *client_table_add(struct client_table *table, const void *client, const char *client_id, const char *username);
+struct client_state *client_table_find(struct client_table *table, const void *client, const char *client_id);
+void client_table_remove(struct client_table *table, const void *client, const char *client_id);
+bool client_table_enabled(const struct client_table *table);
+
+bool client_grants_enabled(const struct client_table *table);
+bool client_grants_match(struct client_table *table, struct client_state *state, const char *topic);
+bool client_grant_add(struct client_table *table, struct client_state *state, const char *filter);
+void client_grant_remove(struct client_table *table, struct client_state *state, const char *filter);
+void client_table_drop_grants(struct client_table *table, const char *client_id);
+
+bool client_memo_enabled(const struct client_table *table);
+bool client_memo_get(struct client_state *state, int access, const char *topic, bool *allow);
+void client_memo_put(struct client_table *table, struct client_state *state, int access, const char *topic, bool allow, int64_t expires);
+void client_table_drop_memo(struct client_table *table, const char *client_id);
+
+#endif//__CLIENT_STATE_H__
@@ -0,0 +1,676 @@
+#include <arpa/inet.h>
+#include <poll.h>
+#include <stdint.h>
+
+#include "db.h"
+#include "utils.h"
+#include "mosquitto_broker.h"
+
+// type OIDs from catalog/pg_type.h, which is not part of the libpq headers
+#define NAMEOID 19
+#define INT8OID 20
+#define INT2OID 21
+#define INT4OID 23
+#define TEXTOID 25
+#define BPCHAROID 1042
+#define VARCHAROID 1043
+
+static bool is_text_type(Oid type)
+{
+	return type == TEXTOID || type == VARCHAROID || type == BPCHAROID || type == NAMEOID;
+}
+
+static bool is_int_type(Oid type)
+{
+	return type == INT2OID || type == INT4OID || type == INT8OID;
+}
+
+// whether parameter `i' of the ACL statement is the access type, else the client id
+static bool is_access_param(const struct db_acl_statement *stmt, int i)
+{
+	return (i == 0) == stmt->access_first;
+}
+
+static bool is_conversion(char c)
+{
+	return c == 's' || c == 'd' || c == 'i' || c == 'u';
+}
+
+/*
+ * Turn the printf style db_aclquery into a parameterized statement: %s (the
+ * client id) and %d (the access type) become $1 and $2 in the order they
+ * first appear, `access_first' being set when %d comes first, so that a
+ * query only using %d takes the access type as $1. Quotes around a
+ * placeholder are dropped as the value is no longer spliced into the SQL,
+ * and %% is unescaped. Returns a new malloc'd string, or NULL, the problem
+ * logged, if the query holds any other conversion or a placeholder inside a
+ * larger string literal, e.g. LIKE '%s/%%', which a parameter cannot fill.
+ */
+char *db_format_acl_query(const char *query, bool *access_first)
+{
+	// each two character conversion becomes a two character parameter
+	char *res = mosquitto_malloc(strlen(query) + 1);
+	char *wp = res;
+	char numbers[2] = {0, 0}; // of the client id and access parameters, once used
+	char next = '1';
+	bool literal = false;
+	const char *s;
+
+	if (res == NULL)
+		return NULL;
+	*access_first = false;
+
+	for (s = query; *s; s++)
+	{
+		bool quoted = !literal && s[0] == '\'' && s[1] == '%' && is_conversion(s[2]) && s[3] == '\'';
+
+		if (quoted)
+			s++;
+
+		if (s[0] != '%')
+		{
+			// a doubled quote inside a literal is a quote, not its end
+			if (s[0] == '\'' && literal && s[1] == '\'')
+				*wp++ = *s++;
+			else if (s[0] == '\'')
+				literal = !literal;
+			*wp++ = *s;
+			continue;
+		}
+
+		if (s[1] == '%')
+		{
+			*wp++ = '%';
+			s++;
+			continue;
+		}
+		if (!is_conversion(s[1]))
+		{
+			mosquitto_log_printf(MOSQ_LOG_ERR, "(mosquitto-auth-plugin) Unsupported placeholder %%%c in db_aclquery, only %%s (client id) "
+								 "and %%d (access) are allowed.", s[1] ? s[1] : ' ');
+			mosquitto_free(res);
+			return NULL;
+		}
+		if (literal)
+		{
+			mosquitto_log_printf(MOSQ_LOG_ERR, "(mosquitto-auth-plugin) Placeholder %%%c inside a string literal of db_aclquery, "
+								 "it can only stand alone or quoted on its own, e.g. '%%s' || '/%%%%'.", s[1]);
+			mosquitto_free(res);
+			return NULL;
+		}
+
+		int param = s[1] == 's' ? 0 : 1;
+		if (numbers[param] == 0)
+		{
+			numbers[param] = next++;
+			*access_first |= param == 1 && numbers[param] == '1';
+		}
+		*wp++ = '$';
+		*wp++ = numbers[param];
+		s += quoted ? 2 : 1;
+	}
+	*wp = '\0';
+
+	return res;
+}
+
+/*
+ * Send the preparation of `query' (as returned by db_format_acl_query) as
+ * the ACL statement on `conn', without waiting for it to complete.
+ */
+int db_send_prepare_acl_query(PGconn *conn, const char *query)
+{
+	if (!PQsendPrepare(conn, DB_ACL_STATEMENT, query, 0, NULL))
+	{
+		mosquitto_log_printf(MOSQ_LOG_ERR, "(mosquitto-auth-plugin) Preparing ACL query failed: %s", PQerrorMessage(conn));
+		return MOSQ_ERR_UNKNOWN;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+/*
+ * Check the result of the preparation and send the description of the
+ * statement, whose result goes to db_describe_acl_query().
+ */
+int db_send_describe_acl_query(PGconn *conn, const PGresult *prepared)
+{
+	if (PQresultStatus(prepared) != PGRES_COMMAND_OK)
+	{
+		mosquitto_log_printf(MOSQ_LOG_ERR, "(mosquitto-auth-plugin) Preparing ACL query failed: %s", PQresultErrorMessage(prepared));
+		return MOSQ_ERR_UNKNOWN;
+	}
+	if (!PQsendDescribePrepared(conn, DB_ACL_STATEMENT))
+	{
+		mosquitto_log_printf(MOSQ_LOG_ERR, "(mosquitto-auth-plugin) Describing ACL query failed: %s", PQerrorMessage(conn));
+		return MOSQ_ERR_UNKNOWN;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+/*
+ * Pick the wire formats of the ACL statement from the types PostgreSQL
+ * inferred, as given by its description.
+ */
+int db_describe_acl_query(const PGresult *res, struct db_acl_statement *stmt)
+{
+	int nparams;
+
+	if (PQresultStatus(res) != PGRES_COMMAND_OK)
+	{
+		mosquitto_log_printf(MOSQ_LOG_ERR, "(mosquitto-auth-plugin) Describing ACL query failed: %s", PQresultErrorMessage(res));
+		return MOSQ_ERR_UNKNOWN;
+	}
+
+	stmt->nparams = nparams = PQnparams(res);
+	if (nparams > 2)
+	{
+		mosquitto_log_printf(MOSQ_LOG_ERR, "(mosquitto-auth-plugin) ACL query takes %d parameters, expected at most 2.", nparams);
+		return MOSQ_ERR_INVAL;
+	}
+
+	for (int i = 0; i < 2; i++)
+	{
+		stmt->param_types[i] = i < nparams ? PQparamtype(res, i) : 0;
+		// text values are sent as their raw bytes either way, integers in network order
+		stmt->param_formats[i] = is_access_param(stmt, i) ? is_int_type(stmt->param_types[i]) : is_text_type(stmt->param_types[i]);
+	}
+
+	stmt->result_format = PQnfields(res) == 1 && is_text_type(PQftype(res, 0));
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+// the last result of the query sent on the blocking `conn', waiting for it
+static PGresult *last_result(PGconn *conn)
+{
+	PGresult *res, *last = NULL;
+
+	while ((res = PQgetResult(conn)) != NULL)
+	{
+		PQclear(last);
+		last = res;
+	}
+	return last;
+}
+
+/*
+ * Prepare `query' as the ACL statement on the blocking `conn' and describe
+ * it into `stmt', waiting for as long as it takes. The pool sets its
+ * connections up step by step instead, see db_pool_maintain().
+ */
+int db_prepare_acl_query(PGconn *conn, const char *query, struct db_acl_statement *stmt)
+{
+	PGresult *res;
+	int rc;
+
+	rc = db_send_prepare_acl_query(conn, query);
+	if (rc != MOSQ_ERR_SUCCESS)
+		return rc;
+	res = last_result(conn);
+	rc = db_send_describe_acl_query(conn, res);
+	PQclear(res);
+	if (rc != MOSQ_ERR_SUCCESS)
+		return rc;
+	res = last_result(conn);
+	rc = db_describe_acl_query(res, stmt);
+	PQclear(res);
+
+	return rc;
+}
+
+/*
+ * Wait until a result of the query sent on `conn' can be read without
+ * blocking, flushing what is left of the query on the way. Returns 1 once
+ * ready, 0 at `deadline' (monotonic ms, 0 for none) and -1 if the
+ * connection failed.
+ */
+static int wait_result(PGconn *conn, int64_t deadline)
+{
+	struct pollfd pfd;
+	int flushed;
+
+	for (;;)
+	{
+		flushed = PQflush(conn);
+		if (flushed < 0)
+			return -1;
+		if (!PQisBusy(conn))
+			return 1;
+
+		int64_t remaining = deadline ? deadline - mono_time_ms() : -1;
+		if (deadline && remaining <= 0)
+			return 0;
+
+		pfd.fd = PQsocket(conn);
+		pfd.events = POLLIN | (flushed ? POLLOUT : 0);
+		pfd.revents = 0;
+		if (pfd.fd < 0 || poll(&pfd, 1, (int)remaining) < 0 || !PQconsumeInput(conn))
+			return -1;
+	}
+}
+
+/*
+ * Read the result of the query just sent on `conn' by the deadline, see
+ * db_exec_acl_query().
+ */
+static PGresult *collect_result(PGconn *conn, int64_t deadline, bool *timed_out)
+{
+	PGresult *res, *last = NULL;
+	int ready;
+
+	// a statement yields a single result, read up to the NULL ending it
+	while ((ready = wait_result(conn, deadline)) > 0 && (res = PQgetResult(conn)) != NULL)
+	{
+		PQclear(last);
+		last = res;
+	}
+
+	if (ready <= 0)
+	{
+		*timed_out = ready == 0;
+		PQclear(last);
+		return NULL;
+	}
+	return last;
+}
+
+/*
+ * Send the prepared ACL statement for `client_id' and `access', without
+ * waiting for its result.
+ */
+static int send_acl_query(PGconn *conn, const struct db_acl_statement *stmt, const char *client_id, int access)
+{
+	const char *values[2];
+	int lengths[2];
+	char access_buf[16];
+
+	for (int i = 0; i < 2; i++)
+	{
+		if (!is_access_param(stmt, i))
+		{
+			values[i] = client_id;
+			lengths[i] = (int)strlen(client_id);
+			continue;
+		}
+
+		values[i] = access_buf;
+		if (stmt->param_formats[i])
+		{
+			switch (stmt->param_types[i])
+			{
+			case INT2OID:
+			{
+				uint16_t v = htons((uint16_t)access);
+				memcpy(access_buf, &v, sizeof(v));
+				lengths[i] = sizeof(v);
+				break;
+			}
+			case INT8OID:
+			{
+				uint32_t v[2] = { 0, htonl((uint32_t)access) };
+				memcpy(access_buf, v, sizeof(v));
+				lengths[i] = sizeof(v);
+				break;
+			}
+			default:
+			{
+				uint32_t v = htonl((uint32_t)access);
+				memcpy(access_buf, &v, sizeof(v));
+				lengths[i] = sizeof(v);
+				break;
+			}
+			}
+		}
+		else
+		{
+			lengths[i] = snprintf(access_buf, sizeof(access_buf), "%d", access);
+		}
+	}
+
+	return PQsendQueryPrepared(conn, DB_ACL_STATEMENT, stmt->nparams, values, lengths, stmt->param_formats, stmt->result_format);
+}
+
+/*
+ * Run the prepared ACL statement for `client_id' and `access' without ever
+ * blocking past `timeout_ms' (0 waits for as long as it takes). Returns its
+ * result, or NULL when the connection failed or, with `timed_out' set, when
+ * the deadline passed; the result still owed then has to be drained from
+ * `conn' before it can be used again.
+ */
+PGresult *db_exec_acl_query(PGconn *conn, const struct db_acl_statement *stmt, const char *client_id, int access,
+							int64_t timeout_ms, bool *timed_out)
+{
+	int64_t deadline = timeout_ms > 0 ? mono_time_ms() + timeout_ms : 0;
+
+	*timed_out = false;
+	if (!send_acl_query(conn, stmt, client_id, access))
+		return NULL;
+
+	return collect_result(conn, deadline, timed_out);
+}
+
+/*
+ * Run the prepared ACL statement for `count' (client id, access) pairs on
+ * the non-blocking `conn', waiting for as long as it takes. In pipeline
+ * mode (libpq 14 and later) every query is sent before the first result is
+ * read, the batch ending on a single sync; with older versions they run one
+ * after the other. results[i] is set to
+ * the result of the i-th query. Returns 0 on success and -1, with no
+ * results, when the connection failed and has to be reset.
+ */
+int db_exec_acl_batch(PGconn *conn, const struct db_acl_statement *stmt, int count, const char *const *client_ids,
+					  const int *access, PGresult **results)
+{
+	int rc = 0;
+
+	for (int i = 0; i < count; i++)
+		results[i] = NULL;
+
+#ifdef LIBPQ_HAS_PIPELINING
+	PGresult *res;
+
+	if (!PQenterPipelineMode(conn))
+		return -1;
+
+	for (int i = 0; rc == 0 && i < count; i++)
+	{
+		if (!send_acl_query(conn, stmt, client_ids[i], access[i]))
+			rc = -1;
+	}
+	if (rc == 0 && !PQpipelineSync(conn))
+		rc = -1;
+
+	// one result per query, each followed by a NULL, then the one of the sync
+	for (int i = 0; rc == 0 && i < count; i++)
+	{
+		if (wait_result(conn, 0) <= 0 || (results[i] = PQgetResult(conn)) == NULL)
+			rc = -1;
+		else if (wait_result(conn, 0) <= 0 || (res = PQgetResult(conn)) != NULL)
+		{
+			PQclear(res);
+			rc = -1;
+		}
+	}
+	if (rc == 0)
+	{
+		res = wait_result(conn, 0) > 0 ? PQgetResult(conn) : NULL;
+		if (PQresultStatus(res) != PGRES_PIPELINE_SYNC)
+			rc = -1;
+		PQclear(res);
+	}
+	if (rc == 0 && !PQexitPipelineMode(conn))
+		rc = -1;
+#else
+	bool timed_out;
+
+	for (int i = 0; rc == 0 && i < count; i++)
+	{
+		results[i] = db_exec_acl_query(conn, stmt, client_ids[i], access[i], 0, &timed_out);
+		if (results[i] == NULL)
+			rc = -1;
+	}
+#endif
+
+	if (rc < 0)
+	{
+		for (int i = 0; i < count; i++)
+		{
+			PQclear(results[i]);
+			results[i] = NULL;
+		}
+	}
+	return rc;
+}
+
+/*
+ * Run a rule listing query with `param' as $1, like db_exec_acl_query() but
+ * returning the whole result at once. Meant for queries returning the rules
+ * of a single client, see db_stream_rules() for larger ones.
+ */
+PGresult *db_exec_rule_query(PGconn *conn, const char *query, const char *param, int64_t timeout_ms, bool *timed_out)
+{
+	int64_t deadline = timeout_ms > 0 ? mono_time_ms() + timeout_ms : 0;
+
+	*timed_out = false;
+	if (!PQsendQueryParams(conn, query, 1, NULL, &param, NULL, NULL, 0))
+		return NULL;
+
+	return collect_result(conn, deadline, timed_out);
+}
+
+/*
+ * Read whatever result is still owed on `conn' after a query timed out,
+ * without blocking. `failed' is set if one of them is an error. The last
+ * rows returned are handed over in `late' when it is not NULL, and
+ * discarded otherwise. Returns 1 once the connection is idle, 0 while
+ * results are pending and -1 if it failed.
+ */
+int db_drain_results(PGconn *conn, bool *failed, PGresult **late)
+{
+	PGresult *res;
+
+	if (PQflush(conn) < 0 || !PQconsumeInput(conn))
+		return -1;
+
+	while (!PQisBusy(conn))
+	{
+		res = PQgetResult(conn);
+		if (res == NULL)
+			return 1;
+		if (PQresultStatus(res) != PGRES_TUPLES_OK && PQresultStatus(res) != PGRES_COMMAND_OK)
+			*failed = true;
+		if (late && PQresultStatus(res) == PGRES_TUPLES_OK)
+		{
+			PQclear(*late);
+			*late = res;
+			continue;
+		}
+		PQclear(res);
+	}
+	return 0;
+}
+
+/*
+ * Read the result of the query sent on `conn' as far as it has arrived,
+ * without blocking. Returns 1 once the query is complete, with its last
+ * result in `res', 0 while it is pending and -1 if the connection failed.
+ */
+int db_poll_result(PGconn *conn, PGresult **res)
+{
+	PGresult *next;
+
+	if (PQflush(conn) < 0 || !PQconsumeInput(conn))
+		return -1;
+
+	while (!PQisBusy(conn))
+	{
+		next = PQgetResult(conn);
+		if (next == NULL)
+			return 1;
+		PQclear(*res);
+		*res = next;
+	}
+	return 0;
+}
+
+/*
+ * Send the subscription of `conn' to the notification channel `channel',
+ * without waiting for it to complete.
+ */
+int db_send_listen(PGconn *conn, const char *channel)
+{
+	char *ident, *query;
+	int rc = MOSQ_ERR_SUCCESS;
+
+	ident = PQescapeIdentifier(conn, channel, strlen(channel));
+	if (ident == NULL)
+	{
+		mosquitto_log_printf(MOSQ_LOG_ERR, "(mosquitto-auth-plugin) Invalid notification channel %s: %s", channel, PQerrorMessage(conn));
+		return MOSQ_ERR_INVAL;
+	}
+
+	query = mosquitto_malloc(strlen("LISTEN ") + strlen(ident) + 1);
+	if (query == NULL)
+	{
+		PQfreemem(ident);
+		return MOSQ_ERR_NOMEM;
+	}
+	sprintf(query, "LISTEN %s", ident);
+	PQfreemem(ident);
+
+	if (!PQsendQuery(conn, query))
+	{
+		mosquitto_log_printf(MOSQ_LOG_ERR, "(mosquitto-auth-plugin) %s failed: %s", query, PQerrorMessage(conn));
+		rc = MOSQ_ERR_UNKNOWN;
+	}
+	mosquitto_free(query);
+
+	return rc;
+}
+
+/*
+ * Hand every notification pending on `conn' to `cb', without blocking when
+ * none has arrived. Returns the number of notifications handled, or -1 if
+ * the connection failed.
+ */
+int db_drain_notifications(PGconn *conn, db_notify_cb cb, void *arg)
+{
+	PGnotify *notify;
+	int count = 0;
+
+	if (!PQconsumeInput(conn))
+		return -1;
+
+	while ((notify = PQnotifies(conn)) != NULL)
+	{
+		cb(notify->extra, arg);
+		PQfreemem(notify);
+		count++;
+	}
+	return count;
+}
+
+/*
+ * Send a rule listing query (client id, access bitmask, topic and an
+ * optional version column) whose rows are read one at a time, see
+ * db_stream_rules(). `param', if not NULL, is sent as $1.
+ */
+int db_send_rule_stream(PGconn *conn, const char *query, const char *param)
+{
+	if (!PQsendQueryParams(conn, query, param ? 1 : 0, NULL, param ? &param : NULL, NULL, NULL, 0))
+	{
+		mosquitto_log_printf(MOSQ_LOG_ERR, "(mosquitto-auth-plugin) Sending rule query failed: %s", PQerrorMessage(conn));
+		return MOSQ_ERR_UNKNOWN;
+	}
+	PQsetSingleRowMode(conn);
+	return MOSQ_ERR_SUCCESS;
+}
+
+// hand the row of a rule listing query to `cb', `failed' set on errors
+static void stream_result(PGresult *res, db_rule_cb cb, void *arg, long *rows, bool *failed)
+{
+	ExecStatusType status = PQresultStatus(res);
+
+	if (status == PGRES_SINGLE_TUPLE && !*failed)
+	{
+		if (PQnfields(res) < 3)
+		{
+			mosquitto_log_printf(MOSQ_LOG_ERR, "(mosquitto-auth-plugin) Rule query returned %d columns, expected client id, access and topic.", PQnfields(res));
+			*failed = true;
+		}
+		else
+		{
+			const char *version = PQnfields(res) > 3 && !PQgetisnull(res, 0, 3) ? PQgetvalue(res, 0, 3) : NULL;
+			const char *topic = PQgetisnull(res, 0, 2) ? NULL : PQgetvalue(res, 0, 2);
+			int access = (int)strtol(PQgetvalue(res, 0, 1), NULL, 10);
+
+			if (cb(PQgetvalue(res, 0, 0), access, topic, version, arg) != MOSQ_ERR_SUCCESS)
+				*failed = true;
+			(*rows)++;
+		}
+	}
+	else if (status != PGRES_SINGLE_TUPLE && status != PGRES_TUPLES_OK)
+	{
+		mosquitto_log_printf(MOSQ_LOG_ERR, "(mosquitto-auth-plugin) Rule query failed: %s", PQresultErrorMessage(res));
+		*failed = true;
+	}
+}
+
+/*
+ * Hand the rows of the rule listing query sent on the non-blocking `conn'
+ * that have arrived to `cb', without blocking. `rows' counts them, and
+ * `failed' is set if the query or `cb' failed, the rest of the result being
+ * read and discarded. Returns 1 once the query is complete, 0 while rows
+ * are pending and -1 if the connection failed.
+ */
+int db_poll_rule_stream(PGconn *conn, db_rule_cb cb, void *arg, long *rows, bool *failed)
+{
+	PGresult *res;
+
+	if (PQflush(conn) < 0 || !PQconsumeInput(conn))
+		return -1;
+
+	while (!PQisBusy(conn))
+	{
+		res = PQgetResult(conn);
+		if (res == NULL)
+			return 1;
+		stream_result(res, cb, arg, rows, failed);
+		PQclear(res);
+	}
+	return 0;
+}
+
+/*
+ * Run a rule listing query and hand its rows to `cb' one at a time, waiting
+ * for as long as it takes. Single row mode keeps libpq from buffering the
+ * whole result, so memory does not grow with the size of the ACL table. A
+ * NULL topic is passed on as NULL. Returns the number of rows read, or -1
+ * on error.
+ */
+long db_stream_rules(PGconn *conn, const char *query, const char *param, db_rule_cb cb, void *arg)
+{
+	PGresult *res;
+	long rows = 0;
+	bool failed = false;
+
+	if (db_send_rule_stream(conn, query, param) != MOSQ_ERR_SUCCESS)
+		return -1;
+
+	// the result has to be read to its end even after a failure
+	while ((res = PQgetResult(conn)) != NULL)
+	{
+		stream_result(res, cb, arg, &rows, &failed);
+		PQclear(res);
+	}
+
+	return failed ? -1 : rows;
+}
+
+/*
+ * Advance a connection started with PQconnectStart() or PQresetStart()
+ * without blocking: PQconnectPoll() is only called once the socket is ready
+ * in the direction it last asked for. `status' carries that request between
+ * calls and must start out as PGRES_POLLING_WRITING. Returns 1 once
+ * connected, 0 while still in progress and -1 on failure.
+ */
+int db_connect_poll(PGconn *conn, PostgresPollingStatusType *status)
+{
+	struct pollfd pfd;
+
+	if (*status == PGRES_POLLING_OK)
+		return 1;
+	if (*status == PGRES_POLLING_FAILED || PQsocket(conn) < 0)
+		return -1;
+
+	pfd.fd = PQsocket(conn);
+	pfd.events = *status == PGRES_POLLING_READING ? POLLIN : POLLOUT;
+	pfd.revents = 0;
+	if (poll(&pfd, 1, 0) <= 0)
+		return 0;
+
+	*status = PQconnectPoll(conn);
+	if (*status == PGRES_POLLING_OK)
+		return 1;
+	return *status == PGRES_POLLING_FAILED ? -1 : 0;
+}
@@ -0,0 +1,48 @@
+#ifndef __DB_H__
+#define __DB_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "libpq-fe.h"
+
+#define DB_ACL_STATEMENT "mosq_auth_acl" // name of the prepared ACL statement
+
+/*
+ * How the parameters of the prepared ACL statement are sent and its result
+ * is received. Formats follow libpq, 0 is text and 1 is binary; the binary
+ * format is used wherever the types PostgreSQL inferred allow it.
+ */
+struct db_acl_statement {
+	int nparams; // parameters the query actually references
+	bool access_first; // $1 is the access type and $2 the client id, see db_format_acl_query()
+	Oid param_types[2]; // of $1 and $2
+	int param_formats[2];
+	int result_format;
+};
+
+typedef void (*db_notify_cb)(char *payload, void *arg);
+typedef int (*db_rule_cb)(const char *client_id, int access, const char *topic, const char *version, void *arg);
+
+char *db_format_acl_query(const char *query, bool *access_first);
+int db_send_prepare_acl_query(PGconn *conn, const char *query);
+int db_send_describe_acl_query(PGconn *conn, const PGresult *prepared);
+int db_describe_acl_query(const PGresult *res, struct db_acl_statement *stmt);
+int db_prepare_acl_query(PGconn *conn, const char *query, struct db_acl_statement *stmt);
+PGresult *db_exec_acl_query(PGconn *conn, const struct db_acl_statement *stmt, const char *client_id, int access,
+							int64_t timeout_ms, bool *timed_out);
+int db_exec_acl_batch(PGconn *conn, const struct db_acl_statement *stmt, int count, const char *const *client_ids,
+					  const int *access, PGresult **results);
+PGresult *db_exec_rule_query(PGconn *conn, const char *query, const char *param, int64_t timeout_ms, bool *timed_out);
+int db_drain_results(PGconn *conn, bool *failed, PGresult **late);
+int db_poll_result(PGconn *conn, PGresult **res);
+
+int db_send_rule_stream(PGconn *conn, const char *query, const char *param);
+int db_poll_rule_stream(PGconn *conn, db_rule_cb cb, void *arg, long *rows, bool *failed);
+long db_stream_rules(PGconn *conn, const char *query, const char *param, db_rule_cb cb, void *arg);
+
+int db_connect_poll(PGconn *conn, PostgresPollingStatusType *status);
+int db_send_listen(PGconn *conn, const char *channel);
+int db_drain_notifications(PGconn *conn, db_notify_cb cb, void *arg);
+
+#endif//__DB_H__
@@ -0,0 +1,519 @@
+#include "db_pool.h"
+#include "utils.h"
+#include "mosquitto_broker.h"
+
+static void conn_lost(struct db_pool_conn *pc)
+{
+	pc->state = DB_CONN_DOWN;
+	pc->next_attempt = mono_time_ms() + pc->backoff;
+	pc->backoff = pc->backoff * 2 < DB_RECONNECT_MAX ? pc->backoff * 2 : DB_RECONNECT_MAX;
+}
+
+static void flight_clear(struct db_pool_conn *pc)
+{
+	mosquitto_free(pc->flight_client_id);
+	mosquitto_free(pc->flight_username);
+	pc->flight_client_id = pc->flight_username = NULL;
+}
+
+static void setup_clear(struct db_pool_conn *pc)
+{
+	PQclear(pc->setup_res);
+	pc->setup_res = NULL;
+}
+
+// deadline of a query sent by the pool itself, in ms
+static int64_t pool_deadline(const struct db_pool *pool)
+{
+	return mono_time_ms() + (pool->timeout_ms > 0 ? pool->timeout_ms : DB_RECONNECT_MAX);
+}
+
+static void conn_ready(struct db_pool_conn *pc)
+{
+	pc->state = DB_CONN_READY;
+	pc->backoff = DB_RECONNECT_MIN;
+	pc->next_check = mono_time_ms() + DB_HEALTH_INTERVAL;
+}
+
+static void start_connect(struct db_pool *pool, struct db_pool_conn *pc)
+{
+	bool started = pc->conn ? PQresetStart(pc->conn) : (pc->conn = PQconnectStart(pool->conninfo)) != NULL;
+
+	if (!started)
+	{
+		mosquitto_log_printf(MOSQ_LOG_WARNING, "(mosquitto-auth-plugin) Reconnecting to database failed: %s", PQerrorMessage(pc->conn));
+		conn_lost(pc);
+		return;
+	}
+	pc->state = DB_CONN_CONNECTING;
+	pc->poll_status = PGRES_POLLING_WRITING;
+	flight_clear(pc);
+	setup_clear(pc);
+}
+
+static int pool_alloc(struct db_pool *pool, const char *conninfo, int size, int64_t timeout_ms, db_setup_cb setup, db_late_cb late,
+					  void *arg)
+{
+	memset(pool, 0, sizeof(*pool));
+	pool->conninfo = conninfo;
+	pool->timeout_ms = timeout_ms;
+	pool->setup = setup;
+	pool->late = late;
+	pool->arg = arg;
+
+	pool->conns = mosquitto_calloc(size, sizeof(struct db_pool_conn));
+	if (pool->conns == NULL)
+		return MOSQ_ERR_NOMEM;
+	pool->size = size;
+
+	for (int i = 0; i < size; i++)
+		pool->conns[i].backoff = DB_RECONNECT_MIN;
+	return MOSQ_ERR_SUCCESS;
+}
+
+/*
+ * Open `size' connections, blocking, and set each up with `setup'. One that
+ * cannot be opened is left to db_pool_maintain(), while a setup error, such
+ * as an invalid ACL query, is returned.
+ */
+int db_pool_init(struct db_pool *pool, const char *conninfo, int size, int64_t timeout_ms, db_setup_cb setup, db_late_cb late,
+				 void *arg)
+{
+	int rc = pool_alloc(pool, conninfo, size, timeout_ms, setup, late, arg);
+
+	if (rc != MOSQ_ERR_SUCCESS)
+		return rc;
+
+	for (int i = 0; i < size; i++)
+	{
+		struct db_pool_conn *pc = &pool->conns[i];
+
+		pc->conn = PQconnectdb(conninfo);
+		if (PQstatus(pc->conn) != CONNECTION_OK)
+		{
+			mosquitto_log_printf(MOSQ_LOG_ERR, "(mosquitto-auth-plugin) Connection %d to database failed: %s", i, PQerrorMessage(pc->conn));
+			conn_lost(pc);
+			continue;
+		}
+
+		// the connection blocks until it is ready, each step waits for its query
+		PGresult *res = NULL, *next;
+		int step = 0;
+		while ((rc = setup(pc->conn, i == 0, step++, res, arg)) == MOSQ_ERR_CONN_PENDING)
+		{
+			PQclear(res);
+			res = NULL;
+			while ((next = PQgetResult(pc->conn)) != NULL)
+			{
+				PQclear(res);
+				res = next;
+			}
+		}
+		PQclear(res);
+		if (rc != MOSQ_ERR_SUCCESS)
+			return rc;
+		PQsetnonblocking(pc->conn, 1);
+		conn_ready(pc);
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+/*
+ * As db_pool_init(), without blocking: the connections are all down and
+ * opened by the following calls to db_pool_maintain(), setup errors
+ * included, each being retried with the usual backoff.
+ */
+int db_pool_start(struct db_pool *pool, const char *conninfo, int size, int64_t timeout_ms, db_setup_cb setup, db_late_cb late,
+				  void *arg)
+{
+	return pool_alloc(pool, conninfo, size, timeout_ms, setup, late, arg);
+}
+
+void db_pool_cleanup(struct db_pool *pool)
+{
+	for (int i = 0; i < pool->size; i++)
+	{
+		PQfinish(pool->conns[i].conn);
+		flight_clear(&pool->conns[i]);
+		setup_clear(&pool->conns[i]);
+	}
+	mosquitto_free(pool->conns);
+	pool->conns = NULL;
+	pool->size = 0;
+}
+
+/*
+ * The primary connection, NULL unless it is ready for a query.
+ */
+PGconn *db_pool_primary(const struct db_pool *pool)
+{
+	return pool->size > 0 && pool->conns[0].state == DB_CONN_READY ? pool->conns[0].conn : NULL;
+}
+
+// whether every connection is ready for a query
+bool db_pool_ready(const struct db_pool *pool)
+{
+	for (int i = 0; i < pool->size; i++)
+	{
+		if (pool->conns[i].state != DB_CONN_READY)
+			return false;
+	}
+	return pool->size > 0;
+}
+
+bool db_pool_available(const struct db_pool *pool)
+{
+	for (int i = 0; i < pool->size; i++)
+	{
+		if (pool->conns[i].state == DB_CONN_READY)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Run the prepared ACL statement, or the rule listing `query' when not
+ * NULL, for `client_id' on the next ready connection, trying the others in
+ * turn should it turn out to be broken. Returns NULL when no connection
+ * could answer, with `timed_out' set if one ran out of time: that one is
+ * then put aside until its result has been drained.
+ */
+static PGresult *exec_query(struct db_pool *pool, const struct db_acl_statement *stmt, const char *query, const char *client_id,
+							const char *username, int access, bool *timed_out)
+{
+	*timed_out = false;
+
+	for (int tried = 0; tried < pool->size; tried++)
+	{
+		struct db_pool_conn *pc = &pool->conns[pool->next];
+
+		pool->next = (pool->next + 1) % pool->size;
+		if (pc->state != DB_CONN_READY)
+			continue;
+
+		PGresult *res = query ? db_exec_rule_query(pc->conn, query, client_id, pool->timeout_ms, timed_out)
+							  : db_exec_acl_query(pc->conn, stmt, client_id, access, pool->timeout_ms, timed_out);
+		if (*timed_out)
+		{
+			mosquitto_log_printf(MOSQ_LOG_WARNING, "(mosquitto-auth-plugin) %s query for %s timed out after %lld ms.",
+								 query ? "Rule" : "ACL", client_id, (long long)pool->timeout_ms);
+			pc->state = DB_CONN_DRAINING;
+			pc->next_attempt = mono_time_ms() + pool->timeout_ms;
+			if (query == NULL)
+			{
+				// the rows are still coming, the checks needing them had better wait for these
+				pc->flight_client_id = mosquitto_strdup(client_id);
+				pc->flight_username = username ? mosquitto_strdup(username) : NULL;
+				pc->flight_access = access;
+				if (pc->flight_client_id == NULL || (username && pc->flight_username == NULL))
+					flight_clear(pc);
+			}
+			return NULL;
+		}
+
+		if (PQstatus(pc->conn) != CONNECTION_OK)
+		{
+			mosquitto_log_printf(MOSQ_LOG_WARNING, "(mosquitto-auth-plugin) Lost connection to database: %s", PQerrorMessage(pc->conn));
+			PQclear(res);
+			conn_lost(pc);
+			continue;
+		}
+		pc->next_check = mono_time_ms() + DB_HEALTH_INTERVAL;
+		return res;
+	}
+	return NULL;
+}
+
+PGresult *db_pool_exec_acl_query(struct db_pool *pool, const struct db_acl_statement *stmt, const char *client_id,
+								 const char *username, int access, bool *timed_out)
+{
+	return exec_query(pool, stmt, NULL, client_id, username, access, timed_out);
+}
+
+/*
+ * Run a rule listing query taking `client_id' as $1 the same way, see
+ * db_exec_rule_query().
+ */
+PGresult *db_pool_exec_rule_query(struct db_pool *pool, const char *query, const char *client_id, bool *timed_out)
+{
+	return exec_query(pool, NULL, query, client_id, NULL, 0, timed_out);
+}
+
+/*
+ * Whether the ACL query for `client_id', `username' and `access' timed out
+ * and its rows are still to come, in which case sending it again would only
+ * queue up behind it on the server.
+ */
+bool db_pool_in_flight(const struct db_pool *pool, const char *client_id, const char *username, int access)
+{
+	for (int i = 0; i < pool->size; i++)
+	{
+		const struct db_pool_conn *pc = &pool->conns[i];
+
+		if (pc->flight_client_id && pc->flight_access == access && !strcmp(pc->flight_client_id, client_id)
+			&& (pc->flight_username ? username && !strcmp(pc->flight_username, username) : username == NULL))
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Drop the rows of the timed out queries once they arrive, e.g. as the ACL
+ * data has changed since they were sent.
+ */
+void db_pool_forget_flights(struct db_pool *pool)
+{
+	for (int i = 0; i < pool->size; i++)
+		flight_clear(&pool->conns[i]);
+}
+
+// drop a connection whose setup failed, to try again from scratch later
+static void setup_failed(struct db_pool_conn *pc)
+{
+	setup_clear(pc);
+	PQfinish(pc->conn);
+	pc->conn = NULL;
+	conn_lost(pc);
+}
+
+/*
+ * Take the setup of a new connection one step further with the result of
+ * the query of its last step, NULL for the first one. Returns true once it
+ * is set up.
+ */
+static bool setup_step(struct db_pool *pool, struct db_pool_conn *pc, int i, const PGresult *res)
+{
+	int rc = pool->setup(pc->conn, i == 0, pc->setup_step++, res, pool->arg);
+
+	if (rc == MOSQ_ERR_CONN_PENDING)
+	{
+		pc->state = DB_CONN_SETUP;
+		pc->next_attempt = pool_deadline(pool);
+		return false;
+	}
+	if (rc != MOSQ_ERR_SUCCESS)
+	{
+		setup_failed(pc);
+		return false;
+	}
+	mosquitto_log_printf(MOSQ_LOG_INFO, "(mosquitto-auth-plugin) Reconnected to database (connection %d).", i);
+	conn_ready(pc);
+	return true;
+}
+
+/*
+ * Take every connection one step further without blocking: reconnect the
+ * lost ones once their backoff has elapsed, check the idle ones and drain
+ * the ones whose query timed out. Returns true when the primary connection
+ * has just been re-established.
+ */
+bool db_pool_maintain(struct db_pool *pool)
+{
+	int64_t now = mono_time_ms();
+	bool primary_ready = false;
+
+	for (int i = 0; i < pool->size; i++)
+	{
+		struct db_pool_conn *pc = &pool->conns[i];
+		int rc;
+
+		switch (pc->state)
+		{
+		case DB_CONN_DOWN:
+			if (now >= pc->next_attempt)
+				start_connect(pool, pc);
+			break;
+
+		case DB_CONN_CONNECTING:
+			rc = db_connect_poll(pc->conn, &pc->poll_status);
+			if (rc < 0)
+			{
+				mosquitto_log_printf(MOSQ_LOG_WARNING, "(mosquitto-auth-plugin) Reconnecting to database failed: %s", PQerrorMessage(pc->conn));
+				conn_lost(pc);
+			}
+			else if (rc > 0)
+			{
+				PQsetnonblocking(pc->conn, 1);
+				pc->setup_step = 0;
+				primary_ready |= setup_step(pool, pc, i, NULL) && i == 0;
+			}
+			break;
+
+		case DB_CONN_SETUP:
+			rc = db_poll_result(pc->conn, &pc->setup_res);
+			if (rc > 0)
+			{
+				PGresult *res = pc->setup_res;
+
+				pc->setup_res = NULL;
+				primary_ready |= setup_step(pool, pc, i, res) && i == 0;
+				PQclear(res);
+			}
+			else if (rc < 0 || now >= pc->next_attempt)
+			{
+				mosquitto_log_printf(MOSQ_LOG_WARNING, "(mosquitto-auth-plugin) Setting up database connection %d %s.", i,
+									 rc < 0 ? "failed" : "timed out");
+				setup_failed(pc);
+			}
+			break;
+
+		case DB_CONN_READY:
+			if (now < pc->next_check)
+				break;
+			pc->next_check = now + DB_HEALTH_INTERVAL;
+			// reading whatever arrived notices a connection the server has closed
+			if (!PQconsumeInput(pc->conn) || PQstatus(pc->conn) != CONNECTION_OK)
+			{
+				mosquitto_log_printf(MOSQ_LOG_WARNING, "(mosquitto-auth-plugin) Lost connection to database: %s", PQerrorMessage(pc->conn));
+				conn_lost(pc);
+			}
+			break;
+
+		case DB_CONN_DRAINING:
+		case DB_CONN_PROBING:
+		{
+			bool failed = false;
+			PGresult *late = NULL;
+
+			rc = db_drain_results(pc->conn, &failed, pc->flight_client_id ? &late : NULL);
+			if (late)
+			{
+				if (pool->late)
+					pool->late(pc->flight_client_id, pc->flight_username, pc->flight_access, late, pool->arg);
+				PQclear(late);
+				flight_clear(pc);
+			}
+			if (rc > 0)
+			{
+				if (pc->state == DB_CONN_PROBING)
+					pool->probe_result = failed ? -1 : 1;
+				flight_clear(pc);
+				pc->state = DB_CONN_READY;
+			}
+			else if (rc < 0 || now >= pc->next_attempt)
+			{
+				if (pc->state == DB_CONN_PROBING)
+					pool->probe_result = -1;
+				// give up on the query, a new session drops it on the server too
+				mosquitto_log_printf(MOSQ_LOG_WARNING, "(mosquitto-auth-plugin) Resetting database connection %d stuck on a query.", i);
+				start_connect(pool, pc);
+			}
+			break;
+		}
+
+		case DB_CONN_STREAMING:
+			// read by db_pool_stream_poll(), deadline included
+			break;
+		}
+	}
+	return primary_ready;
+}
+
+/*
+ * Send a trivial query on a ready connection to tell whether the database
+ * answers again, without waiting for it: its outcome is collected by
+ * db_pool_maintain() and read with db_pool_probe_result(). Returns false
+ * when no connection is ready to send it.
+ */
+bool db_pool_probe(struct db_pool *pool)
+{
+	for (int i = 0; i < pool->size; i++)
+	{
+		struct db_pool_conn *pc = &pool->conns[i];
+
+		if (pc->state != DB_CONN_READY)
+			continue;
+
+		if (!PQsendQuery(pc->conn, "SELECT 1"))
+		{
+			conn_lost(pc);
+			continue;
+		}
+		pc->state = DB_CONN_PROBING;
+		pc->next_attempt = mono_time_ms() + (pool->timeout_ms > 0 ? pool->timeout_ms : DB_RECONNECT_MAX);
+		return true;
+	}
+	return false;
+}
+
+/*
+ * The outcome of the last probe, once: 1 if the database answered it, -1 if
+ * it did not, 0 while none has completed since the last call.
+ */
+int db_pool_probe_result(struct db_pool *pool)
+{
+	int result = pool->probe_result;
+
+	pool->probe_result = 0;
+	return result;
+}
+
+/*
+ * Send a rule listing query, see db_send_rule_stream(), on the primary
+ * connection if it is ready. Its rows are then read without blocking by
+ * db_pool_stream_poll(), the connection serving nothing else meanwhile.
+ */
+int db_pool_stream_start(struct db_pool *pool, const char *query, const char *param)
+{
+	struct db_pool_conn *pc = pool->conns;
+
+	if (pool->size == 0 || pc->state != DB_CONN_READY)
+		return MOSQ_ERR_NO_CONN;
+
+	if (db_send_rule_stream(pc->conn, query, param) != MOSQ_ERR_SUCCESS)
+	{
+		if (PQstatus(pc->conn) != CONNECTION_OK)
+			conn_lost(pc);
+		return MOSQ_ERR_UNKNOWN;
+	}
+	pc->state = DB_CONN_STREAMING;
+	pc->stream_rows = 0;
+	pc->stream_failed = false;
+	pc->next_attempt = pool_deadline(pool);
+	return MOSQ_ERR_SUCCESS;
+}
+
+/*
+ * Hand the rows of the stream that have arrived to `cb'. Returns 1 once the
+ * query is complete, with the number of rows in `rows', 0 while more are to
+ * come and -1 if it failed. The connection is reset when no row comes for
+ * longer than the query deadline.
+ */
+int db_pool_stream_poll(struct db_pool *pool, db_rule_cb cb, void *arg, long *rows)
+{
+	struct db_pool_conn *pc = pool->conns;
+	long before;
+	int rc;
+
+	if (pool->size == 0 || pc->state != DB_CONN_STREAMING)
+		return -1;
+
+	before = pc->stream_rows;
+	rc = db_poll_rule_stream(pc->conn, cb, arg, &pc->stream_rows, &pc->stream_failed);
+	if (rc > 0)
+	{
+		pc->state = DB_CONN_READY;
+		pc->next_check = mono_time_ms() + DB_HEALTH_INTERVAL;
+		*rows = pc->stream_rows;
+		return pc->stream_failed ? -1 : 1;
+	}
+	if (rc < 0)
+	{
+		mosquitto_log_printf(MOSQ_LOG_WARNING, "(mosquitto-auth-plugin) Lost connection to database: %s", PQerrorMessage(pc->conn));
+		conn_lost(pc);
+		return -1;
+	}
+
+	if (pc->stream_rows != before)
+	{
+		pc->next_attempt = pool_deadline(pool);
+	}
+	else if (mono_time_ms() >= pc->next_attempt)
+	{
+		mosquitto_log_printf(MOSQ_LOG_WARNING, "(mosquitto-auth-plugin) Rule query got no row for %lld ms, resetting database connection 0.",
+							 (long long)(pool->timeout_ms > 0 ? pool->timeout_ms : DB_RECONNECT_MAX));
+		start_connect(pool, pc);
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,104 @@
+#ifndef __DB_POOL_H__
+#define __DB_POOL_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "db.h"
+
+#define DB_RECONNECT_MIN 500 // ms before the first attempt to reach a lost database
+#define DB_RECONNECT_MAX 30000 // ms the delay between attempts doubles up to
+#define DB_HEALTH_INTERVAL 10000 // ms between checks of an idle connection
+
+/*
+ * A few database connections the ACL queries are spread over, so that one
+ * stuck on a slow query or being reconnected does not hold up the others.
+ *
+ * Connections are kept in non-blocking mode and maintained from the
+ * broker's tick, never blocking it: lost ones are reconnected with an
+ * exponential backoff, idle ones are checked for a closed socket every
+ * DB_HEALTH_INTERVAL ms, and one whose query timed out is out of use until
+ * its result has been drained, or reset if that takes longer than the
+ * timeout again; probes are waited for the same way. A new connection is
+ * set up one query at a time, each under the query deadline. The key of a
+ * timed out ACL query is remembered while it runs, so that checks needing
+ * the same rows do not send it again (see db_pool_in_flight()), and its
+ * late rows are handed to the `late' callback. The first connection is the
+ * primary: it is the one listening for notifications and running the rule
+ * listing queries, whose rows may be streamed over several ticks (see
+ * db_pool_stream_start()).
+ *
+ * db_pool_start() opens a pool without blocking at all, so that connections
+ * to a reloaded configuration's database come up in the background while
+ * the current pool keeps serving.
+ */
+enum db_conn_state {
+	DB_CONN_DOWN,
+	DB_CONN_CONNECTING,
+	DB_CONN_SETUP, // waiting on a query of its setup, see db_setup_cb
+	DB_CONN_READY,
+	DB_CONN_DRAINING, // results of a timed out query are still owed
+	DB_CONN_PROBING, // checking whether the database answers again, see db_pool_probe()
+	DB_CONN_STREAMING, // primary only, rows of a rule listing query are coming, see db_pool_stream_start()
+};
+
+struct db_pool_conn {
+	PGconn *conn;
+	enum db_conn_state state;
+	PostgresPollingStatusType poll_status; // while connecting, see db_connect_poll()
+	int64_t next_attempt; // monotonic ms of the next reconnection attempt, or deadline of a drain, setup query or stream
+	int64_t backoff; // ms until the attempt after that
+	int64_t next_check; // monotonic ms of the next health check
+	char *flight_client_id; // key of the timed out ACL query being drained, NULL if none
+	char *flight_username;
+	int flight_access;
+	int setup_step; // of the setup under way
+	PGresult *setup_res; // of the query of the setup step under way, read so far
+	long stream_rows; // handed over by the stream under way
+	bool stream_failed;
+};
+
+/*
+ * Called on every new connection, `primary' for the first one of the pool,
+ * once per step of its setup: step 0 with a NULL `res', then each following
+ * step with the result of the query the previous one sent. Returns
+ * MOSQ_ERR_CONN_PENDING after sending a query, MOSQ_ERR_SUCCESS once the
+ * connection is set up, or an error.
+ */
+typedef int (*db_setup_cb)(PGconn *conn, bool primary, int step, const PGresult *res, void *arg);
+// called with the rows of an ACL query that came in after its deadline
+typedef void (*db_late_cb)(const char *client_id, const char *username, int access, PGresult *res, void *arg);
+
+struct db_pool {
+	struct db_pool_conn *conns;
+	int size;
+	int next; // connection the next query starts looking from
+	const char *conninfo;
+	int64_t timeout_ms; // deadline of a query, 0 for none
+	db_setup_cb setup;
+	db_late_cb late;
+	void *arg;
+	int probe_result; // of the last probe, 1 if answered, -1 if not, 0 if none is done
+};
+
+int db_pool_init(struct db_pool *pool, const char *conninfo, int size, int64_t timeout_ms, db_setup_cb setup, db_late_cb late,
+				 void *arg);
+int db_pool_start(struct db_pool *pool, const char *conninfo, int size, int64_t timeout_ms, db_setup_cb setup, db_late_cb late,
+				  void *arg);
+void db_pool_cleanup(struct db_pool *pool);
+
+PGconn *db_pool_primary(const struct db_pool *pool);
+bool db_pool_ready(const struct db_pool *pool);
+bool db_pool_available(const struct db_pool *pool);
+PGresult *db_pool_exec_acl_query(struct db_pool *pool, const struct db_acl_statement *stmt, const char *client_id,
+								 const char *username, int access, bool *timed_out);
+bool db_pool_in_flight(const struct db_pool *pool, const char *client_id, const char *username, int access);
+void db_pool_forget_flights(struct db_pool *pool);
+PGresult *db_pool_exec_rule_query(struct db_pool *pool, const char *query, const char *client_id, bool *timed_out);
+bool db_pool_maintain(struct db_pool *pool);
+bool db_pool_probe(struct db_pool *pool);
+int db_pool_stream_start(struct db_pool *pool, const char *query, const char *param);
+int db_pool_stream_poll(struct db_pool *pool, db_rule_cb cb, void *arg, long *rows);
+int db_pool_probe_result(struct db_pool *pool);
+
+#endif//__DB_POOL_H__
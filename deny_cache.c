@@ -0,0 +1,238 @@
+#include "deny_cache.h"
+#include "utils.h"
+#include "mosquitto_broker.h"
+
+static uint64_t hash64(uint64_t h, const void *data, size_t len)
+{
+	const unsigned char *s = data;
+
+	while (len--)
+	{
+		h ^= *s++;
+		h *= 1099511628211u;
+	}
+	return h;
+}
+
+/*
+ * 64 bit FNV-1a of the whole check, the strings kept apart by their
+ * terminators, finished with a mix so the low bits can pick the bucket.
+ */
+static uint64_t check_key(const char *client_id, const char *username, int access, const char *topic)
+{
+	uint64_t h = 14695981039346656037u;
+
+	h = hash64(h, client_id, strlen(client_id) + 1);
+	h = hash64(h, username ? username : "", username ? strlen(username) + 1 : 1);
+	h = hash64(h, &access, sizeof(access));
+	h = hash64(h, topic, strlen(topic));
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdu;
+	h ^= h >> 33;
+	return h;
+}
+
+static struct deny_cache_slot *bucket_of(struct deny_cache *cache, uint64_t key)
+{
+	return &cache->slots[(key & cache->bucket_mask) * DENY_CACHE_WAYS];
+}
+
+int deny_cache_init(struct deny_cache *cache, size_t max_entries, int64_t ttl_ms, bool count_clients)
+{
+	size_t bucket_count = 1;
+
+	memset(cache, 0, sizeof(*cache));
+	cache->ttl_ms = ttl_ms;
+
+	if (count_clients)
+	{
+		cache->clients = mosquitto_calloc(DENY_CLIENTS_MAX, sizeof(struct deny_client));
+		if (cache->clients == NULL)
+			return MOSQ_ERR_NOMEM;
+	}
+
+	if (ttl_ms <= 0 || max_entries == 0)
+	{
+		cache->ttl_ms = 0;
+		return MOSQ_ERR_SUCCESS;
+	}
+
+	while (bucket_count * DENY_CACHE_WAYS < max_entries)
+		bucket_count <<= 1;
+
+	cache->slots = mosquitto_calloc(bucket_count * DENY_CACHE_WAYS, sizeof(struct deny_cache_slot));
+	if (cache->slots == NULL)
+		return MOSQ_ERR_NOMEM;
+	cache->bucket_mask = bucket_count - 1;
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+void deny_cache_cleanup(struct deny_cache *cache)
+{
+	mosquitto_free(cache->slots);
+	cache->slots = NULL;
+	mosquitto_free(cache->clients);
+	cache->clients = NULL;
+}
+
+bool deny_cache_enabled(const struct deny_cache *cache)
+{
+	return cache->slots != NULL;
+}
+
+bool deny_cache_get(struct deny_cache *cache, const char *client_id, const char *username, int access, const char *topic)
+{
+	uint64_t key;
+	struct deny_cache_slot *slot;
+
+	if (cache->slots == NULL)
+		return false;
+
+	key = check_key(client_id, username, access, topic);
+	slot = bucket_of(cache, key);
+	for (int way = 0; way < DENY_CACHE_WAYS; way++, slot++)
+	{
+		if (slot->expires == 0 || slot->key != key)
+			continue;
+
+		if (slot->expires <= mono_time_ms())
+		{
+			slot->expires = 0;
+			return false;
+		}
+		cache->hits++;
+		return true;
+	}
+	return false;
+}
+
+void deny_cache_put(struct deny_cache *cache, const char *client_id, const char *username, int access, const char *topic)
+{
+	uint64_t key;
+	struct deny_cache_slot *slot, *victim;
+
+	if (cache->slots == NULL)
+		return;
+
+	key = check_key(client_id, username, access, topic);
+	slot = victim = bucket_of(cache, key);
+	for (int way = 0; way < DENY_CACHE_WAYS; way++, slot++)
+	{
+		if (slot->expires != 0 && slot->key == key)
+		{
+			victim = slot;
+			break;
+		}
+		// free slots expire at 0, so they are taken first
+		if (slot->expires < victim->expires)
+			victim = slot;
+	}
+
+	victim->key = key;
+	victim->client_hash = hash_str(client_id, 0);
+	victim->expires = mono_time_ms() + cache->ttl_ms;
+}
+
+/*
+ * Forget the denials of `client_id', e.g. after its permissions have
+ * changed. Walks the whole table, which only notifications do.
+ */
+void deny_cache_remove_client(struct deny_cache *cache, const char *client_id)
+{
+	uint32_t client_hash;
+
+	if (cache->slots == NULL)
+		return;
+
+	client_hash = hash_str(client_id, 0);
+	for (size_t i = 0; i < (cache->bucket_mask + 1) * DENY_CACHE_WAYS; i++)
+	{
+		if (cache->slots[i].client_hash == client_hash)
+			cache->slots[i].expires = 0;
+	}
+}
+
+void deny_cache_clear(struct deny_cache *cache)
+{
+	if (cache->slots)
+		memset(cache->slots, 0, (cache->bucket_mask + 1) * DENY_CACHE_WAYS * sizeof(struct deny_cache_slot));
+}
+
+static bool same_client(const struct deny_client *client, uint32_t hash, const char *client_id)
+{
+	return client->denied && client->hash == hash && !strncmp(client->client_id, client_id, DENY_CLIENT_ID_MAX - 1);
+}
+
+/*
+ * Count a denied check of `client_id', `cached' when the cache answered it.
+ */
+void deny_cache_count(struct deny_cache *cache, const char *client_id, bool cached)
+{
+	uint32_t hash;
+	struct deny_client *client, *victim;
+
+	if (cache->clients == NULL || client_id == NULL)
+		return;
+
+	hash = hash_str(client_id, 0);
+	client = victim = &cache->clients[(hash & (DENY_CLIENTS_MAX / DENY_CLIENT_WAYS - 1)) * DENY_CLIENT_WAYS];
+	for (int way = 0; way < DENY_CLIENT_WAYS; way++, client++)
+	{
+		if (same_client(client, hash, client_id))
+		{
+			victim = client;
+			break;
+		}
+		// free entries count no denial, so they are taken first
+		if (client->denied < victim->denied)
+			victim = client;
+	}
+
+	if (!same_client(victim, hash, client_id))
+	{
+		size_t len = strnlen(client_id, DENY_CLIENT_ID_MAX - 1);
+
+		victim->hash = hash;
+		victim->denied = victim->cached = 0;
+		memcpy(victim->client_id, client_id, len);
+		victim->client_id[len] = '\0';
+	}
+	victim->denied++;
+	if (cached)
+		victim->cached++;
+}
+
+/*
+ * Fill `top' with up to `max' of the most denied clients, most denied
+ * first, and return how many there are.
+ */
+size_t deny_cache_top_clients(const struct deny_cache *cache, const struct deny_client **top, size_t max)
+{
+	size_t count = 0;
+
+	if (cache->clients == NULL)
+		return 0;
+
+	for (size_t i = 0; i < DENY_CLIENTS_MAX; i++)
+	{
+		const struct deny_client *client = &cache->clients[i];
+		size_t pos;
+
+		if (client->denied == 0)
+			continue;
+
+		pos = count < max ? count++ : max;
+		// insertion into the sorted prefix, dropping the last one when full
+		while (pos > 0 && top[pos - 1]->denied < client->denied)
+		{
+			if (pos < max)
+				top[pos] = top[pos - 1];
+			pos--;
+		}
+		if (pos < max)
+			top[pos] = client;
+	}
+	return count;
+}
@@ -0,0 +1,65 @@
+#ifndef __DENY_CACHE_H__
+#define __DENY_CACHE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Bounded cache of denied ACL checks, so a client retrying a topic it may
+ * not use is answered without querying the database again.
+ *
+ * A denial is remembered as a 64 bit hash of its (client id, username,
+ * access type, topic) in a fixed table of DENY_CACHE_WAYS-way buckets:
+ * lookups and inserts touch a single bucket and never allocate, and a full
+ * bucket replaces its entry closest to expiry. Checks hashing alike would
+ * share their decision, which at 64 bits is not a practical concern and can
+ * only ever deny.
+ *
+ * Denials are also counted per client, from any source, for monitoring, in
+ * a fixed table of DENY_CLIENTS_MAX entries laid out the same way: counting
+ * touches a single bucket of DENY_CLIENT_WAYS and never allocates, and a new
+ * client takes the place of the least denied of its bucket, so heavy hitters
+ * stay while a flood of new client ids churns through the rest. Client ids
+ * are kept up to DENY_CLIENT_ID_MAX - 1 bytes, told apart beyond that by
+ * their hash.
+ */
+#define DENY_CACHE_WAYS 4
+#define DENY_CLIENTS_MAX 1024
+#define DENY_CLIENT_WAYS 8
+#define DENY_CLIENT_ID_MAX 128
+
+struct deny_cache_slot {
+	uint64_t key; // hash of the check
+	uint32_t client_hash; // hash_str() of its client id, to drop a client's denials
+	int64_t expires; // monotonic expiry time in ms, 0 when the slot is free
+};
+
+struct deny_client {
+	uint32_t hash; // hash_str() of the whole client id
+	uint64_t denied; // checks denied, 0 when the entry is free
+	uint64_t cached; // of which answered by the cache
+	char client_id[DENY_CLIENT_ID_MAX]; // truncated if longer
+};
+
+struct deny_cache {
+	struct deny_cache_slot *slots; // bucket_mask + 1 buckets of DENY_CACHE_WAYS slots
+	size_t bucket_mask; // bucket count - 1, bucket count is a power of two
+	int64_t ttl_ms; // 0 disables the cache
+	uint64_t hits;
+	struct deny_client *clients; // DENY_CLIENTS_MAX entries, NULL if not counting
+};
+
+int deny_cache_init(struct deny_cache *cache, size_t max_entries, int64_t ttl_ms, bool count_clients);
+void deny_cache_cleanup(struct deny_cache *cache);
+bool deny_cache_enabled(const struct deny_cache *cache);
+
+bool deny_cache_get(struct deny_cache *cache, const char *client_id, const char *username, int access, const char *topic);
+void deny_cache_put(struct deny_cache *cache, const char *client_id, const char *username, int access, const char *topic);
+void deny_cache_remove_client(struct deny_cache *cache, const char *client_id);
+void deny_cache_clear(struct deny_cache *cache);
+
+void deny_cache_count(struct deny_cache *cache, const char *client_id, bool cached);
+size_t deny_cache_top_clients(const struct deny_cache *cache, const struct deny_client **top, size_t max);
+
+#endif//__DENY_CACHE_H__
@@ -0,0 +1,204 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "metrics.h"
+#include "mosquitto_broker.h"
+
+#define METRICS_TOPIC "$SYS/plugin/auth/"
+
+static const char *access_names[METRICS_ACCESS_TYPES] = { "read", "write", "subscribe", "unsubscribe" };
+static const char *decision_names[2] = { "denied", "allowed" };
+static const char *source_names[METRICS_SOURCES] = { "cache", "shared", "store", "snapshot", "db", "grant", "memo", "deny", "fallback", "stale" };
+
+static int publish(const char *topic, const char *payload)
+{
+	char full[128];
+
+	snprintf(full, sizeof(full), METRICS_TOPIC "%s", topic);
+	// retained like the broker's own $SYS topics, so monitoring sees them on subscribing
+	return mosquitto_broker_publish_copy(NULL, full, (int)strlen(payload), payload, 0, true, NULL);
+}
+
+static int publish_count(const char *topic, uint64_t value)
+{
+	char payload[24];
+
+	snprintf(payload, sizeof(payload), "%" PRIu64, value);
+	return publish(topic, payload);
+}
+
+/*
+ * Publish a histogram as {"count":n,"sum":s,"buckets":{"<bound>":n,...}}
+ * where each non-empty bucket is keyed by its exclusive upper bound, the
+ * last one by "inf".
+ */
+static int publish_histogram(const char *topic, const struct metrics_histogram *h, int shift)
+{
+	char payload[1024];
+	int len = snprintf(payload, sizeof(payload), "{\"count\":%" PRIu64 ",\"sum\":%" PRIu64 ",\"buckets\":{", h->count, h->sum);
+	bool first = true;
+
+	for (int i = 0; i < METRICS_BUCKETS; i++)
+	{
+		if (h->buckets[i] == 0)
+			continue;
+
+		if (i < METRICS_BUCKETS - 1)
+			len += snprintf(payload + len, sizeof(payload) - len, "%s\"%" PRIu64 "\":%" PRIu64, first ? "" : ",",
+							(uint64_t)1 << (i + shift), h->buckets[i]);
+		else
+			len += snprintf(payload + len, sizeof(payload) - len, "%s\"inf\":%" PRIu64, first ? "" : ",", h->buckets[i]);
+		first = false;
+	}
+	snprintf(payload + len, sizeof(payload) - len, "}}");
+
+	return publish(topic, payload);
+}
+
+// append `s' as a JSON string, truncated to fit
+static int json_string(char *buf, size_t size, int len, const char *s)
+{
+	if (len < (int)size)
+		buf[len++] = '"';
+	for (; *s && len < (int)size - 8; s++)
+	{
+		unsigned char c = (unsigned char)*s;
+
+		if (c == '"' || c == '\\')
+		{
+			buf[len++] = '\\';
+			buf[len++] = (char)c;
+		}
+		else if (c < 0x20)
+		{
+			len += snprintf(buf + len, size - len, "\\u%04x", c);
+		}
+		else
+		{
+			buf[len++] = (char)c;
+		}
+	}
+	if (len < (int)size)
+		buf[len++] = '"';
+	return len;
+}
+
+/*
+ * Publish the most denied clients as {"<client id>":{"denied":n,"cached":c},...},
+ * `cached' counting the denials answered by the deny cache.
+ */
+static int publish_denied_clients(const char *topic, const struct deny_cache *deny)
+{
+	const struct deny_client *top[METRICS_DENIED_CLIENTS];
+	size_t count = deny_cache_top_clients(deny, top, METRICS_DENIED_CLIENTS);
+	char payload[4096];
+	int len = snprintf(payload, sizeof(payload), "{");
+
+	for (size_t i = 0; i < count; i++)
+	{
+		if (i > 0)
+			payload[len++] = ',';
+		// client ids are capped so every entry fits
+		len = json_string(payload, len + 300, len, top[i]->client_id);
+		len += snprintf(payload + len, sizeof(payload) - len, ":{\"denied\":%" PRIu64 ",\"cached\":%" PRIu64 "}",
+						top[i]->denied, top[i]->cached);
+	}
+	snprintf(payload + len, sizeof(payload) - len, "}");
+
+	return publish(topic, payload);
+}
+
+/*
+ * Publish every metric, and the state of the ACL cache, client states and
+ * certificate cache if they are in use.
+ * Returns the first error of mosquitto_broker_publish_copy(), if any.
+ */
+int metrics_publish(const struct metrics *m, const struct acl_cache *cache, const struct deny_cache *deny,
+					const struct client_table *clients, const struct cert_cache *certs)
+{
+	char topic[96];
+	int rc = MOSQ_ERR_SUCCESS;
+
+#define PUBLISH(call)                          \
+	do                                         \
+	{                                          \
+		int published = (call);                \
+		if (rc == MOSQ_ERR_SUCCESS)            \
+			rc = published;                    \
+	} while (0)
+
+	for (int access = 0; access < METRICS_ACCESS_TYPES; access++)
+	{
+		for (int allowed = 0; allowed < 2; allowed++)
+		{
+			const struct metrics_histogram *h = &m->acl[access][allowed];
+
+			snprintf(topic, sizeof(topic), "acl/%s/%s", access_names[access], decision_names[allowed]);
+			PUBLISH(publish_count(topic, h->count));
+			snprintf(topic, sizeof(topic), "acl/%s/%s/latency", access_names[access], decision_names[allowed]);
+			PUBLISH(publish_histogram(topic, h, METRICS_LATENCY_SHIFT));
+		}
+	}
+
+	for (int source = 0; source < METRICS_SOURCES; source++)
+	{
+		snprintf(topic, sizeof(topic), "acl/source/%s", source_names[source]);
+		PUBLISH(publish_count(topic, m->acl_source[source]));
+	}
+
+	for (int allowed = 0; allowed < 2; allowed++)
+	{
+		snprintf(topic, sizeof(topic), "basic/%s", decision_names[allowed]);
+		PUBLISH(publish_count(topic, m->basic_auth[allowed].count));
+		snprintf(topic, sizeof(topic), "basic/%s/latency", decision_names[allowed]);
+		PUBLISH(publish_histogram(topic, &m->basic_auth[allowed], METRICS_LATENCY_SHIFT));
+	}
+
+	PUBLISH(publish_count("db/queries", m->db_latency.count));
+	PUBLISH(publish_count("db/errors", m->db_errors));
+	PUBLISH(publish_count("db/timeouts", m->db_timeouts));
+	PUBLISH(publish_count("db/coalesced", m->db_coalesced));
+	PUBLISH(publish_count("db/late", m->db_late_rows));
+	PUBLISH(publish("db/breaker", m->db_breaker_open ? "open" : "closed"));
+	PUBLISH(publish_count("db/breaker/trips", m->db_breaker_trips));
+	PUBLISH(publish_count("db/swaps", m->db_swaps));
+	PUBLISH(publish_histogram("db/latency", &m->db_latency, METRICS_LATENCY_SHIFT));
+	PUBLISH(publish_histogram("db/rows", &m->db_rows, 0));
+
+	PUBLISH(publish_count("config/reloads", m->reloads));
+	PUBLISH(publish_count("trace/records", m->trace_records));
+	PUBLISH(publish_count("trace/dropped", m->trace_dropped));
+
+	if (acl_cache_enabled(cache))
+	{
+		PUBLISH(publish_count("cache/hits", cache->hits));
+		PUBLISH(publish_count("cache/misses", cache->misses));
+		PUBLISH(publish_count("cache/entries", cache->entry_count));
+		PUBLISH(publish_count("cache/rulesets", cache->rulesets.count));
+		PUBLISH(publish_count("cache/ruleset_bytes", cache->rulesets.memory));
+		PUBLISH(publish_count("cache/refreshes", m->cache_refreshes));
+		PUBLISH(publish_count("cache/refresh_errors", m->cache_refresh_errors));
+		PUBLISH(publish_count("cache/prefetches", m->cache_prefetches));
+		PUBLISH(publish_count("cache/prefetches_skipped", m->cache_prefetches_skipped));
+	}
+	if (client_table_enabled(clients))
+	{
+		PUBLISH(publish_count("clients/connected", clients->count));
+		PUBLISH(publish_count("clients/blocks", clients->block_count));
+		PUBLISH(publish_count("clients/idle_blocks", clients->idle_count));
+	}
+	if (deny_cache_enabled(deny))
+		PUBLISH(publish_count("deny/hits", deny->hits));
+	if (cert_cache_enabled(certs))
+	{
+		PUBLISH(publish_count("cert/hits", certs->hits));
+		PUBLISH(publish_count("cert/misses", certs->misses));
+		PUBLISH(publish_count("cert/entries", certs->entry_count));
+	}
+	if (deny->clients)
+		PUBLISH(publish_denied_clients("acl/denied/clients", deny));
+#undef PUBLISH
+
+	return rc;
+}
@@ -0,0 +1,95 @@
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "acl_cache.h"
+#include "cert_cache.h"
+#include "client_state.h"
+#include "deny_cache.h"
+
+/*
+ * Counters and latency histograms of the plugin's callbacks, published on
+ * $SYS/plugin/auth/... topics every `metrics_interval' seconds.
+ *
+ * The broker calls the plugin from its single main thread, so the numbers
+ * are plain integers updated in place: recording one costs a couple of
+ * increments and no locks. Histograms have fixed power of two buckets: a
+ * value v lands in bucket bit_length(v >> shift), the last one catching
+ * everything above, so bucket i counts values below 2^i << shift.
+ */
+#define METRICS_BUCKETS 20
+#define METRICS_LATENCY_SHIFT 7 // first latency bucket is below 128 ns, the last open one from 33 ms
+
+#define METRICS_ACCESS_TYPES 4 // MOSQ_ACL_READ, _WRITE, _SUBSCRIBE and _UNSUBSCRIBE
+#define METRICS_DENIED_CLIENTS 10 // most denied clients published
+
+enum metrics_source {
+	METRICS_SOURCE_CACHE,
+	METRICS_SOURCE_SHARED, // rules cached by another broker of the host
+	METRICS_SOURCE_STORE,
+	METRICS_SOURCE_SNAPSHOT,
+	METRICS_SOURCE_DB,
+	METRICS_SOURCE_GRANT,
+	METRICS_SOURCE_MEMO, // decision memoized for the topic
+	METRICS_SOURCE_DENY,
+	METRICS_SOURCE_FALLBACK, // no connection answered in time
+	METRICS_SOURCE_STALE, // expired cached rules, while the database cannot answer
+	METRICS_SOURCES
+};
+
+struct metrics_histogram {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t buckets[METRICS_BUCKETS];
+};
+
+struct metrics {
+	struct metrics_histogram acl[METRICS_ACCESS_TYPES][2]; // ACL check latency in ns, by access type and [denied, allowed]
+	uint64_t acl_source[METRICS_SOURCES]; // ACL checks answered from each source
+	struct metrics_histogram basic_auth[2]; // authentication latency in ns, by [denied, allowed]
+	struct metrics_histogram db_latency; // ACL query round trips, in ns
+	struct metrics_histogram db_rows; // rows returned per ACL query
+	uint64_t db_errors;
+	uint64_t db_timeouts; // ACL queries given up on at their deadline
+	uint64_t db_coalesced; // checks not sending a query already in flight
+	uint64_t db_late_rows; // timed out queries whose rows were cached once they came
+	uint64_t db_breaker_trips; // times the circuit breaker opened
+	bool db_breaker_open;
+	uint64_t db_swaps; // pools replaced by the connections of a reloaded configuration
+	uint64_t cache_refreshes; // cached entries refreshed ahead of expiry
+	uint64_t cache_refresh_errors; // refreshes the worker could not get an answer for
+	uint64_t cache_prefetches; // clients whose rules were cached at authentication
+	uint64_t cache_prefetches_skipped; // reconnects with a certificate whose prefetched rules were still cached
+	uint64_t reloads; // configuration reloads taken, rejected ones left out
+	uint64_t trace_records; // callbacks of sampled clients queued for the trace file
+	uint64_t trace_dropped; // and those dropped, the trace buffer being full
+};
+
+static inline void metrics_record(struct metrics_histogram *h, uint64_t value, int shift)
+{
+	uint64_t scaled = value >> shift;
+	int bucket = scaled ? 64 - __builtin_clzll(scaled) : 0;
+
+	h->count++;
+	h->sum += value;
+	h->buckets[bucket < METRICS_BUCKETS ? bucket : METRICS_BUCKETS - 1]++;
+}
+
+static inline void metrics_record_latency(struct metrics_histogram *h, int64_t start_ns, int64_t end_ns)
+{
+	metrics_record(h, end_ns > start_ns ? (uint64_t)(end_ns - start_ns) : 0, METRICS_LATENCY_SHIFT);
+}
+
+// index of a single MOSQ_ACL_* access type in metrics.acl
+static inline int metrics_access_index(int access)
+{
+	return access ? __builtin_ctz((unsigned)access) & (METRICS_ACCESS_TYPES - 1) : 0;
+}
+
+int metrics_publish(const struct metrics *m, const struct acl_cache *cache, const struct deny_cache *deny,
+					const struct client_table *clients, const struct cert_cache *certs);
+
+#endif//__METRICS_H__
@@ -1,6 +1,464 @@
+#include <limits.h>
+#include <sys/resource.h>
+#include <time.h>
+
 #include "userdata.h"
 //#define DEBUG
 
+#define SNAPSHOT_REVALIDATE_BATCH 16 // snapshot clients refreshed from the database per tick
+#define RELOAD_REVALIDATE_SPREAD 60000 // ms the rules cached under a replaced ACL query or database are fetched again over
+
+/*
+ * Function: match_pattern
+ *
+ * Matches one raw pattern against the topic. Patterns without %c/%u tokens
+ * are matched as they are. Templates are matched in place when `in_place'
+ * (t_match_in_place() of the client's values) allows it, and expanded
+ * otherwise. Empty patterns never match.
+ */
+static bool match_pattern(const char *pattern, bool is_template, const char *client_id, const char *username, bool in_place,
+						  const char *topic)
+{
+	if (*pattern == '\0')
+	{
+		return false;
+	}
+	if (!is_template)
+	{
+		return sub_acl_check(pattern, topic);
+	}
+	if (in_place)
+	{
+		return sub_acl_check_template(pattern, topic, client_id, username);
+	}
+
+	char *expanded;
+	t_expand(client_id, username, pattern, &expanded);
+	bool result = expanded && *expanded && sub_acl_check(expanded, topic);
+	mosquitto_free(expanded);
+
+	return result;
+}
+
+/*
+ * Function: check_rules
+ *
+ * Matches the client's raw ACL patterns against the topic, stopping at the
+ * first pattern that grants access. When `cacheable' is set the patterns
+ * are also stored in the ACL cache, unexpanded: clients with the same ones
+ * share them. They are shared with the other brokers of the host as well
+ * when fetched after `stamp' was taken, unless NULL. A NULL topic only
+ * refreshes the cache.
+ *
+ * Return:
+ *	true if at least one pattern matches the topic.
+ */
+static bool check_rules(struct auth_plugin_userdata *ud, const char *client_id, const char *username, int access_type,
+						const char *topic, const char **patterns, int pattern_count, bool cacheable, const struct acl_shared_stamp *stamp)
+{
+	bool match = false;
+	bool in_place = t_match_in_place(client_id, username);
+
+	for (int idx = 0; topic && idx < pattern_count; idx++)
+	{
+		const char *acl_wildcard = patterns[idx];
+
+#ifdef DEBUG
+		mosquitto_log_printf(MOSQ_LOG_DEBUG, "(mosquitto-auth-plugin) %s", acl_wildcard);
+#endif
+		if (match_pattern(acl_wildcard, t_is_template(acl_wildcard), client_id, username, in_place, topic))
+		{
+			match = true; // matches at least 1 topic with valid permissions, user is authorized
+			break;
+		}
+	}
+
+	if (cacheable)
+	{
+		int64_t expires = mono_time_ms() + ud->aclCache.ttl_ms;
+
+		acl_cache_put_until(&ud->aclCache, client_id, username, access_type, patterns, pattern_count, false, expires);
+		client_table_drop_memo(&ud->clients, client_id);
+		// the other brokers of the host need not fetch them again
+		if (stamp)
+		{
+			acl_shared_put(&ud->aclShared, stamp, client_id, username, access_type, patterns, pattern_count, expires);
+		}
+	}
+
+	return match;
+}
+
+/*
+ * Function: check_degraded
+ *
+ * Answers a check the database cannot: from the client's last known rules,
+ * expired as they may be, or else with the configured fallback decision.
+ */
+static bool check_degraded(struct auth_plugin_userdata *ud, const char *client_id, const char *username, int access_type,
+						   const char *topic, enum metrics_source *source)
+{
+	const struct acl_cache_entry *stale = topic ? acl_cache_get_stale(&ud->aclCache, client_id, username, access_type) : NULL;
+	if (stale)
+	{
+		*source = METRICS_SOURCE_STALE;
+		return acl_cache_match(stale, topic);
+	}
+
+	*source = METRICS_SOURCE_FALLBACK;
+	return ud->dbFallbackAllow;
+}
+
+/*
+ * Function: record_query
+ *
+ * Accounts for a query answering checks: its latency and timeout in the
+ * metrics, its outcome in the circuit breaker.
+ */
+static void record_query(struct auth_plugin_userdata *ud, enum acl_fetch_status status, int64_t start, int64_t end)
+{
+	if (breaker_record(&ud->dbBreaker, status != ACL_FETCH_OK, end - start))
+	{
+		mosquitto_log_printf(MOSQ_LOG_WARNING, "(mosquitto-auth-plugin) ACL queries failing or slow, circuit breaker open: "
+							 "checks are answered from the last known rules until the database recovers.");
+		ud->metrics.db_breaker_trips++;
+		ud->metrics.db_breaker_open = true;
+	}
+	if (status == ACL_FETCH_TIMEOUT)
+	{
+		ud->metrics.db_timeouts++;
+	}
+	if (status != ACL_FETCH_UNAVAILABLE)
+	{
+		metrics_record_latency(&ud->metrics.db_latency, start, end);
+	}
+}
+
+/*
+ * Function: check_backend_rules
+ *
+ * Fetches the client's patterns for the access type from the ACL backend
+ * and matches them against the topic. `answered' tells whether the backend
+ * actually answered; when it does not do so in time, or the circuit breaker
+ * is open, the check is answered by <check_degraded>.
+ */
+static bool check_backend_rules(struct auth_plugin_userdata *ud, const char *client_id, const char *username, int access_type,
+								const char *topic, enum metrics_source *source, bool *answered)
+{
+	*answered = false;
+	*source = METRICS_SOURCE_DB;
+
+	// leave the database alone until a probe gets through, see mosq_tick()
+	if (ud->dbBreaker.open)
+	{
+		return check_degraded(ud, client_id, username, access_type, topic, source);
+	}
+
+	struct acl_rules rules;
+	struct acl_shared_stamp stamp = acl_shared_stamp(&ud->aclShared, client_id, access_type);
+	int64_t start = mono_time_ns();
+	enum acl_fetch_status status = acl_backend_fetch(ud->aclBackend, client_id, username, access_type, &rules);
+	if (status != ACL_FETCH_PENDING)
+	{
+		record_query(ud, status, start, mono_time_ns());
+	}
+	switch (status)
+	{
+	case ACL_FETCH_PENDING:
+		// the same query timed out and is still running, its rows are cached when they come
+		ud->metrics.db_coalesced++;
+		return check_degraded(ud, client_id, username, access_type, topic, source);
+	case ACL_FETCH_TIMEOUT:
+	case ACL_FETCH_UNAVAILABLE:
+		// read-only until a connection is back, see db_pool_maintain()
+		return check_degraded(ud, client_id, username, access_type, topic, source);
+	case ACL_FETCH_ERROR:
+		ud->metrics.db_errors++;
+		return false;
+	case ACL_FETCH_OK:
+		break;
+	}
+	*answered = true;
+
+	metrics_record(&ud->metrics.db_rows, (uint64_t)rules.count, 0);
+	bool match = check_rules(ud, client_id, username, access_type, topic, rules.patterns, rules.count,
+							 acl_cache_enabled(&ud->aclCache), &stamp);
+
+	acl_backend_release(ud->aclBackend, &rules);
+
+	return match;
+}
+
+/*
+ * Function: check_store_rules
+ *
+ * Matches the topic against the client's patterns for the access type from
+ * the preloaded ACL store, without querying the database. A client missing
+ * from the store has no rules.
+ */
+static bool check_store_rules(struct auth_plugin_userdata *ud, const char *client_id, const char *username, int access_type, const char *topic)
+{
+	const struct acl_store_client *client = acl_store_find(ud->aclStore, client_id);
+	const char **patterns = NULL;
+	int pattern_count = 0;
+
+	// without a cache to fill, match straight from the store, templates already told apart
+	if (!acl_cache_enabled(&ud->aclCache))
+	{
+		bool in_place = t_match_in_place(client_id, username);
+
+		for (int idx = 0; client && idx < client->rule_count; idx++)
+		{
+			const struct acl_store_rule *rule = &client->rules[idx];
+
+			if ((rule->access & access_type)
+				&& match_pattern(acl_store_rule_topic(client, rule), rule->flags & ACL_STORE_TEMPLATE, client_id, username, in_place, topic))
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+
+	if (client && client->rule_count > 0)
+	{
+		patterns = (const char **)mosquitto_malloc(sizeof(char *) * client->rule_count);
+		if (patterns == NULL)
+		{
+			return false;
+		}
+
+		for (int idx = 0; idx < client->rule_count; idx++)
+		{
+			if (client->rules[idx].access & access_type)
+			{
+				patterns[pattern_count++] = acl_store_rule_topic(client, &client->rules[idx]);
+			}
+		}
+	}
+
+	struct acl_shared_stamp stamp = acl_shared_stamp(&ud->aclShared, client_id, access_type);
+	bool match = check_rules(ud, client_id, username, access_type, topic, patterns, pattern_count, acl_cache_enabled(&ud->aclCache), &stamp);
+
+	mosquitto_free(patterns);
+
+	return match;
+}
+
+/*
+ * Function: check_snapshot_rules
+ *
+ * Matches the topic against the client's rules persisted by the previous
+ * run, while they have not been revalidated against the database yet.
+ *
+ * Return:
+ *	true if the snapshot holds the client's rules for the access type, the
+ *	result of the check is then stored in `match'.
+ */
+static bool check_snapshot_rules(struct auth_plugin_userdata *ud, const char *client_id, const char *username, int access_type,
+								 const char *topic, bool *match)
+{
+	const struct acl_snapshot_record *record = acl_snapshot_find(&ud->snapshot, client_id);
+	if (record == NULL || !(record->access_known & access_type))
+	{
+		return false;
+	}
+
+	// expanded rules only hold for the username they were expanded with
+	const char *expanded_for = acl_snapshot_username(record);
+	bool expanded = record->flags & ACL_SNAPSHOT_EXPANDED;
+	if (expanded && (expanded_for == NULL || username == NULL ? expanded_for != username : strcmp(expanded_for, username)))
+	{
+		return false;
+	}
+
+	const char **patterns = NULL;
+	int pattern_count = 0;
+	if (record->rule_count > 0)
+	{
+		patterns = (const char **)mosquitto_malloc(sizeof(char *) * record->rule_count);
+		if (patterns == NULL)
+		{
+			return false;
+		}
+	}
+
+	const struct acl_snapshot_rule *rules = acl_snapshot_rules(record);
+	for (uint32_t idx = 0; idx < record->rule_count; idx++)
+	{
+		if (rules[idx].access & access_type)
+		{
+			patterns[pattern_count++] = acl_snapshot_rule_topic(record, &rules[idx]);
+		}
+	}
+
+	if (expanded)
+	{
+		*match = false;
+		for (int idx = 0; idx < pattern_count && !*match; idx++)
+		{
+			*match = sub_acl_check(patterns[idx], topic);
+		}
+		acl_cache_put(&ud->aclCache, client_id, username, access_type, patterns, pattern_count, true);
+		client_table_drop_memo(&ud->clients, client_id);
+	}
+	else
+	{
+		struct acl_shared_stamp stamp = acl_shared_stamp(&ud->aclShared, client_id, access_type);
+		*match = check_rules(ud, client_id, username, access_type, topic, patterns, pattern_count, acl_cache_enabled(&ud->aclCache), &stamp);
+	}
+
+	mosquitto_free(patterns);
+	return true;
+}
+
+/*
+ * Function: check_shared_rules
+ *
+ * Matches the topic against the client's rules shared by another broker of
+ * the host, which are then cached here too for as long as they have left.
+ *
+ * Return:
+ *	true if the rules were shared, the result of the check is then stored in
+ *	`match' and their expiry in `expires'.
+ */
+static bool check_shared_rules(struct auth_plugin_userdata *ud, const char *client_id, const char *username, int access_type,
+							   const char *topic, bool *match, int64_t *expires)
+{
+	struct acl_shared_rules *shared = acl_shared_get(&ud->aclShared, client_id, username, access_type);
+	if (shared == NULL)
+	{
+		return false;
+	}
+
+	bool in_place = t_match_in_place(client_id, username);
+	*match = false;
+	for (int idx = 0; idx < shared->rule_count && !*match; idx++)
+	{
+		*match = match_pattern(shared->rules[idx], t_is_template(shared->rules[idx]), client_id, username, in_place, topic);
+	}
+	acl_cache_put_until(&ud->aclCache, client_id, username, access_type, shared->rules, shared->rule_count, false, shared->expires);
+	client_table_drop_memo(&ud->clients, client_id);
+	*expires = shared->expires;
+
+	mosquitto_free(shared);
+	return true;
+}
+
+/*
+ * Function: check_acl
+ *
+ * Decides a check from the first place holding the client's rules: the ACL
+ * cache, the rules shared by the other brokers of the host, the preloaded
+ * store, the previous run's snapshot or the ACL backend, where a denial
+ * recently answered is not asked again. `source' is set to
+ * the one used, and `holds' to the monotonic time in ms the decision holds
+ * until as long as the rules do not change, 0 if it should not be reused.
+ */
+static bool check_acl(struct auth_plugin_userdata *ud, const char *client_id, const char *username, int access_type,
+					  const char *topic, enum metrics_source *source, int64_t *holds)
+{
+	bool match = false;
+
+	*holds = 0;
+
+	// serve the check from the cached rules when possible, no database or heap use
+	const struct acl_cache_entry *cached = acl_cache_get(&ud->aclCache, client_id, username, access_type);
+	if (cached)
+	{
+		// one walk of the compiled rules, however many there are
+		match = acl_cache_match(cached, topic);
+		*source = METRICS_SOURCE_CACHE;
+		*holds = cached->expires;
+
+		// an entry in use is refreshed in the background before it runs out
+		if (ud->refreshAhead > 0 && acl_cache_claim_refresh(cached, ud->refreshAhead))
+		{
+			struct acl_shared_stamp stamp = acl_shared_stamp(&ud->aclShared, client_id, access_type);
+			refresher_request(&ud->refresher, client_id, username, access_type, ud->aclGeneration, &stamp);
+		}
+	}
+	else if (check_shared_rules(ud, client_id, username, access_type, topic, &match, holds))
+	{
+		*source = METRICS_SOURCE_SHARED;
+	}
+	else if (ud->aclStore)
+	{
+		match = check_store_rules(ud, client_id, username, access_type, topic);
+		*source = METRICS_SOURCE_STORE;
+		*holds = INT64_MAX; // until a delta changes the client's rules
+	}
+	else if (check_snapshot_rules(ud, client_id, username, access_type, topic, &match))
+	{
+		// warm rules from the previous run, revalidated in the background
+		*source = METRICS_SOURCE_SNAPSHOT;
+	}
+	else if (deny_cache_get(&ud->denyCache, client_id, username, access_type, topic))
+	{
+		// a client retrying a forbidden topic costs no query
+		*source = METRICS_SOURCE_DENY;
+	}
+	else
+	{
+		bool answered;
+
+		match = check_backend_rules(ud, client_id, username, access_type, topic, source, &answered);
+		if (!match && answered)
+		{
+			deny_cache_put(&ud->denyCache, client_id, username, access_type, topic);
+		}
+	}
+
+	return match;
+}
+
+/*
+ * Function: grant_subscription
+ *
+ * Called once a subscription passed its ACL check. When the client's read
+ * rules cover every topic the filter can match, the filter is added to the
+ * client's grants, and the messages delivered through it are allowed with
+ * one walk of the grants instead of a full check.
+ */
+static void grant_subscription(struct auth_plugin_userdata *ud, struct client_state *state, const char *filter)
+{
+	enum metrics_source source;
+	int64_t holds;
+
+	// a rule matching the filter itself, its wildcards as plain levels, matches every topic the filter does
+	if (!check_acl(ud, state->client_id, state->username, MOSQ_ACL_READ, filter, &source, &holds) || source == METRICS_SOURCE_FALLBACK
+		|| source == METRICS_SOURCE_STALE)
+	{
+		return;
+	}
+
+	client_grant_add(&ud->clients, state, filter);
+}
+
+/*
+ * Function: capture
+ *
+ * Queues the trace record of a callback of a sampled client, counting it
+ * or its drop.
+ */
+static void capture(struct auth_plugin_userdata *ud, enum trace_event event, int access, int flags, int result, int64_t start, int64_t end,
+					const char *client_id, const char *username, const char *topic)
+{
+	if (!trace_sampled(&ud->trace, client_id))
+	{
+		return;
+	}
+
+	if (trace_record(&ud->trace, event, access, flags, result, start, end, client_id, username, topic))
+	{
+		ud->metrics.trace_records++;
+	}
+	else
+	{
+		ud->metrics.trace_dropped++;
+	}
+}
+
 /*
  * Function: mosquitto_auth_acl_check
  *
@@ -27,112 +485,1308 @@
  */
 static int mosq_auth_acl_check(int event, void *event_data, void *userdata)
 {
+	int64_t start = mono_time_ns();
+	enum metrics_source source;
 	bool match = false;
 	struct mosquitto_evt_acl_check *ed = event_data;
 
-	const char *username = mosquitto_client_username(ed->client),
-			   *client_id = mosquitto_client_id(ed->client),
-			   *topic = ed->topic;
+	const char *username = mosquitto_client_username(ed->client),
+			   *client_id = mosquitto_client_id(ed->client),
+			   *topic = ed->topic;
+
+	int access_type = ed->access;
+
+#ifdef DEBUG
+	mosquitto_log_printf(MOSQ_LOG_DEBUG, "(mosquitto-auth-plugin) username{%s}, cid{%s}, topic{%s}, access{%d}", mosquitto_client_username(ed->client), mosquitto_client_id(ed->client), ed->topic, ed->access);
+#endif
+
+	// grab userdata passed to the function
+	struct auth_plugin_userdata *ud = *(auth_plugin_userdata **)userdata;
+
+	// messages delivered through a subscription granted in full need no rules at all
+	struct client_state *state = NULL;
+	if (client_table_enabled(&ud->clients))
+	{
+		state = client_table_find(&ud->clients, ed->client, client_id);
+	}
+
+	if (state && access_type == MOSQ_ACL_READ && client_grants_match(&ud->clients, state, topic))
+	{
+		match = true;
+		source = METRICS_SOURCE_GRANT;
+	}
+	else if (state && client_memo_get(state, access_type, topic, &match))
+	{
+		// the same topic as before, its decision still holds
+		source = METRICS_SOURCE_MEMO;
+	}
+	else
+	{
+		int64_t holds;
+
+		match = check_acl(ud, client_id, username, access_type, topic, &source, &holds);
+		if (state && holds > 0)
+		{
+			client_memo_put(&ud->clients, state, access_type, topic, match, holds);
+		}
+	}
+
+	if (state)
+	{
+		if (access_type == MOSQ_ACL_SUBSCRIBE && match)
+		{
+			grant_subscription(ud, state, topic);
+		}
+		else if (access_type == MOSQ_ACL_UNSUBSCRIBE)
+		{
+			client_grant_remove(&ud->clients, state, topic);
+		}
+	}
+
+	ud->metrics.acl_source[source]++;
+	if (!match)
+	{
+		deny_cache_count(&ud->denyCache, client_id, source == METRICS_SOURCE_DENY);
+	}
+	int64_t end = mono_time_ns();
+	int rc = match ? MOSQ_ERR_SUCCESS : MOSQ_ERR_ACL_DENIED;
+	metrics_record_latency(&ud->metrics.acl[metrics_access_index(access_type)][match], start, end);
+
+	if (trace_enabled(&ud->trace))
+	{
+		capture(ud, TRACE_ACL_CHECK, access_type, 0, rc, start, end, client_id, username, topic);
+	}
+	return rc;
+}
+
+/*
+ * Function: mosq_disconnect
+ *
+ * Called by the broker when a client disconnects, frees the state of the
+ * connection in one go.
+ */
+static int mosq_disconnect(int event, void *event_data, void *userdata)
+{
+	struct mosquitto_evt_disconnect *ed = event_data;
+	struct auth_plugin_userdata *ud = *(auth_plugin_userdata **)userdata;
+	int64_t start = mono_time_ns();
+
+	client_table_remove(&ud->clients, ed->client, mosquitto_client_id(ed->client));
+
+	if (trace_enabled(&ud->trace))
+	{
+		capture(ud, TRACE_DISCONNECT, 0, 0, MOSQ_ERR_SUCCESS, start, mono_time_ns(), mosquitto_client_id(ed->client),
+				mosquitto_client_username(ed->client), NULL);
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+/*
+ * Function: on_acl_change
+ *
+ * Called by the ACL backend for every client whose permissions changed, or
+ * with a NULL client id when any may have, to drop what was derived from
+ * their old rules.
+ */
+static void on_acl_change(const char *client_id, void *arg)
+{
+	struct auth_plugin_userdata *ud = arg;
+
+	// refreshes in flight may have read the old rules
+	ud->aclGeneration++;
+
+	if (client_id == NULL)
+	{
+		mosquitto_log_printf(MOSQ_LOG_DEBUG, "(mosquitto-auth-plugin) ACL change notification, dropping all cached rules.");
+		acl_cache_clear(&ud->aclCache);
+		acl_shared_clear(&ud->aclShared);
+		client_table_drop_grants(&ud->clients, NULL);
+		client_table_drop_memo(&ud->clients, NULL);
+		deny_cache_clear(&ud->denyCache);
+		return;
+	}
+
+#ifdef DEBUG
+	mosquitto_log_printf(MOSQ_LOG_DEBUG, "(mosquitto-auth-plugin) ACL change notification for %s.", client_id);
+#endif
+	acl_cache_remove_client(&ud->aclCache, client_id);
+	acl_shared_remove_client(&ud->aclShared, client_id);
+	client_table_drop_grants(&ud->clients, client_id);
+	client_table_drop_memo(&ud->clients, client_id);
+	deny_cache_remove_client(&ud->denyCache, client_id);
+}
+
+static void track_version(struct auth_plugin_userdata *ud, const char *version)
+{
+	if (version)
+	{
+		long long v = strtoll(version, NULL, 10);
+		if (v > ud->aclVersion)
+		{
+			ud->aclVersion = v;
+		}
+	}
+}
+
+static int on_preload_row(const char *client_id, int access, const char *topic, const char *version, void *arg)
+{
+	struct auth_plugin_userdata *ud = arg;
+
+	track_version(ud, version);
+	return acl_store_add(ud->aclStore, client_id, access, topic);
+}
+
+static int on_delta_row(const char *client_id, int access, const char *topic, const char *version, void *arg)
+{
+	struct auth_plugin_userdata *ud = arg;
+
+	track_version(ud, version);
+	// compiled rules, grants and decisions of the client are stale now
+	acl_cache_remove_client(&ud->aclCache, client_id);
+	client_table_drop_grants(&ud->clients, client_id);
+	client_table_drop_memo(&ud->clients, client_id);
+	return acl_store_sync(ud->aclStore, client_id, access, topic);
+}
+
+/*
+ * Function: load_acl_store
+ *
+ * Fills the in-process store with the whole ACL table, so that checks never
+ * have to query the database. The table persisted by the previous run is
+ * used when there is one and brought up to date by the next delta; otherwise
+ * the table is streamed from the ACL backend.
+ */
+static int load_acl_store(struct auth_plugin_userdata *ud)
+{
+	int64_t start = mono_time_ms();
+	struct rusage usage;
+	long rows;
+
+	ud->aclStore = mosquitto_malloc(sizeof(struct acl_store));
+	if (ud->aclStore == NULL || acl_store_init(ud->aclStore) != MOSQ_ERR_SUCCESS)
+	{
+		return MOSQ_ERR_NOMEM;
+	}
+
+	if (acl_snapshot_is_open(&ud->snapshot) && (ud->snapshot.header->flags & ACL_SNAPSHOT_STORE))
+	{
+		if (acl_snapshot_load_store(&ud->snapshot, ud->aclStore) != MOSQ_ERR_SUCCESS)
+		{
+			return MOSQ_ERR_NOMEM;
+		}
+		rows = (long)ud->aclStore->rule_count;
+		ud->aclVersion = ud->snapshot.header->acl_version;
+		ud->nextDelta = start;
+	}
+	else
+	{
+		rows = acl_backend_load(ud->aclBackend, on_preload_row, ud);
+		if (rows < 0)
+		{
+			return MOSQ_ERR_UNKNOWN;
+		}
+		ud->nextDelta = mono_time_ms() + ud->deltaInterval;
+	}
+	acl_snapshot_close(&ud->snapshot);
+
+	getrusage(RUSAGE_SELF, &usage);
+	mosquitto_log_printf(MOSQ_LOG_INFO, "(mosquitto-auth-plugin) Preloaded %ld rows: %zu rules for %zu clients in %lld ms, "
+						 "%zu bytes held, peak RSS %ld kB, version %lld.",
+						 rows, ud->aclStore->rule_count, ud->aclStore->client_count, (long long)(mono_time_ms() - start),
+						 ud->aclStore->memory, usage.ru_maxrss, (long long)ud->aclVersion);
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+/*
+ * Function: sync_acl_store
+ *
+ * Applies the rules changed since the last version seen to the preloaded
+ * store, once the delta interval has elapsed. The rows are streamed on the
+ * primary connection and applied as they arrive, over as many ticks as it
+ * takes: a client whose rows are split across two ticks is checked against
+ * those applied so far in between.
+ */
+static void sync_acl_store(struct auth_plugin_userdata *ud)
+{
+	if (!ud->deltaRunning)
+	{
+		int64_t now = mono_time_ms();
+		if (now < ud->nextDelta || db_pool_primary(&ud->dbPool) == NULL)
+		{
+			return;
+		}
+		ud->nextDelta = now + ud->deltaInterval;
+
+		char version[24];
+		snprintf(version, sizeof(version), "%lld", (long long)ud->aclVersion);
+
+		acl_store_begin_sync(ud->aclStore);
+		if (db_pool_stream_start(&ud->dbPool, ud->deltaQuery, version) != MOSQ_ERR_SUCCESS)
+		{
+			return;
+		}
+		ud->deltaRunning = true;
+	}
+
+	long rows;
+	int done = db_pool_stream_poll(&ud->dbPool, on_delta_row, ud, &rows);
+	if (done == 0)
+	{
+		return;
+	}
+	ud->deltaRunning = false;
+	if (done > 0 && rows > 0)
+	{
+		mosquitto_log_printf(MOSQ_LOG_DEBUG, "(mosquitto-auth-plugin) Applied %ld changed rule rows, now at version %lld.", rows, (long long)ud->aclVersion);
+	}
+}
+
+/*
+ * Function: on_late_rows
+ *
+ * Called with the rows of an ACL query that timed out once they finally
+ * arrive: they are cached for the checks that have been waiting on them.
+ */
+static void on_late_rows(const char *client_id, const char *username, int access, PGresult *res, void *arg)
+{
+	struct auth_plugin_userdata *ud = arg;
+
+	if (!acl_cache_enabled(&ud->aclCache) || PQnfields(res) != 1)
+	{
+		return;
+	}
+
+	int rec_count = PQntuples(res);
+	const char **patterns = NULL;
+	if (rec_count > 0)
+	{
+		patterns = (const char **)mosquitto_malloc(sizeof(char *) * rec_count);
+		if (patterns == NULL)
+		{
+			return;
+		}
+	}
+	for (int row = 0; row < rec_count; row++)
+	{
+		patterns[row] = PQgetvalue(res, row, 0);
+	}
+
+	// not shared, the query started before any stamp could be taken
+	check_rules(ud, client_id, username, access, NULL, patterns, rec_count, true, NULL);
+	ud->metrics.db_late_rows++;
+	mosquitto_free(patterns);
+}
+
+/*
+ * Function: prepare_connection
+ *
+ * Sets up a freshly opened database connection one query at a time, see
+ * db_setup_cb: prepares `query' as the ACL statement, and subscribes the
+ * primary one to ACL change notifications.
+ */
+static int prepare_connection(struct auth_plugin_userdata *ud, PGconn *conn, bool primary, int step, const PGresult *res,
+							  const char *query, struct db_acl_statement *stmt)
+{
+	int rc;
+
+	switch (step)
+	{
+	case 0:
+	{
+		// parse and plan the ACL query once, checks only send its parameters
+		char *aclQuery = db_format_acl_query(query, &stmt->access_first);
+		if (aclQuery == NULL)
+		{
+			return MOSQ_ERR_INVAL;
+		}
+
+		mosquitto_log_printf(MOSQ_LOG_DEBUG, "(mosquitto-auth-plugin) Preparing ACL query: %s", aclQuery);
+		rc = db_send_prepare_acl_query(conn, aclQuery);
+		mosquitto_free(aclQuery);
+		break;
+	}
+	case 1:
+		rc = db_send_describe_acl_query(conn, res);
+		break;
+	case 2:
+		rc = db_describe_acl_query(res, stmt);
+		if (rc != MOSQ_ERR_SUCCESS || ud->notifyChannel == NULL || !primary)
+		{
+			return rc;
+		}
+		// follow permission changes so cached rules can be kept for long
+		rc = db_send_listen(conn, ud->notifyChannel);
+		break;
+	default:
+		if (PQresultStatus(res) != PGRES_COMMAND_OK)
+		{
+			mosquitto_log_printf(MOSQ_LOG_ERR, "(mosquitto-auth-plugin) LISTEN %s failed: %s", ud->notifyChannel, PQresultErrorMessage(res));
+			return MOSQ_ERR_UNKNOWN;
+		}
+		mosquitto_log_printf(MOSQ_LOG_INFO, "(mosquitto-auth-plugin) Listening for ACL changes on channel %s.", ud->notifyChannel);
+		return MOSQ_ERR_SUCCESS;
+	}
+
+	return rc == MOSQ_ERR_SUCCESS ? MOSQ_ERR_CONN_PENDING : rc;
+}
+
+static int setup_connection(PGconn *conn, bool primary, int step, const PGresult *res, void *arg)
+{
+	struct auth_plugin_userdata *ud = arg;
+
+	return prepare_connection(ud, conn, primary, step, res, ud->options.aclQuery, &ud->aclStatement);
+}
+
+// as setup_connection(), for the connections opened after a reload
+static int setup_reload_connection(PGconn *conn, bool primary, int step, const PGresult *res, void *arg)
+{
+	struct auth_plugin_userdata *ud = arg;
+
+	return prepare_connection(ud, conn, primary, step, res, ud->reload.aclQuery, &ud->reload.aclStatement);
+}
+
+/*
+ * Function: revalidate_snapshot
+ *
+ * Replaces the rules served from the previous run's snapshot with fresh ones
+ * from the database, a few clients per tick so reconnect storms do not turn
+ * into query storms. The snapshot is unmapped once every client is done.
+ */
+static void revalidate_snapshot(struct auth_plugin_userdata *ud)
+{
+	if (!db_pool_available(&ud->dbPool) || ud->dbBreaker.open)
+	{
+		return;
+	}
+
+	for (int done = 0; done < SNAPSHOT_REVALIDATE_BATCH; done++)
+	{
+		const struct acl_snapshot_record *record = acl_snapshot_next(&ud->snapshot);
+		if (record == NULL)
+		{
+			mosquitto_log_printf(MOSQ_LOG_INFO, "(mosquitto-auth-plugin) ACL snapshot revalidated against the database.");
+			acl_snapshot_close(&ud->snapshot);
+			return;
+		}
+
+		// unexpanded rules need the client's username, they are refreshed on first use instead
+		if (!(record->flags & ACL_SNAPSHOT_EXPANDED))
+		{
+			continue;
+		}
+
+		// grants were given on the snapshot's rules
+		client_table_drop_grants(&ud->clients, acl_snapshot_client_id(record));
+		for (int access_type = MOSQ_ACL_READ; access_type <= MOSQ_ACL_UNSUBSCRIBE; access_type <<= 1)
+		{
+			enum metrics_source source;
+			bool answered;
+
+			if (record->access_known & access_type)
+			{
+				check_backend_rules(ud, acl_snapshot_client_id(record), acl_snapshot_username(record), access_type, NULL, &source,
+									&answered);
+			}
+		}
+	}
+}
+
+/*
+ * Function: save_snapshot
+ *
+ * Persists the preloaded ACL table, or else the cached rules, to the
+ * snapshot file for the next start.
+ */
+static void save_snapshot(struct auth_plugin_userdata *ud)
+{
+	struct acl_snapshot_writer writer;
+	int64_t start = mono_time_ms();
+	int rc;
+
+	acl_snapshot_writer_init(&writer);
+	if (ud->aclStore)
+	{
+		rc = acl_snapshot_writer_add_store(&writer, ud->aclStore);
+	}
+	else
+	{
+		rc = acl_snapshot_writer_add_cache(&writer, &ud->aclCache);
+	}
+
+	if (rc == MOSQ_ERR_SUCCESS)
+	{
+		rc = acl_snapshot_writer_commit(&writer, ud->snapshotPath, ud->aclStore ? ACL_SNAPSHOT_STORE : 0, ud->aclVersion);
+	}
+
+	if (rc == MOSQ_ERR_SUCCESS)
+	{
+		mosquitto_log_printf(MOSQ_LOG_DEBUG, "(mosquitto-auth-plugin) Wrote ACL snapshot with %llu clients in %lld ms.",
+							 (unsigned long long)writer.record_count, (long long)(mono_time_ms() - start));
+	}
+	acl_snapshot_writer_cleanup(&writer);
+}
+
+/*
+ * Function: start_refresher
+ *
+ * Starts the worker refreshing cached rules ahead of their expiry, once the
+ * ACL statement has been prepared on a connection of the pool.
+ */
+static void start_refresher(struct auth_plugin_userdata *ud)
+{
+	bool accessFirst;
+	char *aclQuery = db_format_acl_query(ud->options.aclQuery, &accessFirst);
+	if (aclQuery == NULL)
+	{
+		return;
+	}
+
+	if (refresher_start(&ud->refresher, ud->conninfo, aclQuery, &ud->aclStatement) == MOSQ_ERR_SUCCESS)
+	{
+		mosquitto_log_printf(MOSQ_LOG_INFO, "(mosquitto-auth-plugin) Refreshing cached rules %lld s ahead of expiry.",
+							 (long long)(ud->refreshAhead / 1000));
+	}
+	else
+	{
+		mosquitto_log_printf(MOSQ_LOG_WARNING, "(mosquitto-auth-plugin) Starting the ACL refresh worker failed, cached rules expire as usual.");
+	}
+	mosquitto_free(aclQuery);
+}
+
+/*
+ * Function: start_trace
+ *
+ * Starts capturing the callbacks to the trace file of the options, if one
+ * is set. A trace that cannot be written only costs the capture.
+ */
+static void start_trace(struct auth_plugin_userdata *ud)
+{
+	struct plugin_options *opts = &ud->options;
+
+	if (opts->tracePath == NULL)
+	{
+		return;
+	}
+
+	if (trace_start(&ud->trace, opts->tracePath, opts->traceSample, (size_t)opts->traceBufferSize << 20) == MOSQ_ERR_SUCCESS)
+	{
+		mosquitto_log_printf(MOSQ_LOG_INFO, "(mosquitto-auth-plugin) Tracing one client in %ld to %s (%ld MiB buffer).",
+							 opts->traceSample, opts->tracePath, opts->traceBufferSize);
+	}
+	else
+	{
+		mosquitto_log_printf(MOSQ_LOG_WARNING, "(mosquitto-auth-plugin) Starting the trace to %s failed, callbacks are not captured.", opts->tracePath);
+	}
+}
+
+/*
+ * Function: apply_refreshes
+ *
+ * Replaces the cached entries the refresh worker has fresh rules for,
+ * unless the ACL data changed since they were asked for. Only this thread
+ * touches the cache, so the old entry is freed on the spot.
+ */
+static void apply_refreshes(struct auth_plugin_userdata *ud)
+{
+	struct refresh_job *job;
+
+	while ((job = refresher_poll(&ud->refresher)) != NULL)
+	{
+		if (!job->answered)
+		{
+			ud->metrics.cache_refresh_errors++;
+		}
+		else if (job->generation == ud->aclGeneration)
+		{
+			check_rules(ud, job->key, job->username, job->access, NULL, (const char **)job->patterns, job->pattern_count, true,
+						&job->shared_stamp);
+			ud->metrics.cache_refreshes++;
+		}
+		refresher_release(&ud->refresher, job);
+	}
+}
+
+// replace `*copy' with a copy of `value', false if out of memory
+static bool copy_option(const char *value, char **copy)
+{
+	mosquitto_free(*copy);
+	*copy = mosquitto_strdup(value);
+	return *copy != NULL;
+}
+
+static void free_options(struct plugin_options *opts)
+{
+	mosquitto_free(opts->dbName);
+	mosquitto_free(opts->dbPort);
+	mosquitto_free(opts->aclQuery);
+	mosquitto_free(opts->unixSocketPath);
+	mosquitto_free(opts->notifyChannel);
+	mosquitto_free(opts->preloadQuery);
+	mosquitto_free(opts->deltaQuery);
+	mosquitto_free(opts->prefetchQuery);
+	mosquitto_free(opts->snapshotPath);
+	mosquitto_free(opts->sharedName);
+	mosquitto_free(opts->filePath);
+	mosquitto_free(opts->tracePath);
+	memset(opts, 0, sizeof(*opts));
+}
+
+/*
+ * Function: parse_options
+ *
+ * Reads the plugin options into `opts', checking every value and that the
+ * ones the ACL backend needs are set. Used at startup and on configuration
+ * reloads; `opts' is to be freed with free_options() whatever the outcome.
+ *
+ * Return value:
+ *	MOSQ_ERR_SUCCESS, MOSQ_ERR_INVAL for an invalid value, MOSQ_ERR_UNKNOWN
+ *	for a missing one, MOSQ_ERR_NOMEM.
+ */
+static int parse_options(struct mosquitto_opt *options, int option_count, struct plugin_options *opts)
+{
+	memset(opts, 0, sizeof(*opts));
+	opts->cacheSize = 65536; // caching is off unless a TTL is configured
+	opts->denySize = 16384; // and so is the deny cache
+	opts->breakerCooldown = 5; // the circuit breaker is off by default
+	opts->poolSize = 2;
+	opts->queryTimeout = 1000;
+	opts->deltaInterval = 30;
+	opts->snapshotInterval = 300;
+	opts->metricsInterval = 60;
+	opts->sharedSize = 64;
+	opts->traceSample = 1;
+	opts->traceBufferSize = 4;
+
+	mosquitto_log_printf(MOSQ_LOG_DEBUG, "(mosquitto-auth-plugin) Parsing options, recieved %u options.", option_count);
+	struct mosquitto_opt *option = options;
+	for (int idx = 0; idx < option_count; idx++, option++)
+	{
+		mosquitto_log_printf(MOSQ_LOG_DEBUG, "(mosquitto-auth-plugin) Parsing option %u: (%s %s)", idx + 1, option->key, option->value);
+
+		if (!strcmp(option->key, "db_name"))
+		{
+			// error allocating memory
+			if (!copy_option(option->value, &opts->dbName))
+			{
+				return MOSQ_ERR_NOMEM;
+			}
+		}
+		else if (!strcmp(option->key, "db_port"))
+		{
+			// error allocating memory
+			if (!copy_option(option->value, &opts->dbPort))
+			{
+				return MOSQ_ERR_NOMEM;
+			}
+		}
+		else if (!strcmp(option->key, "acl_backend"))
+		{
+			if (!strcmp(option->value, "postgres") || !strcmp(option->value, "file"))
+			{
+				opts->fileBackend = !strcmp(option->value, "file");
+			}
+			else
+			{
+				mosquitto_log_printf(MOSQ_LOG_ERR, "(mosquitto-auth-plugin) Invalid value for acl_backend: %s, expected postgres or file", option->value);
+				return MOSQ_ERR_INVAL;
+			}
+		}
+		else if (!strcmp(option->key, "acl_file_path"))
+		{
+			// error allocating memory
+			if (!copy_option(option->value, &opts->filePath))
+			{
+				return MOSQ_ERR_NOMEM;
+			}
+		}
+		else if (!strcmp(option->key, "db_pool_size"))
+		{
+			if (!parse_long_option(option->value, 1, 64, &opts->poolSize))
+			{
+				mosquitto_log_printf(MOSQ_LOG_ERR, "(mosquitto-auth-plugin) Invalid value for db_pool_size: %s", option->value);
+				return MOSQ_ERR_INVAL;
+			}
+		}
+		else if (!strcmp(option->key, "db_query_timeout"))
+		{
+			if (!parse_long_option(option->value, 0, INT_MAX, &opts->queryTimeout))
+			{
+				mosquitto_log_printf(MOSQ_LOG_ERR, "(mosquitto-auth-plugin) Invalid value for db_query_timeout: %s", option->value);
+				return MOSQ_ERR_INVAL;
+			}
+		}
+		else if (!strcmp(option->key, "db_timeout_fallback"))
+		{
+			if (!strcmp(option->value, "allow") || !strcmp(option->value, "deny"))
+			{
+				opts->fallbackAllow = !strcmp(option->value, "allow");
+			}
+			else
+			{
+				mosquitto_log_printf(MOSQ_LOG_ERR, "(mosquitto-auth-plugin) Invalid value for db_timeout_fallback: %s, expected allow or deny", option->value);
+				return MOSQ_ERR_INVAL;
+			}
+		}
+		else if (!strcmp(option->key, "db_breaker_threshold"))
+		{
+			if (!parse_long_option(option->value, 0, 100, &opts->breakerThreshold))
+			{
+				mosquitto_log_printf(MOSQ_LOG_ERR, "(mosquitto-auth-plugin) Invalid value for db_breaker_threshold: %s", option->value);
+				return MOSQ_ERR_INVAL;
+			}
+		}
+		else if (!strcmp(option->key, "db_breaker_latency"))
+		{
+			if (!parse_long_option(option->value, 0, INT_MAX, &opts->breakerLatency))
+			{
+				mosquitto_log_printf(MOSQ_LOG_ERR, "(mosquitto-auth-plugin) Invalid value for db_breaker_latency: %s", option->value);
+				return MOSQ_ERR_INVAL;
+			}
+		}
+		else if (!strcmp(option->key, "db_breaker_cooldown"))
+		{
+			if (!parse_long_option(option->value, 1, LONG_MAX / 1000, &opts->breakerCooldown))
+			{
+				mosquitto_log_printf(MOSQ_LOG_ERR, "(mosquitto-auth-plugin) Invalid value for db_breaker_cooldown: %s", option->value);
+				return MOSQ_ERR_INVAL;
+			}
+		}
+		else if (!strcmp(option->key, "db_aclquery"))
+		{
+			// error allocating memory
+			if (!copy_option(option->value, &opts->aclQuery))
+			{
+				return MOSQ_ERR_NOMEM;
+			}
+		}
+		else if (!strcmp(option->key, "unixsocket_path"))
+		{
+			// error allocating memory
+			if (!copy_option(option->value, &opts->unixSocketPath))
+			{
+				return MOSQ_ERR_NOMEM;
+			}
+		}
+		else if (!strcmp(option->key, "db_notify_channel"))
+		{
+			// error allocating memory
+			if (!copy_option(option->value, &opts->notifyChannel))
+			{
+				return MOSQ_ERR_NOMEM;
+			}
+		}
+		else if (!strcmp(option->key, "acl_preload_query"))
+		{
+			// error allocating memory
+			if (!copy_option(option->value, &opts->preloadQuery))
+			{
+				return MOSQ_ERR_NOMEM;
+			}
+		}
+		else if (!strcmp(option->key, "acl_prefetch_query"))
+		{
+			// error allocating memory
+			if (!copy_option(option->value, &opts->prefetchQuery))
+			{
+				return MOSQ_ERR_NOMEM;
+			}
+		}
+		else if (!strcmp(option->key, "acl_delta_query"))
+		{
+			// error allocating memory
+			if (!copy_option(option->value, &opts->deltaQuery))
+			{
+				return MOSQ_ERR_NOMEM;
+			}
+		}
+		else if (!strcmp(option->key, "acl_delta_interval"))
+		{
+			if (!parse_long_option(option->value, 1, LONG_MAX / 1000, &opts->deltaInterval))
+			{
+				mosquitto_log_printf(MOSQ_LOG_ERR, "(mosquitto-auth-plugin) Invalid value for acl_delta_interval: %s", option->value);
+				return MOSQ_ERR_INVAL;
+			}
+		}
+		else if (!strcmp(option->key, "acl_snapshot_path"))
+		{
+			// error allocating memory
+			if (!copy_option(option->value, &opts->snapshotPath))
+			{
+				return MOSQ_ERR_NOMEM;
+			}
+		}
+		else if (!strcmp(option->key, "acl_shared_name"))
+		{
+			// error allocating memory
+			if (!copy_option(option->value, &opts->sharedName))
+			{
+				return MOSQ_ERR_NOMEM;
+			}
+		}
+		else if (!strcmp(option->key, "acl_shared_size"))
+		{
+			if (!parse_long_option(option->value, 1, 1L << 16, &opts->sharedSize))
+			{
+				mosquitto_log_printf(MOSQ_LOG_ERR, "(mosquitto-auth-plugin) Invalid value for acl_shared_size: %s", option->value);
+				return MOSQ_ERR_INVAL;
+			}
+		}
+		else if (!strcmp(option->key, "acl_snapshot_interval"))
+		{
+			if (!parse_long_option(option->value, 0, LONG_MAX / 1000, &opts->snapshotInterval))
+			{
+				mosquitto_log_printf(MOSQ_LOG_ERR, "(mosquitto-auth-plugin) Invalid value for acl_snapshot_interval: %s", option->value);
+				return MOSQ_ERR_INVAL;
+			}
+		}
+		else if (!strcmp(option->key, "metrics_interval"))
+		{
+			if (!parse_long_option(option->value, 0, LONG_MAX / 1000, &opts->metricsInterval))
+			{
+				mosquitto_log_printf(MOSQ_LOG_ERR, "(mosquitto-auth-plugin) Invalid value for metrics_interval: %s", option->value);
+				return MOSQ_ERR_INVAL;
+			}
+		}
+		else if (!strcmp(option->key, "acl_cache_ttl"))
+		{
+			if (!parse_long_option(option->value, 0, LONG_MAX / 1000, &opts->cacheTTL))
+			{
+				mosquitto_log_printf(MOSQ_LOG_ERR, "(mosquitto-auth-plugin) Invalid value for acl_cache_ttl: %s", option->value);
+				return MOSQ_ERR_INVAL;
+			}
+		}
+		else if (!strcmp(option->key, "acl_refresh_ahead"))
+		{
+			if (!parse_long_option(option->value, 0, LONG_MAX / 1000, &opts->refreshAhead))
+			{
+				mosquitto_log_printf(MOSQ_LOG_ERR, "(mosquitto-auth-plugin) Invalid value for acl_refresh_ahead: %s", option->value);
+				return MOSQ_ERR_INVAL;
+			}
+		}
+		else if (!strcmp(option->key, "acl_grant_ttl"))
+		{
+			if (!parse_long_option(option->value, 0, LONG_MAX / 1000, &opts->grantTTL))
+			{
+				mosquitto_log_printf(MOSQ_LOG_ERR, "(mosquitto-auth-plugin) Invalid value for acl_grant_ttl: %s", option->value);
+				return MOSQ_ERR_INVAL;
+			}
+		}
+		else if (!strcmp(option->key, "acl_memo"))
+		{
+			if (!strcmp(option->value, "true") || !strcmp(option->value, "false"))
+			{
+				opts->memo = !strcmp(option->value, "true");
+			}
+			else
+			{
+				mosquitto_log_printf(MOSQ_LOG_ERR, "(mosquitto-auth-plugin) Invalid value for acl_memo: %s, expected true or false", option->value);
+				return MOSQ_ERR_INVAL;
+			}
+		}
+		else if (!strcmp(option->key, "acl_deny_ttl"))
+		{
+			if (!parse_long_option(option->value, 0, LONG_MAX / 1000, &opts->denyTTL))
+			{
+				mosquitto_log_printf(MOSQ_LOG_ERR, "(mosquitto-auth-plugin) Invalid value for acl_deny_ttl: %s", option->value);
+				return MOSQ_ERR_INVAL;
+			}
+		}
+		else if (!strcmp(option->key, "acl_deny_cache_size"))
+		{
+			if (!parse_long_option(option->value, 0, 1L << 30, &opts->denySize))
+			{
+				mosquitto_log_printf(MOSQ_LOG_ERR, "(mosquitto-auth-plugin) Invalid value for acl_deny_cache_size: %s", option->value);
+				return MOSQ_ERR_INVAL;
+			}
+		}
+		else if (!strcmp(option->key, "cert_cache_size"))
+		{
+			if (!parse_long_option(option->value, 0, 1L << 30, &opts->certCacheSize))
+			{
+				mosquitto_log_printf(MOSQ_LOG_ERR, "(mosquitto-auth-plugin) Invalid value for cert_cache_size: %s", option->value);
+				return MOSQ_ERR_INVAL;
+			}
+		}
+		else if (!strcmp(option->key, "trace_path"))
+		{
+			// error allocating memory
+			if (!copy_option(option->value, &opts->tracePath))
+			{
+				return MOSQ_ERR_NOMEM;
+			}
+		}
+		else if (!strcmp(option->key, "trace_sample"))
+		{
+			if (!parse_long_option(option->value, 1, 1000000, &opts->traceSample))
+			{
+				mosquitto_log_printf(MOSQ_LOG_ERR, "(mosquitto-auth-plugin) Invalid value for trace_sample: %s", option->value);
+				return MOSQ_ERR_INVAL;
+			}
+		}
+		else if (!strcmp(option->key, "trace_buffer_size"))
+		{
+			if (!parse_long_option(option->value, 1, 1024, &opts->traceBufferSize))
+			{
+				mosquitto_log_printf(MOSQ_LOG_ERR, "(mosquitto-auth-plugin) Invalid value for trace_buffer_size: %s", option->value);
+				return MOSQ_ERR_INVAL;
+			}
+		}
+		else if (!strcmp(option->key, "acl_cache_size"))
+		{
+			if (!parse_long_option(option->value, 0, 1L << 30, &opts->cacheSize))
+			{
+				mosquitto_log_printf(MOSQ_LOG_ERR, "(mosquitto-auth-plugin) Invalid value for acl_cache_size: %s", option->value);
+				return MOSQ_ERR_INVAL;
+			}
+		}
+	}
+	if (opts->fileBackend && !(opts->filePath && opts->unixSocketPath))
+	{
+		mosquitto_log_printf(MOSQ_LOG_ERR, "(mosquitto-auth-plugin) acl_backend file needs acl_file_path and unixsocket_path.");
+		return MOSQ_ERR_UNKNOWN;
+	}
+	// if name or port is not set then exit
+	if (!opts->fileBackend && !(opts->dbName && opts->dbPort && opts->aclQuery && opts->unixSocketPath))
+	{
+		mosquitto_log_printf(MOSQ_LOG_ERR, "(mosquitto-auth-plugin) Couldn't retrieve all parameters from configuration file, make sure you are setting it properly! (%p %p %p %p)", opts->dbName, opts->dbPort, opts->aclQuery, opts->unixSocketPath);
+		return MOSQ_ERR_UNKNOWN;
+	}
+	// a query that cannot be prepared is rejected now rather than by every connection
+	if (!opts->fileBackend)
+	{
+		bool accessFirst;
+		char *aclQuery = db_format_acl_query(opts->aclQuery, &accessFirst);
+		if (aclQuery == NULL)
+		{
+			return MOSQ_ERR_INVAL;
+		}
+		mosquitto_free(aclQuery);
+	}
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+/*
+ * Function: format_conninfo
+ *
+ * Connection string of database `dbname' through the Unix socket of port
+ * `dbport': peer authentication, therefore no password is exchanged.
+ */
+static char *format_conninfo(const char *dbname, const char *dbport)
+{
+	const char *baseConninfo = "dbname='%s' port=%s";
+
+	// allocate connection string according to the size of each param and parse it
+	char *conninfo = (char *)mosquitto_malloc(sizeof(char) * (strlen(dbname) + strlen(dbport) + strlen(baseConninfo)));
+	if (conninfo)
+	{
+		sprintf(conninfo, baseConninfo, dbname, dbport);
+	}
+	return conninfo;
+}
+
+static bool same_option(const char *a, const char *b)
+{
+	return a == b || (a && b && !strcmp(a, b));
+}
+
+static void restart_only(bool changed, const char *key)
+{
+	if (changed)
+	{
+		mosquitto_log_printf(MOSQ_LOG_WARNING, "(mosquitto-auth-plugin) Reloaded %s ignored, it takes effect on the next restart.", key);
+	}
+}
+
+static void cancel_db_reload(struct auth_plugin_userdata *ud)
+{
+	struct db_reload *reload = &ud->reload;
+
+	db_pool_cleanup(&reload->pool);
+	mosquitto_free(reload->conninfo);
+	mosquitto_free(reload->dbName);
+	mosquitto_free(reload->dbPort);
+	mosquitto_free(reload->aclQuery);
+	memset(reload, 0, sizeof(*reload));
+}
+
+/*
+ * Function: start_db_reload
+ *
+ * Starts opening a pool of connections to database `dbname' on port
+ * `dbport' with `acl_query' prepared on each, without blocking: the running
+ * pool serves checks until finish_db_reload() swaps the new one in.
+ */
+static int start_db_reload(struct auth_plugin_userdata *ud, const char *dbname, const char *dbport, const char *acl_query)
+{
+	struct db_reload *reload = &ud->reload;
+
+	reload->dbName = mosquitto_strdup(dbname);
+	reload->dbPort = mosquitto_strdup(dbport);
+	reload->aclQuery = mosquitto_strdup(acl_query);
+	reload->conninfo = format_conninfo(dbname, dbport);
+	if (reload->dbName == NULL || reload->dbPort == NULL || reload->aclQuery == NULL || reload->conninfo == NULL)
+	{
+		cancel_db_reload(ud);
+		return MOSQ_ERR_NOMEM;
+	}
+
+	int started = db_pool_start(&reload->pool, reload->conninfo, (int)ud->options.poolSize, (int64_t)ud->options.queryTimeout,
+								setup_reload_connection, on_late_rows, ud);
+	if (started != MOSQ_ERR_SUCCESS)
+	{
+		cancel_db_reload(ud);
+		return started;
+	}
+	reload->pending = true;
+	reload->started = mono_time_ms();
+
+	mosquitto_log_printf(MOSQ_LOG_INFO, "(mosquitto-auth-plugin) Opening connections to %s in the background, the running ones serve until then.",
+						 reload->conninfo);
+	return MOSQ_ERR_SUCCESS;
+}
+
+/*
+ * Function: finish_db_reload
+ *
+ * Takes the connections of a reload one step further, and swaps them in
+ * for the running pool once they are all up, or the primary is and the
+ * others are still not after DB_RECONNECT_MAX ms. Cached rules are kept
+ * when only the port changed. Rules fetched with another query or from
+ * another database are expired over the next RELOAD_REVALIDATE_SPREAD ms,
+ * busiest clients first, rather than dropped at once: clients keep being
+ * answered from memory and the new rules come in at a pace the database
+ * takes, compiled rule sets staying shared with the entries not yet
+ * fetched again.
+ */
+static void finish_db_reload(struct auth_plugin_userdata *ud)
+{
+	struct db_reload *reload = &ud->reload;
+	struct plugin_options *opts = &ud->options;
+
+	db_pool_maintain(&reload->pool);
+	if (!db_pool_ready(&reload->pool)
+		&& !(db_pool_primary(&reload->pool) && mono_time_ms() - reload->started >= DB_RECONNECT_MAX))
+	{
+		return;
+	}
+
+	bool rulesChanged = !same_option(reload->aclQuery, opts->aclQuery) || !same_option(reload->dbName, opts->dbName);
+	bool refreshing = ud->refresher.running;
+
+	// the worker has its own connection and statement
+	refresher_stop(&ud->refresher);
+
+	db_pool_cleanup(&ud->dbPool);
+	ud->dbPool = reload->pool;
+	ud->dbPool.setup = setup_connection;
+	if (ud->deltaRunning)
+	{
+		// the delta went with the old connections, run it again on the new ones
+		ud->deltaRunning = false;
+		ud->nextDelta = mono_time_ms();
+	}
+	ud->aclStatement = reload->aclStatement;
+	mosquitto_free(ud->conninfo);
+	ud->conninfo = reload->conninfo;
+	mosquitto_free(opts->dbName);
+	mosquitto_free(opts->dbPort);
+	mosquitto_free(opts->aclQuery);
+	opts->dbName = reload->dbName;
+	opts->dbPort = reload->dbPort;
+	opts->aclQuery = reload->aclQuery;
+	memset(reload, 0, sizeof(*reload));
+	ud->metrics.db_swaps++;
+
+	mosquitto_log_printf(MOSQ_LOG_INFO, "(mosquitto-auth-plugin) Switched to the connections to %s.", ud->conninfo);
+
+	if (rulesChanged)
+	{
+		mosquitto_log_printf(MOSQ_LOG_INFO, "(mosquitto-auth-plugin) ACL query or database changed, fetching the cached rules again over %d s.",
+							 RELOAD_REVALIDATE_SPREAD / 1000);
+		// refreshes in flight ran the old query
+		ud->aclGeneration++;
+		acl_cache_expire_spread(&ud->aclCache, RELOAD_REVALIDATE_SPREAD);
+		// what was derived from the old rules, all cheap to work out again from the cached ones
+		acl_shared_clear(&ud->aclShared);
+		client_table_drop_grants(&ud->clients, NULL);
+		client_table_drop_memo(&ud->clients, NULL);
+		deny_cache_clear(&ud->denyCache);
+		acl_snapshot_close(&ud->snapshot);
+	}
+
+	if (refreshing)
+	{
+		start_refresher(ud);
+	}
+}
+
+/*
+ * Function: reload_database
+ *
+ * Compares the reloaded database options to the running ones and to those
+ * of a reload still under way, opening connections for them if they are
+ * new. With a preloaded table the database cannot change, its deltas being
+ * relative to its own versions.
+ */
+static void reload_database(struct auth_plugin_userdata *ud, const struct plugin_options *next)
+{
+	const struct plugin_options *opts = &ud->options;
+	struct db_reload *reload = &ud->reload;
+	const char *dbname = next->dbName;
+
+	if (ud->aclStore && !same_option(dbname, opts->dbName))
+	{
+		restart_only(true, "db_name");
+		dbname = opts->dbName;
+	}
+
+	if (same_option(dbname, opts->dbName) && same_option(next->dbPort, opts->dbPort) && same_option(next->aclQuery, opts->aclQuery))
+	{
+		if (reload->pending)
+		{
+			mosquitto_log_printf(MOSQ_LOG_INFO, "(mosquitto-auth-plugin) Database options back to the running ones, closing the connections being opened.");
+			cancel_db_reload(ud);
+		}
+		return;
+	}
+
+	if (reload->pending && same_option(dbname, reload->dbName) && same_option(next->dbPort, reload->dbPort)
+		&& same_option(next->aclQuery, reload->aclQuery))
+	{
+		return;
+	}
+
+	cancel_db_reload(ud);
+	if (start_db_reload(ud, dbname, next->dbPort, next->aclQuery) != MOSQ_ERR_SUCCESS)
+	{
+		mosquitto_log_printf(MOSQ_LOG_ERR, "(mosquitto-auth-plugin) Opening connections for the reloaded database options failed, keeping the running ones.");
+	}
+}
+
+/*
+ * Function: mosq_reload
+ *
+ * Called by the broker when its configuration is reloaded, with the plugin
+ * options read again. Options the running caches and connections can take
+ * in place are applied at once, and a new database or ACL query gets
+ * connections of its own, opened in the background (see
+ * finish_db_reload()), so a reload neither drops clients nor empties the
+ * caches. Options only read at startup keep their value until the next
+ * restart, with a warning. Invalid options are rejected as a whole, the
+ * running ones are kept.
+ */
+static int mosq_reload(int event, void *event_data, void *userdata)
+{
+	struct mosquitto_evt_reload *ed = event_data;
+	struct auth_plugin_userdata *ud = *(auth_plugin_userdata **)userdata;
+	struct plugin_options *opts = &ud->options;
+	struct plugin_options next;
+
+	// a query that could not be prepared must not replace a working one, parse_options() checks it
+	if (parse_options(ed->options, ed->option_count, &next) != MOSQ_ERR_SUCCESS)
+	{
+		mosquitto_log_printf(MOSQ_LOG_ERR, "(mosquitto-auth-plugin) Invalid plugin options reloaded, keeping the running configuration.");
+		free_options(&next);
+		return MOSQ_ERR_SUCCESS;
+	}
+
+	restart_only(next.fileBackend != opts->fileBackend, "acl_backend");
+	restart_only(!same_option(next.filePath, opts->filePath), "acl_file_path");
+	restart_only(next.poolSize != opts->poolSize, "db_pool_size");
+	restart_only(!same_option(next.notifyChannel, opts->notifyChannel), "db_notify_channel");
+	restart_only(!same_option(next.preloadQuery, opts->preloadQuery), "acl_preload_query");
+	restart_only(!same_option(next.deltaQuery, opts->deltaQuery), "acl_delta_query");
+	restart_only(!same_option(next.prefetchQuery, opts->prefetchQuery), "acl_prefetch_query");
+	restart_only(!same_option(next.snapshotPath, opts->snapshotPath), "acl_snapshot_path");
+	restart_only(!same_option(next.sharedName, opts->sharedName), "acl_shared_name");
+	restart_only(next.sharedSize != opts->sharedSize, "acl_shared_size");
+	restart_only(next.refreshAhead != opts->refreshAhead, "acl_refresh_ahead");
+	restart_only(next.grantTTL != opts->grantTTL, "acl_grant_ttl");
+	restart_only(next.memo != opts->memo, "acl_memo");
+	restart_only(next.cacheSize != opts->cacheSize, "acl_cache_size");
+	restart_only(next.denySize != opts->denySize, "acl_deny_cache_size");
+	restart_only(next.certCacheSize != opts->certCacheSize, "cert_cache_size");
 
-	int access_type = ed->access;
+	// caches are sized at startup, their TTL can change as long as they stay enabled
+	restart_only((next.cacheTTL > 0) != (opts->cacheTTL > 0), "acl_cache_ttl");
+	if (acl_cache_enabled(&ud->aclCache) && next.cacheTTL > 0)
+	{
+		opts->cacheTTL = next.cacheTTL;
+		ud->aclCache.ttl_ms = (int64_t)next.cacheTTL * 1000;
+	}
+	restart_only((next.denyTTL > 0) != (opts->denyTTL > 0), "acl_deny_ttl");
+	if (deny_cache_enabled(&ud->denyCache) && next.denyTTL > 0)
+	{
+		opts->denyTTL = next.denyTTL;
+		ud->denyCache.ttl_ms = (int64_t)next.denyTTL * 1000;
+	}
 
-#ifdef DEBUG
-	mosquitto_log_printf(MOSQ_LOG_DEBUG, "(mosquitto-auth-plugin) username{%s}, cid{%s}, topic{%s}, access{%d}", mosquitto_client_username(ed->client), mosquitto_client_id(ed->client), ed->topic, ed->access);
-#endif
+	ud->dbFallbackAllow = opts->fallbackAllow = next.fallbackAllow;
+	opts->queryTimeout = next.queryTimeout;
+	ud->dbPool.timeout_ms = ud->reload.pool.timeout_ms = (int64_t)next.queryTimeout;
+	if (!opts->fileBackend && (next.breakerThreshold != opts->breakerThreshold || next.breakerLatency != opts->breakerLatency
+							   || next.breakerCooldown != opts->breakerCooldown))
+	{
+		opts->breakerThreshold = next.breakerThreshold;
+		opts->breakerLatency = next.breakerLatency;
+		opts->breakerCooldown = next.breakerCooldown;
+		breaker_init(&ud->dbBreaker, (int)opts->breakerThreshold, (int64_t)opts->breakerLatency, (int64_t)opts->breakerCooldown * 1000);
+		ud->metrics.db_breaker_open = false;
+	}
 
-	// grab userdata passed to the function
-	struct auth_plugin_userdata *ud = *(auth_plugin_userdata **)userdata;
+	if (next.metricsInterval != opts->metricsInterval)
+	{
+		opts->metricsInterval = next.metricsInterval;
+		ud->metricsInterval = (int64_t)opts->metricsInterval * 1000;
+		ud->nextMetrics = mono_time_ms() + ud->metricsInterval;
+	}
+	if (next.snapshotInterval != opts->snapshotInterval)
+	{
+		opts->snapshotInterval = next.snapshotInterval;
+		ud->snapshotInterval = (int64_t)opts->snapshotInterval * 1000;
+		ud->nextSnapshot = mono_time_ms() + ud->snapshotInterval;
+	}
+	opts->deltaInterval = next.deltaInterval;
+	ud->deltaInterval = (int64_t)opts->deltaInterval * 1000;
 
-	// build query string
-	const char *baseQuery = ud->baseACLQuery;
+	if (!same_option(next.unixSocketPath, opts->unixSocketPath))
+	{
+		char *path = opts->unixSocketPath;
+		opts->unixSocketPath = next.unixSocketPath;
+		next.unixSocketPath = path;
+	}
 
-	char *query = (char *)mosquitto_malloc(sizeof(char) * (strlen(baseQuery) + strlen(client_id) + 1));
-	sprintf(query, baseQuery, client_id, access_type);
+	// a changed trace starts over, as does one that failed: a capture can be taken without restarting the broker
+	if (!same_option(next.tracePath, opts->tracePath) || next.traceSample != opts->traceSample || next.traceBufferSize != opts->traceBufferSize
+		|| (next.tracePath && !trace_enabled(&ud->trace)))
+	{
+		trace_stop(&ud->trace);
+		char *path = opts->tracePath;
+		opts->tracePath = next.tracePath;
+		next.tracePath = path;
+		opts->traceSample = next.traceSample;
+		opts->traceBufferSize = next.traceBufferSize;
+		start_trace(ud);
+	}
 
-#ifdef DEBUG
-	mosquitto_log_printf(MOSQ_LOG_DEBUG, "%s", query);
-#endif
+	if (!opts->fileBackend && !next.fileBackend)
+	{
+		reload_database(ud, &next);
+	}
+
+	free_options(&next);
+	ud->metrics.reloads++;
+	mosquitto_log_printf(MOSQ_LOG_INFO, "(mosquitto-auth-plugin) Configuration reloaded.");
+	return MOSQ_ERR_SUCCESS;
+}
 
-	// query database for topics with the requested permission
-	// and check for errors
-	PGresult *result = PQexec(ud->dbconn, query);
+/*
+ * Function: mosq_tick
+ *
+ * Called by the broker on every iteration of its main loop. Picks up the
+ * ACL changes the backend reports without blocking, keeps the preloaded ACL
+ * store up to date and takes care of the database connections, those of a
+ * configuration reload included, and ACL snapshot.
+ */
+static int mosq_tick(int event, void *event_data, void *userdata)
+{
+	struct auth_plugin_userdata *ud = *(auth_plugin_userdata **)userdata;
 
-	if (PQresultStatus(result) != PGRES_TUPLES_OK)
+	if (ud->reload.pending)
 	{
-		mosquitto_log_printf(MOSQ_LOG_DEBUG, "(mosquitto-auth-plugin) Database error: %s.", PQresultErrorMessage(result));
+		finish_db_reload(ud);
 	}
 
-	if (PQnfields(result) != 1)
+	if (db_pool_maintain(&ud->dbPool))
 	{
-		mosquitto_log_printf(MOSQ_LOG_DEBUG, "(mosquitto-auth-plugin) Database error: Expected 1 number of fields, got %d.", PQnfields(result));
+		// catch up with the changes missed while disconnected
+		ud->nextDelta = mono_time_ms();
+		if (ud->notifyChannel)
+		{
+			// the notifications sent while nobody listened are lost, any cached rule may be stale
+			mosquitto_log_printf(MOSQ_LOG_INFO, "(mosquitto-auth-plugin) Listening again after losing the database, ACL changes may have been missed.");
+			on_acl_change(NULL, ud);
+		}
+		if (ud->refreshAhead > 0 && !ud->refresher.running)
+		{
+			start_refresher(ud);
+		}
 	}
 
-	// get number of results to iterate
-	int rec_count = PQntuples(result);
-	for (int row = 0; row < rec_count; row++)
+	// a tripped circuit breaker closes once the database answers a probe again
+	if (breaker_probe_due(&ud->dbBreaker))
 	{
-		char *acl_wildcard = PQgetvalue(result, row, 0);
+		db_pool_probe(&ud->dbPool);
+	}
+	if (db_pool_probe_result(&ud->dbPool) > 0 && ud->dbBreaker.open)
+	{
+		mosquitto_log_printf(MOSQ_LOG_INFO, "(mosquitto-auth-plugin) Database answering again, circuit breaker closed.");
+		breaker_close(&ud->dbBreaker);
+		ud->metrics.db_breaker_open = false;
+	}
 
-		if (acl_wildcard != NULL)
-		{
-#ifdef DEBUG
-			mosquitto_log_printf(MOSQ_LOG_DEBUG, "(mosquitto-auth-plugin) %s", acl_wildcard);
-#endif
-			char *expanded;
+	apply_refreshes(ud);
 
-			t_expand(client_id, username, acl_wildcard, &expanded);
-			if (expanded && *expanded)
-			{
-				bool result;
-				//mosquitto_sub_matches(expanded, topic, &result);
-				result = sub_acl_check(expanded, topic);
-#ifdef DEBUG
-				mosquitto_log_printf(MOSQ_LOG_DEBUG, "(mosquitto-auth-plugin) topic_matches(%s, %s) == %d",
-									 expanded, topic, result);
-#endif
+	if (acl_snapshot_is_open(&ud->snapshot))
+	{
+		revalidate_snapshot(ud);
+	}
 
-				mosquitto_free(expanded);
+	if (ud->snapshotPath && ud->snapshotInterval > 0 && mono_time_ms() >= ud->nextSnapshot)
+	{
+		ud->nextSnapshot = mono_time_ms() + ud->snapshotInterval;
+		save_snapshot(ud);
+	}
 
-				if (result)
-				{
-					match = true; // matches at least 1 topic with valid permissions, user is authorized
-					break;
-				}
-			}
-			else
-			{
-				mosquitto_free(expanded);
-			}
+	if (ud->metricsInterval > 0 && mono_time_ms() >= ud->nextMetrics)
+	{
+		ud->nextMetrics = mono_time_ms() + ud->metricsInterval;
+		if (metrics_publish(&ud->metrics, &ud->aclCache, &ud->denyCache, &ud->clients, &ud->certCache) != MOSQ_ERR_SUCCESS)
+		{
+			mosquitto_log_printf(MOSQ_LOG_WARNING, "(mosquitto-auth-plugin) Publishing metrics failed.");
 		}
 	}
-	return match ? MOSQ_ERR_SUCCESS : MOSQ_ERR_ACL_DENIED;
+
+	if (ud->aclStore && ud->deltaQuery)
+	{
+		sync_acl_store(ud);
+	}
+
+	if (trace_flush(&ud->trace) != MOSQ_ERR_SUCCESS)
+	{
+		mosquitto_log_printf(MOSQ_LOG_WARNING, "(mosquitto-auth-plugin) Writing the trace to %s failed, capture stopped.", ud->options.tracePath);
+		trace_stop(&ud->trace);
+	}
+
+	struct acl_backend_events events = {.changed = on_acl_change, .arg = ud};
+	acl_backend_poll(ud->aclBackend, &events);
+	return MOSQ_ERR_SUCCESS;
 }
 
 /*
- * Function: mosq_basic_auth_check
+ * Function: basic_auth_check
  *
- * Called by the broker when topic access must be checked. access will be one
- * of:
- *  MOSQ_ACL_SUBSCRIBE when a client is asking to subscribe to a topic string.
- *                     This differs from MOSQ_ACL_READ in that it allows you to
- *                     deny access to topic strings rather than by pattern. For
- *                     example, you may use MOSQ_ACL_SUBSCRIBE to deny
- *                     subscriptions to '#', but allow all topics in
- *                     MOSQ_ACL_READ. This allows clients to subscribe to any
- *                     topic they want, but not discover what topics are in use
- *                     on the server.
- *  MOSQ_ACL_READ      when a message is about to be sent to a client (i.e. whether
- *                     it can read that topic or not).
- *  MOSQ_ACL_WRITE     when a message has been received from a client (i.e. whether
- *                     it can write to that topic or not).
+ * Authenticates a connecting client. One coming through the Unix socket
+ * listener must supply a username containing its client id. Any other must
+ * present a certificate, whose common name becomes its username and must
+ * contain its client id too. The common name of a certificate seen before
+ * is taken from the certificate cache instead of being parsed again.
  *
  * Return:
- *	MOSQ_ERR_SUCCESS if access was granted.
- *	MOSQ_ERR_ACL_DENIED if access was not granted.
- *	MOSQ_ERR_UNKNOWN for an application specific error.
- *	MOSQ_ERR_PLUGIN_DEFER if your plugin does not wish to handle this check.
+ *	MOSQ_ERR_SUCCESS if the client is let in.
+ *	MOSQ_ERR_AUTH if the username or common name does not contain the client
+ *	id, or a Unix socket client lacks a username or client id.
+ *	MOSQ_ERR_UNKNOWN if a TLS client presented no certificate, or one without
+ *	a common name.
+ *
+ * `identity' is set to the cached identity of the client's certificate,
+ * whatever the result, or NULL if the client came through the Unix socket,
+ * presented no certificate with a common name, or its certificate could not
+ * be cached (the certificate cache being disabled, or out of memory).
  */
-static int mosq_basic_auth_check(int event, void *event_data, void *userdata)
+static int basic_auth_check(int event, void *event_data, void *userdata, struct cert_identity **identity)
 {
 #ifdef DEBUG
 	mosquitto_log_printf(MOSQ_LOG_ERR, "(mosquitto-auth-plugin) New client connected.");
@@ -142,10 +1796,12 @@ static int mosq_basic_auth_check(int event, void *event_data, void *userdata)
 	// grab userdata passed to the function
 	struct auth_plugin_userdata *ud = *(auth_plugin_userdata **)userdata;
 
+	*identity = NULL;
+
 	// get client certificate and subject
 	X509 *client_cert = mosquitto_client_certificate(ed->client);
 
-	if (!strcmp(mosquitto_client_address(ed->client), ud->unixSocketPath)) { // Unix Socket communication (trusted)
+	if (!strcmp(mosquitto_client_address(ed->client), ud->options.unixSocketPath)) { // Unix Socket communication (trusted)
 	
 		// get client id and username
 		const char *client_id = mosquitto_client_id(ed->client);
@@ -169,6 +1825,26 @@ static int mosq_basic_auth_check(int event, void *event_data, void *userdata)
 		}
 	}
 	else if (client_cert){ // TLS IP communication
+		// a certificate seen before needs no parsing, its common name is known
+		struct cert_key key;
+		bool keyed = cert_cache_enabled(&ud->certCache) && cert_cache_key(client_cert, &key);
+		struct cert_identity *cached = keyed ? cert_cache_get(&ud->certCache, &key) : NULL;
+		if (cached)
+		{
+			X509_free(client_cert);
+			mosquitto_set_username(ed->client, cached->common_name);
+			*identity = cached;
+
+			const char *client_id = mosquitto_client_id(ed->client);
+			if (!cert_identity_match(cached, client_id))
+			{
+				mosquitto_log_printf(MOSQ_LOG_DEBUG, "(mosquitto-auth-plugin) Mismatch between client id (%s) and username (%s), connection refused.", client_id, cached->common_name);
+				return MOSQ_ERR_AUTH;
+			}
+			mosquitto_log_printf(MOSQ_LOG_DEBUG, "(mosquitto-auth-plugin) Found client id (%s) in username (%s), connection allowed.", client_id, cached->common_name);
+			return MOSQ_ERR_SUCCESS;
+		}
+
 		X509_NAME *name = X509_get_subject_name(client_cert);
 
 		// get index of the common name
@@ -207,6 +1883,12 @@ static int mosq_basic_auth_check(int event, void *event_data, void *userdata)
 	#ifdef DEBUG
 			mosquitto_log_printf(MOSQ_LOG_DEBUG, "(mosquitto-auth-plugin) Setting username returned %u", ret);
 	#endif
+			// repeat connects with this certificate start from here
+			if (keyed)
+			{
+				*identity = cert_cache_put(&ud->certCache, &key, username);
+			}
+
 			// free allocated memory since it is not longer required
 			X509_free(client_cert);
 
@@ -214,7 +1896,7 @@ static int mosq_basic_auth_check(int event, void *event_data, void *userdata)
 			const char *client_id = mosquitto_client_id(ed->client);
 
 			// check if client id is in the certificate's common name / username (as in the specification)
-			if (!strstr(username, client_id))
+			if (*identity ? !cert_identity_match(*identity, client_id) : !strstr(username, client_id))
 			{
 				mosquitto_log_printf(MOSQ_LOG_DEBUG, "(mosquitto-auth-plugin) Mismatch between client id (%s) and username (%s), connection refused.", client_id, username);
 				return MOSQ_ERR_AUTH;
@@ -234,6 +1916,150 @@ static int mosq_basic_auth_check(int event, void *event_data, void *userdata)
 	return MOSQ_ERR_UNKNOWN;
 }
 
+/*
+ * Function: prefetch_rules
+ *
+ * Fills the ACL cache with the rules of a client that has just
+ * authenticated, for every access type at once, from the rows of the
+ * acl_prefetch_query. Its first checks then need no query. Nothing is
+ * cached if the query fails, the checks query per access type as usual.
+ *
+ * Return:
+ *	true if the rules were cached.
+ */
+static bool prefetch_rules(struct auth_plugin_userdata *ud, const char *client_id, const char *username)
+{
+	if (ud->prefetchQuery == NULL || client_id == NULL || ud->dbBreaker.open)
+	{
+		return false;
+	}
+
+	struct acl_shared_stamp stamps[4]; // one per access type, MOSQ_ACL_READ to MOSQ_ACL_UNSUBSCRIBE
+	for (int idx = 0, access_type = MOSQ_ACL_READ; access_type <= MOSQ_ACL_UNSUBSCRIBE; idx++, access_type <<= 1)
+	{
+		stamps[idx] = acl_shared_stamp(&ud->aclShared, client_id, access_type);
+	}
+
+	bool timed_out;
+	int64_t start = mono_time_ns();
+	PGresult *result = db_pool_exec_rule_query(&ud->dbPool, ud->prefetchQuery, client_id, &timed_out);
+	record_query(ud, result == NULL ? (timed_out ? ACL_FETCH_TIMEOUT : ACL_FETCH_UNAVAILABLE)
+				 : PQresultStatus(result) != PGRES_TUPLES_OK ? ACL_FETCH_ERROR : ACL_FETCH_OK,
+				 start, mono_time_ns());
+	if (result == NULL)
+	{
+		return false;
+	}
+	if (PQresultStatus(result) != PGRES_TUPLES_OK || PQnfields(result) < 3)
+	{
+		mosquitto_log_printf(MOSQ_LOG_DEBUG, "(mosquitto-auth-plugin) Prefetching the rules of %s failed: %s", client_id,
+							 PQresultStatus(result) == PGRES_TUPLES_OK ? "expected client id, access and topic columns." : PQresultErrorMessage(result));
+		ud->metrics.db_errors++;
+		PQclear(result);
+		return false;
+	}
+
+	int rec_count = PQntuples(result);
+	metrics_record(&ud->metrics.db_rows, (uint64_t)rec_count, 0);
+
+	const char **patterns = NULL;
+	if (rec_count > 0)
+	{
+		patterns = (const char **)mosquitto_malloc(sizeof(char *) * rec_count);
+		if (patterns == NULL)
+		{
+			PQclear(result);
+			return false;
+		}
+	}
+
+	// one cache entry per access type, an empty one for a type no row grants
+	for (int idx = 0, access_type = MOSQ_ACL_READ; access_type <= MOSQ_ACL_UNSUBSCRIBE; idx++, access_type <<= 1)
+	{
+		int pattern_count = 0;
+		for (int row = 0; row < rec_count; row++)
+		{
+			if (!PQgetisnull(result, row, 2) && (strtol(PQgetvalue(result, row, 1), NULL, 10) & access_type))
+			{
+				patterns[pattern_count++] = PQgetvalue(result, row, 2);
+			}
+		}
+		check_rules(ud, client_id, username, access_type, NULL, patterns, pattern_count, true, &stamps[idx]);
+	}
+	ud->metrics.cache_prefetches++;
+
+	mosquitto_free(patterns);
+	PQclear(result);
+	return true;
+}
+
+/*
+ * Function: mosq_basic_auth_check
+ *
+ * Authentication callback registered with the broker: times
+ * <basic_auth_check> for the plugin's metrics, then sets up the state of
+ * the client it let in and prefetches its rules, unless they were for the
+ * same certificate and client id and are still cached.
+ */
+static int mosq_basic_auth_check(int event, void *event_data, void *userdata)
+{
+	struct auth_plugin_userdata *ud = *(auth_plugin_userdata **)userdata;
+	int64_t start = mono_time_ns();
+
+	struct cert_identity *identity;
+	int rc = basic_auth_check(event, event_data, userdata, &identity);
+
+	metrics_record_latency(&ud->metrics.basic_auth[rc == MOSQ_ERR_SUCCESS], start, mono_time_ns());
+
+	if (rc == MOSQ_ERR_SUCCESS)
+	{
+		struct mosquitto_evt_basic_auth *ed = event_data;
+		const char *client_id = mosquitto_client_id(ed->client), *username = mosquitto_client_username(ed->client);
+
+		// freed on MOSQ_EVT_DISCONNECT, the client's grants and decisions go without it
+		if (client_id && client_table_enabled(&ud->clients))
+		{
+			client_table_add(&ud->clients, ed->client, client_id, username);
+		}
+
+		// a device reconnecting with its certificate finds its rules where the last prefetch left them
+		if (identity && identity->prefetch_expires && identity->prefetch_generation == ud->aclGeneration
+			&& identity->prefetch_expires > mono_time_ms())
+		{
+			ud->metrics.cache_prefetches_skipped++;
+		}
+		else if (prefetch_rules(ud, client_id, username) && identity)
+		{
+			identity->prefetch_generation = ud->aclGeneration;
+			identity->prefetch_expires = mono_time_ms() + ud->aclCache.ttl_ms;
+		}
+	}
+
+	if (trace_enabled(&ud->trace))
+	{
+		// how the client came in, for a replay to present it the same way
+		struct mosquitto_evt_basic_auth *ed = event_data;
+		int flags = 0;
+		if (!strcmp(mosquitto_client_address(ed->client), ud->options.unixSocketPath))
+		{
+			flags |= TRACE_UNIX_SOCKET;
+		}
+		else
+		{
+			X509 *client_cert = mosquitto_client_certificate(ed->client);
+			if (client_cert)
+			{
+				flags |= TRACE_CERTIFICATE;
+				X509_free(client_cert);
+			}
+		}
+		// the username is the certificate's common name by now
+		capture(ud, TRACE_BASIC_AUTH, 0, flags, rc, start, mono_time_ns(), mosquitto_client_id(ed->client),
+				mosquitto_client_username(ed->client), NULL);
+	}
+	return rc;
+}
+
 /*
  * Function: mosquitto_plugin_init
  *
@@ -271,82 +2097,183 @@ int mosquitto_plugin_init(mosquitto_plugin_id_t *identifier, void **userdata, st
 	// set identifier
 	data->identifier = identifier;
 
-	// setup connection via peer authentication, therefore no password is exchanged
-	const char *baseConninfo = "dbname='%s' port=%s";
+	int parsed = parse_options(options, option_count, &data->options);
+	if (parsed != MOSQ_ERR_SUCCESS)
+	{
+		return parsed;
+	}
+	struct plugin_options *opts = &data->options;
 
-	char *dbname = NULL, *dbport = NULL;
-	data->baseACLQuery = NULL;
-	data->unixSocketPath = NULL;
+	data->notifyChannel = opts->notifyChannel;
+	data->preloadQuery = opts->preloadQuery;
+	data->deltaQuery = opts->deltaQuery;
+	data->prefetchQuery = opts->prefetchQuery;
+	data->snapshotPath = opts->snapshotPath;
+	long refreshAhead = opts->refreshAhead;
+	long breakerThreshold = opts->breakerThreshold;
 
-	mosquitto_log_printf(MOSQ_LOG_DEBUG, "(mosquitto-auth-plugin) Parsing options, recieved %u options.", option_count);
-	struct mosquitto_opt *option = options;
-	for (int idx = 0; idx < option_count; idx++, option++)
+	// the file holds every rule and reports its own changes, there is no database to act on
+	if (opts->fileBackend && (data->notifyChannel || data->preloadQuery || data->deltaQuery || data->prefetchQuery || data->snapshotPath
+						|| refreshAhead > 0 || breakerThreshold > 0))
 	{
-		mosquitto_log_printf(MOSQ_LOG_DEBUG, "(mosquitto-auth-plugin) Parsing option %u: (%s %s)", idx + 1, option->key, option->value);
+		mosquitto_log_printf(MOSQ_LOG_WARNING, "(mosquitto-auth-plugin) db_notify_channel, acl_preload_query, acl_delta_query, acl_prefetch_query, "
+							 "acl_snapshot_path, acl_refresh_ahead and db_breaker_threshold ignored with acl_backend file.");
+		data->notifyChannel = data->preloadQuery = data->deltaQuery = data->prefetchQuery = data->snapshotPath = NULL;
+		refreshAhead = breakerThreshold = 0;
+	}
 
-		if (!strcmp(option->key, "db_name"))
+	if (acl_cache_init(&data->aclCache, (size_t)opts->cacheSize, (int64_t)opts->cacheTTL * 1000) != MOSQ_ERR_SUCCESS)
+	{
+		mosquitto_log_printf(MOSQ_LOG_ERR, "(mosquitto-auth-plugin) Error allocating memory for the ACL cache.");
+		return MOSQ_ERR_NOMEM;
+	}
+	if (client_table_init(&data->clients, (int64_t)opts->grantTTL * 1000, opts->memo) != MOSQ_ERR_SUCCESS)
+	{
+		mosquitto_log_printf(MOSQ_LOG_ERR, "(mosquitto-auth-plugin) Error allocating memory for the client states.");
+		return MOSQ_ERR_NOMEM;
+	}
+	// denials are counted per client whenever metrics are published
+	if (deny_cache_init(&data->denyCache, (size_t)opts->denySize, (int64_t)opts->denyTTL * 1000, opts->metricsInterval > 0) != MOSQ_ERR_SUCCESS)
+	{
+		mosquitto_log_printf(MOSQ_LOG_ERR, "(mosquitto-auth-plugin) Error allocating memory for the deny cache.");
+		return MOSQ_ERR_NOMEM;
+	}
+	if (cert_cache_init(&data->certCache, (size_t)opts->certCacheSize) != MOSQ_ERR_SUCCESS)
+	{
+		mosquitto_log_printf(MOSQ_LOG_ERR, "(mosquitto-auth-plugin) Error allocating memory for the certificate cache.");
+		return MOSQ_ERR_NOMEM;
+	}
+	mosquitto_log_printf(MOSQ_LOG_DEBUG, "(mosquitto-auth-plugin) Topic matching uses the %s implementation.", topic_scan_impl());
+	if (acl_cache_enabled(&data->aclCache))
+	{
+		mosquitto_log_printf(MOSQ_LOG_INFO, "(mosquitto-auth-plugin) ACL cache enabled (%ld entries, %ld s TTL).", opts->cacheSize, opts->cacheTTL);
+	}
+	if (client_grants_enabled(&data->clients))
+	{
+		mosquitto_log_printf(MOSQ_LOG_INFO, "(mosquitto-auth-plugin) Subscription grants enabled (%ld s TTL).", opts->grantTTL);
+	}
+	if (client_memo_enabled(&data->clients))
+	{
+		mosquitto_log_printf(MOSQ_LOG_INFO, "(mosquitto-auth-plugin) Decision memo enabled (%zu topics per client).", (size_t)CLIENT_MEMO_SLOTS);
+	}
+	if (deny_cache_enabled(&data->denyCache))
+	{
+		mosquitto_log_printf(MOSQ_LOG_INFO, "(mosquitto-auth-plugin) Deny cache enabled (%ld entries, %ld s TTL).", opts->denySize, opts->denyTTL);
+	}
+	if (cert_cache_enabled(&data->certCache))
+	{
+		mosquitto_log_printf(MOSQ_LOG_INFO, "(mosquitto-auth-plugin) Certificate identity cache enabled (%ld entries).", opts->certCacheSize);
+	}
+
+	data->metricsInterval = (int64_t)opts->metricsInterval * 1000;
+	data->nextMetrics = mono_time_ms() + data->metricsInterval;
+
+	// map the ACL data persisted by the previous run, for a warm start
+	data->snapshotInterval = (int64_t)opts->snapshotInterval * 1000;
+	data->nextSnapshot = mono_time_ms() + data->snapshotInterval;
+	if (data->snapshotPath && acl_snapshot_open(&data->snapshot, data->snapshotPath) == MOSQ_ERR_SUCCESS)
+	{
+		mosquitto_log_printf(MOSQ_LOG_INFO, "(mosquitto-auth-plugin) Mapped ACL snapshot %s with %llu clients, written %lld s ago.",
+							 data->snapshotPath, (unsigned long long)data->snapshot.header->record_count,
+							 (long long)(time(NULL) - data->snapshot.header->created));
+	}
+
+	data->dbFallbackAllow = opts->fallbackAllow;
+	breaker_init(&data->dbBreaker, (int)breakerThreshold, (int64_t)opts->breakerLatency, (int64_t)opts->breakerCooldown * 1000);
+	if (opts->fileBackend)
+	{
+		data->aclBackend = acl_backend_file_new(opts->filePath);
+		if (data->aclBackend == NULL)
 		{
-			dbname = option->value;
-			// error allocating memory
-			if (dbname == NULL)
-			{
-				return MOSQ_ERR_NOMEM;
-			}
+			mosquitto_log_printf(MOSQ_LOG_ERR, "(mosquitto-auth-plugin) Reading the ACL file %s failed.", opts->filePath);
+			return MOSQ_ERR_UNKNOWN;
 		}
-		else if (!strcmp(option->key, "db_port"))
+	}
+	else
+	{
+		data->conninfo = format_conninfo(opts->dbName, opts->dbPort);
+		if (data->conninfo == NULL)
 		{
-			dbport = option->value;
-			// error allocating memory
-			if (dbport == NULL)
-			{
-				return MOSQ_ERR_NOMEM;
-			}
+			return MOSQ_ERR_NOMEM;
 		}
-		else if (!strcmp(option->key, "db_aclquery"))
+
+		mosquitto_log_printf(MOSQ_LOG_ERR, "(mosquitto-auth-plugin) Parsed conninfo: %s", data->conninfo);
+
+		// establish connections to the database
+		int ready = db_pool_init(&data->dbPool, data->conninfo, (int)opts->poolSize, (int64_t)opts->queryTimeout, setup_connection, on_late_rows, data);
+		if (ready != MOSQ_ERR_SUCCESS)
 		{
-			data->baseACLQuery = mosquitto_strdup(option->value);
-			// error allocating memory
-			if (data->baseACLQuery == NULL)
-			{
-				return MOSQ_ERR_NOMEM;
-			}
+			return ready;
 		}
-		else if (!strcmp(option->key, "unixsocket_path"))
+		/* Check to see that the primary backend connection was successfully made */
+		if (db_pool_primary(&data->dbPool) == NULL)
 		{
-			data->unixSocketPath = mosquitto_strdup(option->value);
-			// error allocating memory
-			if (data->unixSocketPath == NULL)
+			if (!acl_snapshot_is_open(&data->snapshot))
 			{
-				return MOSQ_ERR_NOMEM;
+				return MOSQ_ERR_UNKNOWN;
 			}
+			// serve the persisted rules until the database can be reached
+			mosquitto_log_printf(MOSQ_LOG_WARNING, "(mosquitto-auth-plugin) Starting read-only from the ACL snapshot, reconnecting in the background.");
+		}
+		else
+		{
+			mosquitto_log_printf(MOSQ_LOG_INFO, "(mosquitto-auth-plugin) Successfully initialized %ld connections to database, %ld ms query timeout.",
+								 opts->poolSize, opts->queryTimeout);
+		}
+
+		data->aclBackend = acl_backend_pg_new(&data->dbPool, &data->aclStatement, data->preloadQuery, data->notifyChannel != NULL);
+		if (data->aclBackend == NULL)
+		{
+			return MOSQ_ERR_NOMEM;
 		}
 	}
-	// if name or port is not set then exit
-	if (!(dbname && dbport && data->baseACLQuery && data->unixSocketPath))
+
+	// load every rule up front, checks then never query the database
+	data->deltaInterval = (int64_t)opts->deltaInterval * 1000;
+	if (data->preloadQuery)
 	{
-		mosquitto_log_printf(MOSQ_LOG_ERR, "(mosquitto-auth-plugin) Couldn't retrieve all parameters from configuration file, make sure you are setting it properly! (%p %p %p %p)", dbname, dbport, data->baseACLQuery, data->unixSocketPath);
-		return MOSQ_ERR_UNKNOWN;
+		int preloaded = load_acl_store(data);
+		if (preloaded != MOSQ_ERR_SUCCESS)
+		{
+			mosquitto_log_printf(MOSQ_LOG_ERR, "(mosquitto-auth-plugin) Preloading the ACL table failed.");
+			return preloaded;
+		}
+	}
+	else if (acl_snapshot_is_open(&data->snapshot) && !acl_cache_enabled(&data->aclCache))
+	{
+		// without a cache the snapshot could never be revalidated
+		acl_snapshot_close(&data->snapshot);
 	}
 
-	// allocate connection string according to the size of each param and parse it
-	char *conninfo = (char *)mosquitto_malloc(sizeof(char) * (strlen(dbname) + strlen(dbport) + strlen(baseConninfo)));
-	sprintf(conninfo, baseConninfo, dbname, dbport);
-
-	mosquitto_log_printf(MOSQ_LOG_ERR, "(mosquitto-auth-plugin) Parsed conninfo: %s", conninfo);
+	// prefetched rules are kept in the cache, preloaded ones need no prefetching
+	if (data->prefetchQuery && (data->preloadQuery || !acl_cache_enabled(&data->aclCache)))
+	{
+		mosquitto_log_printf(MOSQ_LOG_WARNING, "(mosquitto-auth-plugin) acl_prefetch_query ignored, it needs acl_cache_ttl and no acl_preload_query.");
+		data->prefetchQuery = NULL;
+	}
 
-	// establish connection to the database
-	data->dbconn = PQconnectdb(conninfo);
-	/* Check to see that the backend connection was successfully made */
-	if (PQstatus(data->dbconn) != CONNECTION_OK)
+	// cached rules are shared with the other brokers of the host, preloaded ones are complete already
+	if (opts->sharedName && (data->preloadQuery || !acl_cache_enabled(&data->aclCache)))
+	{
+		mosquitto_log_printf(MOSQ_LOG_WARNING, "(mosquitto-auth-plugin) acl_shared_name ignored, it needs acl_cache_ttl and no acl_preload_query.");
+	}
+	else if (opts->sharedName && acl_shared_open(&data->aclShared, opts->sharedName, (size_t)opts->sharedSize << 20) == MOSQ_ERR_SUCCESS)
 	{
-		mosquitto_log_printf(MOSQ_LOG_ERR, "(mosquitto-auth-plugin) Connection to database failed: %s",
-							 PQerrorMessage(data->dbconn));
+		mosquitto_log_printf(MOSQ_LOG_INFO, "(mosquitto-auth-plugin) Sharing cached rules through segment %s (%zu MiB, %llu slots).",
+							 opts->sharedName, data->aclShared.size >> 20, (unsigned long long)data->aclShared.header->slot_count);
+	}
 
-		mosquitto_free(conninfo);
-		return MOSQ_ERR_UNKNOWN;
+	// rules are queried per client, keep the busy clients' ones from running out
+	if (!data->preloadQuery && acl_cache_enabled(&data->aclCache) && refreshAhead > 0)
+	{
+		data->refreshAhead = (int64_t)refreshAhead * 1000;
+		if (db_pool_primary(&data->dbPool))
+		{
+			start_refresher(data);
+		}
 	}
 
-	mosquitto_log_printf(MOSQ_LOG_INFO, "(mosquitto-auth-plugin) Successfully initialized connection to database.");
+	start_trace(data);
 
 	// setting up callbacks for authentication
 	int ret = mosquitto_callback_register(data->identifier, MOSQ_EVT_ACL_CHECK, mosq_auth_acl_check, NULL, userdata);
@@ -355,10 +2282,16 @@ int mosquitto_plugin_init(mosquitto_plugin_id_t *identifier, void **userdata, st
 	int ret2 = mosquitto_callback_register(data->identifier, MOSQ_EVT_BASIC_AUTH, mosq_basic_auth_check, NULL, userdata);
 	mosquitto_log_printf(MOSQ_LOG_DEBUG, "(mosquitto-auth-plugin) Registering AUTH callback returned (%i)", ret2);
 
-	// free allocated memory as it isn't required anymore
-	mosquitto_free(conninfo);
+	int ret3 = mosquitto_callback_register(data->identifier, MOSQ_EVT_TICK, mosq_tick, NULL, userdata);
+	mosquitto_log_printf(MOSQ_LOG_DEBUG, "(mosquitto-auth-plugin) Registering TICK callback returned (%i)", ret3);
 
-	return ret | ret2 ? MOSQ_ERR_UNKNOWN : MOSQ_ERR_SUCCESS;
+	int ret4 = mosquitto_callback_register(data->identifier, MOSQ_EVT_DISCONNECT, mosq_disconnect, NULL, userdata);
+	mosquitto_log_printf(MOSQ_LOG_DEBUG, "(mosquitto-auth-plugin) Registering DISCONNECT callback returned (%i)", ret4);
+
+	int ret5 = mosquitto_callback_register(data->identifier, MOSQ_EVT_RELOAD, mosq_reload, NULL, userdata);
+	mosquitto_log_printf(MOSQ_LOG_DEBUG, "(mosquitto-auth-plugin) Registering RELOAD callback returned (%i)", ret5);
+
+	return ret | ret2 | ret3 | ret4 | ret5 ? MOSQ_ERR_UNKNOWN : MOSQ_ERR_SUCCESS;
 }
 
 /*
@@ -407,14 +2340,43 @@ int mosquitto_plugin_cleanup(void *userdata, struct mosquitto_opt *options, int
 	mosquitto_log_printf(MOSQ_LOG_DEBUG, "(mosquitto-auth-plugin) Unregistering ACL callback returned (%i)", ret);
 	int ret2 = mosquitto_callback_unregister(data->identifier, MOSQ_EVT_BASIC_AUTH, mosq_basic_auth_check, NULL);
 	mosquitto_log_printf(MOSQ_LOG_DEBUG, "(mosquitto-auth-plugin) Unregistering AUTH callback returned (%i)", ret2);
+	int ret3 = mosquitto_callback_unregister(data->identifier, MOSQ_EVT_TICK, mosq_tick, NULL);
+	mosquitto_log_printf(MOSQ_LOG_DEBUG, "(mosquitto-auth-plugin) Unregistering TICK callback returned (%i)", ret3);
+	int ret4 = mosquitto_callback_unregister(data->identifier, MOSQ_EVT_DISCONNECT, mosq_disconnect, NULL);
+	mosquitto_log_printf(MOSQ_LOG_DEBUG, "(mosquitto-auth-plugin) Unregistering DISCONNECT callback returned (%i)", ret4);
+	int ret5 = mosquitto_callback_unregister(data->identifier, MOSQ_EVT_RELOAD, mosq_reload, NULL);
+	mosquitto_log_printf(MOSQ_LOG_DEBUG, "(mosquitto-auth-plugin) Unregistering RELOAD callback returned (%i)", ret5);
+
+	// persist the rules for a warm start next time
+	if (data->snapshotPath)
+	{
+		save_snapshot(data);
+	}
+	acl_snapshot_close(&data->snapshot);
+
+	// write out the last of the trace
+	trace_stop(&data->trace);
 
-	// close and free database connection
-	PQfinish(data->dbconn);
+	// close and free database connections
+	refresher_stop(&data->refresher);
+	acl_backend_destroy(data->aclBackend);
+	cancel_db_reload(data);
+	db_pool_cleanup(&data->dbPool);
+	mosquitto_free(data->conninfo);
 
 	// free allocated data
-	mosquitto_free(data->unixSocketPath);
-	mosquitto_free(data->baseACLQuery);
+	acl_cache_cleanup(&data->aclCache);
+	acl_shared_close(&data->aclShared);
+	client_table_cleanup(&data->clients);
+	deny_cache_cleanup(&data->denyCache);
+	cert_cache_cleanup(&data->certCache);
+	if (data->aclStore)
+	{
+		acl_store_cleanup(data->aclStore);
+		mosquitto_free(data->aclStore);
+	}
+	free_options(&data->options);
 	mosquitto_free(data);
 
-	return ret | ret2 ? MOSQ_ERR_UNKNOWN : MOSQ_ERR_SUCCESS;
+	return ret | ret2 | ret3 | ret4 | ret5 ? MOSQ_ERR_UNKNOWN : MOSQ_ERR_SUCCESS;
 }
\ No newline at end of file
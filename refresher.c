@@ -0,0 +1,290 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "refresher.h"
+#include "utils.h"
+#include "mosquitto_broker.h"
+
+#define REFRESH_RETRY_INTERVAL 1000 // ms between attempts of the worker to reach a lost database
+
+static void ring_push(struct refresh_ring *ring, struct refresh_job *job)
+{
+	size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+	// never full, there are only as many jobs as slots
+	ring->slots[head & (REFRESH_QUEUE - 1)] = job;
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+static struct refresh_job *ring_pop(struct refresh_ring *ring)
+{
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	struct refresh_job *job;
+
+	if (tail == atomic_load_explicit(&ring->head, memory_order_acquire))
+		return NULL;
+
+	job = ring->slots[tail & (REFRESH_QUEUE - 1)];
+	atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+	return job;
+}
+
+/*
+ * Make sure the worker's connection is up with the ACL statement prepared,
+ * reconnecting at most every REFRESH_RETRY_INTERVAL ms.
+ */
+static bool worker_connect(struct refresher *r, PGconn **conn, int64_t *next_attempt)
+{
+	PGresult *res;
+
+	if (*conn && PQstatus(*conn) == CONNECTION_OK)
+		return true;
+	if (mono_time_ms() < *next_attempt)
+		return false;
+	*next_attempt = mono_time_ms() + REFRESH_RETRY_INTERVAL;
+
+	if (*conn)
+		PQreset(*conn);
+	else
+		*conn = PQconnectdb(r->conninfo);
+	if (PQstatus(*conn) != CONNECTION_OK)
+		return false;
+
+	res = PQprepare(*conn, DB_ACL_STATEMENT, r->query, 0, NULL);
+	if (PQresultStatus(res) != PGRES_COMMAND_OK)
+	{
+		PQclear(res);
+		PQfinish(*conn);
+		*conn = NULL;
+		return false;
+	}
+	PQclear(res);
+	// batches are pipelined, see db_exec_acl_batch()
+	PQsetnonblocking(*conn, 1);
+	return true;
+}
+
+static void job_answer(struct refresh_job *job, const PGresult *res)
+{
+	if (PQresultStatus(res) == PGRES_TUPLES_OK && PQnfields(res) == 1)
+	{
+		int rows = PQntuples(res);
+		size_t size = sizeof(char *) * rows;
+
+		for (int row = 0; row < rows; row++)
+			size += strlen(PQgetvalue(res, row, 0)) + 1;
+
+		job->patterns = malloc(size ? size : 1);
+		if (job->patterns)
+		{
+			char *str = (char *)(job->patterns + rows);
+
+			for (int row = 0; row < rows; row++)
+			{
+				size_t len = strlen(PQgetvalue(res, row, 0)) + 1;
+
+				memcpy(str, PQgetvalue(res, row, 0), len);
+				job->patterns[row] = str;
+				str += len;
+			}
+			job->pattern_count = rows;
+			job->answered = true;
+		}
+	}
+}
+
+/*
+ * Run the queries of a batch of jobs in one go. A connection that failed on
+ * the way is dropped, the next batch connects again.
+ */
+static void worker_run(struct refresher *r, PGconn **conn, struct refresh_job **batch, int count)
+{
+	const char *client_ids[REFRESH_BATCH];
+	int access[REFRESH_BATCH];
+	PGresult *results[REFRESH_BATCH];
+
+	for (int i = 0; i < count; i++)
+	{
+		client_ids[i] = batch[i]->key;
+		access[i] = batch[i]->access;
+	}
+
+	if (db_exec_acl_batch(*conn, &r->stmt, count, client_ids, access, results) < 0)
+	{
+		PQfinish(*conn);
+		*conn = NULL;
+		return;
+	}
+
+	for (int i = 0; i < count; i++)
+	{
+		job_answer(batch[i], results[i]);
+		PQclear(results[i]);
+	}
+}
+
+static void *worker(void *arg)
+{
+	struct refresher *r = arg;
+	struct refresh_job *batch[REFRESH_BATCH];
+	PGconn *conn = NULL;
+	int64_t next_attempt = 0;
+
+	while (!atomic_load(&r->stop))
+	{
+		int count = 0;
+
+		// whatever queued up while the last batch ran goes out together
+		while (count < REFRESH_BATCH && (batch[count] = ring_pop(&r->requests)) != NULL)
+			count++;
+		if (count == 0)
+		{
+			while (sem_wait(&r->wake) && errno == EINTR)
+				;
+			continue;
+		}
+
+		if (worker_connect(r, &conn, &next_attempt))
+			worker_run(r, &conn, batch, count);
+
+		for (int i = 0; i < count; i++)
+			ring_push(&r->responses, batch[i]);
+	}
+
+	PQfinish(conn);
+	return NULL;
+}
+
+/*
+ * Start the worker thread, which connects with `conninfo' and prepares
+ * `query' (as returned by db_format_acl_query) the way `stmt' describes.
+ */
+int refresher_start(struct refresher *r, const char *conninfo, const char *query, const struct db_acl_statement *stmt)
+{
+	memset(r, 0, sizeof(*r));
+	atomic_init(&r->stop, false);
+	atomic_init(&r->requests.head, 0);
+	atomic_init(&r->requests.tail, 0);
+	atomic_init(&r->responses.head, 0);
+	atomic_init(&r->responses.tail, 0);
+
+	for (int i = REFRESH_QUEUE - 1; i >= 0; i--)
+	{
+		r->jobs[i].next_free = r->free_jobs;
+		r->free_jobs = &r->jobs[i];
+	}
+
+	r->conninfo = mosquitto_strdup(conninfo);
+	r->query = mosquitto_strdup(query);
+	if (r->conninfo == NULL || r->query == NULL)
+	{
+		refresher_stop(r);
+		return MOSQ_ERR_NOMEM;
+	}
+	r->stmt = *stmt;
+
+	if (sem_init(&r->wake, 0, 0))
+	{
+		refresher_stop(r);
+		return MOSQ_ERR_UNKNOWN;
+	}
+	if (pthread_create(&r->thread, NULL, worker, r))
+	{
+		sem_destroy(&r->wake);
+		refresher_stop(r);
+		return MOSQ_ERR_UNKNOWN;
+	}
+	r->running = true;
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+void refresher_stop(struct refresher *r)
+{
+	struct refresh_job *job;
+
+	if (r->running)
+	{
+		atomic_store(&r->stop, true);
+		sem_post(&r->wake);
+		pthread_join(r->thread, NULL);
+		sem_destroy(&r->wake);
+		r->running = false;
+
+		while ((job = ring_pop(&r->requests)) != NULL)
+			refresher_release(r, job);
+		while ((job = ring_pop(&r->responses)) != NULL)
+			refresher_release(r, job);
+	}
+
+	mosquitto_free(r->conninfo);
+	mosquitto_free(r->query);
+	r->conninfo = r->query = NULL;
+}
+
+/*
+ * Queue a refresh of the rules of `client_id' for `access', as of the ACL
+ * `generation' and the shared rules' `stamp'. Returns false
+ * when it cannot be queued: the worker is not running, every job is in
+ * flight or the key is too long.
+ */
+bool refresher_request(struct refresher *r, const char *client_id, const char *username, int access, uint64_t generation,
+					   const struct acl_shared_stamp *stamp)
+{
+	struct refresh_job *job = r->free_jobs;
+	size_t client_id_len, username_len;
+
+	if (!r->running || job == NULL)
+		return false;
+
+	client_id_len = strlen(client_id) + 1;
+	username_len = username ? strlen(username) + 1 : 0;
+	if (client_id_len + username_len > REFRESH_KEY_MAX)
+		return false;
+
+	r->free_jobs = job->next_free;
+	job->access = access;
+	job->generation = generation;
+	job->shared_stamp = *stamp;
+	memcpy(job->key, client_id, client_id_len);
+	job->username = NULL;
+	if (username)
+	{
+		memcpy(job->key + client_id_len, username, username_len);
+		job->username = job->key + client_id_len;
+	}
+	job->answered = false;
+	job->pattern_count = 0;
+	job->patterns = NULL;
+
+	ring_push(&r->requests, job);
+	r->wake_pending = true;
+	return true;
+}
+
+/*
+ * Wake the worker for the requests queued since the last call, and return
+ * the next refresh it is done with, if any, to be handed back with
+ * refresher_release().
+ */
+struct refresh_job *refresher_poll(struct refresher *r)
+{
+	if (!r->running)
+		return NULL;
+
+	if (r->wake_pending)
+	{
+		r->wake_pending = false;
+		sem_post(&r->wake);
+	}
+	return ring_pop(&r->responses);
+}
+
+void refresher_release(struct refresher *r, struct refresh_job *job)
+{
+	free(job->patterns);
+	job->patterns = NULL;
+	job->next_free = r->free_jobs;
+	r->free_jobs = job;
+}
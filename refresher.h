@@ -0,0 +1,75 @@
+#ifndef __REFRESHER_H__
+#define __REFRESHER_H__
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "acl_shared.h"
+#include "db.h"
+
+#define REFRESH_QUEUE 256 // refreshes in flight at most, a power of two
+#define REFRESH_BATCH 32 // refreshes sent to the database in one pipeline, at most
+#define REFRESH_KEY_MAX 512 // room for a client id and username, longer ones are not refreshed ahead
+
+/*
+ * Background refresh of cached rules about to expire, so a busy client
+ * never waits on the database when its entry runs out.
+ *
+ * The broker calls the plugin from a single thread, which stays the only
+ * one touching the ACL cache: a worker thread with its own connection only
+ * runs the queries, pipelining those queued meanwhile by batches of up to
+ * REFRESH_BATCH. Jobs go back and forth between the two through a pair
+ * of single producer, single consumer rings, and the cached entry is
+ * replaced by the main thread once the answer is back, freeing the old one
+ * there and then as no other thread can be reading it. Jobs come from a
+ * fixed pool, so asking for a refresh from a callback takes no lock and no
+ * allocation; the worker is only woken from the tick.
+ *
+ * The worker never calls into the broker, its memory is from libc.
+ */
+struct refresh_job {
+	struct refresh_job *next_free;
+	int access;
+	uint64_t generation; // of the ACL data when the refresh was asked for
+	struct acl_shared_stamp shared_stamp; // of the shared rules when the refresh was asked for
+	char key[REFRESH_KEY_MAX]; // client id, then username
+	const char *username; // in `key', NULL if the client has none
+	bool answered; // the query succeeded, `patterns' holds its rows
+	int pattern_count;
+	char **patterns; // one malloc'd block, owned by the job
+};
+
+struct refresh_ring {
+	_Atomic size_t head; // next slot the producer writes
+	_Atomic size_t tail; // next slot the consumer reads
+	struct refresh_job *slots[REFRESH_QUEUE];
+};
+
+struct refresher {
+	bool running;
+	pthread_t thread;
+	sem_t wake; // posted for the worker when requests are queued, or to stop
+	atomic_bool stop;
+	bool wake_pending; // requests queued since the worker was last woken
+	struct refresh_ring requests; // main thread to worker
+	struct refresh_ring responses; // worker to main thread
+	struct refresh_job jobs[REFRESH_QUEUE];
+	struct refresh_job *free_jobs; // main thread only
+	char *conninfo;
+	char *query; // the prepared ACL statement
+	struct db_acl_statement stmt;
+};
+
+int refresher_start(struct refresher *r, const char *conninfo, const char *query, const struct db_acl_statement *stmt);
+void refresher_stop(struct refresher *r);
+
+bool refresher_request(struct refresher *r, const char *client_id, const char *username, int access, uint64_t generation,
+					   const struct acl_shared_stamp *stamp);
+struct refresh_job *refresher_poll(struct refresher *r);
+void refresher_release(struct refresher *r, struct refresh_job *job);
+
+#endif//__REFRESHER_H__
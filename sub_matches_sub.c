@@ -13,55 +13,20 @@ Contributors:
 */
 
 #include "utils.h"
+#include "topic_scan.h"
 
-static char *strtok_hier(char *str, char **saveptr)
-{
-	char *c;
-
-	if(str != NULL){
-		*saveptr = str;
-	}
-
-	if(*saveptr == NULL){
-		return NULL;
-	}
-
-	c = strchr(*saveptr, '/');
-	if(c){
-		str = *saveptr;
-		*saveptr = c+1;
-		c[0] = '\0';
-	}else if(*saveptr){
-		/* No match, but surplus string */
-		str = *saveptr;
-		*saveptr = NULL;
-	}
-	return str;
-}
-
-
-static int count_hier_levels(const char *s)
-{
-	int count = 1;
-	const char *c = s;
-
-	while((c = strchr(c, '/')) && c[0]){
-		c++;
-		count++;
-	}
-	return count;
-}
-
+/*
+ * The matcher works on the const inputs in place: levels are compared as
+ * spans, so nothing is copied, tokenised or NUL terminated. Runs of identical
+ * bytes, which may cover several levels at once, are compared in bulk.
+ */
 
-static bool hash_check(char *s, size_t *len)
+static bool hash_check(const char *s, size_t *len)
 {
 	if((*len) == 1 && s[0] == '#'){
-		s[0] = '\0';
 		(*len)--;
 		return true;
 	}else if((*len) > 1 && s[(*len)-2] == '/' && s[(*len)-1] == '#'){
-		s[(*len)-2] = '\0';
-		s[(*len)-1] = '\0';
 		(*len) -= 2;
 		return true;
 	}
@@ -71,14 +36,10 @@ static bool hash_check(char *s, size_t *len)
 
 bool sub_acl_check(const char *acl, const char *sub)
 {
-	char *acl_local;
-	char *sub_local;
 	size_t acl_len, sub_len;
 	bool acl_hash = false, sub_hash = false;
-	int acl_levels, sub_levels;
-	int i;
-	char *acl_token, *sub_token;
-	char *acl_saveptr, *sub_saveptr;
+	size_t acl_levels, sub_levels;
+	size_t a, s, level, prefix;
 
 	acl_len = strlen(acl);
 	if(acl_len == 1 && acl[0] == '#'){
@@ -88,60 +49,166 @@ bool sub_acl_check(const char *acl, const char *sub)
 	sub_len = strlen(sub);
 	//mosquitto_validate_utf8(acl, acl_len);
 
-	acl_local = strdup(acl);
-	sub_local = strdup(sub);
-	if(acl_local == NULL || sub_local == NULL){
-		free(acl_local);
-		free(sub_local);
+	acl_hash = hash_check(acl, &acl_len);
+	sub_hash = hash_check(sub, &sub_len);
+
+	if(sub_hash == true && acl_hash == false){
+		return false;
+	}
+
+	acl_levels = topic_count_levels(acl, acl_len);
+	sub_levels = topic_count_levels(sub, sub_len);
+	if(acl_levels > sub_levels){
 		return false;
+	}else if(sub_levels > acl_levels){
+		if(acl_hash == false){
+			return false;
+		}
+	}
+
+	/* a and s always point at the start of a level, the same level in both. */
+	a = 0;
+	s = 0;
+	for(;;){
+		prefix = topic_common_prefix(acl+a, sub+s, acl_len-a < sub_len-s ? acl_len-a : sub_len-s);
+
+		/* Every level of the acl is consumed. The sub is either consumed too
+		 * or has further levels, which the level count check above only
+		 * lets through when the acl ends in a multi level wildcard. */
+		if(a+prefix == acl_len && (s+prefix == sub_len || sub[s+prefix] == '/')){
+			return true;
+		}
+
+		/* Find the start of the acl level the mismatch falls in, the sub
+		 * level starts at the same offset as the prefix is identical. */
+		level = prefix;
+		while(level > 0 && acl[a+level-1] != '/'){
+			level--;
+		}
+		a += level;
+		s += level;
+
+		if(acl[a] == '+' && (a+1 == acl_len || acl[a+1] == '/')){
+			/* This level matches a single level wildcard, skip it in both. */
+			const char *sep = topic_next_sep(sub+s, sub+sub_len);
+
+			a++;
+			if(a == acl_len){
+				/* Remaining sub levels, if any, are covered by '#'. */
+				return true;
+			}
+			if(sep == NULL){
+				return false;
+			}
+			a++;
+			s = (size_t)(sep - sub) + 1;
+		}else{
+			return false;
+		}
+	}
+}
+
+
+/* Compare one acl level holding %c/%u tokens against one sub level, the
+ * tokens standing for `clientid' and `username'. Literal runs between
+ * tokens are compared in bulk. */
+bool template_level_equal(const char *acl, size_t acl_len, const char *sub, size_t sub_len,
+		const char *clientid, size_t clientid_len, const char *username, size_t username_len)
+{
+	size_t a = 0, s = 0;
+
+	while(a < acl_len){
+		const char *pct = memchr(acl+a, '%', acl_len-a);
+		size_t lit = pct ? (size_t)(pct-acl)-a : acl_len-a;
+
+		if(pct && a+lit+1 < acl_len && (pct[1] == 'c' || pct[1] == 'u')){
+			const char *value = pct[1] == 'c' ? clientid : username;
+			size_t value_len = pct[1] == 'c' ? clientid_len : username_len;
+
+			if(sub_len-s < lit+value_len
+					|| memcmp(acl+a, sub+s, lit)
+					|| memcmp(value, sub+s+lit, value_len)){
+				return false;
+			}
+			a += lit+2;
+			s += lit+value_len;
+		}else{
+			/* No token, or a lone '%' which is literal: take it and the run
+			 * before it. */
+			if(pct){
+				lit++;
+			}
+			if(sub_len-s < lit || memcmp(acl+a, sub+s, lit)){
+				return false;
+			}
+			a += lit;
+			s += lit;
+		}
+	}
+	return s == sub_len;
+}
+
+
+/* sub_acl_check() of `acl' with its %c and %u tokens replaced by `clientid'
+ * and `username', without building the expanded string. Only valid when
+ * t_match_in_place(clientid, username) holds: the values then never add,
+ * remove or create a level or wildcard, so the acl keeps its structure and
+ * only the bytes of the levels holding tokens differ. */
+bool sub_acl_check_template(const char *acl, const char *sub, const char *clientid, const char *username)
+{
+	size_t acl_len, sub_len, clientid_len, username_len;
+	bool acl_hash, sub_hash;
+	size_t acl_levels, sub_levels;
+	size_t a, s;
+
+	acl_len = strlen(acl);
+	if(acl_len == 1 && acl[0] == '#'){
+		return true;
 	}
 
-	acl_hash = hash_check(acl_local, &acl_len);
-	sub_hash = hash_check(sub_local, &sub_len);
+	sub_len = strlen(sub);
+	acl_hash = hash_check(acl, &acl_len);
+	sub_hash = hash_check(sub, &sub_len);
 
 	if(sub_hash == true && acl_hash == false){
-		free(acl_local);
-		free(sub_local);
 		return false;
 	}
 
-	acl_levels = count_hier_levels(acl_local);
-	sub_levels = count_hier_levels(sub_local);
+	acl_levels = topic_count_levels(acl, acl_len);
+	sub_levels = topic_count_levels(sub, sub_len);
 	if(acl_levels > sub_levels){
-		free(acl_local);
-		free(sub_local);
 		return false;
 	}else if(sub_levels > acl_levels){
 		if(acl_hash == false){
-			free(acl_local);
-			free(sub_local);
 			return false;
 		}
 	}
 
-	acl_saveptr = acl_local;
-	sub_saveptr = sub_local;
-	for(i=0; i<sub_levels; i++){
-		acl_token = strtok_hier(acl_saveptr, &acl_saveptr);
-		sub_token = strtok_hier(sub_saveptr, &sub_saveptr);
-
-		if(i<acl_levels &&
-				(!strcmp(acl_token, "+")
-				 || !strcmp(acl_token, sub_token))){
-
-			/* This level matches a single level wildcard, or is an exact
-			 * match, so carry on checking. */
-		}else if(i>=acl_levels && acl_hash == true){
-			/* The sub has more levels of hierarchy than the acl, but the acl
-			 * ends in a multi level wildcard so the match is fine. */
-		}else{
-			free(acl_local);
-			free(sub_local);
+	clientid_len = strlen(clientid);
+	username_len = strlen(username);
+
+	/* a and s always point at the start of a level, the same level in both;
+	 * the level counts guarantee the sub has one wherever the acl does. */
+	a = 0;
+	s = 0;
+	for(;;){
+		const char *acl_sep = topic_next_sep(acl+a, acl+acl_len);
+		const char *sub_sep = topic_next_sep(sub+s, sub+sub_len);
+		size_t acl_end = acl_sep ? (size_t)(acl_sep-acl) : acl_len;
+		size_t sub_end = sub_sep ? (size_t)(sub_sep-sub) : sub_len;
+
+		if(!(acl_end-a == 1 && acl[a] == '+')
+				&& !template_level_equal(acl+a, acl_end-a, sub+s, sub_end-s,
+					clientid, clientid_len, username, username_len)){
 			return false;
 		}
-	}
 
-	free(acl_local);
-	free(sub_local);
-	return true;
-}
\ No newline at end of file
+		/* Every level of the acl is consumed; remaining sub levels, if any,
+		 * are covered by '#'. */
+		if(acl_end == acl_len){
+			return true;
+		}
+		a = acl_end+1;
+		s = sub_end+1;
+	}
+}
@@ -0,0 +1,191 @@
+#include <string.h>
+
+#include "topic_scan.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#  define TOPIC_SCAN_X86
+#  include <immintrin.h>
+#endif
+
+struct topic_scan_ops {
+	const char *name;
+	size_t (*count_sep)(const char *s, size_t len);
+	const char *(*next_sep)(const char *s, const char *end);
+	size_t (*common_prefix)(const char *a, const char *b, size_t len);
+};
+
+static size_t count_sep_scalar(const char *s, size_t len)
+{
+	size_t count = 0;
+
+	for (size_t i = 0; i < len; i++)
+		count += s[i] == '/';
+	return count;
+}
+
+static const char *next_sep_scalar(const char *s, const char *end)
+{
+	return memchr(s, '/', end - s);
+}
+
+static size_t common_prefix_scalar(const char *a, const char *b, size_t len)
+{
+	size_t i = 0;
+
+	while (i < len && a[i] == b[i])
+		i++;
+	return i;
+}
+
+static const struct topic_scan_ops scan_scalar = {
+	"scalar", count_sep_scalar, next_sep_scalar, common_prefix_scalar
+};
+
+#ifdef TOPIC_SCAN_X86
+
+/*
+ * The vector variants only load whole blocks that lie inside the span and
+ * hand the remaining tail to the scalar code, so they never read past the
+ * end of the string.
+ */
+
+__attribute__((target("sse2")))
+static size_t count_sep_sse2(const char *s, size_t len)
+{
+	const __m128i sep = _mm_set1_epi8('/');
+	size_t count = 0, i = 0;
+
+	for (; i + 16 <= len; i += 16)
+	{
+		__m128i block = _mm_loadu_si128((const __m128i *)(s + i));
+		count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(block, sep)));
+	}
+	return count + count_sep_scalar(s + i, len - i);
+}
+
+__attribute__((target("sse2")))
+static const char *next_sep_sse2(const char *s, const char *end)
+{
+	const __m128i sep = _mm_set1_epi8('/');
+
+	for (; end - s >= 16; s += 16)
+	{
+		__m128i block = _mm_loadu_si128((const __m128i *)s);
+		int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, sep));
+
+		if (mask)
+			return s + __builtin_ctz(mask);
+	}
+	return next_sep_scalar(s, end);
+}
+
+__attribute__((target("sse2")))
+static size_t common_prefix_sse2(const char *a, const char *b, size_t len)
+{
+	size_t i = 0;
+
+	for (; i + 16 <= len; i += 16)
+	{
+		__m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+		__m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+		int diff = ~_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) & 0xffff;
+
+		if (diff)
+			return i + __builtin_ctz(diff);
+	}
+	return i + common_prefix_scalar(a + i, b + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t count_sep_avx2(const char *s, size_t len)
+{
+	const __m256i sep = _mm256_set1_epi8('/');
+	size_t count = 0, i = 0;
+
+	for (; i + 32 <= len; i += 32)
+	{
+		__m256i block = _mm256_loadu_si256((const __m256i *)(s + i));
+		count += __builtin_popcount((unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, sep)));
+	}
+	return count + count_sep_sse2(s + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static const char *next_sep_avx2(const char *s, const char *end)
+{
+	const __m256i sep = _mm256_set1_epi8('/');
+
+	for (; end - s >= 32; s += 32)
+	{
+		__m256i block = _mm256_loadu_si256((const __m256i *)s);
+		unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, sep));
+
+		if (mask)
+			return s + __builtin_ctz(mask);
+	}
+	return next_sep_sse2(s, end);
+}
+
+__attribute__((target("avx2")))
+static size_t common_prefix_avx2(const char *a, const char *b, size_t len)
+{
+	size_t i = 0;
+
+	for (; i + 32 <= len; i += 32)
+	{
+		__m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+		__m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+		unsigned diff = ~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb));
+
+		if (diff)
+			return i + __builtin_ctz(diff);
+	}
+	return i + common_prefix_sse2(a + i, b + i, len - i);
+}
+
+static const struct topic_scan_ops scan_sse2 = {
+	"sse2", count_sep_sse2, next_sep_sse2, common_prefix_sse2
+};
+
+static const struct topic_scan_ops scan_avx2 = {
+	"avx2", count_sep_avx2, next_sep_avx2, common_prefix_avx2
+};
+
+static const struct topic_scan_ops *scan = &scan_scalar;
+
+// pick the widest implementation the CPU supports when the plugin is loaded
+__attribute__((constructor))
+static void topic_scan_select(void)
+{
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		scan = &scan_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		scan = &scan_sse2;
+}
+
+#else
+
+static const struct topic_scan_ops *scan = &scan_scalar;
+
+#endif
+
+size_t topic_count_levels(const char *s, size_t len)
+{
+	return scan->count_sep(s, len) + 1;
+}
+
+const char *topic_next_sep(const char *s, const char *end)
+{
+	return scan->next_sep(s, end);
+}
+
+size_t topic_common_prefix(const char *a, const char *b, size_t len)
+{
+	return scan->common_prefix(a, b, len);
+}
+
+const char *topic_scan_impl(void)
+{
+	return scan->name;
+}
@@ -0,0 +1,24 @@
+#ifndef __TOPIC_SCAN_H__
+#define __TOPIC_SCAN_H__
+
+#include <stddef.h>
+
+/*
+ * Byte scanning primitives used to match topics in place. On x86 the AVX2 or
+ * SSE2 variant is picked once when the plugin is loaded, according to what
+ * the CPU supports; other targets use the scalar versions.
+ */
+
+// number of '/' separated levels in the `len' bytes at `s' (at least 1)
+size_t topic_count_levels(const char *s, size_t len);
+
+// first '/' in [s, end), or NULL
+const char *topic_next_sep(const char *s, const char *end);
+
+// length of the common prefix of the `len' bytes at `a' and `b'
+size_t topic_common_prefix(const char *a, const char *b, size_t len);
+
+// name of the selected implementation, for logging
+const char *topic_scan_impl(void);
+
+#endif//__TOPIC_SCAN_H__
@@ -0,0 +1,417 @@
+#include "topic_trie.h"
+#include "utils.h"
+#include "mosquitto_broker.h"
+
+#define TOPIC_TRIE_TERMINAL 0x01 // a pattern ends at this node
+#define TOPIC_TRIE_HASH 0x02 // a pattern ending in '#' ends at this node
+
+// values the %c/%u tokens of template edges stand for during a walk
+struct template_values {
+	const char *clientid;
+	size_t clientid_len;
+	const char *username;
+	size_t username_len;
+};
+
+/*
+ * Non-destructive equivalent of hash_check() in sub_matches_sub.c: report
+ * whether `s' ends in a multi level wildcard and trim it from `len'.
+ */
+static bool strip_hash(const char *s, size_t *len)
+{
+	if ((*len) == 1 && s[0] == '#')
+	{
+		(*len)--;
+		return true;
+	}
+	else if ((*len) > 1 && s[(*len) - 2] == '/' && s[(*len) - 1] == '#')
+	{
+		(*len) -= 2;
+		return true;
+	}
+	return false;
+}
+
+static uint32_t edge_hash(int32_t parent, const char *token, size_t len)
+{
+	return hash_bytes(token, len, 2166136261u ^ ((uint32_t)parent * 16777619u));
+}
+
+static int32_t find_edge(const struct topic_trie *trie, int32_t parent, const char *token, size_t len)
+{
+	uint32_t hash = edge_hash(parent, token, len);
+	uint32_t slot;
+
+	for (slot = hash & trie->edge_mask; trie->edges[slot].parent != -1; slot = (slot + 1) & trie->edge_mask)
+	{
+		const struct topic_trie_edge *edge = &trie->edges[slot];
+
+		if (edge->hash == hash && edge->parent == parent && edge->token_len == len
+			&& !memcmp(trie->tokens + edge->token_off, token, len))
+		{
+			return edge->child;
+		}
+	}
+	return -1;
+}
+
+static int32_t new_node(struct topic_trie *trie)
+{
+	if (trie->node_count == trie->node_cap)
+	{
+		int32_t cap = trie->node_cap * 2;
+		struct topic_trie_node *nodes = mosquitto_realloc(trie->nodes, sizeof(*nodes) * cap);
+
+		if (nodes == NULL)
+			return -1;
+		trie->nodes = nodes;
+		trie->node_cap = cap;
+	}
+
+	trie->nodes[trie->node_count].plus = -1;
+	trie->nodes[trie->node_count].templates = -1;
+	trie->nodes[trie->node_count].flags = 0;
+	return trie->node_count++;
+}
+
+static int alloc_edges(struct topic_trie *trie, uint32_t slots)
+{
+	trie->edges = mosquitto_malloc(sizeof(*trie->edges) * slots);
+	if (trie->edges == NULL)
+		return MOSQ_ERR_NOMEM;
+
+	for (uint32_t i = 0; i < slots; i++)
+		trie->edges[i].parent = -1;
+	trie->edge_mask = slots - 1;
+	return MOSQ_ERR_SUCCESS;
+}
+
+static void place_edge(struct topic_trie *trie, const struct topic_trie_edge *edge)
+{
+	uint32_t slot = edge->hash & trie->edge_mask;
+
+	while (trie->edges[slot].parent != -1)
+		slot = (slot + 1) & trie->edge_mask;
+	trie->edges[slot] = *edge;
+}
+
+static int grow_edges(struct topic_trie *trie)
+{
+	struct topic_trie_edge *old = trie->edges;
+	uint32_t old_slots = trie->edge_mask + 1;
+
+	if (alloc_edges(trie, old_slots * 2) != MOSQ_ERR_SUCCESS)
+	{
+		trie->edges = old;
+		trie->edge_mask = old_slots - 1;
+		return MOSQ_ERR_NOMEM;
+	}
+
+	for (uint32_t i = 0; i < old_slots; i++)
+	{
+		if (old[i].parent != -1)
+			place_edge(trie, &old[i]);
+	}
+	mosquitto_free(old);
+	return MOSQ_ERR_SUCCESS;
+}
+
+static int reserve_tokens(struct topic_trie *trie, size_t len)
+{
+	if (trie->tokens_len + len > trie->tokens_cap)
+	{
+		size_t cap = trie->tokens_cap * 2;
+		char *tokens;
+
+		while (cap < trie->tokens_len + len)
+			cap *= 2;
+		tokens = mosquitto_realloc(trie->tokens, cap);
+		if (tokens == NULL)
+			return MOSQ_ERR_NOMEM;
+		trie->tokens = tokens;
+		trie->tokens_cap = cap;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+static int32_t add_edge(struct topic_trie *trie, int32_t parent, const char *token, size_t len)
+{
+	struct topic_trie_edge edge;
+	int32_t child;
+
+	// keep the table at most half full
+	if ((trie->edge_count + 1) * 2 > trie->edge_mask + 1 && grow_edges(trie) != MOSQ_ERR_SUCCESS)
+		return -1;
+
+	if (reserve_tokens(trie, len) != MOSQ_ERR_SUCCESS)
+		return -1;
+
+	child = new_node(trie);
+	if (child == -1)
+		return -1;
+
+	memcpy(trie->tokens + trie->tokens_len, token, len);
+	edge.parent = parent;
+	edge.child = child;
+	edge.hash = edge_hash(parent, token, len);
+	edge.token_len = (uint32_t)len;
+	edge.token_off = trie->tokens_len;
+	trie->tokens_len += len;
+
+	place_edge(trie, &edge);
+	trie->edge_count++;
+	return child;
+}
+
+/*
+ * Whether the level holds a %c or %u token, read left to right as
+ * t_is_template() does.
+ */
+static bool level_is_template(const char *level, size_t len)
+{
+	for (const char *s = memchr(level, '%', len); s && s + 1 < level + len; s = memchr(s + 1, '%', level + len - s - 1))
+	{
+		if (s[1] == 'c' || s[1] == 'u')
+			return true;
+	}
+	return false;
+}
+
+static int32_t find_template(const struct topic_trie *trie, int32_t parent, const char *token, size_t len)
+{
+	for (int32_t t = trie->nodes[parent].templates; t != -1; t = trie->templates[t].next)
+	{
+		const struct topic_trie_template *tmpl = &trie->templates[t];
+
+		if (tmpl->token_len == len && !memcmp(trie->tokens + tmpl->token_off, token, len))
+			return tmpl->child;
+	}
+	return -1;
+}
+
+static int32_t add_template(struct topic_trie *trie, int32_t parent, const char *token, size_t len)
+{
+	struct topic_trie_template *tmpl;
+	int32_t child;
+
+	if (trie->template_count == trie->template_cap)
+	{
+		int32_t cap = trie->template_cap ? trie->template_cap * 2 : 4;
+		struct topic_trie_template *templates = mosquitto_realloc(trie->templates, sizeof(*templates) * cap);
+
+		if (templates == NULL)
+			return -1;
+		trie->templates = templates;
+		trie->template_cap = cap;
+	}
+	if (reserve_tokens(trie, len) != MOSQ_ERR_SUCCESS)
+		return -1;
+
+	child = new_node(trie);
+	if (child == -1)
+		return -1;
+
+	memcpy(trie->tokens + trie->tokens_len, token, len);
+	tmpl = &trie->templates[trie->template_count];
+	tmpl->child = child;
+	tmpl->token_len = (uint32_t)len;
+	tmpl->token_off = trie->tokens_len;
+	trie->tokens_len += len;
+
+	// pushed in front, the order of a node's template edges does not matter
+	tmpl->next = trie->nodes[parent].templates;
+	trie->nodes[parent].templates = trie->template_count++;
+	return child;
+}
+
+struct topic_trie *topic_trie_new(void)
+{
+	struct topic_trie *trie = mosquitto_calloc(1, sizeof(struct topic_trie));
+
+	if (trie == NULL)
+		return NULL;
+
+	trie->node_cap = 16;
+	trie->tokens_cap = 256;
+	trie->nodes = mosquitto_malloc(sizeof(*trie->nodes) * trie->node_cap);
+	trie->tokens = mosquitto_malloc(trie->tokens_cap);
+	if (trie->nodes == NULL || trie->tokens == NULL || alloc_edges(trie, 16) != MOSQ_ERR_SUCCESS)
+	{
+		topic_trie_free(trie);
+		return NULL;
+	}
+
+	// node 0 is the root, standing before the first level
+	new_node(trie);
+	return trie;
+}
+
+void topic_trie_free(struct topic_trie *trie)
+{
+	if (trie == NULL)
+		return;
+
+	mosquitto_free(trie->nodes);
+	mosquitto_free(trie->edges);
+	mosquitto_free(trie->templates);
+	mosquitto_free(trie->tokens);
+	mosquitto_free(trie);
+}
+
+int topic_trie_add(struct topic_trie *trie, const char *acl)
+{
+	size_t len = strlen(acl);
+	const char *level = acl, *end;
+	int32_t node = 0;
+	bool hash;
+
+	if (len == 1 && acl[0] == '#')
+	{
+		trie->match_all = true;
+		return MOSQ_ERR_SUCCESS;
+	}
+
+	hash = strip_hash(acl, &len);
+	end = acl + len;
+
+	// even an empty pattern is one (empty) level
+	for (;;)
+	{
+		const char *sep = memchr(level, '/', end - level);
+		size_t level_len = (sep ? sep : end) - level;
+		int32_t child;
+
+		if (level_len == 1 && level[0] == '+')
+		{
+			child = trie->nodes[node].plus;
+			if (child == -1)
+			{
+				child = new_node(trie);
+				if (child == -1)
+					return MOSQ_ERR_NOMEM;
+				trie->nodes[node].plus = child;
+			}
+		}
+		else if (level_is_template(level, level_len))
+		{
+			child = find_template(trie, node, level, level_len);
+			if (child == -1)
+			{
+				child = add_template(trie, node, level, level_len);
+				if (child == -1)
+					return MOSQ_ERR_NOMEM;
+			}
+		}
+		else
+		{
+			child = find_edge(trie, node, level, level_len);
+			if (child == -1)
+			{
+				child = add_edge(trie, node, level, level_len);
+				if (child == -1)
+					return MOSQ_ERR_NOMEM;
+			}
+		}
+		node = child;
+
+		if (sep == NULL)
+			break;
+		level = sep + 1;
+	}
+
+	trie->nodes[node].flags |= hash ? TOPIC_TRIE_HASH : TOPIC_TRIE_TERMINAL;
+	return MOSQ_ERR_SUCCESS;
+}
+
+static bool walk(const struct topic_trie *trie, int32_t node, const char *level, const char *end, bool sub_hash,
+				 const struct template_values *values);
+
+/*
+ * Match what follows the sub level ending at `sep' (NULL for the last one)
+ * against the patterns going through `child'.
+ */
+static bool descend(const struct topic_trie *trie, int32_t child, const char *sep, const char *end, bool sub_hash,
+					const struct template_values *values)
+{
+	// the pattern ends in '#', any further levels of the sub are covered
+	if (trie->nodes[child].flags & TOPIC_TRIE_HASH)
+		return true;
+
+	// last level of the sub, a sub ending in '#' needs a '#' pattern
+	if (sep == NULL)
+		return (trie->nodes[child].flags & TOPIC_TRIE_TERMINAL) && !sub_hash;
+
+	return walk(trie, child, sep + 1, end, sub_hash, values);
+}
+
+/*
+ * Match the levels from `level' to `end' below `node'. Recursion only follows
+ * existing children, so its depth is bounded by the longest pattern.
+ * Template edges are only followed with `values'.
+ */
+static bool walk(const struct topic_trie *trie, int32_t node, const char *level, const char *end, bool sub_hash,
+				 const struct template_values *values)
+{
+	const char *sep = memchr(level, '/', end - level);
+	size_t level_len = (sep ? sep : end) - level;
+	int32_t child;
+
+	child = find_edge(trie, node, level, level_len);
+	if (child != -1 && descend(trie, child, sep, end, sub_hash, values))
+		return true;
+
+	child = trie->nodes[node].plus;
+	if (child != -1 && descend(trie, child, sep, end, sub_hash, values))
+		return true;
+
+	if (values == NULL)
+		return false;
+
+	for (int32_t t = trie->nodes[node].templates; t != -1; t = trie->templates[t].next)
+	{
+		const struct topic_trie_template *tmpl = &trie->templates[t];
+
+		if (template_level_equal(trie->tokens + tmpl->token_off, tmpl->token_len, level, level_len, values->clientid,
+								 values->clientid_len, values->username, values->username_len)
+			&& descend(trie, tmpl->child, sep, end, sub_hash, values))
+			return true;
+	}
+	return false;
+}
+
+static bool match(const struct topic_trie *trie, const char *sub, const struct template_values *values)
+{
+	size_t len;
+	bool sub_hash;
+
+	if (trie->match_all)
+		return true;
+
+	len = strlen(sub);
+	sub_hash = strip_hash(sub, &len);
+	return walk(trie, 0, sub, sub + len, sub_hash, values);
+}
+
+// bytes allocated for the trie
+size_t topic_trie_memory(const struct topic_trie *trie)
+{
+	return sizeof(*trie) + sizeof(*trie->nodes) * trie->node_cap + sizeof(*trie->edges) * (trie->edge_mask + 1)
+		   + sizeof(*trie->templates) * trie->template_cap + trie->tokens_cap;
+}
+
+bool topic_trie_match(const struct topic_trie *trie, const char *sub)
+{
+	return match(trie, sub, NULL);
+}
+
+bool topic_trie_match_template(const struct topic_trie *trie, const char *sub, const char *clientid, const char *username)
+{
+	struct template_values values = {
+		.clientid = clientid,
+		.clientid_len = strlen(clientid),
+		.username = username,
+		.username_len = strlen(username),
+	};
+
+	return match(trie, sub, &values);
+}
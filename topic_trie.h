@@ -0,0 +1,68 @@
+#ifndef __TOPIC_TRIE_H__
+#define __TOPIC_TRIE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A set of ACL patterns compiled into a level indexed trie. Exact levels are
+ * kept in a single open addressed table keyed by (parent node, level), '+'
+ * levels get a dedicated edge per node and a trailing '#' is a flag on the
+ * node it follows, so a topic is matched against every pattern in one walk.
+ *
+ * Levels holding %c/%u tokens are template edges, a short list per node
+ * whose tokens are resolved against the level of the topic as it is walked,
+ * so one trie serves every client the patterns are shared by.
+ *
+ * topic_trie_match(trie, sub) returns the same result as running
+ * sub_acl_check(acl, sub) for every added acl and or-ing the results, the
+ * template edges never matching. topic_trie_match_template(trie, sub,
+ * clientid, username) does the same for sub_acl_check_template(), and so
+ * holds only when t_match_in_place(clientid, username) does.
+ */
+struct topic_trie_node {
+	int32_t plus; // child reached through a '+' level, -1 if none
+	int32_t templates; // first template edge below this node, -1 if none
+	uint8_t flags; // TOPIC_TRIE_* flags
+};
+
+struct topic_trie_edge {
+	int32_t parent; // -1 marks an empty slot
+	int32_t child;
+	uint32_t hash;
+	uint32_t token_len;
+	size_t token_off; // offset of the level text in `tokens'
+};
+
+struct topic_trie_template {
+	int32_t next; // next template edge of the same parent, -1 if none
+	int32_t child;
+	uint32_t token_len;
+	size_t token_off; // offset of the level text in `tokens'
+};
+
+struct topic_trie {
+	struct topic_trie_node *nodes;
+	int32_t node_count;
+	int32_t node_cap;
+	struct topic_trie_edge *edges;
+	uint32_t edge_mask; // edge slots - 1, a power of two
+	uint32_t edge_count;
+	struct topic_trie_template *templates;
+	int32_t template_count;
+	int32_t template_cap;
+	char *tokens; // level text of every exact edge
+	size_t tokens_len;
+	size_t tokens_cap;
+	bool match_all; // a bare '#' pattern was added
+};
+
+struct topic_trie *topic_trie_new(void);
+void topic_trie_free(struct topic_trie *trie);
+int topic_trie_add(struct topic_trie *trie, const char *acl);
+bool topic_trie_match(const struct topic_trie *trie, const char *sub);
+bool topic_trie_match_template(const struct topic_trie *trie, const char *sub, const char *clientid, const char *username);
+size_t topic_trie_memory(const struct topic_trie *trie);
+
+#endif//__TOPIC_TRIE_H__
@@ -0,0 +1,226 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "trace.h"
+#include "utils.h"
+#include "mosquitto_broker.h"
+
+#define TRACE_RING_MIN 4096 // bytes, the ring size is rounded up to a power of two from there
+#define TRACE_FILE_BUFFER (256 * 1024) // stdio buffer of the writer
+#define TRACE_SAMPLE_SEED 0x74726365 // apart from the seed of the ACL tables, their buckets are not what is sampled
+
+static void *writer(void *arg)
+{
+	struct trace *t = arg;
+
+	for (;;)
+	{
+		// read before draining, so what was queued before the stop is written
+		bool stopping = atomic_load(&t->stop);
+		size_t tail = atomic_load_explicit(&t->tail, memory_order_relaxed);
+		size_t head = atomic_load_explicit(&t->head, memory_order_acquire);
+
+		while (tail != head)
+		{
+			const struct trace_record *record = (const struct trace_record *)(t->ring + (tail & t->ring_mask));
+
+			if (record->event != TRACE_PAD && !atomic_load_explicit(&t->failed, memory_order_relaxed)
+				&& fwrite(record, record->size, 1, t->file) != 1)
+			{
+				atomic_store(&t->failed, true);
+			}
+			tail += record->size;
+			atomic_store_explicit(&t->tail, tail, memory_order_release);
+		}
+		if (!atomic_load_explicit(&t->failed, memory_order_relaxed) && fflush(t->file))
+			atomic_store(&t->failed, true);
+
+		if (stopping)
+			break;
+		while (sem_wait(&t->wake) && errno == EINTR)
+			;
+	}
+	return NULL;
+}
+
+/*
+ * Start capturing to `path', overwritten, one client in `sample', through
+ * a ring of at least `ring_size' bytes.
+ */
+int trace_start(struct trace *t, const char *path, long sample, size_t ring_size)
+{
+	struct trace_file_header header;
+	size_t size = TRACE_RING_MIN;
+
+	memset(t, 0, sizeof(*t));
+	atomic_init(&t->head, 0);
+	atomic_init(&t->tail, 0);
+	atomic_init(&t->failed, false);
+	atomic_init(&t->stop, false);
+
+	while (size < ring_size)
+		size <<= 1;
+	t->ring = mosquitto_malloc(size);
+	if (t->ring == NULL)
+		return MOSQ_ERR_NOMEM;
+	t->ring_mask = size - 1;
+	t->sample = sample > 1 ? (uint32_t)sample : 1;
+
+	t->file = fopen(path, "wb");
+	if (t->file == NULL)
+	{
+		mosquitto_log_printf(MOSQ_LOG_WARNING, "(mosquitto-auth-plugin) Opening trace file %s failed: %s", path, strerror(errno));
+		trace_stop(t);
+		return MOSQ_ERR_ERRNO;
+	}
+	setvbuf(t->file, NULL, _IOFBF, TRACE_FILE_BUFFER);
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+	header.format = TRACE_FORMAT;
+	header.sample = t->sample;
+	header.started = (int64_t)time(NULL);
+	if (fwrite(&header, sizeof(header), 1, t->file) != 1)
+	{
+		mosquitto_log_printf(MOSQ_LOG_WARNING, "(mosquitto-auth-plugin) Writing trace file %s failed: %s", path, strerror(errno));
+		trace_stop(t);
+		return MOSQ_ERR_ERRNO;
+	}
+	t->started = mono_time_ns();
+
+	if (sem_init(&t->wake, 0, 0))
+	{
+		trace_stop(t);
+		return MOSQ_ERR_UNKNOWN;
+	}
+	if (pthread_create(&t->thread, NULL, writer, t))
+	{
+		sem_destroy(&t->wake);
+		trace_stop(t);
+		return MOSQ_ERR_UNKNOWN;
+	}
+	t->running = true;
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+/*
+ * Write out what the ring still holds and close the file.
+ */
+void trace_stop(struct trace *t)
+{
+	if (t->running)
+	{
+		atomic_store(&t->stop, true);
+		sem_post(&t->wake);
+		pthread_join(t->thread, NULL);
+		sem_destroy(&t->wake);
+		t->running = false;
+	}
+
+	if (t->file)
+		fclose(t->file);
+	mosquitto_free(t->ring);
+	t->file = NULL;
+	t->ring = NULL;
+}
+
+/*
+ * Wake the writer for the records queued since it last was, from the tick,
+ * when they are worth it. Returns MOSQ_ERR_ERRNO once writing the file has
+ * failed.
+ */
+int trace_flush(struct trace *t)
+{
+	if (!t->running)
+		return MOSQ_ERR_SUCCESS;
+
+	if (t->wake_pending)
+	{
+		size_t queued = atomic_load_explicit(&t->head, memory_order_relaxed) - atomic_load_explicit(&t->tail, memory_order_relaxed);
+		int64_t now = mono_time_ms();
+
+		if (queued > (t->ring_mask + 1) / 8 || now >= t->next_wake)
+		{
+			t->wake_pending = false;
+			t->next_wake = now + TRACE_WAKE_INTERVAL;
+			sem_post(&t->wake);
+		}
+	}
+	return atomic_load_explicit(&t->failed, memory_order_relaxed) ? MOSQ_ERR_ERRNO : MOSQ_ERR_SUCCESS;
+}
+
+bool trace_sampled(const struct trace *t, const char *client_id)
+{
+	return t->sample == 1 || hash_str(client_id ? client_id : "", TRACE_SAMPLE_SEED) % t->sample == 0;
+}
+
+static char *put_string(char *dst, const char *s, size_t len)
+{
+	if (len)
+		memcpy(dst, s, len);
+	dst[len] = '\0';
+	return dst + len + 1;
+}
+
+/*
+ * Queue the record of a callback that ran from `start_ns' to `end_ns' and
+ * returned `result'. Returns false if it was dropped, the ring being full
+ * or a string too long.
+ */
+bool trace_record(struct trace *t, enum trace_event event, int access, int flags, int result, int64_t start_ns, int64_t end_ns,
+				  const char *client_id, const char *username, const char *topic)
+{
+	size_t client_id_len = client_id ? strlen(client_id) : 0;
+	size_t username_len = username ? strlen(username) : 0;
+	size_t topic_len = topic ? strlen(topic) : 0;
+	size_t head, tail, pos, room, size, capacity = t->ring_mask + 1;
+	struct trace_record *record;
+	char *str;
+
+	if (client_id_len >= UINT16_MAX || username_len >= TRACE_NO_USERNAME || topic_len >= UINT16_MAX)
+		return false;
+	size = (sizeof(*record) + client_id_len + username_len + topic_len + 3 + 7) & ~(size_t)7;
+
+	head = atomic_load_explicit(&t->head, memory_order_relaxed);
+	tail = atomic_load_explicit(&t->tail, memory_order_acquire);
+	pos = head & t->ring_mask;
+	room = capacity - pos;
+
+	// a record is never split, the end of the ring is skipped if it does not fit there
+	if ((size > room ? room : 0) + size > capacity - (head - tail))
+		return false;
+	if (size > room)
+	{
+		record = (struct trace_record *)(t->ring + pos);
+		record->size = (uint32_t)room;
+		record->event = TRACE_PAD;
+		head += room;
+		pos = 0;
+	}
+
+	record = (struct trace_record *)(t->ring + pos);
+	memset(record, 0, sizeof(*record));
+	record->size = (uint32_t)size;
+	record->event = (uint8_t)event;
+	record->access = (uint8_t)access;
+	record->flags = (uint8_t)flags;
+	record->result = (uint8_t)result;
+	record->time = start_ns - t->started;
+	record->latency = end_ns - start_ns > UINT32_MAX ? UINT32_MAX : end_ns > start_ns ? (uint32_t)(end_ns - start_ns) : 0;
+	record->client_id_len = (uint16_t)client_id_len;
+	record->username_len = username ? (uint16_t)username_len : TRACE_NO_USERNAME;
+	record->topic_len = (uint16_t)topic_len;
+
+	str = (char *)(record + 1);
+	str = put_string(str, client_id, client_id_len);
+	str = put_string(str, username, username_len);
+	str = put_string(str, topic, topic_len);
+	memset(str, 0, (char *)record + size - str);
+
+	atomic_store_explicit(&t->head, head + size, memory_order_release);
+	t->wake_pending = true;
+	return true;
+}
@@ -0,0 +1,104 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Capture of the authentications, ACL checks and disconnections the broker
+ * hands the plugin, with their outcome and duration, so a production
+ * workload can be replayed offline against another build or configuration
+ * (bench/replay.c).
+ *
+ * Clients are sampled by a hash of their client id, a sampled client having
+ * all of its events captured: sessions replay whole, with the cache, memo
+ * and grant behaviour they had. Records are copied by the broker's thread
+ * into a single producer, single consumer byte ring, so a callback takes no
+ * lock, no allocation and no system call; a writer thread woken from the
+ * tick, once the ring is an eighth full or TRACE_WAKE_INTERVAL after the
+ * last time, drains it to the file in large writes. A record that does not
+ * fit in the ring is dropped rather than waited for.
+ *
+ * The writer never calls into the broker, errors are reported through
+ * trace_flush().
+ *
+ * File layout, all integers in host byte order:
+ *
+ *   header    struct trace_file_header
+ *   records   struct trace_record, each followed by its client id, username
+ *             and topic, each NUL terminated, padded to 8 bytes
+ */
+#define TRACE_MAGIC "MQATRACE"
+#define TRACE_FORMAT 1
+
+#define TRACE_WAKE_INTERVAL 100 // ms records wait in the ring for the writer, at most
+
+#define TRACE_NO_USERNAME UINT16_MAX // username_len of a client without a username
+
+#define TRACE_CERTIFICATE 0x01 // authentication: the client presented a certificate
+#define TRACE_UNIX_SOCKET 0x02 // authentication: the client came through the Unix socket listener
+
+enum trace_event {
+	TRACE_PAD, // ring only, fills the space up to its end, never written
+	TRACE_BASIC_AUTH,
+	TRACE_ACL_CHECK,
+	TRACE_DISCONNECT,
+};
+
+struct trace_file_header {
+	char magic[8];
+	uint32_t format;
+	uint32_t sample; // one client in `sample' was traced
+	int64_t started; // wall clock time the capture started, in s
+};
+
+struct trace_record {
+	uint32_t size; // of the record and its strings, padded
+	uint8_t event; // enum trace_event
+	uint8_t access; // MOSQ_ACL_* of an ACL check
+	uint8_t flags; // TRACE_CERTIFICATE, TRACE_UNIX_SOCKET of an authentication
+	uint8_t result; // MOSQ_ERR_* returned to the broker
+	int64_t time; // ns from the start of the capture to the callback's
+	uint32_t latency; // ns the callback took, saturated
+	uint16_t client_id_len;
+	uint16_t username_len; // TRACE_NO_USERNAME if none
+	uint16_t topic_len;
+	uint16_t padding[3];
+};
+
+struct trace {
+	bool running;
+	uint32_t sample;
+	int64_t started; // monotonic time of the capture start, in ns
+	unsigned char *ring;
+	size_t ring_mask; // ring size - 1, the size is a power of two
+	_Atomic size_t head; // bytes written by the main thread
+	_Atomic size_t tail; // bytes drained by the writer
+	bool wake_pending; // records queued since the writer was last woken
+	int64_t next_wake; // monotonic time in ms the writer is woken at the latest, if records are queued
+	atomic_bool failed; // writing the file failed, records are discarded since
+	atomic_bool stop;
+	pthread_t thread;
+	sem_t wake; // posted for the writer when records are queued, or to stop
+	FILE *file;
+};
+
+int trace_start(struct trace *t, const char *path, long sample, size_t ring_size);
+void trace_stop(struct trace *t);
+int trace_flush(struct trace *t);
+
+bool trace_sampled(const struct trace *t, const char *client_id);
+bool trace_record(struct trace *t, enum trace_event event, int access, int flags, int result, int64_t start_ns, int64_t end_ns,
+				  const char *client_id, const char *username, const char *topic);
+
+static inline bool trace_enabled(const struct trace *t)
+{
+	return t->running;
+}
+
+#endif//__TRACE_H__
@@ -11,13 +11,99 @@
 
 #include <openssl/ssl.h>
 #include "utils.h"
+#include "acl_backend.h"
+#include "acl_cache.h"
+#include "acl_store.h"
+#include "acl_shared.h"
+#include "acl_snapshot.h"
+#include "breaker.h"
+#include "cert_cache.h"
+#include "client_state.h"
+#include "db.h"
+#include "db_pool.h"
+#include "deny_cache.h"
+#include "metrics.h"
+#include "refresher.h"
+#include "topic_scan.h"
+#include "trace.h"
 #include "libpq-fe.h"
 
+struct plugin_options { // plugin options as last applied, strings owned
+    char* dbName;
+    char* dbPort;
+    char* aclQuery; // db_aclquery
+    char* unixSocketPath; // path to unix socket (to validate unix socket connections)
+    char* notifyChannel;
+    char* preloadQuery;
+    char* deltaQuery;
+    char* prefetchQuery;
+    char* snapshotPath;
+    char* sharedName;
+    char* filePath;
+    char* tracePath;
+    bool fileBackend; // rules from a local file instead of the database
+    bool fallbackAllow;
+    bool memo;
+    long poolSize, queryTimeout;
+    long breakerThreshold, breakerLatency, breakerCooldown;
+    long cacheTTL, cacheSize;
+    long grantTTL;
+    long denyTTL, denySize;
+    long certCacheSize;
+    long refreshAhead;
+    long sharedSize;
+    long deltaInterval;
+    long snapshotInterval;
+    long metricsInterval;
+    long traceSample, traceBufferSize;
+};
+
+struct db_reload { // connections to the database of a reloaded configuration, coming up while the running ones serve
+    bool pending;
+    struct db_pool pool;
+    char* conninfo;
+    char* dbName; // the reloaded options, moved to the applied ones with the pool
+    char* dbPort;
+    char* aclQuery;
+    struct db_acl_statement aclStatement; // formats of the ACL query prepared on `pool'
+    int64_t started; // monotonic time the connections were started
+};
+
 typedef struct auth_plugin_userdata { // data to store for the duration of the plugin
-    PGconn * dbconn; // connection to database
+    struct plugin_options options;
+    struct acl_backend *aclBackend; // where the rules are fetched from
+    struct db_pool dbPool; // connections to database, none with the file backend
+    char* conninfo; // connection string, kept to reconnect
+    struct db_reload reload; // replacement of `dbPool' after a configuration reload
+    bool dbFallbackAllow; // allow checks the database cannot answer in time, deny them otherwise
+    struct breaker dbBreaker; // stops querying a failing database
     mosquitto_plugin_id_t * identifier; // identifier for setting up callbacks
-    char* baseACLQuery; // base ACL query
-    char* unixSocketPath; // path to unix socket (to validate unix socket connections)
+    struct db_acl_statement aclStatement; // formats of the prepared ACL query
+    struct acl_cache aclCache; // per (client id, access) cache of ACL rules
+    struct acl_shared aclShared; // cached rules shared with the other brokers of the host, closed if disabled
+    struct client_table clients; // state of the connected clients, their subscription grants
+    struct refresher refresher; // worker refreshing cached rules ahead of expiry
+    int64_t refreshAhead; // ms before expiry a cached entry in use is refreshed, 0 if disabled
+    uint64_t aclGeneration; // bumped on ACL change notifications, refreshes asked for before are dropped
+    struct deny_cache denyCache; // recently denied checks and per client deny counters
+    struct cert_cache certCache; // identities of the client certificates seen, by signature
+    const char* notifyChannel; // channel announcing ACL changes, NULL if not listening, the options own the strings below
+    struct acl_store *aclStore; // preloaded ACL table, NULL when rules are queried per client
+    const char* preloadQuery; // query listing the whole ACL table
+    const char* deltaQuery; // query listing the rules changed since a version ($1)
+    const char* prefetchQuery; // query listing the rules of a client ($1) at authentication, NULL if disabled
+    int64_t aclVersion; // highest rule version seen so far
+    int64_t deltaInterval; // ms between delta queries
+    int64_t nextDelta; // monotonic time of the next delta query
+    bool deltaRunning; // the rows of a delta query are being streamed, see sync_acl_store()
+    const char* snapshotPath; // file the ACL data is persisted to, NULL if disabled
+    struct acl_snapshot snapshot; // previous run's ACL data, mapped until revalidated
+    int64_t snapshotInterval; // ms between snapshot writes, 0 to only write at shutdown
+    int64_t nextSnapshot; // monotonic time of the next snapshot write
+    struct metrics metrics; // callback latencies and counters
+    int64_t metricsInterval; // ms between metrics publications, 0 if disabled
+    int64_t nextMetrics; // monotonic time of the next metrics publication
+    struct trace trace; // capture of the callbacks for offline replay, not running if disabled
 } auth_plugin_userdata;
 
 #endif//__USERDATA_H__
\ No newline at end of file
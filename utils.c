@@ -52,6 +52,9 @@
  * See Also:
  *	<mosquitto_sub_topic_tokens_free>
  */
+#include <errno.h>
+#include <time.h>
+
 #include "utils.h"
 #include "mosquitto_broker.h"
 /*
@@ -106,4 +109,100 @@ void t_expand(const char *clientid, const char *username, const char *in, char *
 	*wp = 0;
 
 	*res = work;
-}
\ No newline at end of file
+}
+
+/*
+ * Whether `in' holds a %c or %u token, read left to right as t_expand() does.
+ */
+bool t_is_template(const char *in)
+{
+	for (const char *s = strchr(in, '%'); s; s = strchr(s + 1, '%'))
+	{
+		if (s[1] == 'c' || s[1] == 'u')
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Whether templates can be matched for these values without expanding them
+ * (see sub_acl_check_template()): both must be non-empty and free of the
+ * characters that would change the structure of the expanded filter.
+ */
+bool t_match_in_place(const char *clientid, const char *username)
+{
+	return clientid && *clientid && username && *username
+		   && !clientid[strcspn(clientid, "/+#")] && !username[strcspn(username, "/+#")];
+}
+/*
+ * 32-bit FNV-1a hash of a NUL terminated string, chained from `seed' so that
+ * composite keys can be hashed without building a temporary buffer.
+ */
+uint32_t hash_str(const char *s, uint32_t seed)
+{
+	uint32_t h = seed ? seed : 2166136261u;
+
+	for (; s && *s; s++)
+	{
+		h ^= (unsigned char)*s;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/*
+ * As hash_str(), for a span that is not NUL terminated.
+ */
+uint32_t hash_bytes(const void *data, size_t len, uint32_t seed)
+{
+	const unsigned char *s = data;
+	uint32_t h = seed ? seed : 2166136261u;
+
+	while (len--)
+	{
+		h ^= *s++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/*
+ * Milliseconds from the monotonic clock, used for cache expiry so that wall
+ * clock adjustments never extend or shorten a TTL.
+ */
+int64_t mono_time_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int64_t mono_time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Parse a decimal plugin option into `res', refusing trailing garbage and
+ * values outside [min, max].
+ */
+bool parse_long_option(const char *value, long min, long max, long *res)
+{
+	char *end;
+	long v;
+
+	if (value == NULL || *value == '\0')
+		return false;
+
+	errno = 0;
+	v = strtol(value, &end, 10);
+	if (errno || *end != '\0' || v < min || v > max)
+		return false;
+
+	*res = v;
+	return true;
+}
@@ -16,11 +16,23 @@ Contributors:
 #define __UTILS_H_
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 bool sub_acl_check(const char *acl, const char *sub);
+bool sub_acl_check_template(const char *acl, const char *sub, const char *clientid, const char *username);
+bool template_level_equal(const char *acl, size_t acl_len, const char *sub, size_t sub_len,
+		const char *clientid, size_t clientid_len, const char *username, size_t username_len);
 void t_expand(const char *clientid, const char *username, const char *in, char **res);
+bool t_is_template(const char *in);
+bool t_match_in_place(const char *clientid, const char *username);
+
+uint32_t hash_str(const char *s, uint32_t seed);
+uint32_t hash_bytes(const void *data, size_t len, uint32_t seed);
+int64_t mono_time_ms(void);
+int64_t mono_time_ns(void);
+bool parse_long_option(const char *value, long min, long max, long *res);
 
 #endif//__UTILS_H_
\ No newline at end of file